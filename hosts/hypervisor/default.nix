@@ -7,6 +7,10 @@
 # - States are portable ZFS datasets in /var/lib/microvms/states/
 # - Use vm-state CLI to manage states
 { config, pkgs, self, ... }:
+let
+  # C++ vm-state, used by units that need its netlink/tc support
+  vm-state = self.packages.${pkgs.system}.vm-state;
+in
 {
   imports = [
     # Generated by: nixos-generate-config
@@ -295,6 +299,8 @@
       Type = "oneshot";
       RemainAfterExit = true;
       ExecStart = "${pkgs.bash}/bin/bash /etc/microvm-bridge-attach.sh vm-slot1 br-slot1";
+      # The TAP is recreated on every start; program saved net-limit rates on it
+      ExecStartPost = "-${vm-state}/bin/vm-state net-limit slot1 --reapply";
       ExecStop = "-${pkgs.iproute2}/bin/ip link set vm-slot1 nomaster";
     };
     wantedBy = [ "microvm@slot1.service" ];
@@ -308,6 +314,8 @@
       Type = "oneshot";
       RemainAfterExit = true;
       ExecStart = "${pkgs.bash}/bin/bash /etc/microvm-bridge-attach.sh vm-slot2 br-slot2";
+      # The TAP is recreated on every start; program saved net-limit rates on it
+      ExecStartPost = "-${vm-state}/bin/vm-state net-limit slot2 --reapply";
       ExecStop = "-${pkgs.iproute2}/bin/ip link set vm-slot2 nomaster";
     };
     wantedBy = [ "microvm@slot2.service" ];
@@ -321,6 +329,8 @@
       Type = "oneshot";
       RemainAfterExit = true;
       ExecStart = "${pkgs.bash}/bin/bash /etc/microvm-bridge-attach.sh vm-slot3 br-slot3";
+      # The TAP is recreated on every start; program saved net-limit rates on it
+      ExecStartPost = "-${vm-state}/bin/vm-state net-limit slot3 --reapply";
       ExecStop = "-${pkgs.iproute2}/bin/ip link set vm-slot3 nomaster";
     };
     wantedBy = [ "microvm@slot3.service" ];
@@ -334,6 +344,8 @@
       Type = "oneshot";
       RemainAfterExit = true;
       ExecStart = "${pkgs.bash}/bin/bash /etc/microvm-bridge-attach.sh vm-slot4 br-slot4";
+      # The TAP is recreated on every start; program saved net-limit rates on it
+      ExecStartPost = "-${vm-state}/bin/vm-state net-limit slot4 --reapply";
       ExecStop = "-${pkgs.iproute2}/bin/ip link set vm-slot4 nomaster";
     };
     wantedBy = [ "microvm@slot4.service" ];
@@ -347,11 +359,80 @@
       Type = "oneshot";
       RemainAfterExit = true;
       ExecStart = "${pkgs.bash}/bin/bash /etc/microvm-bridge-attach.sh vm-slot5 br-slot5";
+      # The TAP is recreated on every start; program saved net-limit rates on it
+      ExecStartPost = "-${vm-state}/bin/vm-state net-limit slot5 --reapply";
       ExecStop = "-${pkgs.iproute2}/bin/ip link set vm-slot5 nomaster";
     };
     wantedBy = [ "microvm@slot5.service" ];
   };
 
+  # Bulk vm-state work (fingerprint, export, reconcile) runs here so it
+  # yields disk and CPU to the slots; vm-state moves itself in when run
+  # by hand
+  systemd.slices."vm-state-background" = {
+    description = "vm-state background work";
+    sliceConfig = {
+      IOWeight = 10;
+      CPUWeight = 20;
+    };
+  };
+
+  # Clean up after crashes before any slot starts: orphan clone snapshots,
+  # temp files, stale assignments and slot links to deleted states
+  systemd.services."vm-state-reconcile" = {
+    description = "Repair vm-state debris left by interrupted operations";
+    after = [ "zfs-mount.service" "systemd-tmpfiles-setup.service" ];
+    before = [ "microvm@slot1.service" "microvm@slot2.service" "microvm@slot3.service"
+               "microvm@slot4.service" "microvm@slot5.service" ];
+    wantedBy = [ "multi-user.target" ];
+    serviceConfig = {
+      Type = "oneshot";
+      Slice = "vm-state-background.slice";
+      IOSchedulingClass = "idle";
+      # Nothing else is running this early, so nothing is too young to repair
+      ExecStart = "${vm-state}/bin/vm-state reconcile --min-age 0";
+    };
+  };
+
+  # Pool scrub and TRIM, scheduled around guest load: each pass pauses
+  # while the slots are busy but still finishes within its window
+  systemd.services."vm-state-scrub" = {
+    description = "Scrub the state pool around guest load";
+    after = [ "zfs-import.target" ];
+    serviceConfig = {
+      Type = "oneshot";
+      Slice = "vm-state-background.slice";
+      ExecStart = "${vm-state}/bin/vm-state maintain scrub --window 3d";
+    };
+  };
+  systemd.timers."vm-state-scrub" = {
+    wantedBy = [ "timers.target" ];
+    timerConfig = {
+      OnCalendar = "Sun 02:00";
+      Persistent = true;
+    };
+  };
+
+  systemd.services."vm-state-trim" = {
+    description = "TRIM the state pool around guest load";
+    after = [ "zfs-import.target" ];
+    serviceConfig = {
+      Type = "oneshot";
+      Slice = "vm-state-background.slice";
+      ExecStart = "${vm-state}/bin/vm-state maintain trim --window 1d";
+    };
+  };
+  systemd.timers."vm-state-trim" = {
+    wantedBy = [ "timers.target" ];
+    timerConfig = {
+      OnCalendar = "Wed 02:00";
+      Persistent = true;
+    };
+  };
+
+  # Kernel nbd devices for vm-state lazy-restore
+  boot.kernelModules = [ "nbd" ];
+
   # Fix microvm service to use correct working directory
   systemd.services."microvm@".serviceConfig.WorkingDirectory = "/var/lib/microvms/%i";
 
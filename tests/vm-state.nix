@@ -14,6 +14,7 @@ pkgs.nixosTest {
     # Enable ZFS support
     boot.supportedFilesystems = [ "zfs" ];
     boot.zfs.forceImportRoot = false;
+    boot.kernelModules = [ "nbd" ];  # lazy-restore
     networking.hostId = "12345678";
 
     # Create a virtual disk for ZFS testing
@@ -26,6 +27,9 @@ pkgs.nixosTest {
     environment.systemPackages = [
       vm-state
       pkgs.zfs
+      pkgs.b3sum
+      pkgs.e2fsprogs
+      pkgs.qemu-utils
     ];
 
     # Create a dummy microvm service to test systemd integration
@@ -88,20 +92,108 @@ pkgs.nixosTest {
     # Verify symlink was created
     machine.succeed("test -L /var/lib/microvms/slot1/data.img")
 
+    # Give the state an image so content operations have something to read
+    machine.succeed("dd if=/dev/urandom of=/var/lib/microvms/states/test-state/data.img bs=1M count=9")
+
     # Create a snapshot
     machine.succeed("vm-state snapshot slot1 snap1")
 
     # Verify snapshot exists
     machine.succeed("zfs list -t snapshot microvms/storage/states/test-state@snap1")
 
+    # Test: the inventory is rewritten after a mutation and serves list
+    machine.succeed("test -s /var/lib/vm-state/inventory")
+    result = machine.succeed("vm-state list")
+    assert "test-state@snap1" in result, "List should include snap1"
+
+    # Test: vm-state snapshots (time-range and glob queries)
+    result = machine.succeed("vm-state snapshots test-state --since 1h --match 'snap*'")
+    assert "snap1" in result, "Recent snapshot should match the query"
+    result = machine.succeed("vm-state snapshots --until 2000-01-01")
+    assert "no matching snapshots" in result, "No snapshot predates 2000"
+
+    # Test: vm-state catalog (shared-memory segment, invalidated by mutations)
+    machine.succeed("vm-state catalog publish")
+    result = machine.succeed("vm-state catalog dump")
+    assert "microvms/storage/states/test-state@snap1" in result, "Catalog should list snap1"
+    assert "assignment\tslot1\ttest-state" in result, "Catalog should list assignments"
+
+    # Test: --dry-run estimates without changing anything
+    result = machine.succeed("vm-state clone --dry-run test-state dry-state")
+    assert "Dry run: clone_state" in result, "Dry run should report the operation"
+    machine.fail("zfs list microvms/storage/states/dry-state")
+
     # Test: vm-state clone
     machine.succeed("vm-state clone test-state cloned-state")
     machine.succeed("zfs list microvms/storage/states/cloned-state")
+    machine.fail("vm-state catalog dump")  # stale after the clone
 
     # Test: vm-state restore
     machine.succeed("vm-state restore snap1 restored-state")
     machine.succeed("zfs list microvms/storage/states/restored-state")
 
+    # Test: vm-state fingerprint (restore must be byte-identical to its snapshot)
+    result = machine.succeed("vm-state fingerprint snap1 restored-state")
+    assert "Identical images: snap1, restored-state" in result, "Restore should match snapshot"
+    expected = machine.succeed("b3sum --no-names /var/lib/microvms/states/test-state/.zfs/snapshot/snap1/data.img").strip()
+    assert expected in result, "Fingerprint should be the BLAKE3 hash of data.img"
+    result = machine.succeed("vm-state fingerprint snap1")
+    assert "(cached)" in result, "Snapshot fingerprints should be cached by GUID"
+
+    # Test: vm-state export (sparse copy off ZFS, same bytes)
+    machine.succeed("vm-state export snap1 /tmp/snap1.img")
+    exported = machine.succeed("b3sum --no-names /tmp/snap1.img").strip()
+    assert exported == expected, "Export should be byte-identical to the snapshot image"
+    machine.succeed("test $(du -k /tmp/snap1.img | cut -f1) -lt 1048576")  # stays sparse
+
+    # Test: background work (moved into vm-state-background.slice) checks --pause-above
+    machine.succeed("vm-state export snap1 /tmp/snap1-bg.img --pause-above 0")
+    machine.fail("vm-state export snap1 /tmp/snap1-bg.img --pause-above 150")
+    machine.succeed("rm /tmp/snap1.img /tmp/snap1-bg.img")
+
+    # Test: vm-state serve-nbd (qemu-img reads the snapshot over NBD)
+    machine.succeed("systemd-run --unit=serve-nbd vm-state serve-nbd snap1 --socket /tmp/nbd.sock")
+    machine.wait_for_file("/tmp/nbd.sock")
+    machine.succeed("qemu-img convert -f raw -O raw 'nbd+unix:///snap1?socket=/tmp/nbd.sock' /tmp/nbd.img")
+    served = machine.succeed("b3sum --no-names /tmp/nbd.img").strip()
+    assert served == expected, "NBD export should be byte-identical to the snapshot image"
+    machine.fail("qemu-io -f raw -c 'write 0 4k' 'nbd+unix:///snap1?socket=/tmp/nbd.sock' 2>&1 | grep -q 'wrote'")
+    machine.succeed("systemctl stop serve-nbd && rm /tmp/nbd.img")
+
+    # Test: vm-state lazy-restore (state usable at once, hydrated into a plain file)
+    machine.succeed("vm-state export snap1 /tmp/lazy-src.img")
+    result = machine.succeed("vm-state lazy-restore /tmp/lazy-src.img lazy-state --foreground 2>&1")
+    assert "usable now" in result and "hydrated" in result, "lazy-restore should report both stages"
+    machine.succeed("test -f /var/lib/microvms/states/lazy-state/data.img -a ! -L /var/lib/microvms/states/lazy-state/data.img")
+    lazy = machine.succeed("b3sum --no-names /var/lib/microvms/states/lazy-state/data.img").strip()
+    assert lazy == expected, "Hydrated state should be byte-identical to the source image"
+    machine.fail("vm-state lazy-restore /tmp/lazy-src.img lazy-state")  # exists
+    machine.succeed("echo 'DELETE' | vm-state delete lazy-state")
+    # By default it runs as a service, outliving the shell that started it
+    machine.succeed("vm-state lazy-restore /tmp/lazy-src.img lazysvc")
+    machine.wait_until_succeeds("test -f /var/lib/microvms/states/lazysvc/data.img -a ! -L /var/lib/microvms/states/lazysvc/data.img")
+    machine.wait_until_fails("systemctl is-active vm-state-lazy-restore-lazysvc.service")
+    machine.succeed("echo 'DELETE' | vm-state delete lazysvc && rm /tmp/lazy-src.img")
+
+    # Test: vm-state changed-ranges (one rewritten record between two snapshots)
+    machine.succeed("zfs snapshot microvms/storage/states/test-state@ranges-a")
+    machine.succeed("dd if=/dev/urandom of=/var/lib/microvms/states/test-state/data.img bs=128K count=1 seek=2 conv=notrunc && sync")
+    machine.succeed("zfs snapshot microvms/storage/states/test-state@ranges-b")
+    result = machine.succeed("vm-state changed-ranges test-state@ranges-a test-state@ranges-b --delta /tmp/delta.img")
+    assert "262144 131072 data" in result, "The rewritten record should be the changed range"
+    assert "extents 1 " in result, "Nothing else changed"
+    machine.succeed("cmp -i 262144 -n 131072 /tmp/delta.img /var/lib/microvms/states/test-state/.zfs/snapshot/ranges-b/data.img")
+    machine.succeed("test $(du -k /tmp/delta.img | cut -f1) -lt 1024")  # only the change is stored
+    machine.succeed("rm /tmp/delta.img")
+    machine.succeed("zfs destroy microvms/storage/states/test-state@ranges-b")
+    machine.succeed("zfs destroy microvms/storage/states/test-state@ranges-a")
+
+    # Test: vm-state maintain (scrub scheduled through libzfs)
+    result = machine.succeed("vm-state maintain scrub --window 1h 2>&1")
+    assert "Scrub finished" in result, "maintain should run the scrub to completion"
+    machine.succeed("zpool status microvms | grep -q 'scrub repaired'")
+    machine.fail("vm-state maintain scrub --window soon")
+
     # Test: Start a dummy microvm service
     machine.succeed("systemctl start microvm@slot1.service")
     machine.succeed("systemctl is-active microvm@slot1.service")
@@ -124,7 +216,103 @@ pkgs.nixosTest {
     machine.succeed("echo 'DELETE' | vm-state delete cloned-state")
     machine.fail("zfs list microvms/storage/states/cloned-state")
 
-    # Cleanup - delete restored state
+    result = machine.succeed("vm-state delete --dry-run restored-state")
+    assert "freed space" in result, "Delete dry run should report freed space"
+    assert "mean of" in result, "Latency history should be recorded after a restore"
+
+    # Test: vm-state reclaim (snap1 is pinned as restored-state's origin)
+    machine.succeed("dd if=/dev/urandom of=/var/lib/microvms/states/test-state/scratch.bin bs=1M count=4")
+    machine.succeed("vm-state snapshot slot1 snap2")
+    machine.succeed("dd if=/dev/urandom of=/var/lib/microvms/states/test-state/scratch.bin bs=1M count=4")
+    machine.succeed("sync && zpool sync microvms")
+    result = machine.succeed("vm-state reclaim --target 1M test-state")
+    assert "snap2" in result, "Reclaim should propose snap2"
+    assert "Pinned:" in result, "Reclaim should report the pinned clone origin"
+    machine.fail("vm-state reclaim --target 1T test-state")
+    machine.succeed("echo 'DELETE' | vm-state reclaim --target 1M test-state --execute")
+    machine.fail("zfs list -t snapshot microvms/storage/states/test-state@snap2")
+    machine.succeed("zfs list -t snapshot microvms/storage/states/test-state@snap1")
+
+    # Test: vm-state inspect reads an ext4 image without mounting it
+    machine.succeed("vm-state create inspect-state")
+    machine.succeed("mkdir -p /tmp/seed/etc /tmp/seed/var/log && echo inspect-host > /tmp/seed/etc/hostname")
+    machine.succeed("dd if=/dev/urandom of=/tmp/seed/var/log/big.log bs=1M count=2")
+    machine.succeed("truncate -s 64M /var/lib/microvms/states/inspect-state/data.img")
+    machine.succeed("mkfs.ext4 -q -F -d /tmp/seed /var/lib/microvms/states/inspect-state/data.img")
+    machine.succeed("zfs snapshot microvms/storage/states/inspect-state@seeded")
+    result = machine.succeed("vm-state inspect inspect-state /etc/hostname")
+    assert result.strip() == "inspect-host", "Inspect should print the file contents"
+    result = machine.succeed("vm-state inspect inspect-state@seeded /")
+    assert "etc/" in result and "var/" in result, "Inspect should list the root directory"
+    result = machine.succeed("vm-state inspect --du seeded /var")
+    assert "/var/log" in result and "2.0M" in result, "du should sum the log directory"
+    machine.fail("vm-state inspect inspect-state /missing")
+
+    # Test: vm-state inject writes files into a stopped state's image
+    machine.succeed("echo tenant-secret > /tmp/secret.txt")
+    machine.succeed("vm-state inject inspect-state /tmp/secret.txt /etc/app/secret --mode 0600 --owner 1000:100")
+    result = machine.succeed("vm-state inspect inspect-state /etc/app/secret")
+    assert result.strip() == "tenant-secret", "Injected file should be readable"
+    result = machine.succeed("vm-state inspect inspect-state /etc/app")
+    assert "-rw-------" in result and "1000" in result, "Mode and owner should be applied"
+    machine.succeed("vm-state clone inspect-state inject-clone --inject /tmp/seed/etc/hostname:/etc/motd")
+    result = machine.succeed("vm-state inspect inject-clone /etc/motd")
+    assert result.strip() == "inspect-host", "Clone should be provisioned before first boot"
+    machine.succeed("e2fsck -fn /var/lib/microvms/states/inject-clone/data.img")
+    result = machine.succeed("echo 'DELETE' | vm-state delete --wait inject-clone")
+    assert "Space freed" in result, "delete --wait should follow the pool's freeing"
+
+    # Test: jobs lists only live operations (a dead process's file is ignored)
+    machine.succeed("mkdir -p /run/vm-state/jobs && echo '{\"pid\": \"999999\", \"operation\": \"export\"}' > /run/vm-state/jobs/999999.json")
+    result = machine.succeed("vm-state jobs")
+    assert "No long-running operations" in result, "Stale job files should be skipped"
+
+    # Test: per-slot network rates come from rtnetlink (no VMs running, so
+    # slots without a tap are listed without rates)
+    result = machine.succeed("vm-state top --count 1 --interval 0.2")
+    assert "RX/s" in result and "slot1" in result, "top should list slots with rate columns"
+    result = machine.succeed("vm-state list --net")
+    assert "RX/s" in result, "list --net should add rate columns"
+
+    # Test: net-limit persists limits with the slot until its tap exists
+    machine.succeed("vm-state net-limit slot1 --egress 200mbit --ingress 50mbps")
+    machine.succeed("grep -q 'egress 200000000' /var/lib/microvms/slot1/net-limit")
+    result = machine.succeed("vm-state net-limit slot1")
+    assert "200mbit" in result and "400mbit" in result, "Limits should be saved"
+    result = machine.succeed("vm-state top --count 1 --interval 0.2")
+    assert "200mbit/400mbit" in result, "top should show the slot's limits"
+    machine.succeed("vm-state net-limit slot1 --reapply")
+    machine.fail("vm-state net-limit slot1 --egress fast")
+    machine.succeed("vm-state net-limit slot1 --clear")
+    machine.fail("test -e /var/lib/microvms/slot1/net-limit")
+
+    # Test: reconcile repairs debris left by interrupted operations
+    machine.succeed("zfs snapshot microvms/storage/states/test-state@clone-for-never-created")
+    machine.succeed("touch /etc/vm-state-assignments.json.tmp")
+    machine.succeed("vm-state assign slot3 test-state")
+    machine.succeed("sed -i 's/\"slot3\": *\"test-state\"/\"slot3\": \"gone-state\"/' /etc/vm-state-assignments.json")
+    result = machine.succeed("vm-state reconcile --dry-run --min-age 0")
+    assert "orphan-snapshot" in result and "stale-assignment" in result, "Dry run should classify debris"
+    assert "stale-temp-file" in result, "Dry run should find the temp file"
+    machine.succeed("zfs list -t snapshot microvms/storage/states/test-state@clone-for-never-created")
+    machine.succeed("vm-state reconcile --min-age 0")
+    machine.fail("zfs list -t snapshot microvms/storage/states/test-state@clone-for-never-created")
+    machine.fail("test -e /etc/vm-state-assignments.json.tmp")
+    machine.fail("grep -q gone-state /etc/vm-state-assignments.json")
+    result = machine.succeed("vm-state reconcile --min-age 0")
+    assert "orphan-snapshot" not in result, "A second pass should find nothing to repair"
+
+    # Test: bluegreen gates the cutover on the clone's readiness (the dummy
+    # microvm never listens, so it must leave the primary untouched)
+    machine.fail("vm-state bluegreen inspect-state --via slot4")
+    machine.succeed("vm-state assign slot4 inspect-state")
+    machine.fail("vm-state bluegreen test-state --via slot4 --name bg-green --ready-timeout 1")
+    machine.succeed("zfs list microvms/storage/states/bg-green")
+    machine.succeed("grep -q '\"slot4\": \"inspect-state\"' /etc/vm-state-assignments.json")
+    machine.succeed("grep -q '\"slot1\": \"test-state\"' /etc/vm-state-assignments.json")
+    machine.fail("systemctl is-active microvm@slot4.service")
+    machine.succeed("echo 'DELETE' | vm-state delete bg-green")
+
     machine.succeed("echo 'DELETE' | vm-state delete restored-state")
 
     print("All vm-state integration tests passed!")
@@ -0,0 +1,139 @@
+// Benchmark: whole-image reads through utils::IoEngine
+//
+// Reads a file with one blocking pread at a time (how fingerprinting used to
+// read per worker) and then through the engine at several queue depths,
+// reporting throughput for each. Both sides use O_DIRECT when the filesystem
+// allows, so the page cache doesn't flatter repeat runs. --hash also times
+// blake3_file, which reads through the engine.
+//
+// Usage: vm-state-bench-io <file> [--depth n]... [--no-direct] [--hash]
+
+#include "utils/blake3.hpp"
+#include "utils/io_engine.hpp"
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+constexpr size_t BLOCK = 4 * 1024 * 1024;
+
+void report(const char* label, uint64_t bytes, std::chrono::steady_clock::duration elapsed) {
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    std::fprintf(stderr, "%-16s %10.1f MiB %8.2f s %10.1f MiB/s\n", label,
+                 static_cast<double>(bytes) / (1 << 20), seconds,
+                 static_cast<double>(bytes) / (1 << 20) / seconds);
+}
+
+bool bench_pread(const std::string& path, bool direct) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | (direct ? O_DIRECT : 0));
+    if (fd < 0 && direct && errno == EINVAL) {
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        std::fprintf(stderr, "Error: %s: %s\n", path.c_str(), std::strerror(errno));
+        return false;
+    }
+    void* buf = std::aligned_alloc(4096, BLOCK);
+    uint64_t total = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (true) {
+        ssize_t n = pread(fd, buf, BLOCK, static_cast<off_t>(total));
+        if (n <= 0) break;
+        total += static_cast<uint64_t>(n);
+    }
+    report("pread", total, std::chrono::steady_clock::now() - start);
+    std::free(buf);
+    close(fd);
+    return true;
+}
+
+bool bench_engine(const std::string& path, unsigned depth, bool direct) {
+    vmstate::utils::IoEngineOptions options;
+    options.queue_depth = depth;
+    options.direct = direct;
+    vmstate::utils::IoEngine engine(options);
+
+    uint64_t data = 0;
+    uint64_t total = 0;
+    auto start = std::chrono::steady_clock::now();
+    bool ok = engine.read_file(path, [&](const vmstate::utils::IoBlock& block) {
+        total += block.length;
+        if (block.data) {
+            data += block.length;
+            engine.release(block);
+        }
+        return true;
+    });
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    if (!ok) {
+        std::fprintf(stderr, "Error: %s\n", engine.get_last_error().c_str());
+        return false;
+    }
+
+    std::string label = std::string(engine.uses_uring() ? "uring" : "fallback") +
+                        " qd=" + std::to_string(depth);
+    report(label.c_str(), total, elapsed);
+    std::fprintf(stderr, "%-16s %10.1f MiB read (rest skipped as holes)\n", "",
+                 static_cast<double>(data) / (1 << 20));
+    return true;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char* argv[]) {
+    std::string path;
+    std::vector<unsigned> depths;
+    bool direct = true;
+    bool hash = false;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--depth") == 0 && i + 1 < argc) {
+            depths.push_back(static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10)));
+        } else if (std::strcmp(argv[i], "--no-direct") == 0) {
+            direct = false;
+        } else if (std::strcmp(argv[i], "--hash") == 0) {
+            hash = true;
+        } else {
+            path = argv[i];
+        }
+    }
+    if (path.empty()) {
+        std::fprintf(stderr, "Usage: %s <file> [--depth n]... [--no-direct] [--hash]\n",
+                     argv[0]);
+        return 1;
+    }
+    if (depths.empty()) {
+        depths = {1, 4, 16, 64};
+    }
+
+    if (!bench_pread(path, direct)) {
+        return 1;
+    }
+    for (unsigned depth : depths) {
+        if (!bench_engine(path, depth, direct)) {
+            return 1;
+        }
+    }
+
+    if (hash) {
+        struct stat st;
+        stat(path.c_str(), &st);
+        std::string error;
+        auto start = std::chrono::steady_clock::now();
+        auto digest = vmstate::utils::blake3_file(path, 0, error);
+        if (!digest) {
+            std::fprintf(stderr, "Error: %s\n", error.c_str());
+            return 1;
+        }
+        report("blake3_file", static_cast<uint64_t>(st.st_size),
+               std::chrono::steady_clock::now() - start);
+    }
+    return 0;
+}
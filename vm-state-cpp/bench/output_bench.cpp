@@ -0,0 +1,128 @@
+// Benchmark: render a large snapshot listing through the CLI output paths
+//
+// Compares per-line std::endl iostream output (how the CLI used to print)
+// against utils::Output. Rows go to /dev/null by default, or to stdout with
+// --stdout (e.g. `| cat > /dev/null` to measure a pipe). Reports wall time
+// and write(2) calls, the latter from /proc/self/io.
+//
+// Usage: vm-state-bench-output [rows] [--stdout]
+
+#include "utils/output.hpp"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <format>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+struct Row {
+    std::string state_name;
+    std::string name;
+    std::string created;
+    uint64_t size_bytes;
+};
+
+// Write syscalls made by this process so far (0 if accounting is unavailable)
+uint64_t write_syscalls() {
+    std::ifstream io("/proc/self/io");
+    std::string key;
+    uint64_t value;
+    while (io >> key >> value) {
+        if (key == "syscw:") {
+            return value;
+        }
+    }
+    return 0;
+}
+
+std::string format_size(uint64_t bytes) {
+    const char* suffixes[] = {"B", "K", "M", "G", "T"};
+    int idx = 0;
+    double size = static_cast<double>(bytes);
+    while (size >= 1024 && idx < 4) {
+        size /= 1024;
+        idx++;
+    }
+    return std::format("{:.1f}{}", size, suffixes[idx]);
+}
+
+template <typename Fn>
+void measure(const char* label, size_t rows, Fn&& fn) {
+    uint64_t writes_before = write_syscalls();
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    uint64_t writes = write_syscalls() - writes_before;
+    std::fprintf(stderr, "%-10s %8zu rows %10.1f ms %10.0f ns/row %10llu writes\n",
+                 label, rows, elapsed.count(), elapsed.count() * 1e6 / static_cast<double>(rows),
+                 static_cast<unsigned long long>(writes));
+}
+
+}  // anonymous namespace
+
+int main(int argc, char* argv[]) {
+    size_t rows = 100000;
+    bool to_stdout = false;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--stdout") == 0) {
+            to_stdout = true;
+        } else {
+            rows = std::strtoull(argv[i], nullptr, 10);
+        }
+    }
+    if (rows == 0) {
+        std::fprintf(stderr, "Usage: %s [rows] [--stdout]\n", argv[0]);
+        return 1;
+    }
+
+    if (!to_stdout) {
+        int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        if (null_fd < 0 || dup2(null_fd, STDOUT_FILENO) < 0) {
+            std::perror("/dev/null");
+            return 1;
+        }
+        close(null_fd);
+    }
+
+    std::vector<Row> data;
+    data.reserve(rows);
+    for (size_t i = 0; i < rows; i++) {
+        data.push_back({"state-" + std::to_string(i % 500),
+                        "auto-" + std::to_string(i),
+                        "2026-01-01 00:00",
+                        (i * 7919) % (64ULL << 30)});
+    }
+
+    measure("iostream", rows, [&] {
+        std::cout << std::left << std::setw(20) << "STATE" << std::setw(30) << "SNAPSHOT"
+                  << std::setw(18) << "CREATED" << "REFERENCED" << std::endl;
+        for (const auto& r : data) {
+            std::cout << std::left
+                      << std::setw(20) << r.state_name
+                      << std::setw(30) << r.name
+                      << std::setw(18) << r.created
+                      << format_size(r.size_bytes) << std::endl;
+        }
+    });
+
+    measure("buffered", rows, [&] {
+        vmstate::utils::Output out(STDOUT_FILENO);
+        out.print("{:<20}{:<30}{:<18}REFERENCED\n", "STATE", "SNAPSHOT", "CREATED");
+        for (const auto& r : data) {
+            out.print("{:<20}{:<30}{:<18}{}\n", r.state_name, r.name, r.created,
+                      format_size(r.size_bytes));
+        }
+        out.flush();
+    });
+
+    return 0;
+}
@@ -3,10 +3,12 @@
 , cmake
 , pkg-config
 , systemd
+, dbus
 , zfs
 , util-linux
 , libtirpc
 , zlib
+, e2fsprogs
 }:
 
 stdenv.mkDerivation rec {
@@ -26,12 +28,18 @@ stdenv.mkDerivation rec {
     util-linux  # Provides blkid, required by libzfs pkg-config
     libtirpc  # Required by libzfs pkg-config
     zlib  # Required by libzfs_core pkg-config
+    e2fsprogs  # Provides libext2fs for reading state images
   ];
 
   cmakeFlags = [
     "-DCMAKE_BUILD_TYPE=Release"
+    "-DVMSTATE_BUILD_TESTS=ON"
   ];
 
+  # Provider tests run against a fake systemd on a private dbus-daemon
+  doCheck = true;
+  nativeCheckInputs = [ dbus ];
+
   meta = with lib; {
     description = "Manage portable VM states with ZFS and systemd using libzfs";
     homepage = "https://github.com/r33drichards/simple-microvm-infra";
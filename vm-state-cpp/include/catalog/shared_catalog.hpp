@@ -0,0 +1,198 @@
+#pragma once
+
+#include "providers/state_provider.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace vmstate {
+
+/**
+ * Shared catalog segment
+ *
+ * A published snapshot of the states, snapshots and slot assignments in a
+ * fixed binary layout, so other processes can map it read-only and walk
+ * 100k entries without parsing or copying. The segment lives on tmpfs
+ * (/run/vm-state/catalog by default), which makes it shared memory that any
+ * vm-state invocation or orchestrator can map.
+ *
+ * Layout: CatalogHeader, then state, snapshot and assignment record arrays,
+ * then a string table. Records refer to strings by (offset, length).
+ * Snapshots are stored sorted by (state, creation time, name).
+ *
+ * The same format is used for the persistent inventory in the cache
+ * directory, where state records' GUIDs and snapshot change times let a
+ * reader tell which states' snapshot lists are still current.
+ *
+ * Consistency uses a seqlock: the publisher makes `seq` odd while rewriting
+ * a segment in place and even again when done. Readers retry if `seq`
+ * changed while they read. A segment that was too small for an update is
+ * replaced by a new file and flagged SUPERSEDED, which tells mapped readers
+ * to remap. Mutations flag it STALE until the next publish.
+ */
+
+constexpr char CATALOG_MAGIC[8] = {'V', 'M', 'S', 'C', 'A', 'T', '\0', '\0'};
+constexpr uint32_t CATALOG_VERSION = 2;
+
+constexpr uint32_t CATALOG_FLAG_SUPERSEDED = 1u << 0;
+constexpr uint32_t CATALOG_FLAG_STALE = 1u << 1;
+
+struct CatalogString {
+    uint32_t offset;            // Offset into the string table
+    uint32_t length;            // Length in bytes (not NUL terminated)
+};
+
+struct CatalogHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;             // CATALOG_FLAG_* (accessed atomically)
+    uint64_t seq;               // Seqlock sequence (accessed atomically)
+    uint64_t generation;        // Publisher-defined catalog generation
+    uint64_t capacity;          // Usable bytes in this segment
+    uint64_t state_count;
+    uint64_t snapshot_count;
+    uint64_t assignment_count;
+    uint64_t states_offset;
+    uint64_t snapshots_offset;
+    uint64_t assignments_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+};
+static_assert(sizeof(CatalogHeader) == 104, "catalog header layout changed");
+
+struct CatalogStateRecord {
+    CatalogString name;
+    CatalogString path;
+    CatalogString dataset;
+    uint64_t used_bytes;
+    uint64_t available_bytes;
+    uint64_t guid;
+    uint64_t snapshots_changed;
+};
+static_assert(sizeof(CatalogStateRecord) == 56, "state record layout changed");
+
+struct CatalogSnapshotRecord {
+    CatalogString name;
+    CatalogString state_name;
+    CatalogString full_name;
+    CatalogString creation_time;
+    uint64_t creation_unix;
+    uint64_t size_bytes;
+};
+static_assert(sizeof(CatalogSnapshotRecord) == 48, "snapshot record layout changed");
+
+struct CatalogAssignmentRecord {
+    CatalogString slot_name;
+    CatalogString state_name;
+};
+static_assert(sizeof(CatalogAssignmentRecord) == 16, "assignment record layout changed");
+
+/**
+ * CatalogData - Contents to publish
+ */
+struct CatalogData {
+    uint64_t generation = 0;
+    std::vector<StateInfo> states;
+    std::vector<SnapshotInfo> snapshots;
+    std::vector<SlotAssignment> assignments;
+};
+
+/**
+ * CatalogView - Zero-copy accessors over a mapped segment
+ *
+ * Only valid inside SharedCatalogReader::read(). Strings point into the
+ * mapping and must be copied if they are kept.
+ */
+class CatalogView {
+public:
+    CatalogView(const uint8_t* base, size_t mapped_size, const CatalogHeader& header);
+
+    uint64_t generation() const { return header_.generation; }
+    size_t state_count() const { return header_.state_count; }
+    size_t snapshot_count() const { return header_.snapshot_count; }
+    size_t assignment_count() const { return header_.assignment_count; }
+
+    const CatalogStateRecord& state(size_t i) const;
+    const CatalogSnapshotRecord& snapshot(size_t i) const;
+    const CatalogAssignmentRecord& assignment(size_t i) const;
+
+    /**
+     * Index range [first, last) of one state's snapshots, found by binary
+     * search since records are sorted by state (empty if it has none)
+     */
+    std::pair<size_t, size_t> snapshot_range(std::string_view state_name) const;
+
+    /**
+     * Resolve a string table reference (empty if out of bounds)
+     */
+    std::string_view str(const CatalogString& s) const;
+
+    // Materialize records when a caller needs owned copies
+    StateInfo to_state_info(const CatalogStateRecord& r) const;
+    SnapshotInfo to_snapshot_info(const CatalogSnapshotRecord& r) const;
+    SlotAssignment to_assignment(const CatalogAssignmentRecord& r) const;
+
+private:
+    const uint8_t* base_;
+    size_t mapped_size_;
+    CatalogHeader header_;      // Copy taken under the seqlock
+};
+
+/**
+ * Publish catalog contents to a segment, reusing it in place when it fits
+ * @param path Segment path (on tmpfs)
+ * @param data Contents to publish
+ * @param error Set to a description on failure
+ * @return true if successful
+ */
+bool publish_shared_catalog(const std::string& path,
+                            const CatalogData& data,
+                            std::string& error);
+
+/**
+ * Flag a published segment as out of date (no-op if none exists)
+ * @param path Segment path
+ */
+void invalidate_shared_catalog(const std::string& path);
+
+/**
+ * SharedCatalogReader - Read-only mapping of a published segment
+ */
+class SharedCatalogReader {
+public:
+    explicit SharedCatalogReader(const std::string& path);
+    ~SharedCatalogReader();
+
+    SharedCatalogReader(const SharedCatalogReader&) = delete;
+    SharedCatalogReader& operator=(const SharedCatalogReader&) = delete;
+
+    /**
+     * Run fn against a consistent view of the segment
+     *
+     * fn may be called more than once if the publisher rewrites the segment
+     * concurrently, so it should only collect results.
+     * @param fn Reader callback
+     * @return false if no current segment is available (missing or stale)
+     */
+    bool read(const std::function<void(const CatalogView&)>& fn);
+
+    /**
+     * Get the last error message
+     */
+    std::string get_last_error() const;
+
+private:
+    bool map();
+    void unmap();
+
+    std::string path_;
+    const uint8_t* base_ = nullptr;
+    size_t mapped_size_ = 0;
+    std::string last_error_;
+};
+
+} // namespace vmstate
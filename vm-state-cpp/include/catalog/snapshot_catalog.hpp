@@ -0,0 +1,71 @@
+#pragma once
+
+#include "providers/state_provider.hpp"
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace vmstate {
+
+/**
+ * SnapshotQuery - Filter for snapshot catalog lookups
+ *
+ * All fields are optional; an empty query matches every snapshot.
+ */
+struct SnapshotQuery {
+    std::string state_name;         // Only snapshots of this state
+    std::optional<uint64_t> since;  // creation_unix >= since
+    std::optional<uint64_t> until;  // creation_unix < until
+    std::string pattern;            // Shell glob on the snapshot name
+};
+
+/**
+ * SnapshotCatalog - Sorted, indexed view of a snapshot listing
+ *
+ * Snapshots are kept sorted by (state, creation time, name) so a time range
+ * within a state is a pair of binary searches. A second index sorted by
+ * snapshot name answers prefix lookups, and globs with a literal prefix
+ * (e.g. "before-*") use it to avoid testing every name.
+ */
+class SnapshotCatalog {
+public:
+    SnapshotCatalog() = default;
+
+    /**
+     * Build the catalog from a provider listing
+     * @param snapshots Snapshots in any order
+     */
+    explicit SnapshotCatalog(std::vector<SnapshotInfo> snapshots);
+
+    /**
+     * Find snapshots matching a query
+     * @param query Filter to apply
+     * @return Matches ordered by (state, creation time, name)
+     */
+    std::vector<const SnapshotInfo*> query(const SnapshotQuery& query) const;
+
+    /**
+     * Find snapshots whose name starts with a prefix
+     * @param prefix Name prefix
+     * @return Matches ordered by name
+     */
+    std::vector<const SnapshotInfo*> with_prefix(const std::string& prefix) const;
+
+    /**
+     * Number of snapshots in the catalog
+     */
+    size_t size() const { return snapshots_.size(); }
+
+private:
+    // Index range [first, last) into snapshots_ for one state (or all)
+    std::pair<size_t, size_t> state_range(const std::string& state_name) const;
+
+    // Snapshots sorted by (state_name, creation_unix, name)
+    std::vector<SnapshotInfo> snapshots_;
+
+    // Indices into snapshots_ sorted by name
+    std::vector<size_t> by_name_;
+};
+
+} // namespace vmstate
@@ -2,13 +2,32 @@
 
 #include "providers/vm_provider.hpp"
 #include "providers/state_provider.hpp"
+#include "utils/output.hpp"
+#include <chrono>
+#include <map>
 #include <memory>
+#include <optional>
 #include <string>
 #include <vector>
 #include <functional>
 
 namespace vmstate {
 
+class CatalogView;
+
+/**
+ * SlotNetRates - Per-second network rates for a slot over a sample window
+ */
+struct SlotNetRates {
+    double rx_bytes;
+    double tx_bytes;
+    double rx_packets;
+    double tx_packets;
+    uint64_t dropped;        // Cumulative rx + tx drops
+    uint64_t errors;         // Cumulative rx + tx errors
+    uint64_t shaped;         // Cumulative drops by net-limit shaping/policing
+};
+
 /**
  * CLI - Command line interface for vm-state
  *
@@ -35,15 +54,34 @@ public:
     int run(int argc, char* argv[]);
 
 private:
+    // Dispatch a command (run() flushes its output afterwards)
+    int dispatch(const std::string& cmd, const std::vector<std::string>& args);
+
     // Command implementations
-    int cmd_list();
+    int cmd_list(const std::vector<std::string>& args);
     int cmd_create(const std::vector<std::string>& args);
     int cmd_snapshot(const std::vector<std::string>& args);
     int cmd_assign(const std::vector<std::string>& args);
     int cmd_clone(const std::vector<std::string>& args);
     int cmd_delete(const std::vector<std::string>& args);
     int cmd_migrate(const std::vector<std::string>& args);
+    int cmd_bluegreen(const std::vector<std::string>& args);
     int cmd_restore(const std::vector<std::string>& args);
+    int cmd_fingerprint(const std::vector<std::string>& args);
+    int cmd_export(const std::vector<std::string>& args);
+    int cmd_changed_ranges(const std::vector<std::string>& args);
+    int cmd_serve_nbd(const std::vector<std::string>& args);
+    int cmd_lazy_restore(const std::vector<std::string>& args);
+    int cmd_jobs(const std::vector<std::string>& args);
+    int cmd_snapshots(const std::vector<std::string>& args);
+    int cmd_catalog(const std::vector<std::string>& args);
+    int cmd_reclaim(const std::vector<std::string>& args);
+    int cmd_reconcile(const std::vector<std::string>& args);
+    int cmd_maintain(const std::vector<std::string>& args);
+    int cmd_inspect(const std::vector<std::string>& args);
+    int cmd_inject(const std::vector<std::string>& args);
+    int cmd_top(const std::vector<std::string>& args);
+    int cmd_net_limit(const std::vector<std::string>& args);
     int cmd_help();
 
     // Output helpers
@@ -52,6 +90,41 @@ private:
     void warn(const std::string& msg) const;
     void error(const std::string& msg) const;
 
+    // Draw a progress line (on a TTY) and publish it as a job file
+    bool show_progress(const utils::OperationProgress& progress);
+
+    // Draw/publish progress without the background pause check
+    void publish_progress(const utils::OperationProgress& progress);
+
+    // Run as background work unless --foreground is given: move into the
+    // background slice and pause while guests are stalled on I/O (takes
+    // --foreground, --pause-above and the --io-* bandwidth caps; false on
+    // bad arguments)
+    bool enter_background(std::vector<std::string>& args);
+
+    // Highest I/O pressure among the slots (0 if none report it)
+    double busiest_slot_pressure(std::string& busiest) const;
+
+    // Wait while any slot's I/O pressure is above pause_above_
+    void pause_for_guests(const utils::OperationProgress& progress);
+
+    // Erase the progress line before other output
+    void clear_progress() const;
+
+    // Erase the progress line and remove this process's job file
+    void end_progress();
+
+    // Print a --dry-run estimate
+    void print_estimate(const OperationEstimate& estimate) const;
+
+    // Sample slot network counters twice, `seconds` apart, and return
+    // per-second rates keyed by slot (nullopt if sampling failed)
+    std::optional<std::map<std::string, SlotNetRates>> sample_network_rates(double seconds);
+
+    // Read the published catalog if it is still at the provider's current
+    // generation (fn's results must be discarded when this returns false)
+    bool read_current_catalog(const std::function<void(const CatalogView&)>& fn);
+
     // Check if running as root
     bool check_root() const;
 
@@ -60,7 +133,17 @@ private:
 
     std::unique_ptr<VMProvider> vm_provider_;
     std::unique_ptr<StateProvider> state_provider_;
+    mutable utils::Output out_;
+    mutable utils::Output err_;
     bool use_colors_ = true;
+
+    mutable bool progress_drawn_ = false;
+    std::chrono::steady_clock::time_point progress_drawn_at_{};
+    std::chrono::steady_clock::time_point job_written_at_{};
+    std::string job_file_;
+
+    double pause_above_ = 0;    // 0 = not background work (never pause)
+    std::chrono::steady_clock::time_point pressure_checked_at_{};
 };
 
 } // namespace vmstate
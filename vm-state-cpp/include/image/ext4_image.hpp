@@ -0,0 +1,158 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+// libext2fs handle, kept opaque so callers don't pull in its headers
+struct struct_ext2_filsys;
+
+namespace vmstate {
+
+/**
+ * Ext4EntryType - Kind of filesystem object
+ */
+enum class Ext4EntryType {
+    REGULAR,
+    DIRECTORY,
+    SYMLINK,
+    OTHER
+};
+
+/**
+ * Ext4Entry - One inode as seen through a path or directory entry
+ */
+struct Ext4Entry {
+    std::string name;           // Entry name (last path component)
+    uint32_t inode;
+    Ext4EntryType type;
+    uint32_t mode;              // Permission bits and file type
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t size_bytes;        // Apparent size
+    uint64_t allocated_bytes;   // Blocks actually allocated
+    uint64_t mtime;             // Modification time (unix seconds)
+};
+
+/**
+ * Ext4Image - Read ext4 filesystems inside state images in user space
+ *
+ * Opens data.img directly with libext2fs, so a stopped state or a snapshot
+ * (through .zfs/snapshot) can be inspected without assigning it to a slot,
+ * booting it, or loop-mounting it on the host. Only the superblock, group
+ * descriptors and the inodes/blocks on the requested paths are read.
+ *
+ * Paths are absolute within the image; symlinks are followed relative to
+ * the image's root, never the host's.
+ *
+ * Opened writable, files can be written into a stopped state's image so
+ * it boots already provisioned. Writes bypass the journal, so the image
+ * must not be in use and must not need journal recovery.
+ */
+class Ext4Image {
+public:
+    explicit Ext4Image(const std::string& image_path);
+    ~Ext4Image();
+
+    Ext4Image(const Ext4Image&) = delete;
+    Ext4Image& operator=(const Ext4Image&) = delete;
+
+    /**
+     * Open the image
+     * @param writable Open for write_file (read-only otherwise)
+     * @return true if the image holds a filesystem libext2fs can read
+     */
+    bool open(bool writable = false);
+
+    /**
+     * Flush pending writes and close the image
+     * @return true if everything was written back
+     */
+    bool close();
+
+    /**
+     * Whether the journal has unreplayed transactions
+     *
+     * True for the image of a running (or crashed) VM; recent changes may
+     * not be visible until the guest replays its journal.
+     */
+    bool needs_recovery() const;
+
+    /**
+     * Space free for new file data
+     * @return Bytes, or nullopt if the image isn't open
+     */
+    std::optional<uint64_t> free_bytes() const;
+
+    /**
+     * Look up a path, following symlinks
+     * @param path Absolute path inside the image
+     * @return Entry, or nullopt if it doesn't exist
+     */
+    std::optional<Ext4Entry> stat(const std::string& path);
+
+    /**
+     * List a directory
+     * @param path Absolute path of a directory inside the image
+     * @return Entries sorted by name (without "." and ".."), or nullopt on error
+     */
+    std::optional<std::vector<Ext4Entry>> list(const std::string& path);
+
+    /**
+     * Stream a regular file's contents
+     * @param path Absolute path of a file inside the image
+     * @param sink Called with successive pieces; return false to stop
+     * @return true if the file was read (or the sink stopped early)
+     */
+    bool read_file(const std::string& path,
+                   const std::function<bool(const char*, size_t)>& sink);
+
+    /**
+     * Allocated space below a path, counting hard-linked inodes once
+     * @param path Absolute path inside the image
+     * @return Bytes, or nullopt on error
+     */
+    std::optional<uint64_t> disk_usage(const std::string& path);
+
+    /**
+     * Write a host file into the image, replacing any existing file
+     *
+     * Missing parent directories are created (mode 0755, owned by root).
+     * An existing file keeps its inode, so hard links stay intact.
+     * @param path Absolute destination path inside the image
+     * @param source_path File on the host to copy
+     * @param mode Permission bits for the file
+     * @param uid Owner inside the image
+     * @param gid Group inside the image
+     * @return true if successful
+     */
+    bool write_file(const std::string& path, const std::string& source_path,
+                    uint32_t mode, uint32_t uid, uint32_t gid);
+
+    /**
+     * Get the last error message
+     */
+    std::string get_last_error() const;
+
+private:
+    // Resolve a directory, creating missing components (0 on failure)
+    uint32_t make_dirs(const std::string& path);
+
+    // Allocate and link an empty regular file (0 on failure)
+    uint32_t create_file(uint32_t parent, const std::string& name);
+
+    // Resolve a path to an inode number (0 on failure, with last_error_ set)
+    uint32_t lookup(const std::string& path);
+
+    // Fill an entry from an inode
+    bool read_entry(uint32_t ino, const std::string& name, Ext4Entry& entry);
+
+    std::string image_path_;
+    struct_ext2_filsys* fs_ = nullptr;
+    bool writable_ = false;
+    std::string last_error_;
+};
+
+} // namespace vmstate
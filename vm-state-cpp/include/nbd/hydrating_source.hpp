@@ -0,0 +1,111 @@
+#pragma once
+
+#include "nbd/nbd_server.hpp"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace vmstate {
+namespace nbd {
+
+/**
+ * HydratingSource - A local image filled in from an origin as it is used
+ *
+ * The local file starts out sparse at the origin's size. The image is
+ * tracked in fixed-size chunks: a chunk is fetched from the origin the
+ * first time anything touches it (reads and writes alike, so a partial
+ * write lands on the origin's data), and fill() walks the rest in order
+ * in the background. Holes in the origin are never copied. Once every
+ * chunk is present the local file is a complete copy and the origin is
+ * no longer read.
+ *
+ * Fetches are serialized; reads and writes of present chunks go straight
+ * to the local file from any thread.
+ */
+class HydratingSource : public BlockSource {
+public:
+    using ProgressFn = std::function<void(uint64_t done, uint64_t total)>;
+
+    static constexpr uint64_t DEFAULT_CHUNK_SIZE = 1024 * 1024;
+
+    /**
+     * @param origin Where missing data comes from (must outlive this)
+     * @param chunk_size Fetch granularity in bytes
+     */
+    explicit HydratingSource(BlockSource& origin,
+                             uint64_t chunk_size = DEFAULT_CHUNK_SIZE);
+
+    HydratingSource(const HydratingSource&) = delete;
+    HydratingSource& operator=(const HydratingSource&) = delete;
+
+    /**
+     * Create the local file (which must not exist) at the origin's size
+     * @return true if successful
+     */
+    bool create(const std::string& path);
+
+    /**
+     * Close the local file (e.g., before removing it)
+     */
+    void close();
+
+    uint64_t size() const override;
+    int read(uint64_t offset, size_t length, uint8_t* buf) override;
+    int write(uint64_t offset, size_t length, const uint8_t* buf) override;
+    int flush() override;
+    std::vector<Extent> extents(uint64_t offset, uint64_t length) override;
+
+    /**
+     * Fetch every missing chunk, in order, until done or stop is set
+     * @param progress Called after each chunk with bytes present so far
+     * @return true once the local file is complete
+     */
+    bool fill(const std::atomic<bool>& stop, const ProgressFn& progress = nullptr);
+
+    /**
+     * True once every chunk is present
+     */
+    bool hydrated() const;
+
+    /**
+     * Chunks fetched because a request needed them (not by fill())
+     */
+    uint64_t demand_fetches() const;
+
+    /**
+     * Get the last error message
+     */
+    std::string get_last_error() const;
+
+private:
+    /**
+     * Make the chunks under a range present
+     * @return 0, or an errno value
+     */
+    int ensure(uint64_t offset, uint64_t length, bool on_demand);
+
+    /**
+     * Copy one chunk from the origin unless present (takes fetch_mutex_)
+     * @return 0, or an errno value
+     */
+    int fetch(uint64_t chunk, bool on_demand);
+
+    BlockSource& origin_;
+    FileSource local_;
+    uint64_t chunk_size_;
+    uint64_t size_ = 0;
+    uint64_t chunks_ = 0;
+    std::unique_ptr<std::atomic<bool>[]> present_;
+    std::atomic<uint64_t> present_count_{0};
+    std::atomic<uint64_t> demand_fetches_{0};
+    std::mutex fetch_mutex_;
+    std::vector<uint8_t> buffer_;       // Guarded by fetch_mutex_
+    std::string last_error_;
+};
+
+} // namespace nbd
+} // namespace vmstate
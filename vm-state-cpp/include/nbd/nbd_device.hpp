@@ -0,0 +1,69 @@
+#pragma once
+
+#include "nbd/nbd_server.hpp"
+#include <string>
+#include <thread>
+
+namespace vmstate {
+namespace nbd {
+
+/**
+ * NbdDevice - An export attached to a kernel /dev/nbdN block device
+ *
+ * Picks a free nbd device, hands the kernel one end of a socket pair and
+ * serves the other end with NbdServer::serve_connected(), so anything
+ * that opens the device (QEMU included) reads and writes the export.
+ * Needs the nbd kernel module and root.
+ */
+class NbdDevice {
+public:
+    NbdDevice() = default;
+    ~NbdDevice();
+
+    NbdDevice(const NbdDevice&) = delete;
+    NbdDevice& operator=(const NbdDevice&) = delete;
+
+    /**
+     * Attach the server's export to the first free device
+     * @return true if successful
+     */
+    bool attach(NbdServer& server, uint64_t size);
+
+    /**
+     * Disconnect the device and wait for its threads (no-op if detached)
+     */
+    void detach();
+
+    /**
+     * Device path (e.g., "/dev/nbd0"); empty until attached
+     */
+    std::string path() const;
+
+    /**
+     * True while another process has the device open
+     */
+    bool opened_elsewhere() const;
+
+    /**
+     * Get the last error message
+     */
+    std::string get_last_error() const;
+
+private:
+    /**
+     * Hand a socket to one device
+     * @return 0, or an errno value (EBUSY: the device is taken)
+     */
+    int connect(const std::string& device, uint64_t size, uint16_t flags, int sock);
+
+    std::string path_;
+    int device_fd_ = -1;
+    int kernel_fd_ = -1;
+    int server_fd_ = -1;
+    std::thread device_thread_;     // Sits in NBD_DO_IT while attached
+    std::thread server_thread_;
+    std::string last_error_;
+};
+
+} // namespace nbd
+} // namespace vmstate
@@ -0,0 +1,224 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace vmstate {
+namespace nbd {
+
+/**
+ * Extent - A run of an export that is either data or a hole
+ */
+struct Extent {
+    uint64_t length;
+    bool hole;              // Reads as zeros and takes no space
+};
+
+/**
+ * BlockSource - The bytes behind an NBD export
+ *
+ * Called from every connection's thread at once, so implementations must
+ * be thread-safe.
+ */
+class BlockSource {
+public:
+    virtual ~BlockSource() = default;
+
+    /**
+     * Export size in bytes
+     */
+    virtual uint64_t size() const = 0;
+
+    /**
+     * Read a range (within size())
+     * @return 0, or an errno value
+     */
+    virtual int read(uint64_t offset, size_t length, uint8_t* buf) = 0;
+
+    /**
+     * Write a range (within size()); only called on writable exports
+     * @return 0, or an errno value (EPERM unless overridden)
+     */
+    virtual int write(uint64_t offset, size_t length, const uint8_t* buf);
+
+    /**
+     * Make completed writes durable
+     * @return 0, or an errno value
+     */
+    virtual int flush();
+
+    /**
+     * Describe the allocation of a range, in order from offset
+     *
+     * May stop short of the full range, but covers at least its first byte.
+     */
+    virtual std::vector<Extent> extents(uint64_t offset, uint64_t length) = 0;
+};
+
+/**
+ * FileSource - A file served as is, holes reported via SEEK_HOLE
+ */
+class FileSource : public BlockSource {
+public:
+    FileSource() = default;
+    ~FileSource() override;
+
+    FileSource(const FileSource&) = delete;
+    FileSource& operator=(const FileSource&) = delete;
+
+    /**
+     * Open the file to serve
+     * @param writable Open read-write so write() and flush() work
+     * @return true if successful
+     */
+    bool open(const std::string& path, bool writable = false);
+
+    /**
+     * Close the file (no-op if not open)
+     */
+    void close();
+
+    uint64_t size() const override;
+    int read(uint64_t offset, size_t length, uint8_t* buf) override;
+    int write(uint64_t offset, size_t length, const uint8_t* buf) override;
+    int flush() override;
+    std::vector<Extent> extents(uint64_t offset, uint64_t length) override;
+
+    /**
+     * Get the last error message
+     */
+    std::string get_last_error() const;
+
+private:
+    int fd_ = -1;
+    uint64_t size_ = 0;
+    std::string last_error_;
+};
+
+/**
+ * NbdServerOptions - Where and how an export is served
+ */
+struct NbdServerOptions {
+    std::string socket_path;            // Unix socket to listen on
+    std::string export_name;            // Clients may also ask for "" (the default export)
+    unsigned max_connections = 16;      // Further connections are closed at once
+    bool writable = false;              // Pass writes and flushes to the source
+};
+
+/**
+ * NbdServer - NBD server for one export on a Unix socket
+ *
+ * Speaks fixed-newstyle negotiation (NBD_OPT_GO/INFO/EXPORT_NAME/LIST)
+ * and, for clients that ask, structured replies: reads come back as data
+ * and hole chunks, and NBD_CMD_BLOCK_STATUS answers the base:allocation
+ * context, so a client copying the export skips what isn't there. Each
+ * connection runs on its own thread. Exports are read-only unless
+ * options.writable is set; either way they are advertised as
+ * multi-connection safe, since a flush on any connection flushes the
+ * source.
+ */
+class NbdServer {
+public:
+    NbdServer(BlockSource& source, const NbdServerOptions& options);
+    ~NbdServer();
+
+    NbdServer(const NbdServer&) = delete;
+    NbdServer& operator=(const NbdServer&) = delete;
+
+    /**
+     * Create the socket (replacing a stale one) and start listening
+     *
+     * The server owns the socket file and removes it when destroyed.
+     * @return true if successful
+     */
+    bool listen();
+
+    /**
+     * Accept and serve connections until stop is set
+     *
+     * Open connections are shut down and joined before returning.
+     * @return true unless accepting failed
+     */
+    bool serve(const std::atomic<bool>& stop);
+
+    /**
+     * Serve a socket that skips negotiation until it disconnects
+     *
+     * For a socket handed to the kernel's nbd driver (see NbdDevice),
+     * which only speaks the transmission phase, with simple replies.
+     */
+    void serve_connected(int fd);
+
+    /**
+     * Export flags for a connection that skipped negotiation
+     */
+    uint16_t export_flags() const;
+
+    /**
+     * Number of connections accepted so far
+     */
+    size_t connections_accepted() const;
+
+    /**
+     * Get the last error message
+     */
+    std::string get_last_error() const;
+
+private:
+    struct Connection {
+        int fd = -1;
+        std::thread thread;
+        std::atomic<bool> done{false};
+    };
+
+    // What a client negotiated
+    struct Session {
+        bool structured = false;
+        bool allocation_context = false;
+        bool no_zeroes = false;
+    };
+
+    /**
+     * Serve one connection: negotiation, then requests until it closes
+     */
+    void handle(Connection& connection);
+
+    /**
+     * Option haggling
+     * @return true once the client has picked the export
+     */
+    bool negotiate(int fd, Session& session);
+
+    /**
+     * Answer requests until disconnect or error
+     */
+    void transmit(int fd, const Session& session);
+
+    /**
+     * Join connections whose thread has finished
+     */
+    void reap_connections(bool all);
+
+    /**
+     * Export flags for the negotiated features
+     */
+    uint16_t transmission_flags(const Session& session) const;
+
+    BlockSource& source_;
+    NbdServerOptions options_;
+    int listen_fd_ = -1;
+    std::mutex mutex_;
+    std::list<std::unique_ptr<Connection>> connections_;
+    std::atomic<size_t> accepted_{0};
+    std::string last_error_;
+};
+
+} // namespace nbd
+} // namespace vmstate
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "state_provider.hpp"
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace vmstate {
+
+/**
+ * StateListing - States and snapshots with name lookups
+ *
+ * The indexes hold positions in the vectors, so finding one entry doesn't
+ * scan the whole listing. Kept free of libzfs so it can be exercised
+ * without a pool.
+ */
+struct StateListing {
+    std::vector<StateInfo> states;
+    std::vector<SnapshotInfo> snapshots;
+
+    std::unordered_map<std::string, size_t> state_index;
+    std::unordered_map<std::string, size_t> snapshot_index;
+    std::unordered_map<std::string, std::vector<size_t>> snapshots_by_state;
+
+    /**
+     * Rebuild the indexes from the vectors
+     */
+    void build_index();
+};
+
+/**
+ * Reads one state's snapshots, appending them to the vector
+ */
+using SnapshotReader = std::function<void(const std::string& state,
+                                          std::vector<SnapshotInfo>& snapshots)>;
+
+/**
+ * Merge freshly walked states with a stored listing
+ *
+ * A state whose guid and snapshots_changed match its stored copy keeps
+ * its stored snapshots; every other state's are read again. A change time
+ * that isn't strictly before the walk may hide a later change in the same
+ * second (snapshots_changed has one-second resolution), so such states
+ * are not trusted: their stored copy should not be reused next time.
+ * @param states States from the walk, in listing order
+ * @param stored_states Stored states (e.g. the inventory)
+ * @param stored_snapshots Stored snapshots, grouped by state; moved from
+ * @param walk_started Unix time the walk began
+ * @param read_snapshots Reads the snapshots of a state that changed
+ * @param trusted Set per state: whether its stored copy may be reused
+ * @return Listing with indexes built
+ */
+StateListing merge_listing(std::vector<StateInfo> states,
+                           const std::vector<StateInfo>& stored_states,
+                           std::vector<SnapshotInfo>& stored_snapshots,
+                           uint64_t walk_started, const SnapshotReader& read_snapshots,
+                           std::vector<bool>& trusted);
+
+/**
+ * Map each assigned state to the first slot (in slot order) using it
+ *
+ * A slot without an assignment uses the state of its own name.
+ * @param slots Slots in order
+ * @param assignments Slot -> state
+ * @return State -> slot
+ */
+std::unordered_map<std::string, std::string> index_state_slots(
+    const std::vector<std::string>& slots,
+    const std::map<std::string, std::string>& assignments);
+
+} // namespace vmstate
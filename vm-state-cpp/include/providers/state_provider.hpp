@@ -1,10 +1,13 @@
 #pragma once
 
+#include "utils/progress.hpp"
+#include <chrono>
 #include <string>
 #include <vector>
 #include <optional>
 #include <memory>
 #include <cstdint>
+#include <functional>
 
 namespace vmstate {
 
@@ -17,6 +20,8 @@ struct StateInfo {
     uint64_t used_bytes;        // Used space
     uint64_t available_bytes;   // Available space
     std::string dataset;        // Backend dataset name (e.g., ZFS dataset)
+    uint64_t guid = 0;          // Backend dataset identity (0 if unknown)
+    uint64_t snapshots_changed = 0;  // When the snapshot list last changed (unix seconds)
 };
 
 /**
@@ -27,6 +32,7 @@ struct SnapshotInfo {
     std::string state_name;     // Parent state name
     std::string full_name;      // Full identifier (e.g., "state@snapshot")
     std::string creation_time;  // Creation timestamp
+    uint64_t creation_unix = 0; // Creation time in seconds since the epoch
     uint64_t size_bytes;        // Referenced size
 };
 
@@ -38,6 +44,157 @@ struct SlotAssignment {
     std::string state_name;
 };
 
+/**
+ * Visitors for streaming listings - return false to stop the walk early
+ */
+using StateVisitor = std::function<bool(const StateInfo&)>;
+using SnapshotVisitor = std::function<bool(const SnapshotInfo&)>;
+
+/**
+ * Progress of long-running operations; return false to stop waiting
+ * (only waits such as wait_for_freeing can be cut short)
+ */
+using ProgressCallback = std::function<bool(const utils::OperationProgress&)>;
+
+/**
+ * FingerprintInfo - Content hash of a state or snapshot image
+ */
+struct FingerprintInfo {
+    std::string name;           // State or snapshot as requested
+    std::string image_path;     // Image file that was hashed
+    std::string hash;           // Hex BLAKE3 tree hash of the image
+    uint64_t size_bytes;        // Image size
+    bool cached;                // Served from the fingerprint cache
+};
+
+/**
+ * OperationEstimate - Expected cost of a state operation (for --dry-run)
+ */
+struct OperationEstimate {
+    std::string operation;          // Operation name (e.g., "clone_state")
+    uint64_t immediate_bytes;       // Space consumed as soon as it runs
+    uint64_t pinned_bytes;          // Space that can't be freed while the result exists
+    uint64_t freed_bytes;           // Space released
+    uint64_t history_samples;       // Past runs behind expected_ms
+    std::optional<double> expected_ms;  // Mean duration of past runs
+    std::vector<std::string> notes; // Caveats (e.g., why an operation would fail)
+};
+
+/**
+ * ImageLocation - Where a state's or snapshot's disk image lives
+ */
+struct ImageLocation {
+    std::string state_name;
+    std::string snapshot_name;  // Empty for the live state
+    std::string image_path;     // Readable path to data.img
+};
+
+/**
+ * ChangedExtent - A byte range of data.img that differs between snapshots
+ */
+struct ChangedExtent {
+    uint64_t offset;
+    uint64_t length;
+    bool zeroed;                // Freed (reads as zeros) rather than rewritten
+};
+
+/**
+ * ChangedRanges - What changed in data.img from one snapshot to a later one
+ */
+struct ChangedRanges {
+    std::string from;           // Full snapshot names ("state@snapshot")
+    std::string to;
+    uint64_t image_size = 0;    // Size of data.img at 'to' (truncate to this)
+    bool replaced = false;      // data.img is a different file: everything changed
+    std::vector<ChangedExtent> extents;     // Sorted, non-overlapping
+    uint64_t stream_bytes = 0;  // Incremental stream read to find them
+};
+
+/**
+ * FileInjection - A host file to write into a state's filesystem
+ */
+struct FileInjection {
+    std::string source_path;        // File on the host
+    std::string dest_path;          // Absolute path inside the state
+    std::optional<uint32_t> mode;   // Permission bits (default: the source's)
+    uint32_t uid = 0;
+    uint32_t gid = 0;
+};
+
+/**
+ * ReclaimDeletion - A contiguous run of snapshots proposed for deletion
+ */
+struct ReclaimDeletion {
+    std::string state_name;
+    std::vector<std::string> snapshots;  // Snapshot names, oldest first
+    uint64_t freed_bytes;                // Space released by destroying the run
+};
+
+/**
+ * ReclaimPlan - Snapshot deletions proposed to free a target amount of space
+ */
+struct ReclaimPlan {
+    uint64_t target_bytes;
+    uint64_t freed_bytes;                // Sum over deletions
+    bool reaches_target;
+    std::vector<ReclaimDeletion> deletions;
+    std::vector<std::string> pinned;     // Full names of snapshots held by clones
+};
+
+/**
+ * ReconcileItem - One piece of debris found by a reconcile pass
+ */
+struct ReconcileItem {
+    std::string kind;           // e.g. "orphan-snapshot", "stale-assignment"
+    std::string target;         // Snapshot, file or slot it concerns
+    std::string detail;         // What is inconsistent
+    std::string action;         // Repair taken (or that would be taken)
+    bool repaired = false;
+    std::string error;          // Why the repair failed, if it did
+};
+
+/**
+ * ReconcileReport - Result of scanning for (and repairing) crash debris
+ */
+struct ReconcileReport {
+    size_t states_scanned = 0;
+    size_t snapshots_scanned = 0;
+    size_t slots_scanned = 0;
+    std::vector<ReconcileItem> items;
+};
+
+/**
+ * PoolScanKind - Pool-wide maintenance passes
+ */
+enum class PoolScanKind {
+    Scrub,      // Read and verify every block
+    Trim,       // Tell the devices which blocks are free
+};
+
+/**
+ * PoolScanStatus - Where a scrub or TRIM of the pool is
+ */
+struct PoolScanStatus {
+    PoolScanKind kind = PoolScanKind::Scrub;
+    bool running = false;           // Started and not finished (may be paused)
+    bool paused = false;
+    bool supported = true;          // false if no device can do it (TRIM)
+    uint64_t bytes_done = 0;
+    uint64_t bytes_total = 0;
+    uint64_t started_unix = 0;      // Start of the current or last pass (0 = never)
+    uint64_t finished_unix = 0;     // End of the last complete pass (0 = none)
+};
+
+/**
+ * PoolLatency - Cumulative I/O latency of the pool since import
+ *
+ * Only differences between two samples mean anything.
+ */
+struct PoolLatency {
+    uint64_t ops = 0;
+    double total_ms = 0;
+};
+
 /**
  * StateProvider - Abstract interface for state/snapshot management
  *
@@ -68,9 +225,12 @@ public:
      * Clone a state to a new state
      * @param source Source state name
      * @param dest Destination state name
+     * @param files Files to write into the clone before it is first booted;
+     *              the clone is removed again if any of them fails
      * @return true if successful
      */
-    virtual bool clone_state(const std::string& source, const std::string& dest) = 0;
+    virtual bool clone_state(const std::string& source, const std::string& dest,
+                             const std::vector<FileInjection>& files = {}) = 0;
 
     /**
      * Check if a state exists
@@ -92,6 +252,13 @@ public:
      */
     virtual std::vector<StateInfo> list_states() = 0;
 
+    /**
+     * Visit states one at a time without materializing the whole listing
+     * @param fn Called per state; return false to stop
+     * @return Number of states visited
+     */
+    virtual size_t for_each_state(const StateVisitor& fn) = 0;
+
     // ========== Snapshot Management ==========
 
     /**
@@ -129,6 +296,18 @@ public:
     virtual std::vector<SnapshotInfo> list_snapshots(
         const std::string& state_name = "") = 0;
 
+    /**
+     * Visit snapshots one at a time, stopping the backend walk as soon as
+     * the consumer has enough
+     * @param state_name State to filter by (empty = all states)
+     * @param limit Stop after this many snapshots (0 = no limit)
+     * @param fn Called per snapshot; return false to stop
+     * @return Number of snapshots visited
+     */
+    virtual size_t for_each_snapshot(const std::string& state_name,
+                                     size_t limit,
+                                     const SnapshotVisitor& fn) = 0;
+
     /**
      * Find a snapshot by name (searches all states)
      * @param snapshot_name Name to find
@@ -148,6 +327,9 @@ public:
 
     /**
      * Assign a state to a slot
+     *
+     * Refused when the state is in use on another slot: both slots would
+     * boot on the same image.
      * @param slot_name Slot name
      * @param state_name State name
      * @return true if successful
@@ -155,6 +337,17 @@ public:
     virtual bool assign_state(const std::string& slot_name,
                                const std::string& state_name) = 0;
 
+    /**
+     * Exchange the states of two slots in one assignment update
+     *
+     * If relinking the slots fails after the update is saved, the
+     * assignments stay exchanged (reconcile repairs the links).
+     * @param slot_a Slot name
+     * @param slot_b Slot name
+     * @return true if successful
+     */
+    virtual bool swap_states(const std::string& slot_a, const std::string& slot_b) = 0;
+
     /**
      * List all slot assignments
      * @return Vector of slot->state mappings
@@ -169,6 +362,159 @@ public:
     virtual std::optional<std::string> is_state_in_use(
         const std::string& state_name) = 0;
 
+    // ========== Images ==========
+
+    /**
+     * Find the disk image of a state or snapshot
+     * @param name State name, snapshot name, or "state@snapshot"
+     * @return ImageLocation, or nullopt if nothing matches
+     */
+    virtual std::optional<ImageLocation> locate_image(const std::string& name) = 0;
+
+    /**
+     * Find the byte ranges of data.img that changed between two snapshots
+     *
+     * Derived from the WRITE/FREE records of an incremental stream between
+     * them, without keeping or writing the stream's data, so the cost
+     * follows the size of the change rather than of the image.
+     * @param from Earlier snapshot
+     * @param to Later snapshot of the same state
+     * @return Ranges, or nullopt if the snapshots can't be compared
+     */
+    virtual std::optional<ChangedRanges> changed_ranges(const std::string& from,
+                                                        const std::string& to) = 0;
+
+    /**
+     * Write host files into a stopped state's filesystem image
+     *
+     * The state must not be running; the image is modified in place.
+     * @param state_name State to modify
+     * @param files Files to write (parent directories are created)
+     * @return true if every file was written
+     */
+    virtual bool inject_files(const std::string& state_name,
+                              const std::vector<FileInjection>& files) = 0;
+
+    // ========== Integrity ==========
+
+    /**
+     * Compute a content fingerprint of a state's or snapshot's image
+     *
+     * Snapshots are immutable, so their fingerprints are cached by
+     * snapshot GUID and repeated calls don't re-read the image.
+     * @param name State name, snapshot name, or "state@snapshot"
+     * @return FingerprintInfo if the image could be hashed
+     */
+    virtual std::optional<FingerprintInfo> fingerprint(const std::string& name) = 0;
+
+    // ========== Space Reclamation ==========
+
+    /**
+     * Propose the fewest snapshot deletions that free a target amount
+     * @param target_bytes Space to free
+     * @param state_name Only consider this state's snapshots (empty = all)
+     * @return Plan (check reaches_target), or nullopt on error
+     */
+    virtual std::optional<ReclaimPlan> plan_reclaim(uint64_t target_bytes,
+                                                    const std::string& state_name = "") = 0;
+
+    /**
+     * Destroy every snapshot in a plan as one batch
+     * @param plan Plan from plan_reclaim
+     * @return true if successful
+     */
+    virtual bool execute_reclaim(const ReclaimPlan& plan) = 0;
+
+    // ========== Consistency ==========
+
+    /**
+     * Find debris left by interrupted operations and repair it
+     *
+     * Covers clone snapshots whose clone was never created, leftover
+     * temporary files, image backups, slot symlinks that don't point at
+     * the assigned state, assignments to states that no longer exist, and
+     * states left by a lazy restore that died before hydrating (deleted).
+     * @param repair Repair what is found (false = report only)
+     * @param min_age_seconds Leave temporary files and orphan snapshots
+     *                        younger than this alone, since an operation in
+     *                        another process may still own them (assignments
+     *                        and links are repaired under the assign lock)
+     * @return Report, or nullopt if the scan itself failed
+     */
+    virtual std::optional<ReconcileReport> reconcile(bool repair,
+                                                     uint64_t min_age_seconds) = 0;
+
+    // ========== Progress ==========
+
+    /**
+     * Report progress of clone, restore, delete, fingerprint and waits
+     *
+     * Called on phase changes and as bytes move. Pass an empty function
+     * to stop reporting.
+     */
+    virtual void set_progress_callback(ProgressCallback fn) = 0;
+
+    /**
+     * Wait until the pool has freed the space of destroyed datasets
+     *
+     * Destroys return at once and the pool frees blocks in the background
+     * (the "freeing" property); this reports that as progress.
+     * @param timeout Give up after this long
+     * @return true once nothing is left to free
+     */
+    virtual bool wait_for_freeing(std::chrono::milliseconds timeout) = 0;
+
+    // ========== Pool Maintenance ==========
+
+    /**
+     * Get the state of the pool's current or last scrub/TRIM
+     * @return Status, or nullopt if the pool can't be read
+     */
+    virtual std::optional<PoolScanStatus> get_pool_scan(PoolScanKind kind) = 0;
+
+    /**
+     * Start a scrub/TRIM of the pool, or resume a paused one
+     * @return true if it is running afterwards
+     */
+    virtual bool start_pool_scan(PoolScanKind kind) = 0;
+
+    /**
+     * Pause a running scrub/TRIM; start_pool_scan picks up where it stopped
+     * @return true if successful
+     */
+    virtual bool pause_pool_scan(PoolScanKind kind) = 0;
+
+    /**
+     * Sample the pool's cumulative I/O latency (reads and writes, queueing
+     * included)
+     * @return Sample, or nullopt if the pool doesn't report latency
+     */
+    virtual std::optional<PoolLatency> get_pool_latency() = 0;
+
+    // ========== Estimation ==========
+
+    /**
+     * Estimate cloning a state, from already-accounted space properties
+     * @param source Source state name
+     * @return Estimate if the source exists
+     */
+    virtual std::optional<OperationEstimate> estimate_clone(const std::string& source) = 0;
+
+    /**
+     * Estimate restoring a snapshot to a new state
+     * @param snapshot_name Snapshot to restore
+     * @return Estimate if the snapshot exists
+     */
+    virtual std::optional<OperationEstimate> estimate_restore(
+        const std::string& snapshot_name) = 0;
+
+    /**
+     * Estimate deleting a state
+     * @param name State name
+     * @return Estimate if the state exists
+     */
+    virtual std::optional<OperationEstimate> estimate_delete(const std::string& name) = 0;
+
     // ========== Utility ==========
 
     /**
@@ -183,6 +529,21 @@ public:
      */
     virtual std::string get_states_dir() const = 0;
 
+    /**
+     * Get the path of the shared catalog segment
+     * @return Path on tmpfs where the catalog is published
+     */
+    virtual std::string get_catalog_path() const = 0;
+
+    /**
+     * Get the current catalog generation
+     *
+     * An opaque number that changes whenever states, snapshots or
+     * assignments may have changed. Caches compare it for equality only.
+     * @return Generation number
+     */
+    virtual uint64_t get_generation() = 0;
+
     /**
      * Factory method to create the default state provider
      */
@@ -17,10 +17,16 @@ public:
      * Constructor
      * @param service_prefix Prefix for service units (default: "microvm@")
      * @param valid_slots Set of valid slot names
+     * @param tap_prefix Prefix of each slot's tap interface (see microvm-base.nix)
+     * @param slots_dir Directory holding each slot's runtime directory
+     * @param cgroup_root Mount point of the unified cgroup hierarchy
      */
     explicit SystemdDBusVMProvider(
         const std::string& service_prefix = "microvm@",
-        const std::set<std::string>& valid_slots = {"slot1", "slot2", "slot3", "slot4", "slot5"}
+        const std::set<std::string>& valid_slots = {"slot1", "slot2", "slot3", "slot4", "slot5"},
+        const std::string& tap_prefix = "vm-",
+        const std::string& slots_dir = "/var/lib/microvms",
+        const std::string& cgroup_root = "/sys/fs/cgroup"
     );
 
     ~SystemdDBusVMProvider() override;
@@ -28,12 +34,25 @@ public:
     // VMProvider interface
     bool start(const std::string& slot_name) override;
     bool stop(const std::string& slot_name) override;
+    bool start_and_wait(const std::string& slot_name,
+                        std::chrono::milliseconds timeout) override;
+    bool stop_and_wait(const std::string& slot_name,
+                       std::chrono::milliseconds timeout) override;
     bool restart(const std::string& slot_name) override;
     bool is_running(const std::string& slot_name) override;
     VMStatus get_status(const std::string& slot_name) override;
+    std::optional<std::map<std::string, VMStatus>> get_all_statuses() override;
     std::optional<VMInfo> get_info(const std::string& slot_name) override;
     std::vector<std::string> list_slots() override;
     bool is_valid_slot(const std::string& slot_name) override;
+    std::optional<std::vector<SlotNetStats>> get_network_stats() override;
+    bool set_net_limit(const std::string& slot_name, const NetLimit& limit) override;
+    std::optional<NetLimit> get_net_limit(const std::string& slot_name) override;
+    bool apply_net_limit(const std::string& slot_name) override;
+    bool enter_background(const BackgroundLimits& limits) override;
+    bool start_transient_service(const std::string& unit, const std::string& description,
+                                 const std::vector<std::string>& argv) override;
+    std::optional<double> get_slot_io_pressure(const std::string& slot_name) override;
     std::string get_last_error() const override;
 
 private:
@@ -46,20 +65,51 @@ private:
      * Call a systemd manager method that takes a unit name
      * @param method Method name (e.g., "StartUnit", "StopUnit")
      * @param unit_name Full unit name
+     * @param job_path Set to the object path of the queued job, if given
      * @return true if successful
      */
     bool call_unit_method(const std::string& method,
-                          const std::string& unit_name);
+                          const std::string& unit_name,
+                          std::string* job_path = nullptr);
+
+    /**
+     * Queue a unit job and wait for its JobRemoved signal
+     * @param method Method name (e.g., "StartUnit", "StopUnit")
+     * @param unit_name Full unit name
+     * @param timeout Give up waiting after this long
+     * @return true if the job finished with result "done"
+     */
+    bool run_unit_job(const std::string& method,
+                      const std::string& unit_name,
+                      std::chrono::milliseconds timeout);
+
+    /**
+     * Handler for Manager.JobRemoved while a job is being waited on
+     */
+    static int job_removed_callback(sd_bus_message* m, void* userdata,
+                                    sd_bus_error* error);
 
     /**
      * Get a property from a unit
      * @param unit_name Full unit name
      * @param property Property name
+     * @param interface Interface the property belongs to
      * @return Property value as string
      */
     std::optional<std::string> get_unit_property(
         const std::string& unit_name,
-        const std::string& property);
+        const std::string& property,
+        const std::string& interface = "org.freedesktop.systemd1.Unit");
+
+    /**
+     * Path of the file persisting a slot's network limits
+     */
+    std::string net_limit_path(const std::string& slot_name) const;
+
+    /**
+     * Program limits on a slot's interface (no-op if it doesn't exist)
+     */
+    bool program_net_limit(const std::string& slot_name, const NetLimit& limit);
 
     /**
      * Initialize the D-Bus connection
@@ -74,6 +124,9 @@ private:
     sd_bus* bus_ = nullptr;
     std::string service_prefix_;
     std::set<std::string> valid_slots_;
+    std::string tap_prefix_;
+    std::string slots_dir_;
+    std::string cgroup_root_;
     mutable std::string last_error_;
 };
 
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <chrono>
+#include <map>
 #include <string>
 #include <vector>
 #include <optional>
@@ -27,6 +29,47 @@ struct VMInfo {
     std::string ip_address;
 };
 
+/**
+ * SlotNetStats - Cumulative network counters for a slot's interface
+ */
+struct SlotNetStats {
+    std::string slot_name;
+    std::string interface;   // Host-side interface (e.g., "vm-slot1")
+    uint64_t rx_bytes;       // Host receive = guest transmit
+    uint64_t tx_bytes;
+    uint64_t rx_packets;
+    uint64_t tx_packets;
+    uint64_t rx_dropped;
+    uint64_t tx_dropped;
+    uint64_t rx_errors;
+    uint64_t tx_errors;
+    uint64_t queue_dropped;  // Dropped by the interface's qdiscs (net-limit shaping/policing)
+};
+
+/**
+ * NetLimit - Bandwidth limits for a slot, from the guest's point of view
+ */
+struct NetLimit {
+    uint64_t egress_bits_per_sec = 0;   // Guest transmit (0 = unlimited)
+    uint64_t ingress_bits_per_sec = 0;  // Guest receive (0 = unlimited)
+};
+
+/**
+ * BackgroundLimits - Resource controls for vm-state's own bulk work
+ *
+ * Hashing and image copies share the pool with running guests; in the
+ * background slice they get a small share of I/O and CPU under contention
+ * and run at idle I/O priority.
+ */
+struct BackgroundLimits {
+    std::string slice = "vm-state-background.slice";
+    uint64_t io_weight = 10;        // cgroup io.weight (guests get the default 100)
+    uint64_t cpu_weight = 20;       // cgroup cpu.weight (guests get the default 100)
+    std::string io_device;          // Block device the io.max limits apply to
+    uint64_t io_read_max = 0;       // Bytes per second (0 = unlimited)
+    uint64_t io_write_max = 0;      // Bytes per second (0 = unlimited)
+};
+
 /**
  * VMProvider - Abstract interface for VM lifecycle management
  *
@@ -50,6 +93,27 @@ public:
      */
     virtual bool stop(const std::string& slot_name) = 0;
 
+    /**
+     * Start a VM slot and wait for the start job to finish
+     * @param slot_name Name of the slot
+     * @param timeout Give up waiting after this long
+     * @return true if the slot started
+     */
+    virtual bool start_and_wait(const std::string& slot_name,
+                                std::chrono::milliseconds timeout) = 0;
+
+    /**
+     * Stop a VM slot and wait until it has fully stopped
+     *
+     * Returns as soon as the stop job is reported finished, so callers
+     * can act on the slot's files without guessing at a delay.
+     * @param slot_name Name of the slot
+     * @param timeout Give up waiting after this long
+     * @return true if the slot stopped
+     */
+    virtual bool stop_and_wait(const std::string& slot_name,
+                               std::chrono::milliseconds timeout) = 0;
+
     /**
      * Restart a VM slot
      * @param slot_name Name of the slot
@@ -71,6 +135,14 @@ public:
      */
     virtual VMStatus get_status(const std::string& slot_name) = 0;
 
+    /**
+     * Get the status of every slot at once
+     *
+     * For callers that walk all slots: one query rather than one per slot.
+     * @return Status per slot, or nullopt on error
+     */
+    virtual std::optional<std::map<std::string, VMStatus>> get_all_statuses() = 0;
+
     /**
      * Get information about a VM slot
      * @param slot_name Name of the slot
@@ -91,6 +163,77 @@ public:
      */
     virtual bool is_valid_slot(const std::string& slot_name) = 0;
 
+    /**
+     * Read network counters for every slot whose interface exists
+     *
+     * All slots are sampled together, so rates can be computed from two
+     * calls without per-slot skew.
+     * @return Stats per slot (slots without an interface are omitted),
+     *         or nullopt on error
+     */
+    virtual std::optional<std::vector<SlotNetStats>> get_network_stats() = 0;
+
+    /**
+     * Set a slot's bandwidth limits
+     *
+     * The limits are saved with the slot's configuration and programmed on
+     * its interface right away if the slot is running.
+     * @param slot_name Name of the slot
+     * @param limit Limits to apply (all zero removes them)
+     * @return true if successful
+     */
+    virtual bool set_net_limit(const std::string& slot_name, const NetLimit& limit) = 0;
+
+    /**
+     * Get a slot's saved bandwidth limits
+     * @param slot_name Name of the slot
+     * @return Limits (zero when none are set), or nullopt on error
+     */
+    virtual std::optional<NetLimit> get_net_limit(const std::string& slot_name) = 0;
+
+    /**
+     * Program a slot's saved limits on its interface
+     *
+     * Interfaces are recreated when a slot restarts, losing their qdiscs;
+     * call this once the new interface exists.
+     * @param slot_name Name of the slot
+     * @return true if successful (or the slot has no interface yet)
+     */
+    virtual bool apply_net_limit(const std::string& slot_name) = 0;
+
+    /**
+     * Move the calling process into the background slice
+     *
+     * Places the process in a transient scope under limits.slice with the
+     * given weights and sets its I/O priority to idle. Threads started
+     * afterwards inherit both.
+     * @param limits Weights and bandwidth caps for the scope
+     * @return true if successful
+     */
+    virtual bool enter_background(const BackgroundLimits& limits) = 0;
+
+    /**
+     * Run a command as a transient service, so it outlives the caller
+     *
+     * The unit is collected once it exits, failed or not.
+     * @param unit Unit name (e.g., "vm-state-lazy-restore-x.service")
+     * @param description Unit description
+     * @param argv Command line; argv[0] is an absolute path
+     * @return true once systemd has accepted the unit
+     */
+    virtual bool start_transient_service(const std::string& unit,
+                                         const std::string& description,
+                                         const std::vector<std::string>& argv) = 0;
+
+    /**
+     * Get how much of the last 10 seconds a slot's tasks spent stalled on I/O
+     *
+     * From the slot unit's cgroup io.pressure ("some avg10").
+     * @param slot_name Name of the slot
+     * @return Percentage (0 when the slot isn't running), or nullopt on error
+     */
+    virtual std::optional<double> get_slot_io_pressure(const std::string& slot_name) = 0;
+
     /**
      * Get the last error message
      * @return Error message string
@@ -1,11 +1,18 @@
 #pragma once
 
 #include "state_provider.hpp"
+#include "state_listing.hpp"
+#include "utils/latency_history.hpp"
+#include <chrono>
 #include <map>
+#include <unordered_map>
+#include <vector>
 #include <libzfs.h>
 
 namespace vmstate {
 
+struct CatalogData;
+
 /**
  * ZFSStateProvider - State/snapshot management via libzfs
  *
@@ -21,13 +28,17 @@ public:
      * @param states_dir Mount point for states
      * @param assignments_file Path to slot assignments JSON file
      * @param slots List of valid slot names
+     * @param cache_dir Directory for derived data such as fingerprints
+     * @param catalog_path Shared catalog segment to invalidate on mutation
      */
     explicit ZFSStateProvider(
         const std::string& pool = "microvms",
         const std::string& base_dataset = "storage/states",
         const std::string& states_dir = "/var/lib/microvms/states",
         const std::string& assignments_file = "/etc/vm-state-assignments.json",
-        const std::vector<std::string>& slots = {"slot1", "slot2", "slot3", "slot4", "slot5"}
+        const std::vector<std::string>& slots = {"slot1", "slot2", "slot3", "slot4", "slot5"},
+        const std::string& cache_dir = "/var/lib/vm-state",
+        const std::string& catalog_path = "/run/vm-state/catalog"
     );
 
     ~ZFSStateProvider() override;
@@ -39,10 +50,12 @@ public:
     // State management
     bool create_state(const std::string& name) override;
     bool delete_state(const std::string& name, bool force = false) override;
-    bool clone_state(const std::string& source, const std::string& dest) override;
+    bool clone_state(const std::string& source, const std::string& dest,
+                     const std::vector<FileInjection>& files = {}) override;
     bool state_exists(const std::string& name) override;
     std::optional<StateInfo> get_state_info(const std::string& name) override;
     std::vector<StateInfo> list_states() override;
+    size_t for_each_state(const StateVisitor& fn) override;
 
     // Snapshot management
     bool create_snapshot(const std::string& state_name,
@@ -53,6 +66,9 @@ public:
                            const std::string& new_state_name) override;
     std::vector<SnapshotInfo> list_snapshots(
         const std::string& state_name = "") override;
+    size_t for_each_snapshot(const std::string& state_name,
+                             size_t limit,
+                             const SnapshotVisitor& fn) override;
     std::optional<SnapshotInfo> find_snapshot(
         const std::string& snapshot_name) override;
 
@@ -60,13 +76,51 @@ public:
     std::string get_slot_state(const std::string& slot_name) override;
     bool assign_state(const std::string& slot_name,
                        const std::string& state_name) override;
+    bool swap_states(const std::string& slot_a, const std::string& slot_b) override;
     std::vector<SlotAssignment> list_assignments() override;
     std::optional<std::string> is_state_in_use(
         const std::string& state_name) override;
 
+    // Images
+    std::optional<ImageLocation> locate_image(const std::string& name) override;
+    std::optional<ChangedRanges> changed_ranges(const std::string& from,
+                                                const std::string& to) override;
+    bool inject_files(const std::string& state_name,
+                      const std::vector<FileInjection>& files) override;
+
+    // Integrity
+    std::optional<FingerprintInfo> fingerprint(const std::string& name) override;
+
+    // Space reclamation
+    std::optional<ReclaimPlan> plan_reclaim(uint64_t target_bytes,
+                                            const std::string& state_name = "") override;
+    bool execute_reclaim(const ReclaimPlan& plan) override;
+
+    // Consistency
+    std::optional<ReconcileReport> reconcile(bool repair,
+                                             uint64_t min_age_seconds) override;
+
+    // Progress
+    void set_progress_callback(ProgressCallback fn) override;
+    bool wait_for_freeing(std::chrono::milliseconds timeout) override;
+
+    // Pool maintenance
+    std::optional<PoolScanStatus> get_pool_scan(PoolScanKind kind) override;
+    bool start_pool_scan(PoolScanKind kind) override;
+    bool pause_pool_scan(PoolScanKind kind) override;
+    std::optional<PoolLatency> get_pool_latency() override;
+
+    // Estimation
+    std::optional<OperationEstimate> estimate_clone(const std::string& source) override;
+    std::optional<OperationEstimate> estimate_restore(
+        const std::string& snapshot_name) override;
+    std::optional<OperationEstimate> estimate_delete(const std::string& name) override;
+
     // Utility
     std::string get_last_error() const override;
     std::string get_states_dir() const override;
+    std::string get_catalog_path() const override;
+    uint64_t get_generation() override;
 
 private:
     /**
@@ -93,15 +147,21 @@ private:
     zfs_handle_t* open_dataset(const std::string& name, int type) const;
 
     /**
-     * Load assignments from JSON file
+     * Load assignments from JSON file (cached per assignment store version,
+     * along with the state -> slot index is_state_in_use() answers from)
      */
-    std::map<std::string, std::string> load_assignments() const;
+    const std::map<std::string, std::string>& load_assignments() const;
 
     /**
      * Save assignments to JSON file
      */
     bool save_assignments(const std::map<std::string, std::string>& assignments) const;
 
+    /**
+     * Get the runtime directory of a slot
+     */
+    std::string get_slot_dir(const std::string& slot_name) const;
+
     /**
      * Create symlink from slot data.img to state data.img
      */
@@ -113,6 +173,118 @@ private:
      */
     bool set_state_permissions(const std::string& state_name) const;
 
+    /**
+     * Get the pool's current transaction group
+     *
+     * Every dataset create/destroy/snapshot lands in a new txg, so the txg
+     * only stands still while the pool is idle.
+     */
+    uint64_t get_pool_txg() const;
+
+    /**
+     * Get a version stamp for the assignments file
+     *
+     * Assignments are saved with write-then-rename, so the inode and
+     * mtime change on every save.
+     */
+    uint64_t get_assignment_store_version() const;
+
+    /**
+     * Add a latency sample for a completed operation
+     */
+    void record_latency(const std::string& operation,
+                        std::chrono::steady_clock::time_point started);
+
+    /**
+     * Fill in expected duration from the latency history
+     */
+    void apply_history(OperationEstimate& estimate) const;
+
+    /**
+     * Pass progress to the callback, if one is set
+     * @return false if the callback asked to stop
+     */
+    bool report_progress(utils::ProgressMeter& meter, const std::string& phase,
+                         uint64_t done = 0, uint64_t total = 0) const;
+
+    /**
+     * Get the pool's "freeing" property (bytes still being released)
+     */
+    std::optional<uint64_t> get_pool_freeing() const;
+
+    /**
+     * Open the pool with fresh stats and get its root vdev config
+     * @return Pool handle (caller closes) or nullptr, with last_error_ set
+     */
+    zpool_handle_t* open_pool_stats(nvlist_t** vdev_tree);
+
+    /**
+     * Add up the TRIM state of the leaf vdevs under a vdev
+     */
+    static void collect_trim_status(nvlist_t* vdev, PoolScanStatus& status,
+                                    size_t& leaves, size_t& active, size_t& complete);
+
+    /**
+     * Record that states, snapshots or assignments changed
+     */
+    void note_mutation() const;
+
+    /**
+     * Bring the listing cache up to the current generation
+     *
+     * Starts from the on-disk inventory: if its generation is current
+     * nothing is walked; otherwise the state datasets are walked and only
+     * the snapshot lists of states whose GUID or snapshot change time moved
+     * are re-read. The inventory is rewritten whenever it was out of date.
+     */
+    void refresh_listing();
+
+    /**
+     * Walk snapshots with libzfs, without consulting the listing cache
+     */
+    size_t walk_snapshots(const std::string& state_name, size_t limit,
+                          const SnapshotVisitor& fn);
+
+    /**
+     * Read the on-disk inventory
+     * @return false if it is missing or unreadable
+     */
+    bool read_inventory(CatalogData& data) const;
+
+    /**
+     * Get the image path inside a snapshot's .zfs/snapshot directory
+     */
+    std::string get_snapshot_image_path(const std::string& state_name,
+                                        const std::string& snapshot_name) const;
+
+    // One state's snapshots in creation order, for reclaim planning
+    struct ReclaimChain {
+        struct Snapshot {
+            std::string name;
+            std::string full_name;
+            uint64_t used_bytes;
+            bool pinned;        // Clone origin or held
+        };
+        std::string state_name;
+        std::vector<Snapshot> snapshots;
+    };
+
+    /**
+     * Load snapshot chains for one state (or all) in creation order
+     */
+    bool load_reclaim_chains(const std::string& state_name,
+                             std::vector<ReclaimChain>& chains);
+
+    /**
+     * Callback for collecting a reclaim chain
+     */
+    static int reclaim_iter_callback(zfs_handle_t* zhp, void* data);
+
+    /**
+     * Callback for a reconcile walk (states and their snapshots)
+     */
+    static int reconcile_iter_callback(zfs_handle_t* zhp, void* data);
+
     /**
      * Callback for iterating datasets
      */
@@ -129,6 +301,28 @@ private:
     std::string states_dir_;
     std::string assignments_file_;
     std::vector<std::string> slots_;
+    std::string cache_dir_;
+    std::string catalog_path_;
+    std::string inventory_path_;
+    utils::LatencyHistory latency_history_;
+    ProgressCallback progress_;
+
+    // Listings cached for the generation they were read at
+    struct ListingCache : StateListing {
+        uint64_t generation = 0;
+        bool has_states = false;
+        bool has_snapshots = false;
+    };
+    mutable ListingCache listing_cache_;
+
+    // Set by mutations; the inventory is rewritten before the provider goes away
+    mutable bool inventory_dirty_ = false;
+
+    // Assignments cached for the assignment store version they were read at
+    mutable uint64_t assignments_version_ = 0;
+    mutable std::map<std::string, std::string> assignments_cache_;
+    mutable std::unordered_map<std::string, std::string> state_slots_;   // First slot per state
+
     mutable std::string last_error_;
 };
 
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+
+namespace vmstate {
+namespace utils {
+
+/**
+ * BLAKE3 tree hashing for state images
+ *
+ * BLAKE3 splits its input into 1 KiB chunks and combines them as a binary
+ * tree, so independent subtrees can be hashed on separate threads and only
+ * the final parent nodes are combined serially. We implement the portable
+ * compression function directly rather than adding a dependency.
+ */
+
+using Blake3Digest = std::array<uint8_t, 32>;
+
+/**
+ * Hash an in-memory buffer
+ * @param data Input bytes
+ * @param len Input length
+ * @return 32-byte BLAKE3 digest
+ */
+Blake3Digest blake3(const void* data, size_t len);
+
+/**
+ * Hash a file read through the io_uring engine, hashing across worker threads
+ * @param path File to hash
+ * @param threads Worker threads (0 = hardware concurrency)
+ * @param error Set to a description on failure
+ * @param progress Called with (bytes covered, file size) as reads complete
+ * @return Digest if the whole file could be read
+ */
+std::optional<Blake3Digest> blake3_file(
+    const std::string& path,
+    unsigned threads,
+    std::string& error,
+    const std::function<void(uint64_t, uint64_t)>& progress = {});
+
+/**
+ * Format a digest as lowercase hex
+ */
+std::string to_hex(const Blake3Digest& digest);
+
+} // namespace utils
+} // namespace vmstate
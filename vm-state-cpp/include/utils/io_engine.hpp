@@ -0,0 +1,181 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace vmstate {
+namespace utils {
+
+/**
+ * IoEngineOptions - Tuning for bulk image I/O
+ */
+struct IoEngineOptions {
+    unsigned queue_depth = 16;              // Reads kept in flight (one buffer each)
+    size_t block_size = 4 * 1024 * 1024;    // Bytes per read; a multiple of 4 KiB
+    bool direct = true;                     // Use O_DIRECT where the filesystem allows
+    bool skip_holes = true;                 // Don't read blocks that are entirely holes
+    // Only read these [start, end) ranges, rounded out to whole blocks; the
+    // rest is treated as holes (empty: the whole file)
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    // Called on the driving thread as blocks complete (bytes covered, file size)
+    std::function<void(uint64_t, uint64_t)> progress;
+};
+
+/**
+ * IoBlock - One block of a file, handed to the caller as its read completes
+ */
+struct IoBlock {
+    uint64_t offset;        // File offset (a multiple of the block size)
+    size_t length;          // Valid bytes (short only at end of file)
+    const uint8_t* data;    // Block contents, or nullptr for a hole (all zeros)
+    unsigned buffer;        // Engine buffer holding the data
+};
+
+/**
+ * IoEngine - io_uring data path for whole-image reads and copies
+ *
+ * State images are large and mostly sparse. The engine walks a file on a
+ * fixed grid of block_size blocks, skips blocks that SEEK_DATA/SEEK_HOLE
+ * report as holes, and keeps queue_depth reads in flight on one io_uring
+ * with registered buffers, so one thread can keep a device busy. Kernels
+ * without io_uring (or where it is disabled) fall back to pread on the
+ * same buffers.
+ *
+ * Buffers are owned by the engine and lent to the caller: a block's
+ * buffer is reused only after release(), which may be called from any
+ * thread, so hashing or compression can run on workers while the engine
+ * keeps reading.
+ */
+class IoEngine {
+public:
+    using BlockVisitor = std::function<bool(const IoBlock&)>;
+
+    explicit IoEngine(const IoEngineOptions& options = {});
+    ~IoEngine();
+
+    IoEngine(const IoEngine&) = delete;
+    IoEngine& operator=(const IoEngine&) = delete;
+
+    /**
+     * Read a whole file, visiting each block as it completes
+     *
+     * Blocks arrive in completion order, not file order. Each data block
+     * must be passed to release() once the caller is done with it; the
+     * engine stalls while every buffer is lent out. Holes are visited
+     * with data == nullptr and need no release. Returns once every block
+     * has been visited and released.
+     * @param path File to read
+     * @param fn Called per block; return false to stop early
+     * @return true if the whole file was read
+     */
+    bool read_file(const std::string& path, const BlockVisitor& fn);
+
+    /**
+     * Return a block's buffer to the engine (thread-safe)
+     */
+    void release(const IoBlock& block);
+
+    /**
+     * Copy a file, keeping it sparse
+     *
+     * Holes and all-zero blocks are not written, leaving holes in the
+     * destination. The destination is created or truncated.
+     * @param src Source file
+     * @param dst Destination file
+     * @param bytes_written Set to the bytes actually written, if given
+     * @return true if successful
+     */
+    bool copy_file(const std::string& src, const std::string& dst,
+                   uint64_t* bytes_written = nullptr);
+
+    /**
+     * Whether I/O goes through io_uring (false: pread/pwrite fallback)
+     */
+    bool uses_uring() const;
+
+    /**
+     * Get the last error message
+     */
+    std::string get_last_error() const;
+
+private:
+    struct Ring;
+
+    // A block of the grid being worked on
+    struct Op {
+        uint64_t offset = 0;
+        size_t length = 0;          // Bytes wanted
+        size_t done = 0;            // Bytes read so far (short reads are resumed)
+        bool writing = false;       // copy_file: the write-back half
+    };
+
+    /**
+     * Shared loop behind read_file and copy_file
+     * @param out_fd Write data blocks here instead of visiting them (-1 to visit)
+     */
+    bool run(const std::string& path, int out_fd, const BlockVisitor& fn,
+             uint64_t* bytes_written);
+
+    /**
+     * Open for reading, with O_DIRECT if allowed and supported
+     */
+    int open_input(const std::string& path, bool& direct);
+
+    /**
+     * Data extents of a file as [start, end) pairs (whole file if unknown)
+     */
+    std::vector<std::pair<uint64_t, uint64_t>> data_extents(int fd, uint64_t size) const;
+
+    /**
+     * Parts of extents that fall within ranges (both as [start, end) pairs)
+     */
+    static std::vector<std::pair<uint64_t, uint64_t>> intersect(
+        const std::vector<std::pair<uint64_t, uint64_t>>& extents,
+        std::vector<std::pair<uint64_t, uint64_t>> ranges);
+
+    /**
+     * Take a free buffer (returns false if none is free)
+     */
+    bool take_buffer(unsigned& index);
+
+    /**
+     * Wait until a buffer is released
+     */
+    void wait_for_buffer();
+
+    /**
+     * Queue a read or write for a buffer; false on submission failure
+     */
+    bool submit(unsigned buffer, int fd, bool write);
+
+    /**
+     * Wait for at least one completion and handle every one available
+     */
+    bool reap(int in_fd, int out_fd, const BlockVisitor& fn, bool& stop,
+              unsigned& inflight, uint64_t& written, bool direct_out);
+
+    IoEngineOptions options_;
+    Ring* ring_ = nullptr;
+    std::vector<uint8_t*> buffers_;
+    std::vector<Op> ops_;
+    uint64_t file_size_ = 0;
+    uint64_t scanned_ = 0;          // Bytes read or skipped as holes so far
+
+    // Fallback mode: (buffer, result) of I/O already done by submit()
+    std::vector<std::pair<unsigned, int>> sync_done_;
+
+    std::mutex mutex_;
+    std::condition_variable released_;
+    std::vector<unsigned> free_;
+
+    std::string last_error_;
+};
+
+} // namespace utils
+} // namespace vmstate
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+
+namespace vmstate {
+namespace utils {
+
+/**
+ * LatencyStats - Recorded duration of one operation type
+ */
+struct LatencyStats {
+    uint64_t samples;
+    double mean_ms;             // Running mean, exponentially weighted once warm
+    double max_ms;
+};
+
+/**
+ * LatencyHistory - Per-operation latency record kept in a JSON file
+ *
+ * Each successful state operation adds a sample, so estimates reflect
+ * this host's pool rather than a fixed guess.
+ */
+class LatencyHistory {
+public:
+    /**
+     * @param path JSON file holding the history
+     */
+    explicit LatencyHistory(const std::string& path);
+
+    /**
+     * Get stats for an operation type
+     * @param operation Operation name (e.g., "clone_state")
+     * @return Stats if at least one sample was recorded
+     */
+    std::optional<LatencyStats> get(const std::string& operation) const;
+
+    /**
+     * Add a sample (best-effort; failures to persist are ignored)
+     * @param operation Operation name
+     * @param ms Duration in milliseconds
+     */
+    void record(const std::string& operation, double ms);
+
+private:
+    std::string path_;
+};
+
+} // namespace utils
+} // namespace vmstate
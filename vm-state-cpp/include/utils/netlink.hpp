@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace vmstate {
+namespace utils {
+
+/**
+ * LinkStats - Counters for one network interface
+ */
+struct LinkStats {
+    std::string ifname;
+    uint32_t ifindex;
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+    uint64_t rx_packets;
+    uint64_t tx_packets;
+    uint64_t rx_dropped;
+    uint64_t tx_dropped;
+    uint64_t rx_errors;
+    uint64_t tx_errors;
+    uint64_t qdisc_dropped;  // Dropped by the root and ingress qdiscs (shaping, policing)
+};
+
+/**
+ * Read counters for every interface with one rtnetlink dump
+ *
+ * Sends a single RTM_GETLINK dump request and reads IFLA_STATS64 from each
+ * reply, so a whole host is sampled with a handful of syscalls instead of
+ * running `ip -s link` per interface. A second RTM_GETQDISC dump on the
+ * same socket adds qdisc drop counters.
+ * @param error Set to a description on failure
+ * @return Stats for all interfaces, or nullopt on failure
+ */
+std::optional<std::vector<LinkStats>> dump_link_stats(std::string& error);
+
+/**
+ * Program rate limits on an interface via rtnetlink tc messages
+ *
+ * Transmit is shaped by a tbf root qdisc with an fq child (so flows share
+ * the limit fairly); receive is policed by a matchall filter on the ingress
+ * qdisc, which drops packets over the rate. A rate of 0 removes that
+ * direction's limit. Equivalent to the `tc qdisc`/`tc filter` commands,
+ * without spawning tc.
+ * @param ifname Interface name
+ * @param tx_bits_per_sec Transmit rate limit (0 = unlimited)
+ * @param rx_bits_per_sec Receive rate limit (0 = unlimited)
+ * @param error Set to a description on failure
+ * @return true if successful
+ */
+bool set_link_rate_limits(const std::string& ifname,
+                          uint64_t tx_bits_per_sec,
+                          uint64_t rx_bits_per_sec,
+                          std::string& error);
+
+} // namespace utils
+} // namespace vmstate
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstddef>
+#include <format>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace vmstate {
+namespace utils {
+
+/**
+ * Output - Buffered writer for stdout/stderr
+ *
+ * Collects output in one large buffer and hands it to write(2) only when
+ * the buffer fills or flush() is called, so a listing of thousands of rows
+ * costs a handful of syscalls instead of one per line. On a terminal,
+ * complete lines are written as they are produced so interactive commands
+ * still update promptly.
+ *
+ * Formatting uses std::format, e.g. out.print("{:<15}{}\n", name, size).
+ */
+class Output {
+public:
+    static constexpr size_t DEFAULT_CAPACITY = 64 * 1024;
+
+    /**
+     * Constructor
+     * @param fd File descriptor to write to
+     * @param capacity Buffered bytes that trigger a write
+     */
+    explicit Output(int fd, size_t capacity = DEFAULT_CAPACITY);
+
+    /**
+     * Destructor - writes anything still buffered
+     */
+    ~Output();
+
+    Output(const Output&) = delete;
+    Output& operator=(const Output&) = delete;
+
+    /**
+     * Append formatted text
+     */
+    template <typename... Args>
+    void print(std::format_string<Args...> fmt, Args&&... args) {
+        std::format_to(std::back_inserter(buffer_), fmt, std::forward<Args>(args)...);
+        after_append();
+    }
+
+    /**
+     * Append text as-is
+     */
+    void write(std::string_view text) {
+        buffer_.append(text);
+        after_append();
+    }
+
+    /**
+     * Write everything buffered
+     * @return false if the descriptor rejected the write (e.g. closed pipe)
+     */
+    bool flush();
+
+    /**
+     * Whether every write so far succeeded
+     */
+    bool good() const { return !failed_; }
+
+    /**
+     * Whether the descriptor is a terminal
+     */
+    bool is_tty() const { return tty_; }
+
+private:
+    // Flush when full, or up to the last complete line on a terminal
+    void after_append();
+
+    // Write and drop the first `len` buffered bytes
+    bool write_out(size_t len);
+
+    int fd_;
+    size_t capacity_;
+    bool tty_;
+    bool failed_ = false;
+    std::string buffer_;
+};
+
+} // namespace utils
+} // namespace vmstate
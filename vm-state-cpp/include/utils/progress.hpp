@@ -0,0 +1,68 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace vmstate {
+namespace utils {
+
+/**
+ * OperationProgress - Where a long-running operation is
+ */
+struct OperationProgress {
+    std::string operation;          // e.g. "clone_state", "delete_state", "export"
+    std::string target;             // State, snapshot or file being worked on
+    std::string phase;              // Current step, e.g. "snapshot", "freeing", "copy"
+    uint64_t bytes_done = 0;
+    uint64_t bytes_total = 0;       // 0 if the operation moves no data (or it's unknown)
+    double bytes_per_second = 0;    // Smoothed over recent samples
+    double elapsed_seconds = 0;
+    int pid = 0;                    // Process running it (set by job files)
+};
+
+/**
+ * ProgressMeter - Turns raw byte counts into OperationProgress with a rate
+ *
+ * The rate is sampled at most twice a second and smoothed, so a burst of
+ * completions doesn't make it jump around. A new phase restarts the rate.
+ */
+class ProgressMeter {
+public:
+    ProgressMeter(const std::string& operation, const std::string& target);
+
+    /**
+     * Record where the operation is
+     * @param phase Current step
+     * @param done Bytes done in this phase
+     * @param total Bytes this phase will move (0 if unknown)
+     * @return Updated progress
+     */
+    const OperationProgress& update(const std::string& phase, uint64_t done, uint64_t total);
+
+    /**
+     * Get the latest progress
+     */
+    const OperationProgress& get() const;
+
+private:
+    OperationProgress progress_;
+    std::chrono::steady_clock::time_point started_;
+    std::chrono::steady_clock::time_point last_sample_;
+    uint64_t last_bytes_ = 0;
+};
+
+/**
+ * Write a progress snapshot to a job file (write-then-rename)
+ */
+bool write_job_file(const std::string& path, const OperationProgress& progress);
+
+/**
+ * Read the job files in a directory, skipping those whose process is gone
+ */
+std::vector<OperationProgress> read_job_files(const std::string& dir);
+
+} // namespace utils
+} // namespace vmstate
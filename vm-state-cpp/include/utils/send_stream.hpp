@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+namespace vmstate {
+namespace utils {
+
+/**
+ * SendRange - A byte range of one object touched by a send stream
+ */
+struct SendRange {
+    uint64_t object;
+    uint64_t offset;
+    uint64_t length;        // UINT64_MAX: to the end of the object
+    bool freed;             // FREE record (reads as zeros) rather than a write
+};
+
+/**
+ * Walk a ZFS send stream, visiting the ranges its WRITE and FREE records
+ * cover
+ *
+ * Only record headers are decoded; block contents are read past and
+ * dropped, so memory use doesn't depend on the stream. Handles the
+ * record types a plain (non-raw, non-replicated) incremental stream
+ * carries, compressed and embedded blocks included. Reads until the END
+ * record, then drains the descriptor so a writer feeding it isn't left
+ * blocked.
+ * @param fd Stream to read
+ * @param fn Called per WRITE/FREE range
+ * @param error Set on failure
+ * @param progress Called with the bytes consumed so far, every few MiB
+ *                 and once at the end
+ * @return true if a complete, well-formed stream was read
+ */
+bool scan_send_stream(int fd, const std::function<void(const SendRange&)>& fn,
+                      std::string& error,
+                      const std::function<void(uint64_t)>& progress = {});
+
+} // namespace utils
+} // namespace vmstate
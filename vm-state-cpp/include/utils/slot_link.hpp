@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+
+namespace vmstate {
+namespace utils {
+
+/**
+ * Point a slot's data.img at a state's image
+ *
+ * The link is staged as <path>.tmp and renamed over <path>, so a slot that
+ * already links to a state switches in one step. A regular file at <path>
+ * (a slot image from before assignments) is first moved to <path>.backup.
+ * Only links are ever staged or replaced: after a crash at any point the
+ * old image is at <path> or <path>.backup, and a leftover <path>.tmp is a
+ * link that is safe to remove. An existing backup is never overwritten.
+ * @param path Slot's data.img
+ * @param target State image the link points at
+ * @param error Set when returning false
+ * @return true if <path> now links to target
+ */
+bool install_slot_link(const std::string& path, const std::string& target,
+                       std::string& error);
+
+} // namespace utils
+} // namespace vmstate
@@ -0,0 +1,483 @@
+#include "catalog/shared_catalog.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <sched.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace vmstate {
+
+namespace {
+
+constexpr int READ_ATTEMPTS = 100;
+
+size_t align8(size_t n) {
+    return (n + 7) & ~static_cast<size_t>(7);
+}
+
+std::atomic_ref<uint64_t> seq_of(CatalogHeader* h) {
+    return std::atomic_ref<uint64_t>(h->seq);
+}
+
+std::atomic_ref<uint32_t> flags_of(CatalogHeader* h) {
+    return std::atomic_ref<uint32_t>(h->flags);
+}
+
+/**
+ * Serialized payload (everything after the header) plus the header fields
+ * that describe it
+ */
+struct Payload {
+    std::vector<uint8_t> bytes;
+    CatalogHeader header = {};
+};
+
+class StringTable {
+public:
+    CatalogString add(const std::string& s) {
+        CatalogString ref{static_cast<uint32_t>(data_.size()),
+                          static_cast<uint32_t>(s.size())};
+        data_.append(s);
+        return ref;
+    }
+    const std::string& data() const { return data_; }
+
+private:
+    std::string data_;
+};
+
+Payload serialize(const CatalogData& data) {
+    StringTable strings;
+
+    std::vector<CatalogStateRecord> states;
+    states.reserve(data.states.size());
+    for (const auto& s : data.states) {
+        states.push_back({strings.add(s.name), strings.add(s.path),
+                          strings.add(s.dataset), s.used_bytes, s.available_bytes,
+                          s.guid, s.snapshots_changed});
+    }
+
+    // Store snapshots in catalog order so readers can binary-search them
+    std::vector<const SnapshotInfo*> sorted;
+    sorted.reserve(data.snapshots.size());
+    for (const auto& s : data.snapshots) {
+        sorted.push_back(&s);
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const SnapshotInfo* a, const SnapshotInfo* b) {
+        if (a->state_name != b->state_name) return a->state_name < b->state_name;
+        if (a->creation_unix != b->creation_unix) return a->creation_unix < b->creation_unix;
+        return a->name < b->name;
+    });
+
+    std::vector<CatalogSnapshotRecord> snapshots;
+    snapshots.reserve(sorted.size());
+    for (const auto* s : sorted) {
+        snapshots.push_back({strings.add(s->name), strings.add(s->state_name),
+                             strings.add(s->full_name), strings.add(s->creation_time),
+                             s->creation_unix, s->size_bytes});
+    }
+
+    std::vector<CatalogAssignmentRecord> assignments;
+    assignments.reserve(data.assignments.size());
+    for (const auto& a : data.assignments) {
+        assignments.push_back({strings.add(a.slot_name), strings.add(a.state_name)});
+    }
+
+    Payload p;
+    CatalogHeader& h = p.header;
+    std::memcpy(h.magic, CATALOG_MAGIC, sizeof(h.magic));
+    h.version = CATALOG_VERSION;
+    h.generation = data.generation;
+    h.state_count = states.size();
+    h.snapshot_count = snapshots.size();
+    h.assignment_count = assignments.size();
+
+    size_t offset = sizeof(CatalogHeader);
+    h.states_offset = offset;
+    offset = align8(offset + states.size() * sizeof(CatalogStateRecord));
+    h.snapshots_offset = offset;
+    offset = align8(offset + snapshots.size() * sizeof(CatalogSnapshotRecord));
+    h.assignments_offset = offset;
+    offset = align8(offset + assignments.size() * sizeof(CatalogAssignmentRecord));
+    h.strings_offset = offset;
+    h.strings_size = strings.data().size();
+    offset += strings.data().size();
+
+    // Payload bytes are laid out relative to the start of the segment;
+    // the header region is left zeroed and written separately
+    p.bytes.assign(offset, 0);
+    auto copy_in = [&p](uint64_t at, const void* src, size_t len) {
+        if (len) std::memcpy(p.bytes.data() + at, src, len);
+    };
+    copy_in(h.states_offset, states.data(), states.size() * sizeof(CatalogStateRecord));
+    copy_in(h.snapshots_offset, snapshots.data(),
+            snapshots.size() * sizeof(CatalogSnapshotRecord));
+    copy_in(h.assignments_offset, assignments.data(),
+            assignments.size() * sizeof(CatalogAssignmentRecord));
+    copy_in(h.strings_offset, strings.data().data(), strings.data().size());
+    return p;
+}
+
+bool header_valid(const CatalogHeader* h, size_t size) {
+    return size >= sizeof(CatalogHeader) &&
+           std::memcmp(h->magic, CATALOG_MAGIC, sizeof(h->magic)) == 0 &&
+           h->version == CATALOG_VERSION;
+}
+
+// Serializes publishers; readers never take this lock
+class PublishLock {
+public:
+    explicit PublishLock(const std::string& path) {
+        fd_ = open((path + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd_ >= 0) {
+            flock(fd_, LOCK_EX);
+        }
+    }
+    ~PublishLock() {
+        if (fd_ >= 0) {
+            flock(fd_, LOCK_UN);
+            close(fd_);
+        }
+    }
+
+private:
+    int fd_ = -1;
+};
+
+// Run a modification of an existing segment inside its seqlock
+template <typename Fn>
+bool modify_in_place(const std::string& path, Fn&& fn) {
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void* addr = size >= sizeof(CatalogHeader)
+        ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+        : MAP_FAILED;
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+
+    auto* h = static_cast<CatalogHeader*>(addr);
+    bool ok = false;
+    if (header_valid(h, size)) {
+        seq_of(h).fetch_add(1, std::memory_order_acq_rel);   // odd: writing
+        std::atomic_thread_fence(std::memory_order_release);
+        ok = fn(h, static_cast<uint8_t*>(addr), size);
+        seq_of(h).fetch_add(1, std::memory_order_release);   // even: done
+    }
+    munmap(addr, size);
+    return ok;
+}
+
+}  // anonymous namespace
+
+// ========== CatalogView ==========
+
+CatalogView::CatalogView(const uint8_t* base, size_t mapped_size,
+                         const CatalogHeader& header)
+    : base_(base), mapped_size_(mapped_size), header_(header) {}
+
+const CatalogStateRecord& CatalogView::state(size_t i) const {
+    return reinterpret_cast<const CatalogStateRecord*>(base_ + header_.states_offset)[i];
+}
+
+const CatalogSnapshotRecord& CatalogView::snapshot(size_t i) const {
+    return reinterpret_cast<const CatalogSnapshotRecord*>(base_ + header_.snapshots_offset)[i];
+}
+
+const CatalogAssignmentRecord& CatalogView::assignment(size_t i) const {
+    return reinterpret_cast<const CatalogAssignmentRecord*>(
+        base_ + header_.assignments_offset)[i];
+}
+
+std::pair<size_t, size_t> CatalogView::snapshot_range(std::string_view state_name) const {
+    // First record whose state sorts at or after (or strictly after) the name
+    auto bound = [&](bool after) {
+        size_t lo = 0;
+        size_t hi = snapshot_count();
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            std::string_view name = str(snapshot(mid).state_name);
+            if (after ? name <= state_name : name < state_name) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    };
+    return {bound(false), bound(true)};
+}
+
+std::string_view CatalogView::str(const CatalogString& s) const {
+    // Bounds-check: a reader racing a rewrite may see garbage offsets
+    // before the seqlock tells it to retry
+    uint64_t end = static_cast<uint64_t>(s.offset) + s.length;
+    if (end > header_.strings_size ||
+        header_.strings_offset + end > mapped_size_) {
+        return {};
+    }
+    return std::string_view(
+        reinterpret_cast<const char*>(base_ + header_.strings_offset + s.offset), s.length);
+}
+
+StateInfo CatalogView::to_state_info(const CatalogStateRecord& r) const {
+    StateInfo info;
+    info.name = std::string(str(r.name));
+    info.path = std::string(str(r.path));
+    info.dataset = std::string(str(r.dataset));
+    info.used_bytes = r.used_bytes;
+    info.available_bytes = r.available_bytes;
+    info.guid = r.guid;
+    info.snapshots_changed = r.snapshots_changed;
+    return info;
+}
+
+SnapshotInfo CatalogView::to_snapshot_info(const CatalogSnapshotRecord& r) const {
+    SnapshotInfo info;
+    info.name = std::string(str(r.name));
+    info.state_name = std::string(str(r.state_name));
+    info.full_name = std::string(str(r.full_name));
+    info.creation_time = std::string(str(r.creation_time));
+    info.creation_unix = r.creation_unix;
+    info.size_bytes = r.size_bytes;
+    return info;
+}
+
+SlotAssignment CatalogView::to_assignment(const CatalogAssignmentRecord& r) const {
+    SlotAssignment a;
+    a.slot_name = std::string(str(r.slot_name));
+    a.state_name = std::string(str(r.state_name));
+    return a;
+}
+
+// ========== Publishing ==========
+
+bool publish_shared_catalog(const std::string& path,
+                            const CatalogData& data,
+                            std::string& error) {
+    std::error_code ec;
+    fs::create_directories(fs::path(path).parent_path(), ec);
+
+    Payload payload = serialize(data);
+    size_t needed = payload.bytes.size();
+    PublishLock lock(path);
+
+    // Fast path: rewrite the existing segment under its seqlock so mapped
+    // readers keep their mapping
+    bool rewritten = modify_in_place(path, [&](CatalogHeader* h, uint8_t* base, size_t size) {
+        if (needed > size) {
+            return false;
+        }
+        std::memcpy(base + sizeof(CatalogHeader),
+                    payload.bytes.data() + sizeof(CatalogHeader),
+                    needed - sizeof(CatalogHeader));
+        CatalogHeader fresh = payload.header;
+        h->generation = fresh.generation;
+        h->state_count = fresh.state_count;
+        h->snapshot_count = fresh.snapshot_count;
+        h->assignment_count = fresh.assignment_count;
+        h->states_offset = fresh.states_offset;
+        h->snapshots_offset = fresh.snapshots_offset;
+        h->assignments_offset = fresh.assignments_offset;
+        h->strings_offset = fresh.strings_offset;
+        h->strings_size = fresh.strings_size;
+        flags_of(h).store(0, std::memory_order_release);
+        return true;
+    });
+    if (rewritten) {
+        return true;
+    }
+
+    // Slow path: write a larger segment next to the old one and swap it in.
+    // Headroom lets later publishes of a growing catalog stay in place.
+    long page = sysconf(_SC_PAGESIZE);
+    size_t capacity = needed + needed / 2;
+    capacity = (capacity + page - 1) / page * page;
+
+    std::string temp_path = path + ".tmp";
+    int fd = open(temp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        error = "Failed to create " + temp_path + ": " + std::strerror(errno);
+        return false;
+    }
+    if (ftruncate(fd, static_cast<off_t>(capacity)) != 0) {
+        error = "Failed to size " + temp_path + ": " + std::strerror(errno);
+        close(fd);
+        return false;
+    }
+
+    payload.header.capacity = capacity;
+    std::memcpy(payload.bytes.data(), &payload.header, sizeof(CatalogHeader));
+    size_t written = 0;
+    while (written < needed) {
+        ssize_t n = pwrite(fd, payload.bytes.data() + written, needed - written,
+                           static_cast<off_t>(written));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            error = "Failed to write " + temp_path + ": " + std::strerror(errno);
+            close(fd);
+            return false;
+        }
+        written += static_cast<size_t>(n);
+    }
+    close(fd);
+
+    // Keep the old segment open across the rename so it can be flagged
+    int old_fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (rename(temp_path.c_str(), path.c_str()) != 0) {
+        error = "Failed to install " + path + ": " + std::strerror(errno);
+        if (old_fd >= 0) close(old_fd);
+        return false;
+    }
+
+    if (old_fd >= 0) {
+        struct stat st;
+        if (fstat(old_fd, &st) == 0 &&
+            static_cast<size_t>(st.st_size) >= sizeof(CatalogHeader)) {
+            void* addr = mmap(nullptr, sizeof(CatalogHeader), PROT_READ | PROT_WRITE,
+                              MAP_SHARED, old_fd, 0);
+            if (addr != MAP_FAILED) {
+                auto* h = static_cast<CatalogHeader*>(addr);
+                if (header_valid(h, sizeof(CatalogHeader))) {
+                    flags_of(h).fetch_or(CATALOG_FLAG_SUPERSEDED, std::memory_order_release);
+                    seq_of(h).fetch_add(2, std::memory_order_release);
+                }
+                munmap(addr, sizeof(CatalogHeader));
+            }
+        }
+        close(old_fd);
+    }
+    return true;
+}
+
+void invalidate_shared_catalog(const std::string& path) {
+    if (access(path.c_str(), F_OK) != 0) {
+        return;
+    }
+    PublishLock lock(path);
+    modify_in_place(path, [](CatalogHeader* h, uint8_t*, size_t) {
+        flags_of(h).fetch_or(CATALOG_FLAG_STALE, std::memory_order_release);
+        return true;
+    });
+}
+
+// ========== SharedCatalogReader ==========
+
+SharedCatalogReader::SharedCatalogReader(const std::string& path)
+    : path_(path) {}
+
+SharedCatalogReader::~SharedCatalogReader() {
+    unmap();
+}
+
+bool SharedCatalogReader::map() {
+    unmap();
+    int fd = open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        last_error_ = "No published catalog at " + path_;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(CatalogHeader)) {
+        last_error_ = "Catalog segment " + path_ + " is truncated";
+        close(fd);
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void* addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        last_error_ = "Failed to map " + path_ + ": " + std::strerror(errno);
+        return false;
+    }
+    base_ = static_cast<const uint8_t*>(addr);
+    mapped_size_ = size;
+
+    if (!header_valid(reinterpret_cast<const CatalogHeader*>(base_), mapped_size_)) {
+        last_error_ = "Catalog segment " + path_ + " has an unknown format";
+        unmap();
+        return false;
+    }
+    return true;
+}
+
+void SharedCatalogReader::unmap() {
+    if (base_) {
+        munmap(const_cast<uint8_t*>(base_), mapped_size_);
+        base_ = nullptr;
+        mapped_size_ = 0;
+    }
+}
+
+bool SharedCatalogReader::read(const std::function<void(const CatalogView&)>& fn) {
+    if (!base_ && !map()) {
+        return false;
+    }
+
+    for (int attempt = 0; attempt < READ_ATTEMPTS; attempt++) {
+        // The mapping is read-only; atomic_ref needs a non-const object
+        auto* h = reinterpret_cast<CatalogHeader*>(const_cast<uint8_t*>(base_));
+
+        uint64_t before = seq_of(h).load(std::memory_order_acquire);
+        if (before & 1) {
+            sched_yield();
+            continue;
+        }
+
+        uint32_t flags = flags_of(h).load(std::memory_order_acquire);
+        if (flags & CATALOG_FLAG_SUPERSEDED) {
+            if (!map()) return false;
+            continue;
+        }
+        if (flags & CATALOG_FLAG_STALE) {
+            last_error_ = "Catalog segment " + path_ + " is stale";
+            return false;
+        }
+
+        CatalogHeader header;
+        std::memcpy(&header, h, sizeof(header));
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        // Reject headers that a concurrent rewrite could have torn
+        bool in_bounds =
+            header.states_offset + header.state_count * sizeof(CatalogStateRecord) <= mapped_size_ &&
+            header.snapshots_offset + header.snapshot_count * sizeof(CatalogSnapshotRecord) <= mapped_size_ &&
+            header.assignments_offset + header.assignment_count * sizeof(CatalogAssignmentRecord) <= mapped_size_ &&
+            header.strings_offset + header.strings_size <= mapped_size_;
+
+        if (in_bounds) {
+            fn(CatalogView(base_, mapped_size_, header));
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seq_of(h).load(std::memory_order_acquire) == before && in_bounds) {
+            return true;
+        }
+    }
+
+    last_error_ = "Catalog segment " + path_ + " kept changing while being read";
+    return false;
+}
+
+std::string SharedCatalogReader::get_last_error() const {
+    return last_error_;
+}
+
+} // namespace vmstate
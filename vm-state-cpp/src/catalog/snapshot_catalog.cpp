@@ -0,0 +1,120 @@
+#include "catalog/snapshot_catalog.hpp"
+#include <algorithm>
+#include <fnmatch.h>
+#include <numeric>
+
+namespace vmstate {
+
+namespace {
+
+bool sort_key_less(const SnapshotInfo& a, const SnapshotInfo& b) {
+    if (a.state_name != b.state_name) return a.state_name < b.state_name;
+    if (a.creation_unix != b.creation_unix) return a.creation_unix < b.creation_unix;
+    return a.name < b.name;
+}
+
+// Literal text before the first glob metacharacter
+std::string literal_prefix(const std::string& pattern) {
+    size_t pos = pattern.find_first_of("*?[\\");
+    return pattern.substr(0, pos);
+}
+
+}  // anonymous namespace
+
+SnapshotCatalog::SnapshotCatalog(std::vector<SnapshotInfo> snapshots)
+    : snapshots_(std::move(snapshots)) {
+    std::sort(snapshots_.begin(), snapshots_.end(), sort_key_less);
+
+    by_name_.resize(snapshots_.size());
+    std::iota(by_name_.begin(), by_name_.end(), 0);
+    std::sort(by_name_.begin(), by_name_.end(), [this](size_t a, size_t b) {
+        return snapshots_[a].name < snapshots_[b].name;
+    });
+}
+
+std::pair<size_t, size_t> SnapshotCatalog::state_range(
+    const std::string& state_name) const {
+    if (state_name.empty()) {
+        return {0, snapshots_.size()};
+    }
+    auto first = std::lower_bound(
+        snapshots_.begin(), snapshots_.end(), state_name,
+        [](const SnapshotInfo& s, const std::string& v) { return s.state_name < v; });
+    auto last = std::upper_bound(
+        first, snapshots_.end(), state_name,
+        [](const std::string& v, const SnapshotInfo& s) { return v < s.state_name; });
+    return {static_cast<size_t>(first - snapshots_.begin()),
+            static_cast<size_t>(last - snapshots_.begin())};
+}
+
+std::vector<const SnapshotInfo*> SnapshotCatalog::with_prefix(
+    const std::string& prefix) const {
+    std::vector<const SnapshotInfo*> result;
+    auto it = std::lower_bound(
+        by_name_.begin(), by_name_.end(), prefix,
+        [this](size_t i, const std::string& v) { return snapshots_[i].name < v; });
+    for (; it != by_name_.end(); ++it) {
+        const auto& snap = snapshots_[*it];
+        if (snap.name.compare(0, prefix.size(), prefix) != 0) break;
+        result.push_back(&snap);
+    }
+    return result;
+}
+
+std::vector<const SnapshotInfo*> SnapshotCatalog::query(
+    const SnapshotQuery& q) const {
+    std::vector<const SnapshotInfo*> result;
+
+    auto in_time_range = [&q](const SnapshotInfo& s) {
+        return (!q.since || s.creation_unix >= *q.since) &&
+               (!q.until || s.creation_unix < *q.until);
+    };
+
+    // A glob with a literal prefix is answered from the name index, then
+    // put back into catalog order
+    std::string prefix = literal_prefix(q.pattern);
+    if (!prefix.empty()) {
+        for (const auto* snap : with_prefix(prefix)) {
+            if ((q.state_name.empty() || snap->state_name == q.state_name) &&
+                in_time_range(*snap) &&
+                fnmatch(q.pattern.c_str(), snap->name.c_str(), 0) == 0) {
+                result.push_back(snap);
+            }
+        }
+        std::sort(result.begin(), result.end(),
+                  [](const SnapshotInfo* a, const SnapshotInfo* b) {
+                      return sort_key_less(*a, *b);
+                  });
+        return result;
+    }
+
+    // Otherwise binary-search the time range inside each state's run
+    auto [first, last] = state_range(q.state_name);
+    size_t i = first;
+    while (i < last) {
+        const std::string& state = snapshots_[i].state_name;
+        size_t run_end = state_range(state).second;
+
+        auto begin = snapshots_.begin() + static_cast<std::ptrdiff_t>(i);
+        auto end = snapshots_.begin() + static_cast<std::ptrdiff_t>(run_end);
+        if (q.since) {
+            begin = std::lower_bound(begin, end, *q.since,
+                [](const SnapshotInfo& s, uint64_t t) { return s.creation_unix < t; });
+        }
+        if (q.until) {
+            end = std::lower_bound(begin, end, *q.until,
+                [](const SnapshotInfo& s, uint64_t t) { return s.creation_unix < t; });
+        }
+        for (auto it = begin; it != end; ++it) {
+            if (q.pattern.empty() ||
+                fnmatch(q.pattern.c_str(), it->name.c_str(), 0) == 0) {
+                result.push_back(&*it);
+            }
+        }
+        i = run_end;
+    }
+
+    return result;
+}
+
+} // namespace vmstate
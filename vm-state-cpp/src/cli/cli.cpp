@@ -1,8 +1,39 @@
 #include "cli/cli.hpp"
+#include "catalog/shared_catalog.hpp"
+#include "catalog/snapshot_catalog.hpp"
+#include "image/ext4_image.hpp"
+#include "nbd/hydrating_source.hpp"
+#include "nbd/nbd_device.hpp"
+#include "nbd/nbd_server.hpp"
+#include "utils/io_engine.hpp"
+#include "utils/progress.hpp"
 #include <iostream>
-#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <arpa/inet.h>
+#include <grp.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pwd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cctype>
+#include <climits>
+#include <charconv>
+#include <cmath>
 #include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <format>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <thread>
 
 namespace vmstate {
 
@@ -15,46 +46,707 @@ namespace colors {
     const char* RESET = "\033[0m";
 }
 
+namespace {
+
+// Upper bound on waiting for a slot's start or stop job; systemd's own unit
+// timeouts normally end the job well before this
+constexpr std::chrono::minutes UNIT_JOB_TIMEOUT{5};
+
+/**
+ * Parse a point in time for --since/--until
+ *
+ * Accepts seconds since the epoch, a relative age ("90m", "12h", "7d",
+ * "2w" ago), or a local date/time ("2026-03-01", "2026-03-01 14:30",
+ * "2026-03-01T14:30:00").
+ */
+std::optional<uint64_t> parse_time(const std::string& text) {
+    if (text.empty()) {
+        return std::nullopt;
+    }
+
+    size_t digits = 0;
+    while (digits < text.size() && std::isdigit(static_cast<unsigned char>(text[digits]))) {
+        digits++;
+    }
+
+    // Out-of-range numbers are rejected, not clamped
+    uint64_t amount = 0;
+    if (digits > 0) {
+        auto [end, ec] = std::from_chars(text.data(), text.data() + digits, amount);
+        if (ec != std::errc{}) {
+            return std::nullopt;
+        }
+    }
+
+    if (digits == text.size()) {
+        return amount;
+    }
+
+    if (digits > 0 && digits + 1 == text.size()) {
+        uint64_t unit = 0;
+        switch (text.back()) {
+            case 'm': unit = 60; break;
+            case 'h': unit = 3600; break;
+            case 'd': unit = 86400; break;
+            case 'w': unit = 7 * 86400; break;
+            default: return std::nullopt;
+        }
+        uint64_t now = static_cast<uint64_t>(std::time(nullptr));
+        if (amount > std::numeric_limits<uint64_t>::max() / unit) {
+            return std::nullopt;
+        }
+        uint64_t age = amount * unit;
+        return age > now ? 0 : now - age;
+    }
+
+    const char* formats[] = {
+        "%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S",
+        "%Y-%m-%d %H:%M", "%Y-%m-%dT%H:%M", "%Y-%m-%d",
+    };
+    for (const char* format : formats) {
+        struct tm tm = {};
+        const char* end = strptime(text.c_str(), format, &tm);
+        if (end && *end == '\0') {
+            tm.tm_isdst = -1;
+            time_t t = mktime(&tm);
+            if (t < 0) return std::nullopt;
+            return static_cast<uint64_t>(t);
+        }
+    }
+    return std::nullopt;
+}
+
+// Format sizes
+std::string format_size(uint64_t bytes) {
+    const char* suffixes[] = {"B", "K", "M", "G", "T"};
+    int idx = 0;
+    double size = static_cast<double>(bytes);
+    while (size >= 1024 && idx < 4) {
+        size /= 1024;
+        idx++;
+    }
+    return std::format("{:.1f}{}", size, suffixes[idx]);
+}
+
+// Running operations publish their progress here for `vm-state jobs`
+const std::string JOBS_DIR = "/run/vm-state/jobs";
+
+// Background work pauses while any slot's tasks spent more than this
+// percentage of the last 10s stalled on I/O
+constexpr double DEFAULT_PAUSE_ABOVE = 10.0;
+
+// Longest single pause, so background work still finishes under constant load
+constexpr std::chrono::minutes MAX_BACKGROUND_PAUSE{5};
+
+// How often maintain re-checks load and the scan
+constexpr std::chrono::seconds MAINTAIN_POLL{5};
+
+// Longest maintain window; also keeps the deadline within steady_clock's range
+constexpr uint64_t MAX_MAINTAIN_WINDOW = 365 * 86400;
+
+// Pool latency (mean per I/O over a poll) above which maintain pauses
+constexpr double DEFAULT_MAX_LATENCY_MS = 20.0;
+
+// maintain stops pausing once the projected finish comes this close to
+// the end of the window (projected time x margin)
+constexpr double MAINTAIN_DEADLINE_MARGIN = 1.25;
+
+// Parse a duration such as "90m", "12h", "3d" or plain seconds
+std::optional<uint64_t> parse_duration(const std::string& text) {
+    // from_chars takes no sign, so "-5m" is rejected rather than wrapped
+    uint64_t amount = 0;
+    auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), amount);
+    if (ec != std::errc()) {
+        return std::nullopt;
+    }
+    std::string unit(end, text.data() + text.size());
+    uint64_t multiplier = unit.empty() || unit == "s" ? 1
+                          : unit == "m"               ? 60
+                          : unit == "h"               ? 3600
+                          : unit == "d"               ? 86400
+                                                      : 0;
+    if (multiplier == 0 || amount > std::numeric_limits<uint64_t>::max() / multiplier) {
+        return std::nullopt;
+    }
+    return amount * multiplier;
+}
+
+// Progress line such as "fingerprint snap1: hash 12.0G/64.0G 18% 1.2G/s 0:43 left"
+std::string format_progress(const utils::OperationProgress& p) {
+    std::string line = std::format("{} {}: {}", p.operation, p.target, p.phase);
+    if (p.bytes_total > 0) {
+        line += std::format(" {}/{} {:.0f}%", format_size(p.bytes_done),
+                            format_size(p.bytes_total),
+                            100.0 * static_cast<double>(p.bytes_done) /
+                                static_cast<double>(p.bytes_total));
+    }
+    if (p.bytes_per_second > 0) {
+        line += std::format(" {}/s", format_size(static_cast<uint64_t>(p.bytes_per_second)));
+        if (p.bytes_total > p.bytes_done) {
+            auto left = static_cast<uint64_t>(
+                static_cast<double>(p.bytes_total - p.bytes_done) / p.bytes_per_second);
+            line += std::format(" {}:{:02} left", left / 60, left % 60);
+        }
+    }
+    return line;
+}
+
+// Split the leading decimal number off a size or rate ("1.5" of "1.5G"),
+// leaving the rest in unit. The number must be all of that prefix ("1.2.3"
+// and "." are not numbers), finite and above zero.
+std::optional<double> parse_quantity(const std::string& text, std::string& unit) {
+    size_t digits = 0;
+    while (digits < text.size() &&
+           (std::isdigit(static_cast<unsigned char>(text[digits])) || text[digits] == '.')) {
+        digits++;
+    }
+    std::string number = text.substr(0, digits);
+    char* end = nullptr;
+    double value = std::strtod(number.c_str(), &end);
+    if (digits == 0 || end != number.c_str() + number.size() || !std::isfinite(value) ||
+        value <= 0) {
+        return std::nullopt;
+    }
+    unit = text.substr(digits);
+    return value;
+}
+
+// Convert a parsed quantity to an integer, rejecting what uint64_t can't hold
+std::optional<uint64_t> to_uint64(double value) {
+    if (value >= static_cast<double>(std::numeric_limits<uint64_t>::max())) {
+        return std::nullopt;
+    }
+    return static_cast<uint64_t>(value);
+}
+
+// Parse sizes like "200G", "512M" or a plain byte count (1024-based)
+std::optional<uint64_t> parse_size(const std::string& text) {
+    std::string unit;
+    auto value = parse_quantity(text, unit);
+    if (!value || unit.size() > 1) {
+        return std::nullopt;
+    }
+    if (!unit.empty()) {
+        const std::string suffixes = "BKMGT";
+        size_t idx = suffixes.find(static_cast<char>(std::toupper(
+            static_cast<unsigned char>(unit[0]))));
+        if (idx == std::string::npos) {
+            return std::nullopt;
+        }
+        for (size_t i = 0; i < idx; i++) {
+            *value *= 1024;
+        }
+    }
+    return to_uint64(*value);
+}
+
+// Parse tc-style rates: bit/kbit/mbit/gbit, or bps/kbps/mbps/gbps for
+// bytes (1000-based); returns bits per second
+std::optional<uint64_t> parse_rate(const std::string& text) {
+    std::string unit;
+    auto value = parse_quantity(text, unit);
+    if (!value) {
+        return std::nullopt;
+    }
+    std::transform(unit.begin(), unit.end(), unit.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+
+    double multiplier = 1;
+    if (!unit.empty() && (unit[0] == 'k' || unit[0] == 'm' || unit[0] == 'g')) {
+        multiplier = unit[0] == 'k' ? 1e3 : unit[0] == 'm' ? 1e6 : 1e9;
+        unit.erase(0, 1);
+    }
+    if (unit == "bps") {
+        multiplier *= 8;
+    } else if (unit != "bit" && !(unit.empty() && multiplier == 1)) {
+        return std::nullopt;
+    }
+    return to_uint64(*value * multiplier);
+}
+
+// Format bits per second the way parse_rate accepts them
+std::string format_rate(uint64_t bits_per_sec) {
+    const char* units[] = {"bit", "kbit", "mbit", "gbit"};
+    int idx = 0;
+    double rate = static_cast<double>(bits_per_sec);
+    while (rate >= 1000 && idx < 3) {
+        rate /= 1000;
+        idx++;
+    }
+    return std::format("{:g}{}", rate, units[idx]);
+}
+
+// Remove a boolean flag from args, reporting whether it was present
+bool take_flag(std::vector<std::string>& args, const std::string& flag) {
+    auto it = std::find(args.begin(), args.end(), flag);
+    if (it == args.end()) {
+        return false;
+    }
+    args.erase(it);
+    return true;
+}
+
+// Remove "--flag <value>" from args; missing_value is set if the value is absent
+std::optional<std::string> take_option(std::vector<std::string>& args,
+                                       const std::string& flag,
+                                       bool& missing_value) {
+    auto it = std::find(args.begin(), args.end(), flag);
+    if (it == args.end()) {
+        return std::nullopt;
+    }
+    if (it + 1 == args.end()) {
+        missing_value = true;
+        args.erase(it);
+        return std::nullopt;
+    }
+    std::string value = *(it + 1);
+    args.erase(it, it + 2);
+    return value;
+}
+
+// Fill mode/owner of an injection from "0600" and "uid:gid" strings
+bool parse_injection_attrs(const std::string& mode, const std::string& owner,
+                           FileInjection& file) {
+    if (!mode.empty()) {
+        char* end = nullptr;
+        unsigned long bits = std::strtoul(mode.c_str(), &end, 8);
+        if (*end != '\0' || bits > 07777) return false;
+        file.mode = static_cast<uint32_t>(bits);
+    }
+    if (!owner.empty()) {
+        size_t colon = owner.find(':');
+        if (colon == std::string::npos) return false;
+        char* end = nullptr;
+        file.uid = static_cast<uint32_t>(std::strtoul(owner.c_str(), &end, 10));
+        if (end != owner.c_str() + colon) return false;
+        file.gid = static_cast<uint32_t>(std::strtoul(owner.c_str() + colon + 1, &end, 10));
+        if (*end != '\0') return false;
+    }
+    return true;
+}
+
+/**
+ * Read a batch injection manifest
+ *
+ * One file per line: "<source> <dest-path> [mode] [uid:gid]". Blank lines
+ * and lines starting with '#' are ignored. "-" reads from stdin.
+ */
+bool load_injection_manifest(const std::string& path, std::vector<FileInjection>& files,
+                             std::string& error) {
+    std::ifstream file_in;
+    if (path != "-") {
+        file_in.open(path);
+        if (!file_in) {
+            error = "Failed to open manifest " + path;
+            return false;
+        }
+    }
+    std::istream& in = path == "-" ? std::cin : file_in;
+
+    std::string line;
+    size_t line_no = 0;
+    while (std::getline(in, line)) {
+        line_no++;
+        std::istringstream fields(line);
+        FileInjection file;
+        std::string mode, owner;
+        if (!(fields >> file.source_path) || file.source_path[0] == '#') {
+            continue;
+        }
+        fields >> file.dest_path >> mode >> owner;
+        if (file.dest_path.empty() || !parse_injection_attrs(mode, owner, file)) {
+            error = path + ":" + std::to_string(line_no) +
+                    ": expected '<source> <dest-path> [mode] [uid:gid]'";
+            return false;
+        }
+        files.push_back(std::move(file));
+    }
+    return true;
+}
+
+// ls-style permission string, e.g. "drwxr-xr-x"
+std::string format_mode(const Ext4Entry& entry) {
+    std::string out;
+    switch (entry.type) {
+        case Ext4EntryType::DIRECTORY: out += 'd'; break;
+        case Ext4EntryType::SYMLINK: out += 'l'; break;
+        case Ext4EntryType::REGULAR: out += '-'; break;
+        default: out += '?'; break;
+    }
+    const char* rwx = "rwxrwxrwx";
+    for (int i = 0; i < 9; i++) {
+        out += (entry.mode & (0400u >> i)) ? rwx[i] : '-';
+    }
+    return out;
+}
+
+std::string format_time(uint64_t unix_time) {
+    time_t t = static_cast<time_t>(unix_time);
+    struct tm tm;
+    localtime_r(&t, &tm);
+    char buf[32];
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M", &tm);
+    return buf;
+}
+
+/**
+ * Wait until a TCP port accepts connections
+ *
+ * Retries until the deadline, so a guest that is still booting (no route,
+ * connection refused) is simply polled again.
+ * @return true once a connection succeeded
+ */
+bool wait_for_tcp(const std::string& ip, uint16_t port, std::chrono::milliseconds timeout) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) != 1) {
+        return false;
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (true) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            return false;
+        }
+        bool connected = connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+        if (!connected && errno == EINPROGRESS) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now());
+            pollfd pfd{fd, POLLOUT, 0};
+            int wait_ms = static_cast<int>(std::clamp<int64_t>(left.count(), 0, 1000));
+            if (poll(&pfd, 1, wait_ms) == 1) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                connected = getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0;
+            }
+        }
+        close(fd);
+
+        if (connected) {
+            return true;
+        }
+        if (std::chrono::steady_clock::now() >= deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    }
+}
+
+// Set by SIGINT/SIGTERM/SIGHUP in commands that run until interrupted
+std::atomic<bool> stop_requested{false};
+
+void request_stop(int) {
+    stop_requested = true;
+}
+
+/**
+ * Route SIGINT/SIGTERM/SIGHUP to stop_requested
+ *
+ * SIGHUP covers a closed terminal or SSH session, so the command still
+ * cleans up. No SA_RESTART, so blocking calls return early and see the flag.
+ */
+void catch_stop_signals() {
+    struct sigaction action{};
+    action.sa_handler = request_stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    sigaction(SIGHUP, &action, nullptr);
+}
+
+/**
+ * Escape a name for use in a unit name, as systemd-escape does: bytes
+ * outside [A-Za-z0-9:_.] (and a leading '.') become \xNN
+ */
+std::string escape_unit_name(const std::string& name) {
+    std::string escaped;
+    for (size_t i = 0; i < name.size(); i++) {
+        unsigned char c = name[i];
+        if (std::isalnum(c) || c == ':' || c == '_' || (c == '.' && i > 0)) {
+            escaped += static_cast<char>(c);
+        } else {
+            escaped += std::format("\\x{:02x}", c);
+        }
+    }
+    return escaped;
+}
+
+/**
+ * Let the microvm user (QEMU) open a file or device, as the provider does
+ * for state directories; skipped where the user doesn't exist
+ */
+void give_to_microvm(const std::string& path) {
+    struct passwd* pw = getpwnam("microvm");
+    struct group* gr = getgrnam("kvm");
+    if (pw && gr && chown(path.c_str(), pw->pw_uid, gr->gr_gid) != 0) {
+        // Not fatal: QEMU reports it if it can't open the image
+    }
+}
+
+}  // anonymous namespace
+
 CLI::CLI(std::unique_ptr<VMProvider> vm_provider,
          std::unique_ptr<StateProvider> state_provider)
     : vm_provider_(std::move(vm_provider)),
-      state_provider_(std::move(state_provider)) {
+      state_provider_(std::move(state_provider)),
+      out_(STDOUT_FILENO),
+      err_(STDERR_FILENO) {
     // Disable colors if not a TTY
-    use_colors_ = isatty(STDOUT_FILENO) != 0;
+    use_colors_ = out_.is_tty();
+
+    state_provider_->set_progress_callback([this](const utils::OperationProgress& progress) {
+        return show_progress(progress);
+    });
+}
+
+bool CLI::show_progress(const utils::OperationProgress& progress) {
+    publish_progress(progress);
+
+    auto now = std::chrono::steady_clock::now();
+    if (pause_above_ > 0 && now - pressure_checked_at_ >= std::chrono::seconds(1)) {
+        pause_for_guests(progress);
+        pressure_checked_at_ = std::chrono::steady_clock::now();
+    }
+    return true;
+}
+
+void CLI::publish_progress(const utils::OperationProgress& progress) {
+    // Quick operations stay quiet; only ones that run a while get a
+    // progress line and a job file
+    auto now = std::chrono::steady_clock::now();
+    if (err_.is_tty() && progress.elapsed_seconds >= 0.5 &&
+        now - progress_drawn_at_ >= std::chrono::milliseconds(100)) {
+        err_.print("\r{}\033[K", format_progress(progress));
+        err_.flush();
+        progress_drawn_ = true;
+        progress_drawn_at_ = now;
+    }
+
+    if (progress.elapsed_seconds >= 1 && now - job_written_at_ >= std::chrono::seconds(1)) {
+        if (job_file_.empty()) {
+            mkdir("/run/vm-state", 0755);
+            mkdir(JOBS_DIR.c_str(), 0755);
+            job_file_ = JOBS_DIR + "/" + std::to_string(getpid()) + ".json";
+        }
+        utils::OperationProgress job = progress;
+        job.pid = static_cast<int>(getpid());
+        // Best-effort: a missing job file only hides us from `vm-state jobs`
+        utils::write_job_file(job_file_, job);
+        job_written_at_ = now;
+    }
+}
+
+bool CLI::enter_background(std::vector<std::string>& args) {
+    bool foreground = take_flag(args, "--foreground");
+    bool missing_value = false;
+    auto pause_text = take_option(args, "--pause-above", missing_value);
+    if (missing_value) {
+        error("--pause-above needs a percentage");
+        return false;
+    }
+    BackgroundLimits limits;
+    auto device = take_option(args, "--io-device", missing_value);
+    auto read_max = take_option(args, "--io-read-max", missing_value);
+    auto write_max = take_option(args, "--io-write-max", missing_value);
+    if (missing_value) {
+        error("--io-device needs a block device; --io-read-max and --io-write-max a "
+              "rate in bytes per second (e.g. 200M)");
+        return false;
+    }
+    for (auto [text, target] : {std::pair{&read_max, &limits.io_read_max},
+                                std::pair{&write_max, &limits.io_write_max}}) {
+        if (!*text) continue;
+        auto rate = parse_size(**text);
+        if (!rate || *rate == 0) {
+            error("Invalid rate '" + **text + "'. Use bytes per second like 200M.");
+            return false;
+        }
+        *target = *rate;
+    }
+    if ((read_max || write_max) != static_cast<bool>(device)) {
+        error("--io-device and --io-read-max/--io-write-max go together");
+        return false;
+    }
+    if (device) {
+        limits.io_device = *device;
+    }
+    double pause_above = DEFAULT_PAUSE_ABOVE;
+    if (pause_text) {
+        char* end = nullptr;
+        pause_above = std::strtod(pause_text->c_str(), &end);
+        if (pause_text->empty() || *end != '\0' || pause_above < 0 || pause_above > 100) {
+            error("Invalid percentage '" + *pause_text + "'. Use 0-100 (0 never pauses).");
+            return false;
+        }
+    }
+    if (foreground) {
+        return true;
+    }
+
+    pause_above_ = pause_above;
+    if (!vm_provider_->enter_background(limits)) {
+        warn("Running without I/O isolation: " + vm_provider_->get_last_error());
+    }
+    return true;
+}
+
+double CLI::busiest_slot_pressure(std::string& busiest) const {
+    double worst = 0;
+    for (const auto& slot : vm_provider_->list_slots()) {
+        auto pressure = vm_provider_->get_slot_io_pressure(slot);
+        if (pressure && *pressure > worst) {
+            worst = *pressure;
+            busiest = slot;
+        }
+    }
+    return worst;
+}
+
+void CLI::pause_for_guests(const utils::OperationProgress& progress) {
+    auto started = std::chrono::steady_clock::now();
+    while (std::chrono::steady_clock::now() - started < MAX_BACKGROUND_PAUSE) {
+        std::string busiest;
+        double worst = busiest_slot_pressure(busiest);
+        if (worst <= pause_above_) {
+            return;
+        }
+
+        utils::OperationProgress paused = progress;
+        paused.phase = std::format("paused ({} stalled {:.0f}% on I/O)", busiest, worst);
+        paused.bytes_per_second = 0;
+        publish_progress(paused);
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+}
+
+void CLI::clear_progress() const {
+    if (progress_drawn_) {
+        err_.write("\r\033[K");
+        err_.flush();
+        progress_drawn_ = false;
+    }
+}
+
+void CLI::end_progress() {
+    clear_progress();
+    if (!job_file_.empty()) {
+        unlink(job_file_.c_str());
+        job_file_.clear();
+    }
 }
 
 void CLI::info(const std::string& msg) const {
+    clear_progress();
     if (use_colors_) {
-        std::cout << colors::BLUE << "[INFO]" << colors::RESET << " " << msg << std::endl;
+        out_.print("{}[INFO]{} {}\n", colors::BLUE, colors::RESET, msg);
     } else {
-        std::cout << "[INFO] " << msg << std::endl;
+        out_.print("[INFO] {}\n", msg);
     }
 }
 
 void CLI::success(const std::string& msg) const {
+    clear_progress();
     if (use_colors_) {
-        std::cout << colors::GREEN << "[OK]" << colors::RESET << " " << msg << std::endl;
+        out_.print("{}[OK]{} {}\n", colors::GREEN, colors::RESET, msg);
     } else {
-        std::cout << "[OK] " << msg << std::endl;
+        out_.print("[OK] {}\n", msg);
     }
 }
 
 void CLI::warn(const std::string& msg) const {
+    clear_progress();
     if (use_colors_) {
-        std::cout << colors::YELLOW << "[WARN]" << colors::RESET << " " << msg << std::endl;
+        out_.print("{}[WARN]{} {}\n", colors::YELLOW, colors::RESET, msg);
     } else {
-        std::cout << "[WARN] " << msg << std::endl;
+        out_.print("[WARN] {}\n", msg);
     }
 }
 
 void CLI::error(const std::string& msg) const {
+    clear_progress();
+    // Keep stdout and stderr in order when both go to the same place
+    out_.flush();
     if (use_colors_) {
-        std::cerr << colors::RED << "[ERROR]" << colors::RESET << " " << msg << std::endl;
+        err_.print("{}[ERROR]{} {}\n", colors::RED, colors::RESET, msg);
+    } else {
+        err_.print("[ERROR] {}\n", msg);
+    }
+    err_.flush();
+}
+
+void CLI::print_estimate(const OperationEstimate& estimate) const {
+    info("Dry run: " + estimate.operation + " (nothing was changed)");
+    out_.print("  immediate space: {}\n", format_size(estimate.immediate_bytes));
+    out_.print("  pinned space:    {}\n", format_size(estimate.pinned_bytes));
+    out_.print("  freed space:     {}\n", format_size(estimate.freed_bytes));
+    if (estimate.expected_ms) {
+        out_.print("  expected time:   {:.0f}ms (mean of {} runs)\n",
+                   *estimate.expected_ms, estimate.history_samples);
     } else {
-        std::cerr << "[ERROR] " << msg << std::endl;
+        out_.write("  expected time:   unknown (no recorded runs yet)\n");
+    }
+    for (const auto& note : estimate.notes) {
+        out_.print("  note: {}\n", note);
     }
 }
 
+std::optional<std::map<std::string, SlotNetRates>> CLI::sample_network_rates(
+    double seconds) {
+    auto before = vm_provider_->get_network_stats();
+    auto start = std::chrono::steady_clock::now();
+    if (!before) {
+        return std::nullopt;
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    auto after = vm_provider_->get_network_stats();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (!after) {
+        return std::nullopt;
+    }
+
+    std::map<std::string, const SlotNetStats*> previous;
+    for (const auto& s : *before) {
+        previous[s.slot_name] = &s;
+    }
+
+    // Counters reset when a tap is recreated (slot restarted); treat a
+    // decrease as a fresh start rather than a huge wrap-around
+    auto delta = [](uint64_t now, uint64_t then) { return now >= then ? now - then : now; };
+    double secs = std::max(elapsed.count(), 1e-3);
+
+    std::map<std::string, SlotNetRates> rates;
+    for (const auto& s : *after) {
+        auto it = previous.find(s.slot_name);
+        const SlotNetStats zero{};
+        const SlotNetStats& p = it != previous.end() ? *it->second : zero;
+        rates[s.slot_name] = {
+            delta(s.rx_bytes, p.rx_bytes) / secs,
+            delta(s.tx_bytes, p.tx_bytes) / secs,
+            delta(s.rx_packets, p.rx_packets) / secs,
+            delta(s.tx_packets, p.tx_packets) / secs,
+            s.rx_dropped + s.tx_dropped,
+            s.rx_errors + s.tx_errors,
+            s.queue_dropped,
+        };
+    }
+    return rates;
+}
+
+bool CLI::read_current_catalog(const std::function<void(const CatalogView&)>& fn) {
+    uint64_t current = state_provider_->get_generation();
+    uint64_t published = 0;
+    SharedCatalogReader reader(state_provider_->get_catalog_path());
+    bool ok = reader.read([&](const CatalogView& view) {
+        published = view.generation();
+        if (published == current) {
+            fn(view);
+        }
+    });
+    return ok && published == current;
+}
+
 bool CLI::check_root() const {
     if (geteuid() != 0) {
         error("This command must be run as root");
@@ -73,18 +765,22 @@ std::string CLI::status_string(VMStatus status) const {
 }
 
 int CLI::run(int argc, char* argv[]) {
-    if (argc < 2) {
-        return cmd_list();
-    }
-
-    std::string cmd = argv[1];
+    std::string cmd = argc < 2 ? "list" : argv[1];
     std::vector<std::string> args;
     for (int i = 2; i < argc; i++) {
         args.push_back(argv[i]);
     }
 
+    int result = dispatch(cmd, args);
+    end_progress();
+    out_.flush();
+    err_.flush();
+    return result;
+}
+
+int CLI::dispatch(const std::string& cmd, const std::vector<std::string>& args) {
     if (cmd == "list") {
-        return cmd_list();
+        return cmd_list(args);
     } else if (cmd == "create") {
         return cmd_create(args);
     } else if (cmd == "snapshot") {
@@ -97,8 +793,40 @@ int CLI::run(int argc, char* argv[]) {
         return cmd_delete(args);
     } else if (cmd == "migrate") {
         return cmd_migrate(args);
+    } else if (cmd == "bluegreen") {
+        return cmd_bluegreen(args);
     } else if (cmd == "restore") {
         return cmd_restore(args);
+    } else if (cmd == "snapshots") {
+        return cmd_snapshots(args);
+    } else if (cmd == "catalog") {
+        return cmd_catalog(args);
+    } else if (cmd == "fingerprint") {
+        return cmd_fingerprint(args);
+    } else if (cmd == "export") {
+        return cmd_export(args);
+    } else if (cmd == "changed-ranges") {
+        return cmd_changed_ranges(args);
+    } else if (cmd == "serve-nbd") {
+        return cmd_serve_nbd(args);
+    } else if (cmd == "lazy-restore") {
+        return cmd_lazy_restore(args);
+    } else if (cmd == "jobs") {
+        return cmd_jobs(args);
+    } else if (cmd == "reclaim") {
+        return cmd_reclaim(args);
+    } else if (cmd == "reconcile") {
+        return cmd_reconcile(args);
+    } else if (cmd == "maintain") {
+        return cmd_maintain(args);
+    } else if (cmd == "inspect") {
+        return cmd_inspect(args);
+    } else if (cmd == "inject") {
+        return cmd_inject(args);
+    } else if (cmd == "top") {
+        return cmd_top(args);
+    } else if (cmd == "net-limit") {
+        return cmd_net_limit(args);
     } else if (cmd == "help" || cmd == "--help" || cmd == "-h") {
         return cmd_help();
     } else {
@@ -107,82 +835,137 @@ int CLI::run(int argc, char* argv[]) {
     }
 }
 
-int CLI::cmd_list() {
+int CLI::cmd_list(const std::vector<std::string>& raw_args) {
     if (!check_root()) return 1;
 
+    std::vector<std::string> args = raw_args;
+    bool show_net = take_flag(args, "--net");
+    if (!args.empty()) {
+        error("Usage: vm-state list [--net]");
+        return 1;
+    }
+
+    // Rates need a sample window; one second keeps list responsive
+    std::optional<std::map<std::string, SlotNetRates>> net;
+    if (show_net) {
+        net = sample_network_rates(1.0);
+        if (!net) {
+            warn("Network stats unavailable: " + vm_provider_->get_last_error());
+        }
+    }
+
+    // Serve the listing from the published catalog when nothing changed
+    // since it was published; otherwise walk the provider
+    const size_t page = 20;
+    std::vector<SlotAssignment> assignments;
+    std::vector<StateInfo> states;
+    std::vector<std::string> snapshots;
+    bool truncated = false;
+
+    bool cached = read_current_catalog([&](const CatalogView& view) {
+        assignments.clear();
+        states.clear();
+        snapshots.clear();
+        for (size_t i = 0; i < view.assignment_count(); i++) {
+            assignments.push_back(view.to_assignment(view.assignment(i)));
+        }
+        for (size_t i = 0; i < view.state_count(); i++) {
+            states.push_back(view.to_state_info(view.state(i)));
+        }
+        for (size_t i = 0; i < view.snapshot_count() && i < page; i++) {
+            snapshots.emplace_back(view.str(view.snapshot(i).full_name));
+        }
+        truncated = view.snapshot_count() > page;
+    });
+
+    if (!cached) {
+        assignments = state_provider_->list_assignments();
+        states = state_provider_->list_states();
+
+        // list_states() has already brought a caching provider's listing
+        // (snapshots included) up to date, so counting the rest past the
+        // page is a pass over memory
+        size_t seen = state_provider_->for_each_snapshot(
+            "", 0, [&](const SnapshotInfo& snap) {
+                if (snapshots.size() < page) {
+                    snapshots.push_back(snap.full_name);
+                }
+                return true;
+            });
+        truncated = seen > page;
+    }
+
+    std::map<std::string, const StateInfo*> states_by_name;
+    for (const auto& state : states) {
+        states_by_name[state.name] = &state;
+    }
+
     info("States and assignments:");
-    std::cout << std::endl;
+    out_.write("\n");
 
     // Header
-    std::cout << std::left
-              << std::setw(15) << "SLOT"
-              << std::setw(15) << "STATE"
-              << std::setw(10) << "RUNNING"
-              << "ZFS DATASET" << std::endl;
-    std::cout << std::left
-              << std::setw(15) << "----"
-              << std::setw(15) << "-----"
-              << std::setw(10) << "-------"
-              << "-----------" << std::endl;
-
-    // List slots and their assignments
-    auto assignments = state_provider_->list_assignments();
-    for (const auto& a : assignments) {
-        bool running = vm_provider_->is_running(a.slot_name);
-        auto state_info = state_provider_->get_state_info(a.state_name);
+    out_.print("{:<15}{:<15}{:<10}", "SLOT", "STATE", "RUNNING");
+    if (net) {
+        out_.print("{:<10}{:<10}{:<8}", "RX/s", "TX/s", "DROPS");
+    }
+    out_.write("ZFS DATASET\n");
+    out_.print("{:<15}{:<15}{:<10}", "----", "-----", "-------");
+    if (net) {
+        out_.print("{:<10}{:<10}{:<8}", "----", "----", "-----");
+    }
+    out_.write("-----------\n");
 
-        std::cout << std::left
-                  << std::setw(15) << a.slot_name
-                  << std::setw(15) << a.state_name
-                  << std::setw(10) << (running ? "yes" : "no")
-                  << (state_info ? state_info->dataset : "(not found)")
-                  << std::endl;
+    // List slots and their assignments; statuses come in one query when
+    // the provider can, rather than a round trip per slot
+    auto statuses = vm_provider_->get_all_statuses();
+    for (const auto& a : assignments) {
+        bool running = false;
+        if (statuses) {
+            auto status = statuses->find(a.slot_name);
+            running = status != statuses->end() && status->second == VMStatus::Running;
+        } else {
+            running = vm_provider_->is_running(a.slot_name);
+        }
+        auto it = states_by_name.find(a.state_name);
+
+        out_.print("{:<15}{:<15}{:<10}", a.slot_name, a.state_name, running ? "yes" : "no");
+        if (net) {
+            auto rate = net->find(a.slot_name);
+            if (rate != net->end()) {
+                out_.print("{:<10}{:<10}{:<8}",
+                           format_size(static_cast<uint64_t>(rate->second.rx_bytes)),
+                           format_size(static_cast<uint64_t>(rate->second.tx_bytes)),
+                           rate->second.dropped);
+            } else {
+                out_.print("{:<10}{:<10}{:<8}", "-", "-", "-");
+            }
+        }
+        out_.print("{}\n", it != states_by_name.end() ? it->second->dataset : "(not found)");
     }
 
-    std::cout << std::endl;
+    out_.write("\n");
     info("Available states (ZFS datasets):");
 
-    auto states = state_provider_->list_states();
     if (states.empty()) {
-        std::cout << "  (no states created yet)" << std::endl;
+        out_.write("  (no states created yet)\n");
     } else {
         for (const auto& state : states) {
-            std::cout << "  " << std::left << std::setw(20) << state.name;
-
-            // Format sizes
-            auto format_size = [](uint64_t bytes) -> std::string {
-                const char* suffixes[] = {"B", "K", "M", "G", "T"};
-                int idx = 0;
-                double size = static_cast<double>(bytes);
-                while (size >= 1024 && idx < 4) {
-                    size /= 1024;
-                    idx++;
-                }
-                char buf[32];
-                snprintf(buf, sizeof(buf), "%.1f%s", size, suffixes[idx]);
-                return std::string(buf);
-            };
-
-            std::cout << "used: " << std::left << std::setw(8) << format_size(state.used_bytes)
-                      << "avail: " << format_size(state.available_bytes)
-                      << std::endl;
+            out_.print("  {:<20}used: {:<8}avail: {}\n", state.name,
+                       format_size(state.used_bytes), format_size(state.available_bytes));
         }
     }
 
-    std::cout << std::endl;
+    out_.write("\n");
     info("Snapshots:");
 
-    auto snapshots = state_provider_->list_snapshots();
     if (snapshots.empty()) {
-        std::cout << "  (no snapshots)" << std::endl;
+        out_.write("  (no snapshots)\n");
     } else {
-        int count = 0;
-        for (const auto& snap : snapshots) {
-            std::cout << "  " << snap.full_name << std::endl;
-            if (++count >= 20) {
-                std::cout << "  ... (truncated)" << std::endl;
-                break;
-            }
+        for (const auto& name : snapshots) {
+            out_.print("  {}\n", name);
+        }
+        if (truncated) {
+            out_.write("  ... (truncated)\n");
         }
     }
 
@@ -286,39 +1069,96 @@ int CLI::cmd_assign(const std::vector<std::string>& args) {
     return 0;
 }
 
-int CLI::cmd_clone(const std::vector<std::string>& args) {
+int CLI::cmd_clone(const std::vector<std::string>& raw_args) {
     if (!check_root()) return 1;
 
-    if (args.size() < 2) {
-        error("Usage: vm-state clone <source-state> <destination-state>");
+    const std::string usage =
+        "Usage: vm-state clone [--dry-run] <source-state> <destination-state> "
+        "[--inject <src>:<dest-path>]... [--inject-batch <manifest>]";
+
+    std::vector<std::string> args = raw_args;
+    bool dry_run = take_flag(args, "--dry-run");
+
+    // Files to provision into the clone before it first boots
+    std::vector<FileInjection> files;
+    bool missing_value = false;
+    while (auto spec = take_option(args, "--inject", missing_value)) {
+        size_t colon = spec->find(':');
+        if (colon == std::string::npos) {
+            error(usage);
+            return 1;
+        }
+        FileInjection file;
+        file.source_path = spec->substr(0, colon);
+        file.dest_path = spec->substr(colon + 1);
+        files.push_back(std::move(file));
+    }
+    if (auto manifest = take_option(args, "--inject-batch", missing_value)) {
+        std::string manifest_error;
+        if (!load_injection_manifest(*manifest, files, manifest_error)) {
+            error(manifest_error);
+            return 1;
+        }
+    }
+
+    if (args.size() < 2 || missing_value) {
+        error(usage);
         return 1;
     }
 
     std::string src = args[0];
     std::string dst = args[1];
 
+    if (dry_run) {
+        auto estimate = state_provider_->estimate_clone(src);
+        if (!estimate) {
+            error(state_provider_->get_last_error());
+            return 1;
+        }
+        if (state_provider_->state_exists(dst)) {
+            estimate->notes.push_back("Destination '" + dst + "' already exists; clone will fail");
+        }
+        print_estimate(*estimate);
+        return 0;
+    }
+
     info("Cloning state '" + src + "' to '" + dst + "'...");
 
-    if (!state_provider_->clone_state(src, dst)) {
+    if (!state_provider_->clone_state(src, dst, files)) {
         error(state_provider_->get_last_error());
         return 1;
     }
 
-    success("State '" + src + "' cloned to '" + dst + "'");
+    success("State '" + src + "' cloned to '" + dst + "'" +
+            (files.empty() ? "" : " with " + std::to_string(files.size()) + " file(s) injected"));
     info("Assign it to a slot with: vm-state assign <slot> " + dst);
     return 0;
 }
 
-int CLI::cmd_delete(const std::vector<std::string>& args) {
+int CLI::cmd_delete(const std::vector<std::string>& raw_args) {
     if (!check_root()) return 1;
 
+    std::vector<std::string> args = raw_args;
+    bool dry_run = take_flag(args, "--dry-run");
+    bool wait = take_flag(args, "--wait");
+
     if (args.empty()) {
-        error("Usage: vm-state delete <name>");
+        error("Usage: vm-state delete [--dry-run] [--wait] <name>");
         return 1;
     }
 
     std::string name = args[0];
 
+    if (dry_run) {
+        auto estimate = state_provider_->estimate_delete(name);
+        if (!estimate) {
+            error(state_provider_->get_last_error());
+            return 1;
+        }
+        print_estimate(*estimate);
+        return 0;
+    }
+
     // Check if in use
     auto slot = state_provider_->is_state_in_use(name);
     if (slot) {
@@ -328,8 +1168,8 @@ int CLI::cmd_delete(const std::vector<std::string>& args) {
     }
 
     warn("This will permanently delete state '" + name + "' and all its data!");
-    std::cout << "Type 'DELETE' to confirm: ";
-    std::cout.flush();
+    out_.write("Type 'DELETE' to confirm: ");
+    out_.flush();
 
     std::string confirm;
     std::getline(std::cin, confirm);
@@ -347,6 +1187,15 @@ int CLI::cmd_delete(const std::vector<std::string>& args) {
     }
 
     success("State '" + name + "' deleted");
+
+    if (wait) {
+        info("Waiting for the pool to free the space...");
+        if (!state_provider_->wait_for_freeing(std::chrono::hours(1))) {
+            error(state_provider_->get_last_error());
+            return 1;
+        }
+        success("Space freed");
+    }
     return 0;
 }
 
@@ -363,49 +1212,284 @@ int CLI::cmd_migrate(const std::vector<std::string>& args) {
 
     info("Migrating state '" + state + "' to " + slot + "...");
 
-    // Stop slot if running
-    if (vm_provider_->is_running(slot)) {
+    if (!vm_provider_->is_valid_slot(slot)) {
+        error("Invalid slot name: " + slot);
+        return 1;
+    }
+
+    // Do anything slow before the slot goes down; the switchover itself is
+    // an assignment save and a symlink rename
+    if (!state_provider_->state_exists(state)) {
+        info("Creating state '" + state + "'...");
+        if (!state_provider_->create_state(state)) {
+            error(state_provider_->get_last_error());
+            return 1;
+        }
+    }
+
+    // A state is on one slot at a time: moving it from another slot hands
+    // that slot this one's state, and leaves it stopped
+    auto source = state_provider_->is_state_in_use(state);
+    if (source && *source == slot) {
+        source.reset();
+    }
+    if (source && vm_provider_->is_running(*source)) {
+        info("Stopping " + *source + "...");
+        if (!vm_provider_->stop_and_wait(*source, UNIT_JOB_TIMEOUT)) {
+            error("Failed to stop " + *source + ": " + vm_provider_->get_last_error());
+            return 1;
+        }
+    }
+
+    // Stop slot if running, continuing the moment systemd reports it down
+    auto down_at = std::chrono::steady_clock::now();
+    bool was_running = vm_provider_->is_running(slot);
+    if (was_running) {
         info("Stopping " + slot + "...");
-        if (!vm_provider_->stop(slot)) {
+        if (!vm_provider_->stop_and_wait(slot, UNIT_JOB_TIMEOUT)) {
             error("Failed to stop " + slot + ": " + vm_provider_->get_last_error());
             return 1;
         }
-        // Wait a moment for clean shutdown
-        sleep(2);
     }
+    auto stopped_at = std::chrono::steady_clock::now();
 
     // Assign state
-    if (!state_provider_->assign_state(slot, state)) {
+    bool switched = source ? state_provider_->swap_states(*source, slot)
+                           : state_provider_->assign_state(slot, state);
+    if (!switched) {
         error(state_provider_->get_last_error());
         return 1;
     }
+    auto switched_at = std::chrono::steady_clock::now();
+    if (source) {
+        info(*source + " now holds '" + state_provider_->get_slot_state(*source) +
+             "' (stopped)");
+    }
 
     // Start slot
     info("Starting " + slot + " with state '" + state + "'...");
-    if (!vm_provider_->start(slot)) {
+    if (!vm_provider_->start_and_wait(slot, UNIT_JOB_TIMEOUT)) {
         error("Failed to start " + slot + ": " + vm_provider_->get_last_error());
         return 1;
     }
+    auto up_at = std::chrono::steady_clock::now();
 
     success("Migration complete. " + slot + " is now running state '" + state + "'");
+    if (was_running) {
+        using seconds = std::chrono::duration<double>;
+        using millis = std::chrono::duration<double, std::milli>;
+        info(std::format("Slot downtime {:.2f}s (stop {:.2f}s, switch {:.1f}ms, start {:.2f}s)",
+                         seconds(up_at - down_at).count(),
+                         seconds(stopped_at - down_at).count(),
+                         millis(switched_at - stopped_at).count(),
+                         seconds(up_at - switched_at).count()));
+    }
     return 0;
 }
 
-int CLI::cmd_restore(const std::vector<std::string>& args) {
+int CLI::cmd_bluegreen(const std::vector<std::string>& raw_args) {
     if (!check_root()) return 1;
 
-    if (args.size() < 2) {
-        error("Usage: vm-state restore <snapshot-name> <new-state-name>");
+    const std::string usage =
+        "Usage: vm-state bluegreen <state> --via <spare-slot> [--name <new-state>] "
+        "[--ready-port <port>] [--ready-timeout <seconds>]";
+
+    std::vector<std::string> args = raw_args;
+    bool missing_value = false;
+    auto spare = take_option(args, "--via", missing_value);
+    auto name = take_option(args, "--name", missing_value);
+    auto port_text = take_option(args, "--ready-port", missing_value);
+    auto timeout_text = take_option(args, "--ready-timeout", missing_value);
+    if (missing_value || !spare || args.size() != 1) {
+        error(usage);
         return 1;
     }
+    std::string state = args[0];
 
-    std::string snapshot = args[0];
-    std::string new_state = args[1];
-
-    info("Restoring snapshot '" + snapshot + "' to state '" + new_state + "'...");
+    // Readiness: the guest accepts connections on this port (sshd by default)
+    unsigned long port = 22;
+    double ready_seconds = 300;
+    if (port_text) {
+        char* end = nullptr;
+        port = std::strtoul(port_text->c_str(), &end, 10);
+        if (port_text->empty() || *end != '\0' || port == 0 || port > 65535) {
+            error("Invalid port '" + *port_text + "'");
+            return 1;
+        }
+    }
+    if (timeout_text) {
+        char* end = nullptr;
+        ready_seconds = std::strtod(timeout_text->c_str(), &end);
+        if (timeout_text->empty() || *end != '\0' || ready_seconds <= 0) {
+            error("Invalid timeout '" + *timeout_text + "'. Use a number of seconds.");
+            return 1;
+        }
+    }
+    auto ready_timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::duration<double>(ready_seconds));
 
-    if (!state_provider_->restore_snapshot(snapshot, new_state)) {
-        error(state_provider_->get_last_error());
+    auto primary = state_provider_->is_state_in_use(state);
+    if (!primary) {
+        error("State '" + state + "' isn't assigned to a slot; use migrate instead");
+        return 1;
+    }
+    if (!vm_provider_->is_valid_slot(*spare) || *spare == *primary) {
+        error("Invalid spare slot: " + *spare);
+        return 1;
+    }
+    if (vm_provider_->is_running(*spare)) {
+        error("Spare slot " + *spare + " is running; stop it first");
+        return 1;
+    }
+    auto primary_info = vm_provider_->get_info(*primary);
+    auto spare_info = vm_provider_->get_info(*spare);
+    if (!primary_info || !spare_info) {
+        error(vm_provider_->get_last_error());
+        return 1;
+    }
+
+    std::string green = name ? *name : "";
+    if (green.empty()) {
+        time_t now = std::time(nullptr);
+        struct tm tm;
+        localtime_r(&now, &tm);
+        char stamp[32];
+        strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+        green = state + "-" + stamp;
+    }
+
+    // Green: a clone of the live state, booted on the spare slot
+    info("Cloning '" + state + "' to '" + green + "'...");
+    if (!state_provider_->clone_state(state, green)) {
+        error(state_provider_->get_last_error());
+        return 1;
+    }
+    std::string spare_state = state_provider_->get_slot_state(*spare);
+    if (!state_provider_->assign_state(*spare, green)) {
+        error(state_provider_->get_last_error());
+        return 1;
+    }
+
+    info("Booting '" + green + "' on " + *spare + "...");
+    bool healthy = vm_provider_->start_and_wait(*spare, UNIT_JOB_TIMEOUT);
+    if (healthy) {
+        info(std::format("Waiting for {}:{}...", spare_info->ip_address, port));
+        healthy = wait_for_tcp(spare_info->ip_address, static_cast<uint16_t>(port), ready_timeout);
+    }
+    if (!healthy) {
+        // Nothing served from green yet: put the spare back as it was
+        vm_provider_->stop_and_wait(*spare, UNIT_JOB_TIMEOUT);
+        if (state_provider_->state_exists(spare_state)) {
+            state_provider_->assign_state(*spare, spare_state);
+        }
+        error("'" + green + "' didn't become ready on " + *spare + "; " + *primary +
+              " was not touched (clone kept for inspection)");
+        return 1;
+    }
+    success("'" + green + "' is ready on " + *spare);
+
+    // The green image can only be open once, so it leaves the spare before
+    // the primary goes down; the blackout is the primary's stop and boot
+    if (!vm_provider_->stop_and_wait(*spare, UNIT_JOB_TIMEOUT)) {
+        error("Failed to stop " + *spare + ": " + vm_provider_->get_last_error());
+        return 1;
+    }
+
+    info("Cutting " + *primary + " over to '" + green + "'...");
+    auto blackout_start = std::chrono::steady_clock::now();
+    if (!vm_provider_->stop_and_wait(*primary, UNIT_JOB_TIMEOUT)) {
+        error("Failed to stop " + *primary + ": " + vm_provider_->get_last_error());
+        return 1;
+    }
+
+    // Put the primary back on blue and boot it, reporting the step that
+    // failed. A swap that failed while linking has already saved the
+    // exchange, so the swap back depends on what the primary is assigned
+    auto roll_back = [&] {
+        if (!vm_provider_->stop_and_wait(*primary, UNIT_JOB_TIMEOUT)) {
+            error("Rollback: failed to stop " + *primary + ": " + vm_provider_->get_last_error());
+            return false;
+        }
+        if (state_provider_->get_slot_state(*primary) != state &&
+            !state_provider_->swap_states(*primary, *spare)) {
+            error("Rollback: failed to swap '" + state + "' back to " + *primary + ": " +
+                  state_provider_->get_last_error());
+            return false;
+        }
+        if (!vm_provider_->start_and_wait(*primary, UNIT_JOB_TIMEOUT)) {
+            error("Rollback: failed to start " + *primary + " on '" + state + "': " +
+                  vm_provider_->get_last_error());
+            return false;
+        }
+        return true;
+    };
+    auto report_rollback = [&](const std::string& failure) {
+        if (roll_back()) {
+            error(failure + "; " + *primary + " is back on '" + state + "'");
+        } else {
+            error(failure + " and the rollback did not complete; " + *primary +
+                  " is assigned '" + state_provider_->get_slot_state(*primary) +
+                  "' (check with vm-state list)");
+        }
+    };
+
+    // Swap assignments in one update: the primary identity takes green,
+    // blue stays assigned (and so protected from delete) on the spare for
+    // rollback, and neither state is ever on both slots
+    if (!state_provider_->swap_states(*primary, *spare)) {
+        error("Failed to swap assignments: " + state_provider_->get_last_error());
+        report_rollback("Cutover failed");
+        return 1;
+    }
+
+    bool up = vm_provider_->start_and_wait(*primary, UNIT_JOB_TIMEOUT) &&
+              wait_for_tcp(primary_info->ip_address, static_cast<uint16_t>(port), ready_timeout);
+    if (!up) {
+        warn("'" + green + "' didn't come up as " + *primary + "; rolling back");
+        report_rollback("Cutover failed");
+        return 1;
+    }
+    std::chrono::duration<double> blackout = std::chrono::steady_clock::now() - blackout_start;
+
+    success(*primary + " (" + primary_info->ip_address + ") is now running '" + green + "'");
+    info(std::format("Blackout {:.2f}s", blackout.count()));
+    // migrate moves blue back by swapping, so green returns to the spare
+    info("'" + state + "' is kept on " + *spare + " (stopped); roll back with: "
+         "vm-state migrate " + state + " " + *primary);
+    return 0;
+}
+
+int CLI::cmd_restore(const std::vector<std::string>& raw_args) {
+    if (!check_root()) return 1;
+
+    std::vector<std::string> args = raw_args;
+    bool dry_run = take_flag(args, "--dry-run");
+
+    if (args.size() < 2) {
+        error("Usage: vm-state restore [--dry-run] <snapshot-name> <new-state-name>");
+        return 1;
+    }
+
+    std::string snapshot = args[0];
+    std::string new_state = args[1];
+
+    if (dry_run) {
+        auto estimate = state_provider_->estimate_restore(snapshot);
+        if (!estimate) {
+            error(state_provider_->get_last_error());
+            return 1;
+        }
+        if (state_provider_->state_exists(new_state)) {
+            estimate->notes.push_back("State '" + new_state + "' already exists; restore will fail");
+        }
+        print_estimate(*estimate);
+        return 0;
+    }
+
+    info("Restoring snapshot '" + snapshot + "' to state '" + new_state + "'...");
+
+    if (!state_provider_->restore_snapshot(snapshot, new_state)) {
+        error(state_provider_->get_last_error());
         return 1;
     }
 
@@ -414,23 +1498,1331 @@ int CLI::cmd_restore(const std::vector<std::string>& args) {
     return 0;
 }
 
+int CLI::cmd_snapshots(const std::vector<std::string>& args) {
+    if (!check_root()) return 1;
+
+    const std::string usage =
+        "Usage: vm-state snapshots [state] [--since <time>] [--until <time>] [--match <glob>]";
+
+    SnapshotQuery query;
+    for (size_t i = 0; i < args.size(); i++) {
+        const std::string& arg = args[i];
+        if (arg == "--since" || arg == "--until" || arg == "--match") {
+            if (i + 1 >= args.size()) {
+                error(usage);
+                return 1;
+            }
+            const std::string& value = args[++i];
+            if (arg == "--match") {
+                query.pattern = value;
+                continue;
+            }
+            auto t = parse_time(value);
+            if (!t) {
+                error("Invalid time '" + value + "'. Use epoch seconds, YYYY-MM-DD[ HH:MM], or an age like 12h/7d.");
+                return 1;
+            }
+            (arg == "--since" ? query.since : query.until) = t;
+        } else if (!arg.empty() && arg[0] == '-') {
+            error(usage);
+            return 1;
+        } else if (query.state_name.empty()) {
+            query.state_name = arg;
+        } else {
+            error(usage);
+            return 1;
+        }
+    }
+
+    // Prefer the published catalog; fall back to walking the pool
+    std::vector<SnapshotInfo> snapshots;
+    bool from_segment = read_current_catalog([&](const CatalogView& view) {
+        snapshots.clear();
+        auto [first, last] = query.state_name.empty()
+            ? std::pair<size_t, size_t>{0, view.snapshot_count()}
+            : view.snapshot_range(query.state_name);
+        snapshots.reserve(last - first);
+        for (size_t i = first; i < last; i++) {
+            snapshots.push_back(view.to_snapshot_info(view.snapshot(i)));
+        }
+    });
+    if (!from_segment) {
+        snapshots = state_provider_->list_snapshots(query.state_name);
+    }
+
+    SnapshotCatalog catalog(std::move(snapshots));
+    auto matches = catalog.query(query);
+
+    if (matches.empty()) {
+        out_.write("  (no matching snapshots)\n");
+        return 0;
+    }
+
+    out_.print("{:<20}{:<30}{:<18}REFERENCED\n", "STATE", "SNAPSHOT", "CREATED");
+    for (const auto* snap : matches) {
+        out_.print("{:<20}{:<30}{:<18}{}\n", snap->state_name, snap->name,
+                   format_time(snap->creation_unix), format_size(snap->size_bytes));
+    }
+    return 0;
+}
+
+int CLI::cmd_catalog(const std::vector<std::string>& args) {
+    const std::string usage = "Usage: vm-state catalog <publish|dump>";
+    if (args.empty()) {
+        error(usage);
+        return 1;
+    }
+
+    std::string path = state_provider_->get_catalog_path();
+
+    if (args[0] == "publish") {
+        if (!check_root()) return 1;
+
+        CatalogData data;
+        // Taken before the walk: a change during it leaves the segment
+        // looking stale instead of current
+        data.generation = state_provider_->get_generation();
+        data.states = state_provider_->list_states();
+        data.snapshots = state_provider_->list_snapshots();
+        data.assignments = state_provider_->list_assignments();
+
+        std::string publish_error;
+        if (!publish_shared_catalog(path, data, publish_error)) {
+            error(publish_error);
+            return 1;
+        }
+        success("Published " + std::to_string(data.states.size()) + " states, " +
+                std::to_string(data.snapshots.size()) + " snapshots to " + path);
+        return 0;
+    }
+
+    if (args[0] == "dump") {
+        // Tab-separated records for scripts; built in one buffer because the
+        // reader may retry if the catalog is republished mid-read
+        std::string out;
+        SharedCatalogReader reader(path);
+        bool ok = reader.read([&](const CatalogView& view) {
+            out.clear();
+            auto it = std::back_inserter(out);
+            for (size_t i = 0; i < view.state_count(); i++) {
+                const auto& r = view.state(i);
+                it = std::format_to(it, "state\t{}\t{}\t{}\t{}\n", view.str(r.name),
+                                    view.str(r.dataset), r.used_bytes, r.available_bytes);
+            }
+            for (size_t i = 0; i < view.snapshot_count(); i++) {
+                const auto& r = view.snapshot(i);
+                it = std::format_to(it, "snapshot\t{}\t{}\t{}\n", view.str(r.full_name),
+                                    r.creation_unix, r.size_bytes);
+            }
+            for (size_t i = 0; i < view.assignment_count(); i++) {
+                const auto& r = view.assignment(i);
+                it = std::format_to(it, "assignment\t{}\t{}\n", view.str(r.slot_name),
+                                    view.str(r.state_name));
+            }
+        });
+        if (!ok) {
+            error(reader.get_last_error() + ". Run: vm-state catalog publish");
+            return 1;
+        }
+        out_.write(out);
+        return 0;
+    }
+
+    error(usage);
+    return 1;
+}
+
+int CLI::cmd_fingerprint(const std::vector<std::string>& raw_args) {
+    if (!check_root()) return 1;
+
+    std::vector<std::string> args = raw_args;
+    if (!enter_background(args)) return 1;
+
+    if (args.empty()) {
+        error("Usage: vm-state fingerprint [--foreground] [--pause-above <pct>] "
+              "<state|snapshot>...");
+        return 1;
+    }
+
+    // hash -> names, to report images that could share one clone
+    std::map<std::string, std::vector<std::string>> by_hash;
+    int failures = 0;
+
+    for (const auto& name : args) {
+        auto fp = state_provider_->fingerprint(name);
+        if (!fp) {
+            error(name + ": " + state_provider_->get_last_error());
+            failures++;
+            continue;
+        }
+        out_.print("{}  {}{}\n", fp->hash, fp->name, fp->cached ? "  (cached)" : "");
+        by_hash[fp->hash].push_back(fp->name);
+    }
+
+    for (const auto& [hash, names] : by_hash) {
+        if (names.size() < 2) continue;
+        std::string joined;
+        for (const auto& n : names) {
+            joined += (joined.empty() ? "" : ", ") + n;
+        }
+        info("Identical images: " + joined);
+    }
+
+    return failures == 0 ? 0 : 1;
+}
+
+int CLI::cmd_export(const std::vector<std::string>& raw_args) {
+    if (!check_root()) return 1;
+
+    const std::string usage =
+        "Usage: vm-state export <state|snapshot> <file> [--queue-depth <n>] "
+        "[--foreground] [--pause-above <pct>]";
+
+    std::vector<std::string> args = raw_args;
+    if (!enter_background(args)) return 1;
+    bool missing_value = false;
+    auto depth_text = take_option(args, "--queue-depth", missing_value);
+    if (missing_value || args.size() != 2) {
+        error(usage);
+        return 1;
+    }
+
+    utils::IoEngineOptions options;
+    if (depth_text) {
+        char* end = nullptr;
+        unsigned long depth = std::strtoul(depth_text->c_str(), &end, 10);
+        if (depth_text->empty() || *end != '\0' || depth == 0 || depth > 256) {
+            error("Invalid queue depth '" + *depth_text + "'. Use 1-256.");
+            return 1;
+        }
+        options.queue_depth = static_cast<unsigned>(depth);
+    }
+
+    auto location = state_provider_->locate_image(args[0]);
+    if (!location) {
+        error(state_provider_->get_last_error());
+        return 1;
+    }
+    if (location->snapshot_name.empty()) {
+        auto slot = state_provider_->is_state_in_use(location->state_name);
+        if (slot && vm_provider_->is_running(*slot)) {
+            warn("'" + location->state_name + "' is running on " + *slot +
+                 "; export a snapshot for a consistent copy");
+        }
+    }
+
+    utils::ProgressMeter meter("export", args[0]);
+    options.progress = [&](uint64_t done, uint64_t total) {
+        show_progress(meter.update("copy", done, total));
+    };
+
+    utils::IoEngine engine(options);
+    auto started = std::chrono::steady_clock::now();
+    uint64_t written = 0;
+    if (!engine.copy_file(location->image_path, args[1], &written)) {
+        error(engine.get_last_error());
+        return 1;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+
+    success(std::format("Exported {} to {} ({} of data in {:.1f}s{})", args[0], args[1],
+                        format_size(written), elapsed.count(),
+                        engine.uses_uring() ? "" : ", without io_uring"));
+    return 0;
+}
+
+int CLI::cmd_changed_ranges(const std::vector<std::string>& raw_args) {
+    if (!check_root()) return 1;
+
+    const std::string usage =
+        "Usage: vm-state changed-ranges <from-snapshot> <to-snapshot> [--delta <file>]";
+
+    std::vector<std::string> args = raw_args;
+    bool missing_value = false;
+    auto delta_path = take_option(args, "--delta", missing_value);
+    if (missing_value || args.size() != 2) {
+        error(usage);
+        return 1;
+    }
+
+    auto ranges = state_provider_->changed_ranges(args[0], args[1]);
+    if (!ranges) {
+        error(state_provider_->get_last_error());
+        return 1;
+    }
+
+    // One line per extent after a summary comment, so scripts can read it
+    uint64_t written = 0;
+    uint64_t zeroed = 0;
+    for (const auto& extent : ranges->extents) {
+        (extent.zeroed ? zeroed : written) += extent.length;
+    }
+    clear_progress();
+    out_.print("# {} -> {} size {} extents {} data {} zero {}{}\n", ranges->from, ranges->to,
+               ranges->image_size, ranges->extents.size(), written, zeroed,
+               ranges->replaced ? " replaced" : "");
+    for (const auto& extent : ranges->extents) {
+        out_.print("{} {} {}\n", extent.offset, extent.length, extent.zeroed ? "zero" : "data");
+    }
+
+    if (delta_path) {
+        // Changed data at its own offsets, holes everywhere else; zeroed
+        // extents stay holes too, so the map says which holes matter.
+        // Blocks match the default recordsize, the grain of the changes
+        utils::IoEngineOptions options;
+        options.block_size = 128 * 1024;
+        for (const auto& extent : ranges->extents) {
+            if (!extent.zeroed) {
+                options.ranges.emplace_back(extent.offset, extent.offset + extent.length);
+            }
+        }
+        auto location = state_provider_->locate_image(ranges->to);
+        if (!location) {
+            error(state_provider_->get_last_error());
+            return 1;
+        }
+        utils::ProgressMeter meter("changed_ranges", *delta_path);
+        options.progress = [&](uint64_t done, uint64_t total) {
+            show_progress(meter.update("delta", done, total));
+        };
+        // Nothing to copy: skip the whole-file walk, an empty sparse file will do
+        if (options.ranges.empty()) {
+            options.ranges.emplace_back(0, 0);
+        }
+
+        utils::IoEngine engine(options);
+        uint64_t delta_bytes = 0;
+        if (!engine.copy_file(location->image_path, *delta_path, &delta_bytes)) {
+            error(engine.get_last_error());
+            return 1;
+        }
+        clear_progress();
+        err_.print("Wrote {} of changed data to {}\n", format_size(delta_bytes), *delta_path);
+    }
+    return 0;
+}
+
+int CLI::cmd_serve_nbd(const std::vector<std::string>& raw_args) {
+    if (!check_root()) return 1;
+
+    const std::string usage =
+        "Usage: vm-state serve-nbd <state|snapshot> --socket <path> [--name <export>]";
+
+    std::vector<std::string> args = raw_args;
+    bool missing_value = false;
+    auto socket_path = take_option(args, "--socket", missing_value);
+    auto export_name = take_option(args, "--name", missing_value);
+    if (missing_value || !socket_path || args.size() != 1) {
+        error(usage);
+        return 1;
+    }
+
+    auto location = state_provider_->locate_image(args[0]);
+    if (!location) {
+        error(state_provider_->get_last_error());
+        return 1;
+    }
+    if (location->snapshot_name.empty()) {
+        auto slot = state_provider_->is_state_in_use(location->state_name);
+        if (slot && vm_provider_->is_running(*slot)) {
+            warn("'" + location->state_name + "' is running on " + *slot +
+                 "; serve a snapshot for a consistent image");
+        }
+    }
+
+    nbd::FileSource source;
+    if (!source.open(location->image_path)) {
+        error(source.get_last_error());
+        return 1;
+    }
+
+    nbd::NbdServerOptions options;
+    options.socket_path = *socket_path;
+    options.export_name = export_name ? *export_name : args[0];
+    nbd::NbdServer server(source, options);
+    if (!server.listen()) {
+        error(server.get_last_error());
+        return 1;
+    }
+
+    catch_stop_signals();
+
+    info(std::format("Serving {} ({}) read-only on nbd+unix:///{}?socket={}", args[0],
+                     format_size(source.size()), options.export_name, options.socket_path));
+    out_.flush();
+
+    bool served = server.serve(stop_requested);
+    if (!served) {
+        error(server.get_last_error());
+        return 1;
+    }
+    success(std::format("Stopped serving {} ({} connections)", args[0],
+                        server.connections_accepted()));
+    return 0;
+}
+
+int CLI::cmd_lazy_restore(const std::vector<std::string>& raw_args) {
+    if (!check_root()) return 1;
+
+    const std::string usage =
+        "Usage: vm-state lazy-restore <image-file> <new-state> [--slot <slot>] [--foreground]";
+
+    std::vector<std::string> args = raw_args;
+    bool foreground = take_flag(args, "--foreground");
+    bool missing_value = false;
+    auto slot = take_option(args, "--slot", missing_value);
+    if (missing_value || args.size() != 2) {
+        error(usage);
+        return 1;
+    }
+    const std::string& image = args[0];
+    const std::string& state = args[1];
+    auto started = std::chrono::steady_clock::now();
+
+    if (state_provider_->state_exists(state)) {
+        error("State '" + state + "' already exists");
+        return 1;
+    }
+    if (slot && !vm_provider_->is_valid_slot(*slot)) {
+        error("Invalid slot: " + *slot);
+        return 1;
+    }
+    nbd::FileSource origin;
+    if (!origin.open(image)) {
+        error(origin.get_last_error());
+        return 1;
+    }
+
+    // The state's image is served by this process until it is hydrated
+    // (and until the last user closes the device), so by default it runs
+    // as a service that outlives the terminal it was started from
+    if (!foreground) {
+        char self[PATH_MAX];
+        ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+        char* image_path = realpath(image.c_str(), nullptr);
+        if (len <= 0 || !image_path) {
+            error(std::string("Failed to resolve paths: ") + std::strerror(errno));
+            std::free(image_path);
+            return 1;
+        }
+        self[len] = '\0';
+        std::vector<std::string> command = {self, "lazy-restore", image_path, state,
+                                            "--foreground"};
+        std::free(image_path);
+        if (slot) {
+            command.insert(command.end(), {"--slot", *slot});
+        }
+        std::string unit = "vm-state-lazy-restore-" + escape_unit_name(state) + ".service";
+        if (!vm_provider_->start_transient_service(unit, "vm-state lazy restore of " + state,
+                                                   command)) {
+            error(vm_provider_->get_last_error());
+            return 1;
+        }
+        success("Started " + unit);
+        info("Follow it with: journalctl -fu " + unit + " (or vm-state jobs); "
+             "systemctl stop " + unit + " abandons the restore");
+        return 0;
+    }
+
+    info("Creating state '" + state + "' from " + image + " (" +
+         format_size(origin.size()) + ")...");
+    if (!state_provider_->create_state(state)) {
+        error(state_provider_->get_last_error());
+        return 1;
+    }
+    auto location = state_provider_->locate_image(state);
+    if (!location) {
+        error(state_provider_->get_last_error());
+        return 1;
+    }
+
+    // Blocks land in data.img.partial as they are fetched; until it is
+    // complete, data.img is a link to an nbd device serving it, so the
+    // state (and any slot assigned to it) is usable right away
+    std::string partial = location->image_path + ".partial";
+    nbd::HydratingSource source(origin);
+    nbd::NbdServerOptions options;
+    options.export_name = state;
+    options.writable = true;
+    nbd::NbdServer server(source, options);
+    nbd::NbdDevice device;
+
+    // Undo everything; the dataset can only go once nothing holds files in it
+    auto abandon = [&] {
+        device.detach();
+        source.close();
+        state_provider_->delete_state(state, true);
+    };
+
+    if (!source.create(partial)) {
+        error(source.get_last_error());
+        abandon();
+        return 1;
+    }
+    give_to_microvm(partial);
+    if (!device.attach(server, source.size())) {
+        error(device.get_last_error());
+        abandon();
+        return 1;
+    }
+    give_to_microvm(device.path());
+    if (symlink(device.path().c_str(), location->image_path.c_str()) != 0) {
+        error("Failed to link " + location->image_path + ": " + std::strerror(errno));
+        abandon();
+        return 1;
+    }
+    catch_stop_signals();
+
+    // Boot the slot off the device, as migrate would
+    std::string previous;
+    bool was_running = false;
+    if (slot) {
+        previous = state_provider_->get_slot_state(*slot);
+        was_running = vm_provider_->is_running(*slot);
+        if (was_running && !vm_provider_->stop_and_wait(*slot, UNIT_JOB_TIMEOUT)) {
+            error("Failed to stop " + *slot + ": " + vm_provider_->get_last_error());
+            abandon();
+            return 1;
+        }
+        if (!state_provider_->assign_state(*slot, state)) {
+            error(state_provider_->get_last_error());
+            stop_requested = true;  // Roll back below
+        } else if (!vm_provider_->start_and_wait(*slot, UNIT_JOB_TIMEOUT)) {
+            error("Failed to boot " + *slot + ": " + vm_provider_->get_last_error());
+            stop_requested = true;
+        } else {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+            success(std::format("{} is running state '{}' {:.1f}s after the restore began",
+                                *slot, state, elapsed.count()));
+        }
+    } else {
+        success("State '" + state + "' is usable now (data.img -> " + device.path() + ")");
+    }
+
+    utils::ProgressMeter meter("lazy_restore", state);
+    bool complete = !stop_requested && source.fill(stop_requested, [&](uint64_t done,
+                                                                         uint64_t total) {
+        show_progress(meter.update("fill", done, total));
+    });
+
+    if (!complete && !stop_requested) {
+        error(source.get_last_error());
+    }
+
+    // Complete: the local file replaces the link and the state is an
+    // ordinary one. Whoever has the device open keeps writing to the same
+    // file through it until they close it. If it can't be installed the
+    // state is rolled back like an unfinished one
+    if (complete) {
+        int err = source.flush();
+        if (err == 0 && rename(partial.c_str(), location->image_path.c_str()) != 0) {
+            err = errno;
+        }
+        if (err != 0) {
+            error("Failed to install " + location->image_path + ": " + std::strerror(err));
+            complete = false;
+        }
+    }
+
+    if (!complete) {
+        // Without this process the state has no image: put the slot back
+        // and drop the state, guest writes included
+        warn("Restore of '" + state + "' did not finish; removing it");
+        if (slot && state_provider_->get_slot_state(*slot) == state) {
+            vm_provider_->stop_and_wait(*slot, UNIT_JOB_TIMEOUT);
+            state_provider_->assign_state(*slot, previous);
+            if (was_running) {
+                vm_provider_->start_and_wait(*slot, UNIT_JOB_TIMEOUT);
+            }
+        }
+        abandon();
+        return 1;
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+    success(std::format("State '{}' hydrated in {:.1f}s ({} chunks fetched on demand)", state,
+                        elapsed.count(), source.demand_fetches()));
+
+    // Only the device's users are left waiting on this process; as a
+    // service it waits in the background, and restarting the slot ends it
+    if (device.opened_elsewhere()) {
+        info("Serving " + device.path() + " until it is closed; " +
+             (slot ? "restart " + *slot + " to" : std::string("the next user will")) +
+             " switch to the local image");
+        out_.flush();
+        while (device.opened_elsewhere() && !stop_requested) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+        if (stop_requested && device.opened_elsewhere()) {
+            warn(device.path() + " is still open; its users lose it now");
+        }
+    }
+    device.detach();
+    return 0;
+}
+
+int CLI::cmd_jobs(const std::vector<std::string>& args) {
+    if (!args.empty()) {
+        error("Usage: vm-state jobs");
+        return 1;
+    }
+
+    auto jobs = utils::read_job_files(JOBS_DIR);
+    if (jobs.empty()) {
+        info("No long-running operations");
+        return 0;
+    }
+
+    out_.print("{:<8}{:<18}{:<20}{:<10}{:<24}{:<10}{}\n",
+               "PID", "OPERATION", "TARGET", "PHASE", "PROGRESS", "RATE", "ELAPSED");
+    for (const auto& job : jobs) {
+        std::string progress = "-";
+        if (job.bytes_total > 0) {
+            progress = std::format("{}/{} {:.0f}%", format_size(job.bytes_done),
+                                   format_size(job.bytes_total),
+                                   100.0 * static_cast<double>(job.bytes_done) /
+                                       static_cast<double>(job.bytes_total));
+        }
+        std::string rate = job.bytes_per_second > 0
+            ? format_size(static_cast<uint64_t>(job.bytes_per_second)) + "/s"
+            : "-";
+        out_.print("{:<8}{:<18}{:<20}{:<10}{:<24}{:<10}{:.0f}s\n", job.pid, job.operation,
+                   job.target, job.phase, progress, rate, job.elapsed_seconds);
+    }
+    return 0;
+}
+
+int CLI::cmd_reclaim(const std::vector<std::string>& raw_args) {
+    if (!check_root()) return 1;
+
+    const std::string usage = "Usage: vm-state reclaim --target <size> [state] [--execute]";
+
+    std::vector<std::string> args = raw_args;
+    bool execute = take_flag(args, "--execute");
+
+    std::optional<uint64_t> target;
+    std::string state_name;
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i] == "--target" && i + 1 < args.size()) {
+            target = parse_size(args[++i]);
+            if (!target) {
+                error("Invalid size '" + args[i] + "'. Use bytes or a size like 512M/200G.");
+                return 1;
+            }
+        } else if (!args[i].empty() && args[i][0] != '-' && state_name.empty()) {
+            state_name = args[i];
+        } else {
+            error(usage);
+            return 1;
+        }
+    }
+    if (!target) {
+        error(usage);
+        return 1;
+    }
+
+    info("Computing reclaimable space...");
+    auto plan = state_provider_->plan_reclaim(*target, state_name);
+    if (!plan) {
+        error(state_provider_->get_last_error());
+        return 1;
+    }
+
+    if (plan->deletions.empty()) {
+        out_.write("  (no snapshots can be deleted)\n");
+    } else {
+        out_.print("{:<20}{:<50}FREES\n", "STATE", "SNAPSHOTS");
+        for (const auto& deletion : plan->deletions) {
+            std::string range = deletion.snapshots.front();
+            if (deletion.snapshots.size() > 1) {
+                range += " .. " + deletion.snapshots.back() +
+                         " (" + std::to_string(deletion.snapshots.size()) + ")";
+            }
+            out_.print("{:<20}{:<50}{}\n", deletion.state_name, range,
+                       format_size(deletion.freed_bytes));
+        }
+    }
+
+    size_t count = 0;
+    for (const auto& deletion : plan->deletions) {
+        count += deletion.snapshots.size();
+    }
+    out_.write("\n");
+    out_.print("Target:    {}\n", format_size(plan->target_bytes));
+    out_.print("Freed:     {} by deleting {} snapshot(s)\n", format_size(plan->freed_bytes), count);
+    if (!plan->pinned.empty()) {
+        out_.print("Pinned:    {} snapshot(s) kept as clone origins or held\n",
+                   plan->pinned.size());
+    }
+
+    if (!plan->reaches_target) {
+        warn("Deleting every unpinned snapshot doesn't reach the target");
+    }
+
+    if (!execute) {
+        if (count > 0) {
+            info("Run again with --execute to delete these snapshots");
+        }
+        return plan->reaches_target ? 0 : 1;
+    }
+    if (count == 0) {
+        return 1;
+    }
+
+    warn("This will permanently delete " + std::to_string(count) + " snapshot(s)!");
+    out_.write("Type 'DELETE' to confirm: ");
+    out_.flush();
+
+    std::string confirm;
+    std::getline(std::cin, confirm);
+
+    if (confirm != "DELETE") {
+        error("Aborted");
+        return 1;
+    }
+
+    if (!state_provider_->execute_reclaim(*plan)) {
+        error(state_provider_->get_last_error());
+        return 1;
+    }
+
+    success("Deleted " + std::to_string(count) + " snapshot(s), freeing " +
+            format_size(plan->freed_bytes));
+    return 0;
+}
+
+int CLI::cmd_reconcile(const std::vector<std::string>& raw_args) {
+    if (!check_root()) return 1;
+
+    const std::string usage = "Usage: vm-state reconcile [--dry-run] [--min-age <seconds>] "
+                              "[--foreground]";
+
+    std::vector<std::string> args = raw_args;
+    if (!enter_background(args)) return 1;
+    bool dry_run = take_flag(args, "--dry-run");
+    bool missing_value = false;
+    auto min_age_text = take_option(args, "--min-age", missing_value);
+    if (missing_value || !args.empty()) {
+        error(usage);
+        return 1;
+    }
+
+    // Debris younger than this may belong to an operation still running
+    uint64_t min_age = 60;
+    if (min_age_text) {
+        // from_chars takes no sign, so "-5" can't wrap to a huge age
+        const char* end = min_age_text->data() + min_age_text->size();
+        auto [ptr, ec] = std::from_chars(min_age_text->data(), end, min_age);
+        if (min_age_text->empty() || ec != std::errc() || ptr != end) {
+            error("Invalid age '" + *min_age_text + "'. Use a number of seconds.");
+            return 1;
+        }
+    }
+
+    auto report = state_provider_->reconcile(!dry_run, min_age);
+    if (!report) {
+        error(state_provider_->get_last_error());
+        return 1;
+    }
+
+    size_t repaired = 0;
+    size_t failed = 0;
+    if (!report->items.empty()) {
+        out_.print("{:<20}{:<44}{}\n", "KIND", "TARGET", "ACTION");
+        for (const auto& item : report->items) {
+            std::string result;
+            if (item.repaired) {
+                result = "done";
+                repaired++;
+            } else if (!item.error.empty()) {
+                result = "FAILED: " + item.error;
+                failed++;
+            } else {
+                result = dry_run ? "planned" : "skipped";
+            }
+            out_.print("{:<20}{:<44}{} [{}]\n", item.kind, item.target, item.action, result);
+            out_.print("{:<20}{}\n", "", item.detail);
+        }
+        out_.write("\n");
+    }
+
+    info(std::format("Scanned {} state(s), {} snapshot(s) and {} slot(s): {} item(s) found",
+                     report->states_scanned, report->snapshots_scanned,
+                     report->slots_scanned, report->items.size()));
+    if (failed > 0) {
+        error(std::to_string(failed) + " repair(s) failed");
+        return 1;
+    }
+    if (dry_run) {
+        if (!report->items.empty()) {
+            info("Run again without --dry-run to repair");
+        }
+    } else if (repaired > 0) {
+        success("Repaired " + std::to_string(repaired) + " item(s)");
+    }
+    return 0;
+}
+
+int CLI::cmd_maintain(const std::vector<std::string>& raw_args) {
+    if (!check_root()) return 1;
+
+    const std::string usage =
+        "Usage: vm-state maintain <scrub|trim> [--window <time>] [--pause-above <pct>] "
+        "[--max-latency <ms>]";
+
+    std::vector<std::string> args = raw_args;
+    bool missing_value = false;
+    auto window_text = take_option(args, "--window", missing_value);
+    auto pause_text = take_option(args, "--pause-above", missing_value);
+    auto latency_text = take_option(args, "--max-latency", missing_value);
+    if (missing_value || args.size() != 1 || (args[0] != "scrub" && args[0] != "trim")) {
+        error(usage);
+        return 1;
+    }
+    PoolScanKind kind = args[0] == "scrub" ? PoolScanKind::Scrub : PoolScanKind::Trim;
+    std::string label = args[0] == "scrub" ? "Scrub" : "TRIM";
+
+    uint64_t window = 86400;
+    if (window_text) {
+        auto parsed = parse_duration(*window_text);
+        if (!parsed || *parsed == 0 || *parsed > MAX_MAINTAIN_WINDOW) {
+            error("Invalid window '" + *window_text + "'. Use e.g. 12h or 3d (up to 365d).");
+            return 1;
+        }
+        window = *parsed;
+    }
+    // Thresholds of 0 turn that reason to pause off
+    auto parse_threshold = [this](const std::optional<std::string>& text, double fallback,
+                                  double& value) {
+        value = fallback;
+        if (!text) return true;
+        char* end = nullptr;
+        value = std::strtod(text->c_str(), &end);
+        if (text->empty() || *end != '\0' || value < 0) {
+            error("Invalid value '" + *text + "'. Use a non-negative number (0 never pauses).");
+            return false;
+        }
+        return true;
+    };
+    double pause_above = 0;
+    double max_latency = 0;
+    if (!parse_threshold(pause_text, DEFAULT_PAUSE_ABOVE, pause_above) ||
+        !parse_threshold(latency_text, DEFAULT_MAX_LATENCY_MS, max_latency)) {
+        return 1;
+    }
+
+    auto status = state_provider_->get_pool_scan(kind);
+    if (!status) {
+        error(state_provider_->get_last_error());
+        return 1;
+    }
+    if (!status->supported) {
+        info("No device in the pool supports TRIM; nothing to do");
+        return 0;
+    }
+
+    // A pass already underway (perhaps paused by an earlier run that was
+    // killed) is adopted rather than restarted
+    uint64_t begun = static_cast<uint64_t>(std::time(nullptr));
+    if (status->running) {
+        begun = std::min(begun, status->started_unix);
+        info(label + " already in progress; scheduling it");
+    } else if (!state_provider_->start_pool_scan(kind)) {
+        error(state_provider_->get_last_error());
+        return 1;
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    auto deadline = started + std::chrono::seconds(window);
+    utils::ProgressMeter meter(args[0], "pool");
+    auto last_latency = state_provider_->get_pool_latency();
+    // Throughput while actually running, for projecting the finish
+    double running_seconds = 0;
+    uint64_t running_bytes = 0;
+    uint64_t last_done = status->bytes_done;
+    auto last_poll = std::chrono::steady_clock::now();
+    bool was_running = !status->paused;
+
+    while (true) {
+        std::this_thread::sleep_for(MAINTAIN_POLL);
+        status = state_provider_->get_pool_scan(kind);
+        // The time between polls includes the load and latency queries,
+        // not just the sleep
+        auto poll = std::chrono::steady_clock::now();
+        double since_last_poll = std::chrono::duration<double>(poll - last_poll).count();
+        last_poll = poll;
+        if (!status) {
+            error(state_provider_->get_last_error());
+            return 1;
+        }
+        if (!status->running) {
+            clear_progress();
+            if (status->finished_unix < begun) {
+                error(label + " stopped before finishing (cancelled?)");
+                return 1;
+            }
+            auto took = std::chrono::duration_cast<std::chrono::seconds>(
+                std::chrono::steady_clock::now() - started).count();
+            success(std::format("{} finished in {}:{:02}:{:02}", label, took / 3600,
+                                took / 60 % 60, took % 60));
+            return 0;
+        }
+
+        if (was_running && !status->paused && status->bytes_done >= last_done) {
+            running_seconds += since_last_poll;
+            running_bytes += status->bytes_done - last_done;
+        }
+        last_done = status->bytes_done;
+
+        // Busy if a slot is stalled on I/O or pool I/O has slowed down
+        std::string busy;
+        std::string busiest;
+        double pressure = busiest_slot_pressure(busiest);
+        if (pause_above > 0 && pressure > pause_above) {
+            busy = std::format("{} stalled {:.0f}% on I/O", busiest, pressure);
+        }
+        auto latency = state_provider_->get_pool_latency();
+        if (latency && last_latency && latency->ops > last_latency->ops) {
+            double mean = (latency->total_ms - last_latency->total_ms) /
+                          static_cast<double>(latency->ops - last_latency->ops);
+            if (busy.empty() && max_latency > 0 && mean > max_latency) {
+                busy = std::format("pool latency {:.1f}ms", mean);
+            }
+        }
+        last_latency = latency;
+
+        // Stop yielding once the window no longer has room for it
+        auto now = std::chrono::steady_clock::now();
+        double left = std::chrono::duration<double>(deadline - now).count();
+        double remaining = static_cast<double>(
+            status->bytes_total > status->bytes_done ? status->bytes_total - status->bytes_done
+                                                     : 0);
+        bool must_run = left <= 0;
+        if (running_bytes > 0) {
+            double rate = static_cast<double>(running_bytes) / running_seconds;
+            must_run = must_run || remaining / rate * MAINTAIN_DEADLINE_MARGIN >= left;
+        } else {
+            // Never got to run long enough to measure: use the second half
+            must_run = must_run || left <= static_cast<double>(window) / 2;
+        }
+
+        bool pause = !busy.empty() && !must_run;
+        if (pause && !status->paused) {
+            if (!state_provider_->pause_pool_scan(kind)) {
+                warn(state_provider_->get_last_error());
+            }
+        } else if (!pause && status->paused) {
+            if (!state_provider_->start_pool_scan(kind)) {
+                warn(state_provider_->get_last_error());
+            }
+        }
+        was_running = !pause;
+
+        std::string phase = pause ? "paused (" + busy + ")"
+                          : busy.empty() ? args[0]
+                          : args[0] + " (busy, but due: " + busy + ")";
+        publish_progress(meter.update(phase, status->bytes_done, status->bytes_total));
+    }
+}
+
+int CLI::cmd_inspect(const std::vector<std::string>& raw_args) {
+    if (!check_root()) return 1;
+
+    std::vector<std::string> args = raw_args;
+    bool du = take_flag(args, "--du");
+
+    if (args.empty() || args.size() > 2) {
+        error("Usage: vm-state inspect [--du] <state|snapshot> [path]");
+        return 1;
+    }
+    std::string path = args.size() > 1 ? args[1] : "/";
+
+    auto location = state_provider_->locate_image(args[0]);
+    if (!location) {
+        error(state_provider_->get_last_error());
+        return 1;
+    }
+
+    Ext4Image image(location->image_path);
+    auto entry = image.stat(path);
+    if (!entry) {
+        error(image.get_last_error());
+        return 1;
+    }
+
+    // File contents go to stdout untouched so they can be piped
+    if (entry->type == Ext4EntryType::REGULAR && !du) {
+        bool ok = image.read_file(path, [this](const char* data, size_t len) {
+            out_.write(std::string_view(data, len));
+            return out_.good();
+        });
+        out_.flush();
+        if (!ok) {
+            error(image.get_last_error());
+            return 1;
+        }
+        return 0;
+    }
+
+    if (location->snapshot_name.empty()) {
+        auto slot = state_provider_->is_state_in_use(location->state_name);
+        if (slot && vm_provider_->is_running(*slot)) {
+            warn("'" + location->state_name + "' is running on " + *slot +
+                 "; inspect a snapshot for a consistent view");
+        }
+    }
+    if (image.needs_recovery()) {
+        warn("The filesystem journal has unreplayed changes; recent writes may be missing");
+    }
+
+    if (entry->type != Ext4EntryType::DIRECTORY) {
+        if (du) {
+            out_.print("{}\t{}\n", format_size(entry->allocated_bytes), path);
+        } else {
+            out_.print("{} {}\n", format_mode(*entry), path);
+        }
+        return 0;
+    }
+
+    auto entries = image.list(path);
+    if (!entries) {
+        error(image.get_last_error());
+        return 1;
+    }
+    std::string prefix = path.back() == '/' ? path : path + "/";
+
+    if (du) {
+        // Directories are summed recursively; symlinks are not followed
+        std::vector<std::pair<uint64_t, std::string>> usage;
+        uint64_t total = entry->allocated_bytes;
+        for (const auto& child : *entries) {
+            uint64_t bytes = child.allocated_bytes;
+            if (child.type == Ext4EntryType::DIRECTORY) {
+                auto sum = image.disk_usage(prefix + child.name);
+                if (!sum) {
+                    error(image.get_last_error());
+                    return 1;
+                }
+                bytes = *sum;
+            }
+            total += bytes;
+            usage.emplace_back(bytes, child.name);
+        }
+        std::sort(usage.begin(), usage.end(), std::greater<>());
+        for (const auto& [bytes, name] : usage) {
+            out_.print("{:<10}{}{}\n", format_size(bytes), prefix, name);
+        }
+        out_.print("{:<10}total\n", format_size(total));
+        return 0;
+    }
+
+    for (const auto& child : *entries) {
+        out_.print("{} {:>6} {:>6} {:>8} {} {}{}\n", format_mode(child), child.uid, child.gid,
+                   format_size(child.size_bytes), format_time(child.mtime), child.name,
+                   child.type == Ext4EntryType::DIRECTORY ? "/" : "");
+    }
+    return 0;
+}
+
+int CLI::cmd_inject(const std::vector<std::string>& raw_args) {
+    if (!check_root()) return 1;
+
+    const std::string usage =
+        "Usage: vm-state inject <state> <src> <dest-path> [--mode <octal>] [--owner <uid:gid>]\n"
+        "       vm-state inject <state> --batch <manifest|->";
+
+    std::vector<std::string> args = raw_args;
+    bool missing_value = false;
+    auto manifest = take_option(args, "--batch", missing_value);
+    auto mode = take_option(args, "--mode", missing_value);
+    auto owner = take_option(args, "--owner", missing_value);
+
+    std::vector<FileInjection> files;
+    if (missing_value || args.empty()) {
+        error(usage);
+        return 1;
+    }
+    std::string state = args[0];
+
+    if (manifest) {
+        std::string manifest_error;
+        if (args.size() != 1 || !load_injection_manifest(*manifest, files, manifest_error)) {
+            error(manifest_error.empty() ? usage : manifest_error);
+            return 1;
+        }
+    } else {
+        if (args.size() != 3) {
+            error(usage);
+            return 1;
+        }
+        FileInjection file;
+        file.source_path = args[1];
+        file.dest_path = args[2];
+        if (!parse_injection_attrs(mode.value_or(""), owner.value_or(""), file)) {
+            error("Invalid --mode or --owner. Use e.g. --mode 0600 --owner 1000:100.");
+            return 1;
+        }
+        files.push_back(std::move(file));
+    }
+
+    // The guest would see its filesystem change underneath it
+    auto slot = state_provider_->is_state_in_use(state);
+    if (slot && vm_provider_->is_running(*slot)) {
+        error("State '" + state + "' is running on " + *slot +
+              ". Stop it first with: systemctl stop microvm@" + *slot);
+        return 1;
+    }
+
+    if (!state_provider_->inject_files(state, files)) {
+        error(state_provider_->get_last_error());
+        return 1;
+    }
+
+    success("Injected " + std::to_string(files.size()) + " file(s) into '" + state + "'");
+    return 0;
+}
+
+int CLI::cmd_top(const std::vector<std::string>& raw_args) {
+    const std::string usage = "Usage: vm-state top [--interval <seconds>] [--count <n>]";
+
+    std::vector<std::string> args = raw_args;
+    bool missing_value = false;
+    auto interval_arg = take_option(args, "--interval", missing_value);
+    auto count_arg = take_option(args, "--count", missing_value);
+    if (missing_value || !args.empty()) {
+        error(usage);
+        return 1;
+    }
+
+    double interval = 1.0;
+    if (interval_arg) {
+        char* end = nullptr;
+        interval = std::strtod(interval_arg->c_str(), &end);
+        if (interval_arg->empty() || *end != '\0' || !std::isfinite(interval) ||
+            interval <= 0) {
+            error("Invalid interval '" + *interval_arg + "'. Use seconds above 0 (e.g. 0.5).");
+            return 1;
+        }
+    }
+    long count = 0;
+    if (count_arg) {
+        char* end = nullptr;
+        count = std::strtol(count_arg->c_str(), &end, 10);
+        if (count_arg->empty() || *end != '\0' || count < 0) {
+            error("Invalid count '" + *count_arg + "'. Use 0 (until interrupted) or more.");
+            return 1;
+        }
+    }
+
+    std::map<std::string, std::string> assigned;
+    for (const auto& a : state_provider_->list_assignments()) {
+        assigned[a.slot_name] = a.state_name;
+    }
+
+    // count == 0 refreshes until interrupted
+    for (long i = 0; count == 0 || i < count; i++) {
+        auto rates = sample_network_rates(interval);
+        if (!rates) {
+            error(vm_provider_->get_last_error());
+            return 1;
+        }
+
+        if (use_colors_) {
+            out_.write("\033[H\033[2J");
+        }
+        out_.print("vm-state top - {} (every {}s)\n\n",
+                   format_time(static_cast<uint64_t>(std::time(nullptr))), interval);
+        out_.print("{:<8}{:<20}{:<9}{:<22}{:<10}{:<10}{:<10}{:<10}{:<8}{:<8}ERRORS\n",
+                   "SLOT", "STATE", "RUNNING", "LIMIT (OUT/IN)", "RX/s", "TX/s",
+                   "RXPKT/s", "TXPKT/s", "DROPS", "SHAPED");
+
+        for (const auto& slot : vm_provider_->list_slots()) {
+            auto state = assigned.find(slot);
+            out_.print("{:<8}{:<20}{:<9}", slot,
+                       state != assigned.end() ? state->second : "-",
+                       vm_provider_->is_running(slot) ? "yes" : "no");
+            auto limit = vm_provider_->get_net_limit(slot);
+            std::string limit_text = "-";
+            if (limit && (limit->egress_bits_per_sec || limit->ingress_bits_per_sec)) {
+                auto side = [](uint64_t bits) { return bits ? format_rate(bits) : std::string("-"); };
+                limit_text = side(limit->egress_bits_per_sec) + "/" + side(limit->ingress_bits_per_sec);
+            }
+            out_.print("{:<22}", limit_text);
+            auto rate = rates->find(slot);
+            if (rate == rates->end()) {
+                out_.write("(no interface)\n");
+                continue;
+            }
+            const auto& r = rate->second;
+            out_.print("{:<10}{:<10}{:<10}{:<10}{:<8}{:<8}{}\n",
+                       format_size(static_cast<uint64_t>(r.rx_bytes)),
+                       format_size(static_cast<uint64_t>(r.tx_bytes)),
+                       static_cast<uint64_t>(r.rx_packets),
+                       static_cast<uint64_t>(r.tx_packets),
+                       r.dropped, r.shaped, r.errors);
+        }
+        out_.flush();
+    }
+    return 0;
+}
+
+int CLI::cmd_net_limit(const std::vector<std::string>& raw_args) {
+    if (!check_root()) return 1;
+
+    const std::string usage =
+        "Usage: vm-state net-limit <slot> [--egress <rate>] [--ingress <rate>] [--clear] [--reapply]";
+
+    std::vector<std::string> args = raw_args;
+    bool missing_value = false;
+    auto egress_arg = take_option(args, "--egress", missing_value);
+    auto ingress_arg = take_option(args, "--ingress", missing_value);
+    bool clear = take_flag(args, "--clear");
+    bool reapply = take_flag(args, "--reapply");
+    if (missing_value || args.size() != 1) {
+        error(usage);
+        return 1;
+    }
+    const std::string& slot = args[0];
+
+    // Run from the slot's unit once its tap exists (limits die with the tap)
+    if (reapply) {
+        if (!vm_provider_->apply_net_limit(slot)) {
+            error("Failed to apply network limits: " + vm_provider_->get_last_error());
+            return 1;
+        }
+        return 0;
+    }
+
+    auto current = vm_provider_->get_net_limit(slot);
+    if (!current) {
+        error(vm_provider_->get_last_error());
+        return 1;
+    }
+
+    if (!egress_arg && !ingress_arg && !clear) {
+        auto side = [](uint64_t bits) { return bits ? format_rate(bits) : std::string("unlimited"); };
+        out_.print("Slot:    {}\n", slot);
+        out_.print("Egress:  {}\n", side(current->egress_bits_per_sec));
+        out_.print("Ingress: {}\n", side(current->ingress_bits_per_sec));
+        return 0;
+    }
+
+    // Unspecified directions keep their current limit; "none" removes one
+    NetLimit limit = clear ? NetLimit{} : *current;
+    for (auto [arg, target] : {std::pair{&egress_arg, &limit.egress_bits_per_sec},
+                               std::pair{&ingress_arg, &limit.ingress_bits_per_sec}}) {
+        if (!*arg) continue;
+        if (**arg == "none") {
+            *target = 0;
+            continue;
+        }
+        auto rate = parse_rate(**arg);
+        if (!rate || *rate == 0) {
+            error("Invalid rate '" + **arg + "'. Use a rate like 200mbit, 1gbit or 50mbps, or 'none'.");
+            return 1;
+        }
+        *target = *rate;
+    }
+
+    if (!vm_provider_->set_net_limit(slot, limit)) {
+        error("Failed to set network limits: " + vm_provider_->get_last_error());
+        return 1;
+    }
+
+    if (limit.egress_bits_per_sec == 0 && limit.ingress_bits_per_sec == 0) {
+        success("Removed network limits for " + slot);
+    } else {
+        success("Set network limits for " + slot + ": egress " +
+                (limit.egress_bits_per_sec ? format_rate(limit.egress_bits_per_sec) : "unlimited") +
+                ", ingress " +
+                (limit.ingress_bits_per_sec ? format_rate(limit.ingress_bits_per_sec) : "unlimited"));
+    }
+    if (!vm_provider_->is_running(slot)) {
+        info("Slot is not running; limits apply when it starts");
+    }
+    return 0;
+}
+
 int CLI::cmd_help() {
-    std::cout << R"(vm-state - Manage portable VM states
+    out_.write(R"(vm-state - Manage portable VM states
 
 USAGE:
   vm-state <command> [arguments]
 
 COMMANDS:
-  list                        List all states and slot assignments
+  list [--net]                List all states and slot assignments
+                              (--net adds per-slot network rates)
   create <name>               Create a new empty state
   snapshot <slot> <name>      Snapshot current slot's state
   assign <slot> <state>       Assign a state to a slot
   clone <source> <dest>       Clone a state to a new name
-  delete <name>               Delete a state (must not be in use)
-  migrate <state> <slot>      Stop slot, assign state, start slot
+  delete <name>               Delete a state (must not be in use; --wait
+                              to follow the pool freeing its space)
+  migrate <state> <slot>      Stop slot, assign state, start slot (a state
+                              on another slot moves; that slot gets this
+                              slot's state and stays stopped)
+  bluegreen <state> --via <spare-slot>
+                              Clone a running state, boot the clone on a
+                              spare slot, and cut the state's slot over
+                              once it is ready (old state kept for rollback)
   restore <snapshot> <state>  Restore a snapshot to a new state
+                              (clone/delete/restore accept --dry-run to
+                              report space impact and expected duration)
+  snapshots [state] [filters] Query snapshots (--since, --until, --match)
+  catalog <publish|dump>      Publish/read the shared-memory catalog
+  fingerprint <name>...       Hash state/snapshot images (cached per snapshot)
+  export <name> <file>        Copy a state/snapshot image to a plain sparse
+                              file ([--queue-depth n] reads in flight)
+  changed-ranges <from> <to> [--delta <file>]
+                              Byte ranges of data.img that changed between
+                              two snapshots, as "offset length data|zero"
+                              lines (--delta: sparse file of just the
+                              changed data, for incremental copies)
+  serve-nbd <name> --socket <path> [--name <export>]
+                              Serve a state/snapshot image read-only over
+                              NBD on a Unix socket until interrupted (e.g.
+                              qemu-img convert nbd+unix:///<name>?socket=...)
+  lazy-restore <file> <state> [--slot <slot>] [--foreground]
+                              Create a state from an exported image that
+                              is usable at once: blocks are fetched on
+                              demand through an nbd device while the rest
+                              fills in, then it becomes a normal state
+                              (--slot boots it right away). Runs as the
+                              vm-state-lazy-restore-<state> service unless
+                              --foreground
+  jobs                        Show progress of long-running operations
+                              in other vm-state processes
+
+  inspect <name> [path]       List a directory or print a file inside a
+                              state/snapshot image without booting it
+                              (--du to summarize disk usage)
+  inject <state> <src> <dst>  Write a host file into a stopped state
+                              (--batch <manifest> for many; clone also
+                              accepts --inject <src>:<dest>)
+  top [--interval s] [--count n]
+                              Live per-slot network throughput, drops
+                              and errors (from rtnetlink)
+  net-limit <slot> [--egress <rate>] [--ingress <rate>] [--clear]
+                              Show or set a slot's bandwidth limits
+                              (e.g. 200mbit); kept across restarts
+  reclaim --target <size>     Propose snapshot deletions that free <size>
+                              ([state] to limit, --execute to delete them)
+  reconcile [--dry-run]       Repair debris left by interrupted operations
+                              (orphan clone snapshots, temp files, stale
+                              assignments and slot links, abandoned lazy
+                              restores)
+  maintain <scrub|trim> [--window <time>]
+                              Scrub or TRIM the pool, pausing while the
+                              slots are busy yet finishing within the
+                              window (default 24h)
   help                        Show this help
 
+  fingerprint, export and reconcile run as background work: in
+  vm-state-background.slice at idle I/O priority, pausing while any slot
+  is stalled on I/O over 10% of the time (--pause-above <pct> to change,
+  0 to never pause; --foreground to opt out). --io-device <dev> with
+  --io-read-max/--io-write-max <bytes/s> caps their bandwidth on one device
+
 EXAMPLES:
   # List all states
   vm-state list
@@ -449,9 +2841,44 @@ EXAMPLES:
   vm-state clone prod-env test-env
   vm-state migrate test-env slot3
 
+  # Upgrade prod-env on its slot, health-checked on slot5 first
+  vm-state bluegreen prod-env --via slot5
+
   # Restore a snapshot
   vm-state restore before-update recovered-state
 
+  # Snapshots of prod-env from the last week named before-*
+  vm-state snapshots prod-env --since 7d --match 'before-*'
+
+  # Find the fewest snapshots to delete to free 200G, then delete them
+  vm-state reclaim --target 200G
+  vm-state reclaim --target 200G --execute
+
+  # Scrub the pool around guest load, done within three days
+  vm-state maintain scrub --window 3d
+
+  # See what a crash left behind, then clean it up
+  vm-state reconcile --dry-run
+  vm-state reconcile
+
+  # Provision a clone before its first boot
+  vm-state clone base-env tenant-a --inject ./tenant-a.env:/etc/tenant.env
+  vm-state inject tenant-a --batch secrets.manifest
+
+  # Check a stopped state's config and disk usage without booting it
+  vm-state inspect dev-env /etc/hostname
+  vm-state inspect --du dev-env /var
+
+  # Verify a restore is byte-identical to its snapshot
+  vm-state fingerprint before-update recovered-state
+
+  # Copy a snapshot's image off ZFS, e.g. to an NFS share
+  vm-state export before-update /mnt/backup/before-update.img
+
+  # Cap slot2's bandwidth, then watch its rates and drops
+  vm-state net-limit slot2 --egress 200mbit --ingress 500mbit
+  vm-state top
+
 ARCHITECTURE:
   Slots are fixed network identities:
     slot1 = 10.1.0.2, slot2 = 10.2.0.2, ..., slot5 = 10.5.0.2
@@ -463,7 +2890,7 @@ ARCHITECTURE:
     - Snapshotted for backup/rollback
     - Cloned for experimentation
     - Migrated between slots
-)";
+)");
     return 0;
 }
 
@@ -0,0 +1,478 @@
+#include "image/ext4_image.hpp"
+#include <ext2fs/ext2fs.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <unordered_set>
+
+namespace vmstate {
+
+namespace {
+
+constexpr size_t READ_CHUNK = 1024 * 1024;
+
+std::string describe(errcode_t err) {
+    return error_message(err);
+}
+
+Ext4EntryType type_of(uint16_t mode) {
+    if (LINUX_S_ISREG(mode)) return Ext4EntryType::REGULAR;
+    if (LINUX_S_ISDIR(mode)) return Ext4EntryType::DIRECTORY;
+    if (LINUX_S_ISLNK(mode)) return Ext4EntryType::SYMLINK;
+    return Ext4EntryType::OTHER;
+}
+
+// Directory entries collected by dir_iterate_callback
+struct DirWalk {
+    std::vector<std::pair<std::string, ext2_ino_t>> entries;
+};
+
+int dir_iterate_callback(ext2_ino_t, int, struct ext2_dir_entry* dirent,
+                         int, int, char*, void* data) {
+    auto* walk = static_cast<DirWalk*>(data);
+    std::string name(dirent->name, ext2fs_dirent_name_len(dirent));
+    if (dirent->inode != 0 && name != "." && name != "..") {
+        walk->entries.emplace_back(std::move(name), dirent->inode);
+    }
+    return 0;
+}
+
+}  // anonymous namespace
+
+Ext4Image::Ext4Image(const std::string& image_path)
+    : image_path_(image_path) {}
+
+Ext4Image::~Ext4Image() {
+    close();
+}
+
+bool Ext4Image::open(bool writable) {
+    if (fs_) {
+        if (writable && !writable_) {
+            last_error_ = image_path_ + " is already open read-only";
+            return false;
+        }
+        return true;
+    }
+    // Without EXT2_FLAG_RW nothing is ever written back to the image
+    int flags = EXT2_FLAG_64BITS;
+    flags |= writable ? EXT2_FLAG_RW : EXT2_FLAG_IGNORE_CSUM_ERRORS;
+    errcode_t err = ext2fs_open(image_path_.c_str(), flags, 0, 0, unix_io_manager, &fs_);
+    if (err) {
+        last_error_ = "Failed to open filesystem in " + image_path_ + ": " + describe(err);
+        fs_ = nullptr;
+        return false;
+    }
+    writable_ = writable;
+
+    if (writable) {
+        // Allocation needs the block and inode bitmaps
+        err = ext2fs_read_bitmaps(fs_);
+        if (err) {
+            last_error_ = "Failed to read bitmaps in " + image_path_ + ": " + describe(err);
+            ext2fs_close_free(&fs_);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Ext4Image::close() {
+    if (!fs_) {
+        return true;
+    }
+    // Closing a writable filesystem writes back the superblock, group
+    // descriptors and bitmaps
+    errcode_t err = ext2fs_close_free(&fs_);
+    fs_ = nullptr;
+    writable_ = false;
+    if (err) {
+        last_error_ = "Failed to write back " + image_path_ + ": " + describe(err);
+        return false;
+    }
+    return true;
+}
+
+bool Ext4Image::needs_recovery() const {
+    return fs_ && ext2fs_has_feature_journal_needs_recovery(fs_->super);
+}
+
+std::optional<uint64_t> Ext4Image::free_bytes() const {
+    if (!fs_) {
+        return std::nullopt;
+    }
+    return static_cast<uint64_t>(ext2fs_free_blocks_count(fs_->super)) * fs_->blocksize;
+}
+
+uint32_t Ext4Image::lookup(const std::string& path) {
+    if (!open()) {
+        return 0;
+    }
+    if (path.empty() || path[0] != '/') {
+        last_error_ = "Path must be absolute: " + path;
+        return 0;
+    }
+    if (path.find_first_not_of('/') == std::string::npos) {
+        return EXT2_ROOT_INO;
+    }
+
+    ext2_ino_t ino = 0;
+    // namei resolves relative to the given root, so absolute symlinks
+    // inside the image stay inside the image
+    errcode_t err = ext2fs_namei_follow(fs_, EXT2_ROOT_INO, EXT2_ROOT_INO,
+                                        path.c_str() + 1, &ino);
+    if (err) {
+        last_error_ = path + ": " + describe(err);
+        return 0;
+    }
+    return ino;
+}
+
+bool Ext4Image::read_entry(uint32_t ino, const std::string& name, Ext4Entry& entry) {
+    struct ext2_inode inode;
+    errcode_t err = ext2fs_read_inode(fs_, ino, &inode);
+    if (err) {
+        last_error_ = "Failed to read inode " + std::to_string(ino) + ": " + describe(err);
+        return false;
+    }
+    entry.name = name;
+    entry.inode = ino;
+    entry.type = type_of(inode.i_mode);
+    entry.mode = inode.i_mode;
+    entry.uid = inode_uid(inode);
+    entry.gid = inode_gid(inode);
+    entry.size_bytes = EXT2_I_SIZE(&inode);
+    // i_blocks is in 512-byte units (scaled for huge files by the helper)
+    entry.allocated_bytes = ext2fs_get_stat_i_blocks(fs_, &inode) * 512;
+    entry.mtime = inode.i_mtime;
+    return true;
+}
+
+std::optional<Ext4Entry> Ext4Image::stat(const std::string& path) {
+    uint32_t ino = lookup(path);
+    if (!ino) {
+        return std::nullopt;
+    }
+    size_t end = path.find_last_not_of('/');
+    std::string name = end == std::string::npos
+        ? "/"
+        : path.substr(path.find_last_of('/', end) + 1, end - path.find_last_of('/', end));
+    Ext4Entry entry;
+    if (!read_entry(ino, name, entry)) {
+        return std::nullopt;
+    }
+    return entry;
+}
+
+std::optional<std::vector<Ext4Entry>> Ext4Image::list(const std::string& path) {
+    auto dir = stat(path);
+    if (!dir) {
+        return std::nullopt;
+    }
+    if (dir->type != Ext4EntryType::DIRECTORY) {
+        last_error_ = path + " is not a directory";
+        return std::nullopt;
+    }
+
+    DirWalk walk;
+    errcode_t err = ext2fs_dir_iterate2(fs_, dir->inode, 0, nullptr,
+                                        dir_iterate_callback, &walk);
+    if (err) {
+        last_error_ = "Failed to read directory " + path + ": " + describe(err);
+        return std::nullopt;
+    }
+
+    std::vector<Ext4Entry> entries;
+    entries.reserve(walk.entries.size());
+    for (const auto& [name, ino] : walk.entries) {
+        Ext4Entry entry;
+        if (!read_entry(ino, name, entry)) {
+            return std::nullopt;
+        }
+        entries.push_back(std::move(entry));
+    }
+    std::sort(entries.begin(), entries.end(),
+              [](const Ext4Entry& a, const Ext4Entry& b) { return a.name < b.name; });
+    return entries;
+}
+
+bool Ext4Image::read_file(const std::string& path,
+                          const std::function<bool(const char*, size_t)>& sink) {
+    auto file = stat(path);
+    if (!file) {
+        return false;
+    }
+    if (file->type != Ext4EntryType::REGULAR) {
+        last_error_ = path + " is not a regular file";
+        return false;
+    }
+
+    ext2_file_t handle;
+    errcode_t err = ext2fs_file_open(fs_, file->inode, 0, &handle);
+    if (err) {
+        last_error_ = "Failed to open " + path + ": " + describe(err);
+        return false;
+    }
+
+    std::vector<char> buf(READ_CHUNK);
+    bool ok = true;
+    for (;;) {
+        unsigned int got = 0;
+        err = ext2fs_file_read(handle, buf.data(), static_cast<unsigned int>(buf.size()), &got);
+        if (err) {
+            last_error_ = "Failed to read " + path + ": " + describe(err);
+            ok = false;
+            break;
+        }
+        if (got == 0 || !sink(buf.data(), got)) {
+            break;
+        }
+    }
+    ext2fs_file_close(handle);
+    return ok;
+}
+
+std::optional<uint64_t> Ext4Image::disk_usage(const std::string& path) {
+    auto root = stat(path);
+    if (!root) {
+        return std::nullopt;
+    }
+
+    uint64_t total = 0;
+    std::unordered_set<uint32_t> seen;
+    std::vector<Ext4Entry> pending{*root};
+
+    // Iterative walk; a directory's entries are collected before any of
+    // them is visited, so dir_iterate2 is never re-entered
+    while (!pending.empty()) {
+        Ext4Entry entry = std::move(pending.back());
+        pending.pop_back();
+        if (!seen.insert(entry.inode).second) {
+            continue;
+        }
+        total += entry.allocated_bytes;
+        if (entry.type != Ext4EntryType::DIRECTORY) {
+            continue;
+        }
+
+        DirWalk walk;
+        errcode_t err = ext2fs_dir_iterate2(fs_, entry.inode, 0, nullptr,
+                                            dir_iterate_callback, &walk);
+        if (err) {
+            last_error_ = "Failed to read directory inode " + std::to_string(entry.inode) +
+                          ": " + describe(err);
+            return std::nullopt;
+        }
+        for (const auto& [name, ino] : walk.entries) {
+            Ext4Entry child;
+            if (!read_entry(ino, name, child)) {
+                return std::nullopt;
+            }
+            pending.push_back(std::move(child));
+        }
+    }
+    return total;
+}
+
+uint32_t Ext4Image::make_dirs(const std::string& path) {
+    ext2_ino_t dir = EXT2_ROOT_INO;
+    size_t pos = 0;
+    while (pos < path.size()) {
+        size_t end = path.find('/', pos);
+        if (end == std::string::npos) end = path.size();
+        std::string name = path.substr(pos, end - pos);
+        pos = end + 1;
+        if (name.empty() || name == ".") continue;
+
+        ext2_ino_t child = 0;
+        errcode_t err = ext2fs_namei_follow(fs_, EXT2_ROOT_INO, dir, name.c_str(), &child);
+        if (err == EXT2_ET_FILE_NOT_FOUND) {
+            err = ext2fs_mkdir(fs_, dir, 0, name.c_str());
+            if (err == EXT2_ET_DIR_NO_SPACE) {
+                err = ext2fs_expand_dir(fs_, dir);
+                if (!err) err = ext2fs_mkdir(fs_, dir, 0, name.c_str());
+            }
+            if (!err) {
+                err = ext2fs_namei(fs_, EXT2_ROOT_INO, dir, name.c_str(), &child);
+            }
+        }
+        if (err) {
+            last_error_ = "Failed to create directory " + path.substr(0, end) + ": " +
+                          describe(err);
+            return 0;
+        }
+
+        Ext4Entry entry;
+        if (!read_entry(child, name, entry)) {
+            return 0;
+        }
+        if (entry.type != Ext4EntryType::DIRECTORY) {
+            last_error_ = path.substr(0, end) + " exists and is not a directory";
+            return 0;
+        }
+        dir = child;
+    }
+    return dir;
+}
+
+uint32_t Ext4Image::create_file(uint32_t parent, const std::string& name) {
+    // Same sequence as mke2fs -d (misc/create_inode.c)
+    ext2_ino_t ino = 0;
+    errcode_t err = ext2fs_new_inode(fs_, parent, LINUX_S_IFREG | 0644, nullptr, &ino);
+    if (err) {
+        last_error_ = "Failed to allocate an inode for " + name + ": " + describe(err);
+        return 0;
+    }
+
+    err = ext2fs_link(fs_, parent, name.c_str(), ino, EXT2_FT_REG_FILE);
+    if (err == EXT2_ET_DIR_NO_SPACE) {
+        err = ext2fs_expand_dir(fs_, parent);
+        if (!err) err = ext2fs_link(fs_, parent, name.c_str(), ino, EXT2_FT_REG_FILE);
+    }
+    if (err) {
+        last_error_ = "Failed to link " + name + ": " + describe(err);
+        return 0;
+    }
+    ext2fs_inode_alloc_stats2(fs_, ino, +1, 0);
+
+    struct ext2_inode inode;
+    std::memset(&inode, 0, sizeof(inode));
+    inode.i_mode = LINUX_S_IFREG | 0644;
+    inode.i_atime = inode.i_ctime = inode.i_mtime = static_cast<uint32_t>(std::time(nullptr));
+    inode.i_links_count = 1;
+
+    if (ext2fs_has_feature_inline_data(fs_->super)) {
+        inode.i_flags |= EXT4_INLINE_DATA_FL;
+    } else if (ext2fs_has_feature_extents(fs_->super)) {
+        // Opening an extent handle initializes the inode's extent header
+        ext2_extent_handle_t handle;
+        inode.i_flags &= ~EXT4_EXTENTS_FL;
+        err = ext2fs_extent_open2(fs_, ino, &inode, &handle);
+        if (err) {
+            last_error_ = "Failed to set up extents for " + name + ": " + describe(err);
+            return 0;
+        }
+        ext2fs_extent_free(handle);
+    }
+
+    err = ext2fs_write_new_inode(fs_, ino, &inode);
+    if (!err && (inode.i_flags & EXT4_INLINE_DATA_FL)) {
+        err = ext2fs_inline_data_init(fs_, ino);
+    }
+    if (err) {
+        last_error_ = "Failed to write inode for " + name + ": " + describe(err);
+        return 0;
+    }
+    return ino;
+}
+
+bool Ext4Image::write_file(const std::string& path, const std::string& source_path,
+                           uint32_t mode, uint32_t uid, uint32_t gid) {
+    if (!fs_ || !writable_) {
+        last_error_ = image_path_ + " is not open for writing";
+        return false;
+    }
+    size_t slash = path.find_last_of('/');
+    if (path.empty() || path[0] != '/' || slash == path.size() - 1) {
+        last_error_ = "Destination must be an absolute file path: " + path;
+        return false;
+    }
+    std::string name = path.substr(slash + 1);
+
+    int src = ::open(source_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (src < 0) {
+        last_error_ = "Failed to open " + source_path + ": " + std::strerror(errno);
+        return false;
+    }
+
+    // Read the whole source before touching the image, so a failed read
+    // never leaves a truncated file behind
+    std::string contents;
+    char buf[65536];
+    for (;;) {
+        ssize_t n = ::read(src, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            last_error_ = "Failed to read " + source_path + ": " + std::strerror(errno);
+            ::close(src);
+            return false;
+        }
+        if (n == 0) break;
+        contents.append(buf, static_cast<size_t>(n));
+    }
+    ::close(src);
+
+    ext2_ino_t parent = make_dirs(path.substr(0, slash));
+    if (!parent) {
+        return false;
+    }
+
+    // The final component is not followed: replacing a symlink's target
+    // could write somewhere the caller didn't name
+    ext2_ino_t ino = 0;
+    errcode_t err = ext2fs_namei(fs_, EXT2_ROOT_INO, parent, name.c_str(), &ino);
+    if (err == EXT2_ET_FILE_NOT_FOUND) {
+        ino = create_file(parent, name);
+        if (!ino) return false;
+    } else if (err) {
+        last_error_ = path + ": " + describe(err);
+        return false;
+    } else {
+        Ext4Entry existing;
+        if (!read_entry(ino, name, existing)) return false;
+        if (existing.type != Ext4EntryType::REGULAR) {
+            last_error_ = path + " exists and is not a regular file";
+            return false;
+        }
+    }
+
+    ext2_file_t file;
+    err = ext2fs_file_open(fs_, ino, EXT2_FILE_WRITE, &file);
+    if (err) {
+        last_error_ = "Failed to open " + path + " for writing: " + describe(err);
+        return false;
+    }
+    err = ext2fs_file_set_size2(file, 0);
+    size_t written = 0;
+    while (!err && written < contents.size()) {
+        unsigned int chunk = static_cast<unsigned int>(
+            std::min(contents.size() - written, READ_CHUNK));
+        unsigned int got = 0;
+        err = ext2fs_file_write(file, contents.data() + written, chunk, &got);
+        written += got;
+    }
+    if (!err) {
+        err = ext2fs_file_set_size2(file, contents.size());
+    }
+    errcode_t close_err = ext2fs_file_close(file);
+    if (err || close_err) {
+        last_error_ = "Failed to write " + path + ": " + describe(err ? err : close_err);
+        return false;
+    }
+
+    struct ext2_inode inode;
+    err = ext2fs_read_inode(fs_, ino, &inode);
+    if (!err) {
+        inode.i_mode = LINUX_S_IFREG | (mode & 07777);
+        inode.i_uid = static_cast<uint16_t>(uid);
+        ext2fs_set_i_uid_high(inode, uid >> 16);
+        inode.i_gid = static_cast<uint16_t>(gid);
+        ext2fs_set_i_gid_high(inode, gid >> 16);
+        inode.i_mtime = inode.i_ctime = static_cast<uint32_t>(std::time(nullptr));
+        err = ext2fs_write_inode(fs_, ino, &inode);
+    }
+    if (err) {
+        last_error_ = "Failed to set attributes on " + path + ": " + describe(err);
+        return false;
+    }
+    return true;
+}
+
+std::string Ext4Image::get_last_error() const {
+    return last_error_;
+}
+
+} // namespace vmstate
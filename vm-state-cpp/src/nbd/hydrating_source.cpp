@@ -0,0 +1,170 @@
+#include "nbd/hydrating_source.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace vmstate {
+namespace nbd {
+
+HydratingSource::HydratingSource(BlockSource& origin, uint64_t chunk_size)
+    : origin_(origin), chunk_size_(std::max<uint64_t>(chunk_size, 4096)) {}
+
+bool HydratingSource::create(const std::string& path) {
+    size_ = origin_.size();
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        last_error_ = "Failed to create " + path + ": " + std::strerror(errno);
+        return false;
+    }
+    bool sized = ftruncate(fd, static_cast<off_t>(size_)) == 0;
+    int err = errno;
+    ::close(fd);
+    if (!sized) {
+        last_error_ = "Failed to size " + path + ": " + std::strerror(err);
+        return false;
+    }
+    if (!local_.open(path, true)) {
+        last_error_ = local_.get_last_error();
+        return false;
+    }
+
+    chunks_ = (size_ + chunk_size_ - 1) / chunk_size_;
+    present_ = std::make_unique<std::atomic<bool>[]>(chunks_);
+    for (uint64_t i = 0; i < chunks_; i++) {
+        present_[i] = false;
+    }
+    buffer_.resize(chunk_size_);
+    return true;
+}
+
+void HydratingSource::close() {
+    local_.close();
+}
+
+uint64_t HydratingSource::size() const {
+    return size_;
+}
+
+int HydratingSource::read(uint64_t offset, size_t length, uint8_t* buf) {
+    int err = ensure(offset, length, true);
+    return err != 0 ? err : local_.read(offset, length, buf);
+}
+
+int HydratingSource::write(uint64_t offset, size_t length, const uint8_t* buf) {
+    int err = ensure(offset, length, true);
+    return err != 0 ? err : local_.write(offset, length, buf);
+}
+
+int HydratingSource::flush() {
+    return local_.flush();
+}
+
+std::vector<Extent> HydratingSource::extents(uint64_t offset, uint64_t length) {
+    if (length == 0 || offset >= size_) {
+        return {};
+    }
+
+    // Answer for the leading run of chunks that share a home: the local
+    // file where present, the origin where not (callers accept a short answer)
+    uint64_t chunk = offset / chunk_size_;
+    bool local = present_[chunk];
+    uint64_t end = std::min(offset + length, size_);
+    uint64_t run_end = std::min((chunk + 1) * chunk_size_, end);
+    while (run_end < end && present_[run_end / chunk_size_] == local) {
+        run_end = std::min(run_end + chunk_size_, end);
+    }
+    BlockSource& home = local ? static_cast<BlockSource&>(local_) : origin_;
+    return home.extents(offset, run_end - offset);
+}
+
+bool HydratingSource::fill(const std::atomic<bool>& stop, const ProgressFn& progress) {
+    for (uint64_t chunk = 0; chunk < chunks_ && !stop; chunk++) {
+        if (present_[chunk]) {
+            continue;
+        }
+        int err = fetch(chunk, false);
+        if (err != 0) {
+            last_error_ = "Failed to fetch chunk at offset " +
+                          std::to_string(chunk * chunk_size_) + ": " + std::strerror(err);
+            return false;
+        }
+        if (progress) {
+            progress(std::min(present_count_ * chunk_size_, size_), size_);
+        }
+    }
+    return hydrated();
+}
+
+bool HydratingSource::hydrated() const {
+    return present_count_ == chunks_;
+}
+
+uint64_t HydratingSource::demand_fetches() const {
+    return demand_fetches_;
+}
+
+std::string HydratingSource::get_last_error() const {
+    return last_error_;
+}
+
+int HydratingSource::ensure(uint64_t offset, uint64_t length, bool on_demand) {
+    if (length == 0 || hydrated()) {
+        return 0;
+    }
+    uint64_t last = (offset + length - 1) / chunk_size_;
+    for (uint64_t chunk = offset / chunk_size_; chunk <= last; chunk++) {
+        if (!present_[chunk]) {
+            int err = fetch(chunk, on_demand);
+            if (err != 0) {
+                return err;
+            }
+        }
+    }
+    return 0;
+}
+
+int HydratingSource::fetch(uint64_t chunk, bool on_demand) {
+    std::lock_guard<std::mutex> lock(fetch_mutex_);
+    if (present_[chunk]) {
+        return 0;   // Someone else got here first
+    }
+
+    uint64_t start = chunk * chunk_size_;
+    uint64_t end = std::min(start + chunk_size_, size_);
+    for (uint64_t pos = start; pos < end;) {
+        auto extents = origin_.extents(pos, end - pos);
+        if (extents.empty() || extents.front().length == 0) {
+            extents = {Extent{end - pos, false}};
+        }
+        for (const auto& extent : extents) {
+            uint64_t take = std::min(extent.length, end - pos);
+            if (take == 0) {
+                break;
+            }
+            // Holes stay holes: the local file is sparse to begin with
+            if (!extent.hole) {
+                uint8_t* buf = buffer_.data() + (pos - start);
+                int err = origin_.read(pos, take, buf);
+                if (err == 0) {
+                    err = local_.write(pos, take, buf);
+                }
+                if (err != 0) {
+                    return err;
+                }
+            }
+            pos += take;
+        }
+    }
+
+    present_[chunk] = true;
+    present_count_++;
+    if (on_demand) {
+        demand_fetches_++;
+    }
+    return 0;
+}
+
+} // namespace nbd
+} // namespace vmstate
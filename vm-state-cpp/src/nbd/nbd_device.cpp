@@ -0,0 +1,162 @@
+#include "nbd/nbd_device.hpp"
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/nbd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace vmstate {
+namespace nbd {
+
+NbdDevice::~NbdDevice() {
+    detach();
+}
+
+bool NbdDevice::attach(NbdServer& server, uint64_t size) {
+    if (size == 0 || size % 512 != 0) {
+        last_error_ = "Image size must be a non-zero multiple of 512 bytes";
+        return false;
+    }
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+        last_error_ = std::string("Failed to create socket pair: ") + std::strerror(errno);
+        return false;
+    }
+    kernel_fd_ = fds[0];
+    server_fd_ = fds[1];
+
+    // Devices exist up to the module's nbds_max; take the first one free
+    int err = ENOENT;
+    for (int i = 0;; i++) {
+        std::string device = "/dev/nbd" + std::to_string(i);
+        if (access(device.c_str(), F_OK) != 0) {
+            break;
+        }
+        err = connect(device, size, server.export_flags(), kernel_fd_);
+        if (err == 0) {
+            path_ = device;
+            break;
+        }
+        if (err != EBUSY) {
+            break;
+        }
+    }
+    if (path_.empty()) {
+        last_error_ = err == ENOENT
+            ? "No /dev/nbd* devices (is the nbd kernel module loaded?)"
+            : std::string("Failed to attach an nbd device: ") + std::strerror(err);
+        close(kernel_fd_);
+        close(server_fd_);
+        kernel_fd_ = server_fd_ = -1;
+        return false;
+    }
+
+    server_thread_ = std::thread([&server, fd = server_fd_] { server.serve_connected(fd); });
+    device_thread_ = std::thread([fd = device_fd_] {
+        // Returns once the device is disconnected
+        ioctl(fd, NBD_DO_IT);
+        ioctl(fd, NBD_CLEAR_QUE);
+        ioctl(fd, NBD_CLEAR_SOCK);
+    });
+    return true;
+}
+
+int NbdDevice::connect(const std::string& device, uint64_t size, uint16_t flags, int sock) {
+    // A connected device has a pid in sysfs; skip those without touching them
+    std::string name = device.substr(device.rfind('/') + 1);
+    if (access(("/sys/block/" + name + "/pid").c_str(), F_OK) == 0) {
+        return EBUSY;
+    }
+
+    int fd = ::open(device.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return errno;
+    }
+    unsigned long block = size % 4096 == 0 ? 4096 : 512;
+    if (ioctl(fd, NBD_SET_BLKSIZE, block) != 0 ||
+        ioctl(fd, NBD_SET_SIZE_BLOCKS, static_cast<unsigned long>(size / block)) != 0 ||
+        ioctl(fd, NBD_SET_FLAGS, static_cast<unsigned long>(flags)) != 0 ||
+        ioctl(fd, NBD_SET_SOCK, static_cast<unsigned long>(sock)) != 0) {
+        // EBUSY: another process claimed it since the check; leave it be
+        int err = errno;
+        close(fd);
+        return err;
+    }
+    device_fd_ = fd;
+    return 0;
+}
+
+void NbdDevice::detach() {
+    if (device_fd_ < 0) {
+        return;
+    }
+    // The kernel sends NBD_CMD_DISC, which ends serve_connected()
+    ioctl(device_fd_, NBD_DISCONNECT);
+    if (device_thread_.joinable()) {
+        device_thread_.join();
+    }
+    shutdown(server_fd_, SHUT_RDWR);
+    if (server_thread_.joinable()) {
+        server_thread_.join();
+    }
+    close(device_fd_);
+    close(kernel_fd_);
+    close(server_fd_);
+    device_fd_ = kernel_fd_ = server_fd_ = -1;
+}
+
+std::string NbdDevice::path() const {
+    return path_;
+}
+
+bool NbdDevice::opened_elsewhere() const {
+    struct stat device;
+    if (path_.empty() || stat(path_.c_str(), &device) != 0) {
+        return false;
+    }
+
+    // Like fuser: look for the device among other processes' open files
+    std::string self = std::to_string(getpid());
+    DIR* proc = opendir("/proc");
+    if (!proc) {
+        return false;
+    }
+    bool found = false;
+    while (dirent* entry = readdir(proc)) {
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9' || self == entry->d_name) {
+            continue;
+        }
+        std::string fd_dir = std::string("/proc/") + entry->d_name + "/fd";
+        DIR* fds = opendir(fd_dir.c_str());
+        if (!fds) {
+            continue;   // Exited, or not ours to look at
+        }
+        while (dirent* fd = readdir(fds)) {
+            struct stat st;
+            if (fd->d_name[0] != '.' &&
+                stat((fd_dir + "/" + fd->d_name).c_str(), &st) == 0 &&
+                S_ISBLK(st.st_mode) && st.st_rdev == device.st_rdev) {
+                found = true;
+                break;
+            }
+        }
+        closedir(fds);
+        if (found) {
+            break;
+        }
+    }
+    closedir(proc);
+    return found;
+}
+
+std::string NbdDevice::get_last_error() const {
+    return last_error_;
+}
+
+} // namespace nbd
+} // namespace vmstate
@@ -0,0 +1,835 @@
+#include "nbd/nbd_server.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace vmstate {
+namespace nbd {
+
+namespace {
+
+// Handshake (see the NBD protocol document)
+constexpr uint64_t NBDMAGIC = 0x4e42444d41474943ULL;
+constexpr uint64_t IHAVEOPT = 0x49484156454F5054ULL;
+constexpr uint64_t OPT_REPLY_MAGIC = 0x3e889045565a9ULL;
+
+constexpr uint16_t FLAG_FIXED_NEWSTYLE = 1 << 0;
+constexpr uint16_t FLAG_NO_ZEROES = 1 << 1;
+constexpr uint32_t FLAG_C_NO_ZEROES = 1 << 1;
+
+enum : uint32_t {
+    OPT_EXPORT_NAME = 1,
+    OPT_ABORT = 2,
+    OPT_LIST = 3,
+    OPT_INFO = 6,
+    OPT_GO = 7,
+    OPT_STRUCTURED_REPLY = 8,
+    OPT_LIST_META_CONTEXT = 9,
+    OPT_SET_META_CONTEXT = 10,
+};
+
+enum : uint32_t {
+    REP_ACK = 1,
+    REP_SERVER = 2,
+    REP_INFO = 3,
+    REP_META_CONTEXT = 4,
+    REP_ERR_UNSUP = 0x80000001,
+    REP_ERR_INVALID = 0x80000003,
+    REP_ERR_UNKNOWN = 0x80000006,
+};
+
+enum : uint16_t {
+    INFO_EXPORT = 0,
+    INFO_BLOCK_SIZE = 3,
+};
+
+enum : uint16_t {
+    TFLAG_HAS_FLAGS = 1 << 0,
+    TFLAG_READ_ONLY = 1 << 1,
+    TFLAG_SEND_FLUSH = 1 << 2,
+    TFLAG_SEND_FUA = 1 << 3,
+    TFLAG_SEND_DF = 1 << 7,
+    TFLAG_CAN_MULTI_CONN = 1 << 8,
+    TFLAG_SEND_CACHE = 1 << 10,
+};
+
+// Transmission
+constexpr uint32_t REQUEST_MAGIC = 0x25609513;
+constexpr uint32_t SIMPLE_REPLY_MAGIC = 0x67446698;
+constexpr uint32_t STRUCTURED_REPLY_MAGIC = 0x668e33ef;
+
+enum : uint16_t {
+    CMD_READ = 0,
+    CMD_WRITE = 1,
+    CMD_DISC = 2,
+    CMD_FLUSH = 3,
+    CMD_TRIM = 4,
+    CMD_CACHE = 5,
+    CMD_WRITE_ZEROES = 6,
+    CMD_BLOCK_STATUS = 7,
+};
+
+enum : uint16_t {
+    CMD_FLAG_FUA = 1 << 0,
+    CMD_FLAG_DF = 1 << 2,
+    CMD_FLAG_REQ_ONE = 1 << 3,
+};
+
+enum : uint16_t {
+    REPLY_FLAG_DONE = 1 << 0,
+    REPLY_TYPE_NONE = 0,
+    REPLY_TYPE_OFFSET_DATA = 1,
+    REPLY_TYPE_OFFSET_HOLE = 2,
+    REPLY_TYPE_BLOCK_STATUS = 5,
+    REPLY_TYPE_ERROR = 0x8001,
+};
+
+constexpr uint32_t STATE_HOLE = 1 << 0;
+constexpr uint32_t STATE_ZERO = 1 << 1;
+
+const std::string ALLOCATION_CONTEXT = "base:allocation";
+constexpr uint32_t ALLOCATION_CONTEXT_ID = 1;
+
+// Largest read served in one request (also the advertised maximum)
+constexpr uint32_t MAX_REQUEST = 32 * 1024 * 1024;
+
+// Longest option accepted during negotiation
+constexpr uint32_t MAX_OPTION = 64 * 1024;
+
+// Most descriptors in one block status reply
+constexpr size_t MAX_DESCRIPTORS = 1024;
+
+void put16(std::string& out, uint16_t v) {
+    out.push_back(static_cast<char>(v >> 8));
+    out.push_back(static_cast<char>(v));
+}
+
+void put32(std::string& out, uint32_t v) {
+    put16(out, static_cast<uint16_t>(v >> 16));
+    put16(out, static_cast<uint16_t>(v));
+}
+
+void put64(std::string& out, uint64_t v) {
+    put32(out, static_cast<uint32_t>(v >> 32));
+    put32(out, static_cast<uint32_t>(v));
+}
+
+uint16_t get16(const uint8_t* p) {
+    return static_cast<uint16_t>(p[0] << 8 | p[1]);
+}
+
+uint32_t get32(const uint8_t* p) {
+    return static_cast<uint32_t>(get16(p)) << 16 | get16(p + 2);
+}
+
+uint64_t get64(const uint8_t* p) {
+    return static_cast<uint64_t>(get32(p)) << 32 | get32(p + 4);
+}
+
+bool read_all(int fd, void* buf, size_t len) {
+    auto* p = static_cast<uint8_t*>(buf);
+    while (len > 0) {
+        ssize_t n = ::recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool write_all(int fd, const void* buf, size_t len) {
+    const auto* p = static_cast<const uint8_t*>(buf);
+    while (len > 0) {
+        // MSG_NOSIGNAL: a client hanging up must not kill the server
+        ssize_t n = ::send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool write_all(int fd, const std::string& data) {
+    return write_all(fd, data.data(), data.size());
+}
+
+// Drop len bytes the client sent (e.g. the payload of a refused write)
+bool skip(int fd, uint64_t len) {
+    uint8_t buf[4096];
+    while (len > 0) {
+        size_t n = static_cast<size_t>(std::min<uint64_t>(len, sizeof(buf)));
+        if (!read_all(fd, buf, n)) {
+            return false;
+        }
+        len -= n;
+    }
+    return true;
+}
+
+bool option_reply(int fd, uint32_t option, uint32_t type, const std::string& data = {}) {
+    std::string out;
+    put64(out, OPT_REPLY_MAGIC);
+    put32(out, option);
+    put32(out, type);
+    put32(out, static_cast<uint32_t>(data.size()));
+    out += data;
+    return write_all(fd, out);
+}
+
+// Errors on the wire use the protocol's own small set of errno values
+uint32_t wire_error(int err) {
+    switch (err) {
+        case EPERM: return 1;
+        case EIO: return 5;
+        case ENOMEM: return 12;
+        case EINVAL: return 22;
+        case ENOSPC: return 28;
+        case EOVERFLOW: return 75;
+        case ENOTSUP: return 95;
+        case ESHUTDOWN: return 108;
+        default: return 5;
+    }
+}
+
+std::string structured_header(uint16_t flags, uint16_t type, uint64_t cookie,
+                              uint32_t length) {
+    std::string out;
+    put32(out, STRUCTURED_REPLY_MAGIC);
+    put16(out, flags);
+    put16(out, type);
+    put64(out, cookie);
+    put32(out, length);
+    return out;
+}
+
+bool reply_error(int fd, bool structured, uint64_t cookie, int err) {
+    if (!structured) {
+        std::string out;
+        put32(out, SIMPLE_REPLY_MAGIC);
+        put32(out, wire_error(err));
+        put64(out, cookie);
+        return write_all(fd, out);
+    }
+    std::string out = structured_header(REPLY_FLAG_DONE, REPLY_TYPE_ERROR, cookie, 6);
+    put32(out, wire_error(err));
+    put16(out, 0);  // No message
+    return write_all(fd, out);
+}
+
+bool reply_ok(int fd, bool structured, uint64_t cookie) {
+    if (!structured) {
+        std::string out;
+        put32(out, SIMPLE_REPLY_MAGIC);
+        put32(out, 0);
+        put64(out, cookie);
+        return write_all(fd, out);
+    }
+    return write_all(fd, structured_header(REPLY_FLAG_DONE, REPLY_TYPE_NONE, cookie, 0));
+}
+
+}  // anonymous namespace
+
+// ========== BlockSource ==========
+
+int BlockSource::write(uint64_t, size_t, const uint8_t*) {
+    return EPERM;
+}
+
+int BlockSource::flush() {
+    return 0;
+}
+
+// ========== FileSource ==========
+
+FileSource::~FileSource() {
+    close();
+}
+
+void FileSource::close() {
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
+
+bool FileSource::open(const std::string& path, bool writable) {
+    fd_ = ::open(path.c_str(), (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (fd_ < 0) {
+        last_error_ = "Failed to open " + path + ": " + std::strerror(errno);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd_, &st) != 0) {
+        last_error_ = "Failed to stat " + path + ": " + std::strerror(errno);
+        return false;
+    }
+    size_ = static_cast<uint64_t>(st.st_size);
+    return true;
+}
+
+uint64_t FileSource::size() const {
+    return size_;
+}
+
+int FileSource::read(uint64_t offset, size_t length, uint8_t* buf) {
+    while (length > 0) {
+        ssize_t n = pread(fd_, buf, length, static_cast<off_t>(offset));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return errno;
+        }
+        if (n == 0) {
+            return EIO;     // The file shrank under us
+        }
+        buf += n;
+        offset += static_cast<uint64_t>(n);
+        length -= static_cast<size_t>(n);
+    }
+    return 0;
+}
+
+int FileSource::write(uint64_t offset, size_t length, const uint8_t* buf) {
+    while (length > 0) {
+        ssize_t n = pwrite(fd_, buf, length, static_cast<off_t>(offset));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return errno;
+        }
+        buf += n;
+        offset += static_cast<uint64_t>(n);
+        length -= static_cast<size_t>(n);
+    }
+    return 0;
+}
+
+int FileSource::flush() {
+    return fdatasync(fd_) == 0 ? 0 : errno;
+}
+
+std::vector<Extent> FileSource::extents(uint64_t offset, uint64_t length) {
+    std::vector<Extent> result;
+    uint64_t end = std::min(offset + length, size_);
+    uint64_t pos = offset;
+    while (pos < end && result.size() < MAX_DESCRIPTORS) {
+        off_t data = lseek(fd_, static_cast<off_t>(pos), SEEK_DATA);
+        if (data < 0) {
+            // ENXIO: only a hole remains; anything else: no SEEK_DATA, call it data
+            result.push_back(Extent{end - pos, errno == ENXIO});
+            break;
+        }
+        uint64_t data_start = std::min(static_cast<uint64_t>(data), end);
+        if (data_start > pos) {
+            result.push_back(Extent{data_start - pos, true});
+            pos = data_start;
+            continue;
+        }
+        off_t hole = lseek(fd_, static_cast<off_t>(pos), SEEK_HOLE);
+        uint64_t data_end = hole < 0 ? end : std::min(static_cast<uint64_t>(hole), end);
+        result.push_back(Extent{data_end - pos, false});
+        pos = data_end;
+    }
+    return result;
+}
+
+std::string FileSource::get_last_error() const {
+    return last_error_;
+}
+
+// ========== NbdServer ==========
+
+NbdServer::NbdServer(BlockSource& source, const NbdServerOptions& options)
+    : source_(source), options_(options) {}
+
+NbdServer::~NbdServer() {
+    reap_connections(true);
+    if (listen_fd_ >= 0) {
+        close(listen_fd_);
+        unlink(options_.socket_path.c_str());
+    }
+}
+
+bool NbdServer::listen() {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (options_.socket_path.size() >= sizeof(addr.sun_path)) {
+        last_error_ = "Socket path too long: " + options_.socket_path;
+        return false;
+    }
+    std::strcpy(addr.sun_path, options_.socket_path.c_str());
+
+    // A socket left by a server that died is in the way; anything else isn't ours
+    struct stat st;
+    if (lstat(options_.socket_path.c_str(), &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            last_error_ = options_.socket_path + " exists and is not a socket";
+            return false;
+        }
+        unlink(options_.socket_path.c_str());
+    }
+
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd_ < 0) {
+        last_error_ = std::string("Failed to create socket: ") + std::strerror(errno);
+        return false;
+    }
+    if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        ::listen(listen_fd_, 16) != 0) {
+        last_error_ = "Failed to listen on " + options_.socket_path + ": " +
+                      std::strerror(errno);
+        close(listen_fd_);
+        listen_fd_ = -1;
+        return false;
+    }
+    return true;
+}
+
+bool NbdServer::serve(const std::atomic<bool>& stop) {
+    bool ok = true;
+    while (!stop) {
+        pollfd pfd{listen_fd_, POLLIN, 0};
+        int r = poll(&pfd, 1, 250);
+        if (r < 0 && errno != EINTR) {
+            last_error_ = std::string("poll failed: ") + std::strerror(errno);
+            ok = false;
+            break;
+        }
+        reap_connections(false);
+        if (r <= 0) {
+            continue;
+        }
+
+        int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            last_error_ = std::string("accept failed: ") + std::strerror(errno);
+            ok = false;
+            break;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (connections_.size() >= options_.max_connections) {
+            close(fd);
+            continue;
+        }
+        accepted_++;
+        auto connection = std::make_unique<Connection>();
+        connection->fd = fd;
+        Connection& c = *connection;
+        connections_.push_back(std::move(connection));
+        c.thread = std::thread([this, &c] { handle(c); });
+    }
+
+    reap_connections(true);
+    return ok;
+}
+
+void NbdServer::reap_connections(bool all) {
+    std::list<std::unique_ptr<Connection>> finished;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = connections_.begin(); it != connections_.end();) {
+            if (all || (*it)->done) {
+                if (all && !(*it)->done) {
+                    // Wakes the connection's blocking recv
+                    shutdown((*it)->fd, SHUT_RDWR);
+                }
+                finished.splice(finished.end(), connections_, it++);
+            } else {
+                ++it;
+            }
+        }
+    }
+    for (auto& connection : finished) {
+        if (connection->thread.joinable()) {
+            connection->thread.join();
+        }
+        close(connection->fd);
+    }
+}
+
+void NbdServer::serve_connected(int fd) {
+    transmit(fd, Session{});
+}
+
+uint16_t NbdServer::export_flags() const {
+    return transmission_flags(Session{});
+}
+
+size_t NbdServer::connections_accepted() const {
+    return accepted_;
+}
+
+std::string NbdServer::get_last_error() const {
+    return last_error_;
+}
+
+uint16_t NbdServer::transmission_flags(const Session& session) const {
+    uint16_t flags = TFLAG_HAS_FLAGS | TFLAG_SEND_FLUSH | TFLAG_CAN_MULTI_CONN |
+                     TFLAG_SEND_CACHE;
+    flags |= options_.writable ? TFLAG_SEND_FUA : TFLAG_READ_ONLY;
+    if (session.structured) {
+        flags |= TFLAG_SEND_DF;
+    }
+    return flags;
+}
+
+void NbdServer::handle(Connection& connection) {
+    Session session;
+    if (negotiate(connection.fd, session)) {
+        transmit(connection.fd, session);
+    }
+    connection.done = true;
+}
+
+bool NbdServer::negotiate(int fd, Session& session) {
+    std::string hello;
+    put64(hello, NBDMAGIC);
+    put64(hello, IHAVEOPT);
+    put16(hello, FLAG_FIXED_NEWSTYLE | FLAG_NO_ZEROES);
+    uint8_t client_flags[4];
+    if (!write_all(fd, hello) || !read_all(fd, client_flags, sizeof(client_flags))) {
+        return false;
+    }
+    session.no_zeroes = (get32(client_flags) & FLAG_C_NO_ZEROES) != 0;
+
+    auto known_export = [this](const std::string& name) {
+        return name.empty() || name == options_.export_name;
+    };
+
+    while (true) {
+        uint8_t header[16];
+        if (!read_all(fd, header, sizeof(header)) || get64(header) != IHAVEOPT) {
+            return false;
+        }
+        uint32_t option = get32(header + 8);
+        uint32_t length = get32(header + 12);
+        if (length > MAX_OPTION) {
+            return false;
+        }
+        std::vector<uint8_t> data(length);
+        if (!read_all(fd, data.data(), length)) {
+            return false;
+        }
+
+        switch (option) {
+        case OPT_EXPORT_NAME: {
+            // No way to refuse here but to hang up
+            if (!known_export(std::string(data.begin(), data.end()))) {
+                return false;
+            }
+            std::string out;
+            put64(out, source_.size());
+            put16(out, transmission_flags(session));
+            if (!session.no_zeroes) {
+                out.append(124, '\0');
+            }
+            return write_all(fd, out);
+        }
+
+        case OPT_INFO:
+        case OPT_GO: {
+            if (length < 6 || get32(data.data()) > length - 6) {
+                if (!option_reply(fd, option, REP_ERR_INVALID)) return false;
+                break;
+            }
+            uint32_t name_len = get32(data.data());
+            std::string name(data.begin() + 4, data.begin() + 4 + name_len);
+            uint16_t requests = get16(data.data() + 4 + name_len);
+            if (length != 6 + name_len + 2u * requests) {
+                if (!option_reply(fd, option, REP_ERR_INVALID)) return false;
+                break;
+            }
+            if (!known_export(name)) {
+                if (!option_reply(fd, option, REP_ERR_UNKNOWN)) return false;
+                break;
+            }
+
+            std::string info;
+            put16(info, INFO_EXPORT);
+            put64(info, source_.size());
+            put16(info, transmission_flags(session));
+            if (!option_reply(fd, option, REP_INFO, info)) return false;
+            for (uint16_t i = 0; i < requests; i++) {
+                if (get16(data.data() + 6 + name_len + 2 * i) == INFO_BLOCK_SIZE) {
+                    std::string sizes;
+                    put16(sizes, INFO_BLOCK_SIZE);
+                    put32(sizes, 1);
+                    put32(sizes, 4096);
+                    put32(sizes, MAX_REQUEST);
+                    if (!option_reply(fd, option, REP_INFO, sizes)) return false;
+                }
+            }
+            if (!option_reply(fd, option, REP_ACK)) return false;
+            if (option == OPT_GO) {
+                return true;
+            }
+            break;
+        }
+
+        case OPT_LIST: {
+            std::string entry;
+            put32(entry, static_cast<uint32_t>(options_.export_name.size()));
+            entry += options_.export_name;
+            if (!option_reply(fd, option, REP_SERVER, entry) ||
+                !option_reply(fd, option, REP_ACK)) {
+                return false;
+            }
+            break;
+        }
+
+        case OPT_STRUCTURED_REPLY:
+            if (length != 0) {
+                if (!option_reply(fd, option, REP_ERR_INVALID)) return false;
+                break;
+            }
+            session.structured = true;
+            if (!option_reply(fd, option, REP_ACK)) return false;
+            break;
+
+        case OPT_LIST_META_CONTEXT:
+        case OPT_SET_META_CONTEXT: {
+            // export name, then queries; the only context is base:allocation
+            bool valid = length >= 8 && get32(data.data()) <= length - 8;
+            uint32_t name_len = valid ? get32(data.data()) : 0;
+            size_t pos = 4 + name_len;
+            uint32_t queries = valid ? get32(data.data() + pos) : 0;
+            pos += 4;
+            bool matched = option == OPT_LIST_META_CONTEXT && queries == 0;
+            for (uint32_t i = 0; valid && i < queries; i++) {
+                if (pos + 4 > length || get32(data.data() + pos) > length - pos - 4) {
+                    valid = false;
+                    break;
+                }
+                uint32_t query_len = get32(data.data() + pos);
+                std::string query(data.begin() + static_cast<long>(pos) + 4,
+                                  data.begin() + static_cast<long>(pos) + 4 + query_len);
+                pos += 4 + query_len;
+                // Listing also accepts namespace-wide queries
+                matched = matched || query == ALLOCATION_CONTEXT ||
+                          (option == OPT_LIST_META_CONTEXT &&
+                           (query == "base:" || query == "base"));
+            }
+            if (!valid || (option == OPT_SET_META_CONTEXT && !session.structured)) {
+                if (!option_reply(fd, option, REP_ERR_INVALID)) return false;
+                break;
+            }
+            if (!known_export(std::string(data.begin() + 4, data.begin() + 4 + name_len))) {
+                if (!option_reply(fd, option, REP_ERR_UNKNOWN)) return false;
+                break;
+            }
+            if (option == OPT_SET_META_CONTEXT) {
+                session.allocation_context = matched;
+            }
+            if (matched) {
+                std::string context;
+                put32(context, option == OPT_SET_META_CONTEXT ? ALLOCATION_CONTEXT_ID : 0);
+                context += ALLOCATION_CONTEXT;
+                if (!option_reply(fd, option, REP_META_CONTEXT, context)) return false;
+            }
+            if (!option_reply(fd, option, REP_ACK)) return false;
+            break;
+        }
+
+        case OPT_ABORT:
+            option_reply(fd, option, REP_ACK);
+            return false;
+
+        default:
+            // Including STARTTLS: this is a local socket
+            if (!option_reply(fd, option, REP_ERR_UNSUP)) return false;
+            break;
+        }
+    }
+}
+
+void NbdServer::transmit(int fd, const Session& session) {
+    std::vector<uint8_t> buffer;
+    const uint64_t size = source_.size();
+
+    while (true) {
+        uint8_t request[28];
+        if (!read_all(fd, request, sizeof(request)) || get32(request) != REQUEST_MAGIC) {
+            return;
+        }
+        uint16_t flags = get16(request + 4);
+        uint16_t type = get16(request + 6);
+        uint64_t cookie = get64(request + 8);
+        uint64_t offset = get64(request + 16);
+        uint32_t length = get32(request + 24);
+        bool in_bounds = offset <= size && length <= size - offset;
+
+        switch (type) {
+        case CMD_READ: {
+            if (!in_bounds || length > MAX_REQUEST) {
+                if (!reply_error(fd, session.structured, cookie, EINVAL)) return;
+                break;
+            }
+            if (!session.structured) {
+                buffer.resize(length);
+                int err = source_.read(offset, length, buffer.data());
+                if (err != 0) {
+                    if (!reply_error(fd, false, cookie, err)) return;
+                    break;
+                }
+                std::string header;
+                put32(header, SIMPLE_REPLY_MAGIC);
+                put32(header, 0);
+                put64(header, cookie);
+                if (!write_all(fd, header) || !write_all(fd, buffer.data(), length)) return;
+                break;
+            }
+
+            // Structured: data and hole chunks, unless the client wants one piece
+            std::vector<Extent> extents;
+            for (uint64_t pos = offset; pos < offset + length;) {
+                auto more = (flags & CMD_FLAG_DF) ? std::vector<Extent>{}
+                                                  : source_.extents(pos, offset + length - pos);
+                if (more.empty() || more.front().length == 0) {
+                    // Unknown from here on: send the rest as data
+                    more = {Extent{offset + length - pos, false}};
+                }
+                for (const auto& extent : more) {
+                    uint64_t take = std::min(extent.length, offset + length - pos);
+                    if (take == 0) {
+                        break;
+                    }
+                    pos += take;
+                    if (!extents.empty() && extents.back().hole == extent.hole) {
+                        extents.back().length += take;
+                    } else {
+                        extents.push_back(Extent{take, extent.hole});
+                    }
+                }
+            }
+
+            uint64_t pos = offset;
+            bool failed = false;
+            for (size_t i = 0; i < extents.size(); i++) {
+                uint16_t done = i + 1 == extents.size() ? REPLY_FLAG_DONE : 0;
+                auto len = static_cast<uint32_t>(extents[i].length);
+                if (extents[i].hole) {
+                    std::string chunk = structured_header(done, REPLY_TYPE_OFFSET_HOLE,
+                                                          cookie, 12);
+                    put64(chunk, pos);
+                    put32(chunk, len);
+                    if (!write_all(fd, chunk)) return;
+                } else {
+                    buffer.resize(len);
+                    int err = source_.read(pos, len, buffer.data());
+                    if (err != 0) {
+                        if (!reply_error(fd, true, cookie, err)) return;
+                        failed = true;
+                        break;
+                    }
+                    std::string chunk = structured_header(done, REPLY_TYPE_OFFSET_DATA,
+                                                          cookie, 8 + len);
+                    put64(chunk, pos);
+                    if (!write_all(fd, chunk) || !write_all(fd, buffer.data(), len)) return;
+                }
+                pos += len;
+            }
+            if (!failed && extents.empty() && !reply_ok(fd, true, cookie)) return;
+            break;
+        }
+
+        case CMD_BLOCK_STATUS: {
+            if (!session.allocation_context || !in_bounds || length == 0) {
+                if (!reply_error(fd, session.structured, cookie, EINVAL)) return;
+                break;
+            }
+            auto extents = source_.extents(offset, length);
+            if (extents.empty()) {
+                extents.push_back(Extent{length, false});
+            }
+            if (flags & CMD_FLAG_REQ_ONE) {
+                extents.resize(1);
+            }
+            std::string chunk = structured_header(REPLY_FLAG_DONE, REPLY_TYPE_BLOCK_STATUS,
+                                                  cookie,
+                                                  static_cast<uint32_t>(4 + 8 * extents.size()));
+            put32(chunk, ALLOCATION_CONTEXT_ID);
+            for (const auto& extent : extents) {
+                put32(chunk, static_cast<uint32_t>(extent.length));
+                put32(chunk, extent.hole ? STATE_HOLE | STATE_ZERO : 0);
+            }
+            if (!write_all(fd, chunk)) return;
+            break;
+        }
+
+        case CMD_WRITE: {
+            // The payload follows regardless; read it past before refusing
+            if (!options_.writable || !in_bounds || length > MAX_REQUEST) {
+                int err = options_.writable ? EINVAL : EPERM;
+                if (!skip(fd, length) || !reply_error(fd, session.structured, cookie, err)) {
+                    return;
+                }
+                break;
+            }
+            buffer.resize(length);
+            if (!read_all(fd, buffer.data(), length)) return;
+            int err = source_.write(offset, length, buffer.data());
+            if (err == 0 && (flags & CMD_FLAG_FUA)) {
+                err = source_.flush();
+            }
+            bool sent = err == 0 ? reply_ok(fd, session.structured, cookie)
+                                 : reply_error(fd, session.structured, cookie, err);
+            if (!sent) return;
+            break;
+        }
+
+        case CMD_TRIM:
+        case CMD_WRITE_ZEROES:
+            // Never advertised; refused as a read-only export would
+            if (!reply_error(fd, session.structured, cookie,
+                             options_.writable ? EINVAL : EPERM)) {
+                return;
+            }
+            break;
+
+        case CMD_FLUSH: {
+            int err = options_.writable ? source_.flush() : 0;
+            bool sent = err == 0 ? reply_ok(fd, session.structured, cookie)
+                                 : reply_error(fd, session.structured, cookie, err);
+            if (!sent) return;
+            break;
+        }
+
+        case CMD_CACHE:
+            // Reads go straight to the source
+            if (!reply_ok(fd, session.structured, cookie)) return;
+            break;
+
+        case CMD_DISC:
+            return;
+
+        default:
+            if (!reply_error(fd, session.structured, cookie, EINVAL)) return;
+            break;
+        }
+    }
+}
+
+} // namespace nbd
+} // namespace vmstate
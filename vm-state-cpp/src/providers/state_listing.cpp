@@ -0,0 +1,78 @@
+#include "providers/state_listing.hpp"
+
+namespace vmstate {
+
+void StateListing::build_index() {
+    state_index.clear();
+    snapshot_index.clear();
+    snapshots_by_state.clear();
+    state_index.reserve(states.size());
+    snapshot_index.reserve(snapshots.size());
+    for (size_t i = 0; i < states.size(); i++) {
+        state_index.try_emplace(states[i].name, i);
+    }
+    for (size_t i = 0; i < snapshots.size(); i++) {
+        snapshot_index.try_emplace(snapshots[i].name, i);
+        snapshots_by_state[snapshots[i].state_name].push_back(i);
+    }
+}
+
+StateListing merge_listing(std::vector<StateInfo> states,
+                           const std::vector<StateInfo>& stored_states,
+                           std::vector<SnapshotInfo>& stored_snapshots,
+                           uint64_t walk_started, const SnapshotReader& read_snapshots,
+                           std::vector<bool>& trusted) {
+    // Stored snapshots, grouped by state (the inventory keeps them sorted)
+    std::unordered_map<std::string, const StateInfo*> previous;
+    std::unordered_map<std::string, std::pair<size_t, size_t>> previous_snaps;
+    previous.reserve(stored_states.size());
+    for (const auto& state : stored_states) {
+        previous[state.name] = &state;
+    }
+    for (size_t i = 0; i < stored_snapshots.size(); i++) {
+        auto it = previous_snaps.try_emplace(stored_snapshots[i].state_name, i, i).first;
+        it->second.second = i + 1;
+    }
+
+    StateListing listing;
+    listing.states = std::move(states);
+    trusted.assign(listing.states.size(), false);
+    for (size_t s = 0; s < listing.states.size(); s++) {
+        const auto& state = listing.states[s];
+        auto prev = previous.find(state.name);
+        bool unchanged = prev != previous.end() && state.guid != 0 &&
+                         state.snapshots_changed != 0 &&
+                         prev->second->guid == state.guid &&
+                         prev->second->snapshots_changed == state.snapshots_changed;
+
+        if (unchanged) {
+            auto range = previous_snaps.find(state.name);
+            if (range != previous_snaps.end()) {
+                for (size_t i = range->second.first; i < range->second.second; i++) {
+                    listing.snapshots.push_back(std::move(stored_snapshots[i]));
+                }
+            }
+        } else {
+            read_snapshots(state.name, listing.snapshots);
+        }
+
+        trusted[s] = state.snapshots_changed < walk_started;
+    }
+    listing.build_index();
+    return listing;
+}
+
+std::unordered_map<std::string, std::string> index_state_slots(
+    const std::vector<std::string>& slots,
+    const std::map<std::string, std::string>& assignments) {
+    // In slot order, so the first slot using a state wins like a scan would
+    std::unordered_map<std::string, std::string> state_slots;
+    state_slots.reserve(slots.size());
+    for (const auto& slot : slots) {
+        auto it = assignments.find(slot);
+        state_slots.try_emplace(it != assignments.end() ? it->second : slot, slot);
+    }
+    return state_slots;
+}
+
+} // namespace vmstate
@@ -1,14 +1,44 @@
 #include "providers/systemd_dbus_vm_provider.hpp"
+#include "utils/netlink.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
 #include <cstring>
+#include <fstream>
 #include <iostream>
+#include <net/if.h>
+#include <sstream>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 namespace vmstate {
 
+namespace {
+
+VMStatus status_from_active_state(const std::string& active_state) {
+    if (active_state == "active" || active_state == "activating") {
+        return VMStatus::Running;
+    } else if (active_state == "inactive" || active_state == "deactivating") {
+        return VMStatus::Stopped;
+    } else if (active_state == "failed") {
+        return VMStatus::Failed;
+    }
+    return VMStatus::Unknown;
+}
+
+}  // anonymous namespace
+
 SystemdDBusVMProvider::SystemdDBusVMProvider(
     const std::string& service_prefix,
-    const std::set<std::string>& valid_slots)
+    const std::set<std::string>& valid_slots,
+    const std::string& tap_prefix,
+    const std::string& slots_dir,
+    const std::string& cgroup_root)
     : service_prefix_(service_prefix),
-      valid_slots_(valid_slots) {
+      valid_slots_(valid_slots),
+      tap_prefix_(tap_prefix),
+      slots_dir_(slots_dir),
+      cgroup_root_(cgroup_root) {
     init_bus();
 }
 
@@ -40,7 +70,8 @@ std::string SystemdDBusVMProvider::get_unit_name(
 
 bool SystemdDBusVMProvider::call_unit_method(
     const std::string& method,
-    const std::string& unit_name) {
+    const std::string& unit_name,
+    std::string* job_path) {
     if (!bus_) {
         last_error_ = "D-Bus connection not initialized";
         return false;
@@ -70,14 +101,133 @@ bool SystemdDBusVMProvider::call_unit_method(
         return false;
     }
 
+    if (job_path) {
+        const char* path = nullptr;
+        if (sd_bus_message_read(m, "o", &path) < 0) {
+            last_error_ = "Failed to parse job path from " + method;
+            sd_bus_error_free(&error);
+            sd_bus_message_unref(m);
+            return false;
+        }
+        *job_path = path;
+    }
+
     sd_bus_error_free(&error);
     sd_bus_message_unref(m);
     return true;
 }
 
+namespace {
+
+// A job being waited on, filled in by job_removed_callback
+struct JobWait {
+    std::string job_path;
+    std::string result;
+    bool done = false;
+};
+
+}  // anonymous namespace
+
+int SystemdDBusVMProvider::job_removed_callback(sd_bus_message* m, void* userdata,
+                                                sd_bus_error* /*error*/) {
+    auto* wait = static_cast<JobWait*>(userdata);
+    uint32_t id = 0;
+    const char* path = nullptr;
+    const char* unit = nullptr;
+    const char* result = nullptr;
+    if (sd_bus_message_read(m, "uoss", &id, &path, &unit, &result) < 0) {
+        return 0;
+    }
+    if (!wait->job_path.empty() && wait->job_path == path) {
+        wait->result = result;
+        wait->done = true;
+    }
+    return 0;
+}
+
+bool SystemdDBusVMProvider::run_unit_job(const std::string& method,
+                                         const std::string& unit_name,
+                                         std::chrono::milliseconds timeout) {
+    if (!bus_) {
+        last_error_ = "D-Bus connection not initialized";
+        return false;
+    }
+
+    // Match before queueing the job so its JobRemoved can't slip past;
+    // signals that arrive with the method reply stay queued until
+    // sd_bus_process below, by which time job_path is known
+    JobWait wait;
+    sd_bus_slot* match = nullptr;
+    int r = sd_bus_match_signal(bus_, &match,
+                                "org.freedesktop.systemd1",
+                                "/org/freedesktop/systemd1",
+                                "org.freedesktop.systemd1.Manager",
+                                "JobRemoved",
+                                job_removed_callback, &wait);
+    if (r < 0) {
+        last_error_ = "Failed to watch for job completion: " + std::string(strerror(-r));
+        return false;
+    }
+
+    // systemd only emits job signals while someone is subscribed
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    r = sd_bus_call_method(bus_,
+                           "org.freedesktop.systemd1",
+                           "/org/freedesktop/systemd1",
+                           "org.freedesktop.systemd1.Manager",
+                           "Subscribe",
+                           &error, nullptr, "");
+    if (r < 0) {
+        last_error_ = "Failed to subscribe to systemd: " +
+                      std::string(error.message ? error.message : strerror(-r));
+        sd_bus_error_free(&error);
+        sd_bus_slot_unref(match);
+        return false;
+    }
+    sd_bus_error_free(&error);
+
+    std::string job_path;
+    if (!call_unit_method(method, unit_name, &job_path)) {
+        sd_bus_slot_unref(match);
+        return false;
+    }
+    wait.job_path = job_path;
+
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!wait.done) {
+        r = sd_bus_process(bus_, nullptr);
+        if (r < 0) {
+            last_error_ = "Failed to process bus messages: " + std::string(strerror(-r));
+            break;
+        }
+        if (r > 0) {
+            continue;
+        }
+        auto left = std::chrono::duration_cast<std::chrono::microseconds>(
+            deadline - std::chrono::steady_clock::now());
+        if (left.count() <= 0) {
+            last_error_ = "Timed out waiting for " + method + " of " + unit_name;
+            break;
+        }
+        sd_bus_wait(bus_, static_cast<uint64_t>(left.count()));
+    }
+    sd_bus_slot_unref(match);
+
+    if (!wait.done) {
+        return false;
+    }
+    if (wait.result != "done") {
+        last_error_ = method + " of " + unit_name + " finished with result '" +
+                      wait.result + "'";
+        return false;
+    }
+    return true;
+}
+
 std::optional<std::string> SystemdDBusVMProvider::get_unit_property(
     const std::string& unit_name,
-    const std::string& property) {
+    const std::string& property,
+    const std::string& interface) {
     if (!bus_) {
         last_error_ = "D-Bus connection not initialized";
         return std::nullopt;
@@ -148,7 +298,7 @@ std::optional<std::string> SystemdDBusVMProvider::get_unit_property(
         bus_,
         "org.freedesktop.systemd1",
         unit_path.c_str(),
-        "org.freedesktop.systemd1.Unit",
+        interface.c_str(),
         property.c_str(),
         &error,
         &m,
@@ -194,6 +344,24 @@ bool SystemdDBusVMProvider::stop(const std::string& slot_name) {
     return call_unit_method("StopUnit", get_unit_name(slot_name));
 }
 
+bool SystemdDBusVMProvider::start_and_wait(const std::string& slot_name,
+                                           std::chrono::milliseconds timeout) {
+    if (!is_valid_slot(slot_name)) {
+        last_error_ = "Invalid slot name: " + slot_name;
+        return false;
+    }
+    return run_unit_job("StartUnit", get_unit_name(slot_name), timeout);
+}
+
+bool SystemdDBusVMProvider::stop_and_wait(const std::string& slot_name,
+                                          std::chrono::milliseconds timeout) {
+    if (!is_valid_slot(slot_name)) {
+        last_error_ = "Invalid slot name: " + slot_name;
+        return false;
+    }
+    return run_unit_job("StopUnit", get_unit_name(slot_name), timeout);
+}
+
 bool SystemdDBusVMProvider::restart(const std::string& slot_name) {
     if (!is_valid_slot(slot_name)) {
         last_error_ = "Invalid slot name: " + slot_name;
@@ -216,16 +384,74 @@ VMStatus SystemdDBusVMProvider::get_status(const std::string& slot_name) {
     if (!active_state) {
         return VMStatus::Unknown;
     }
+    return status_from_active_state(*active_state);
+}
 
-    if (*active_state == "active" || *active_state == "activating") {
-        return VMStatus::Running;
-    } else if (*active_state == "inactive" || *active_state == "deactivating") {
-        return VMStatus::Stopped;
-    } else if (*active_state == "failed") {
-        return VMStatus::Failed;
+std::optional<std::map<std::string, VMStatus>> SystemdDBusVMProvider::get_all_statuses() {
+    if (!bus_) {
+        last_error_ = "D-Bus connection not initialized";
+        return std::nullopt;
     }
 
-    return VMStatus::Unknown;
+    // One ListUnitsByPatterns call covers every slot; only loaded units are
+    // listed, and a slot unit that isn't loaded isn't running
+    std::map<std::string, VMStatus> result;
+    for (const auto& slot : valid_slots_) {
+        result[slot] = VMStatus::Stopped;
+    }
+
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message* call = nullptr;
+    sd_bus_message* reply = nullptr;
+    std::string pattern = get_unit_name("*");
+    char* patterns[] = {pattern.data(), nullptr};
+    char* no_states[] = {nullptr};
+
+    int r = sd_bus_message_new_method_call(bus_, &call,
+                                           "org.freedesktop.systemd1",
+                                           "/org/freedesktop/systemd1",
+                                           "org.freedesktop.systemd1.Manager",
+                                           "ListUnitsByPatterns");
+    if (r >= 0) r = sd_bus_message_append_strv(call, no_states);
+    if (r >= 0) r = sd_bus_message_append_strv(call, patterns);
+    if (r >= 0) r = sd_bus_call(bus_, call, 0, &error, &reply);
+    sd_bus_message_unref(call);
+    if (r < 0) {
+        last_error_ = std::string("Failed to list units: ") +
+                      (error.message ? error.message : strerror(-r));
+        sd_bus_error_free(&error);
+        sd_bus_message_unref(reply);
+        return std::nullopt;
+    }
+
+    r = sd_bus_message_enter_container(reply, 'a', "(ssssssouso)");
+    const std::string suffix = ".service";
+    while (r > 0) {
+        const char* name = nullptr;
+        const char* active_state = nullptr;
+        r = sd_bus_message_read(reply, "(ssssssouso)", &name, nullptr, nullptr,
+                                &active_state, nullptr, nullptr, nullptr, nullptr,
+                                nullptr, nullptr);
+        if (r <= 0) {
+            break;
+        }
+        std::string unit(name);
+        if (unit.size() <= service_prefix_.size() + suffix.size()) {
+            continue;
+        }
+        std::string slot = unit.substr(service_prefix_.size(),
+                                       unit.size() - service_prefix_.size() - suffix.size());
+        if (is_valid_slot(slot)) {
+            result[slot] = status_from_active_state(active_state);
+        }
+    }
+    sd_bus_error_free(&error);
+    sd_bus_message_unref(reply);
+    if (r < 0) {
+        last_error_ = "Failed to parse unit list";
+        return std::nullopt;
+    }
+    return result;
 }
 
 std::optional<VMInfo> SystemdDBusVMProvider::get_info(
@@ -263,6 +489,301 @@ bool SystemdDBusVMProvider::is_valid_slot(const std::string& slot_name) {
     return valid_slots_.find(slot_name) != valid_slots_.end();
 }
 
+std::optional<std::vector<SlotNetStats>> SystemdDBusVMProvider::get_network_stats() {
+    std::string error;
+    auto links = utils::dump_link_stats(error);
+    if (!links) {
+        last_error_ = error;
+        return std::nullopt;
+    }
+
+    std::vector<SlotNetStats> result;
+    for (const auto& link : *links) {
+        if (link.ifname.compare(0, tap_prefix_.size(), tap_prefix_) != 0) {
+            continue;
+        }
+        std::string slot = link.ifname.substr(tap_prefix_.size());
+        if (!is_valid_slot(slot)) {
+            continue;
+        }
+        result.push_back({slot, link.ifname,
+                          link.rx_bytes, link.tx_bytes,
+                          link.rx_packets, link.tx_packets,
+                          link.rx_dropped, link.tx_dropped,
+                          link.rx_errors, link.tx_errors,
+                          link.qdisc_dropped});
+    }
+    std::sort(result.begin(), result.end(),
+              [](const SlotNetStats& a, const SlotNetStats& b) { return a.slot_name < b.slot_name; });
+    return result;
+}
+
+std::string SystemdDBusVMProvider::net_limit_path(const std::string& slot_name) const {
+    return slots_dir_ + "/" + slot_name + "/net-limit";
+}
+
+bool SystemdDBusVMProvider::program_net_limit(const std::string& slot_name,
+                                              const NetLimit& limit) {
+    std::string ifname = tap_prefix_ + slot_name;
+    if (if_nametoindex(ifname.c_str()) == 0) {
+        return true;  // Applied when the slot next starts
+    }
+
+    // Guest transmit arrives as tap receive and vice versa
+    std::string error;
+    if (!utils::set_link_rate_limits(ifname, limit.ingress_bits_per_sec,
+                                     limit.egress_bits_per_sec, error)) {
+        last_error_ = error;
+        return false;
+    }
+    return true;
+}
+
+bool SystemdDBusVMProvider::set_net_limit(const std::string& slot_name,
+                                          const NetLimit& limit) {
+    if (!is_valid_slot(slot_name)) {
+        last_error_ = "Invalid slot name: " + slot_name;
+        return false;
+    }
+
+    std::string path = net_limit_path(slot_name);
+    if (limit.egress_bits_per_sec == 0 && limit.ingress_bits_per_sec == 0) {
+        if (unlink(path.c_str()) != 0 && errno != ENOENT) {
+            last_error_ = "Failed to remove " + path + ": " + strerror(errno);
+            return false;
+        }
+    } else {
+        // Write then rename, so a restart never reads a partial file
+        std::string tmp_path = path + ".tmp";
+        {
+            std::ofstream out(tmp_path, std::ios::trunc);
+            out << "egress " << limit.egress_bits_per_sec << "\n"
+                << "ingress " << limit.ingress_bits_per_sec << "\n";
+            if (!out.flush()) {
+                last_error_ = "Failed to write " + tmp_path;
+                return false;
+            }
+        }
+        if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+            last_error_ = "Failed to save " + path + ": " + strerror(errno);
+            unlink(tmp_path.c_str());
+            return false;
+        }
+    }
+
+    return program_net_limit(slot_name, limit);
+}
+
+std::optional<NetLimit> SystemdDBusVMProvider::get_net_limit(const std::string& slot_name) {
+    if (!is_valid_slot(slot_name)) {
+        last_error_ = "Invalid slot name: " + slot_name;
+        return std::nullopt;
+    }
+
+    NetLimit limit;
+    std::ifstream in(net_limit_path(slot_name));
+    std::string key;
+    uint64_t value;
+    while (in >> key >> value) {
+        if (key == "egress") {
+            limit.egress_bits_per_sec = value;
+        } else if (key == "ingress") {
+            limit.ingress_bits_per_sec = value;
+        }
+    }
+    return limit;
+}
+
+bool SystemdDBusVMProvider::apply_net_limit(const std::string& slot_name) {
+    auto limit = get_net_limit(slot_name);
+    if (!limit) {
+        return false;
+    }
+    return program_net_limit(slot_name, *limit);
+}
+
+namespace {
+
+// From linux/ioprio.h (not exported by every libc)
+constexpr int IOPRIO_WHO_PROCESS = 1;
+constexpr int IOPRIO_CLASS_IDLE = 3;
+constexpr int IOPRIO_CLASS_SHIFT = 13;
+
+}  // anonymous namespace
+
+bool SystemdDBusVMProvider::enter_background(const BackgroundLimits& limits) {
+    // Idle I/O priority needs no systemd, so it applies even if the scope
+    // can't be created
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0) {
+        last_error_ = std::string("Failed to set idle I/O priority: ") + strerror(errno);
+        return false;
+    }
+
+    // A service started with Slice= is already where it belongs
+    std::ifstream self_cgroup("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(self_cgroup, line)) {
+        if (line.rfind("0::", 0) == 0 && line.find("/" + limits.slice) != std::string::npos) {
+            return true;
+        }
+    }
+
+    if (!bus_) {
+        last_error_ = "D-Bus connection not initialized";
+        return false;
+    }
+
+    std::string unit = "vm-state-" + std::to_string(getpid()) + ".scope";
+    sd_bus_message* m = nullptr;
+    int r = sd_bus_message_new_method_call(bus_, &m,
+                                           "org.freedesktop.systemd1",
+                                           "/org/freedesktop/systemd1",
+                                           "org.freedesktop.systemd1.Manager",
+                                           "StartTransientUnit");
+    if (r >= 0) r = sd_bus_message_append(m, "ss", unit.c_str(), "fail");
+    if (r >= 0) r = sd_bus_message_open_container(m, 'a', "(sv)");
+    if (r >= 0) {
+        r = sd_bus_message_append(m, "(sv)(sv)(sv)(sv)(sv)",
+                                  "Description", "s", "vm-state background work",
+                                  "Slice", "s", limits.slice.c_str(),
+                                  "PIDs", "au", 1, static_cast<uint32_t>(getpid()),
+                                  "IOWeight", "t", limits.io_weight,
+                                  "CPUWeight", "t", limits.cpu_weight);
+    }
+    if (r >= 0 && !limits.io_device.empty() && limits.io_read_max > 0) {
+        r = sd_bus_message_append(m, "(sv)", "IOReadBandwidthMax", "a(st)", 1,
+                                  limits.io_device.c_str(), limits.io_read_max);
+    }
+    if (r >= 0 && !limits.io_device.empty() && limits.io_write_max > 0) {
+        r = sd_bus_message_append(m, "(sv)", "IOWriteBandwidthMax", "a(st)", 1,
+                                  limits.io_device.c_str(), limits.io_write_max);
+    }
+    if (r >= 0) r = sd_bus_message_close_container(m);
+    if (r >= 0) r = sd_bus_message_append(m, "a(sa(sv))", 0);
+    if (r < 0) {
+        last_error_ = std::string("Failed to build StartTransientUnit call: ") + strerror(-r);
+        sd_bus_message_unref(m);
+        return false;
+    }
+
+    // The process is moved when the scope starts, before the job finishes
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message* reply = nullptr;
+    r = sd_bus_call(bus_, m, 0, &error, &reply);
+    sd_bus_message_unref(m);
+    if (r < 0) {
+        last_error_ = "Failed to call StartTransientUnit: " +
+                      std::string(error.message ? error.message : strerror(-r));
+        sd_bus_error_free(&error);
+        sd_bus_message_unref(reply);
+        return false;
+    }
+    sd_bus_error_free(&error);
+    sd_bus_message_unref(reply);
+    return true;
+}
+
+bool SystemdDBusVMProvider::start_transient_service(const std::string& unit,
+                                                    const std::string& description,
+                                                    const std::vector<std::string>& argv) {
+    if (!bus_) {
+        last_error_ = "D-Bus connection not initialized";
+        return false;
+    }
+    if (argv.empty()) {
+        last_error_ = "No command for " + unit;
+        return false;
+    }
+
+    sd_bus_message* m = nullptr;
+    int r = sd_bus_message_new_method_call(bus_, &m,
+                                           "org.freedesktop.systemd1",
+                                           "/org/freedesktop/systemd1",
+                                           "org.freedesktop.systemd1.Manager",
+                                           "StartTransientUnit");
+    if (r >= 0) r = sd_bus_message_append(m, "ss", unit.c_str(), "fail");
+    if (r >= 0) r = sd_bus_message_open_container(m, 'a', "(sv)");
+    if (r >= 0) {
+        r = sd_bus_message_append(m, "(sv)(sv)",
+                                  "Description", "s", description.c_str(),
+                                  "CollectMode", "s", "inactive-or-failed");
+    }
+    // ExecStart is a(sasb): path, argv, and whether a failure is ignored
+    if (r >= 0) r = sd_bus_message_open_container(m, 'r', "sv");
+    if (r >= 0) r = sd_bus_message_append(m, "s", "ExecStart");
+    if (r >= 0) r = sd_bus_message_open_container(m, 'v', "a(sasb)");
+    if (r >= 0) r = sd_bus_message_open_container(m, 'a', "(sasb)");
+    if (r >= 0) r = sd_bus_message_open_container(m, 'r', "sasb");
+    if (r >= 0) r = sd_bus_message_append(m, "s", argv[0].c_str());
+    if (r >= 0) r = sd_bus_message_open_container(m, 'a', "s");
+    for (size_t i = 0; r >= 0 && i < argv.size(); i++) {
+        r = sd_bus_message_append(m, "s", argv[i].c_str());
+    }
+    if (r >= 0) r = sd_bus_message_close_container(m);
+    if (r >= 0) r = sd_bus_message_append(m, "b", 0);
+    for (int level = 0; r >= 0 && level < 4; level++) {
+        r = sd_bus_message_close_container(m);
+    }
+    if (r >= 0) r = sd_bus_message_close_container(m);
+    if (r >= 0) r = sd_bus_message_append(m, "a(sa(sv))", 0);
+    if (r < 0) {
+        last_error_ = std::string("Failed to build StartTransientUnit call: ") + strerror(-r);
+        sd_bus_message_unref(m);
+        return false;
+    }
+
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message* reply = nullptr;
+    r = sd_bus_call(bus_, m, 0, &error, &reply);
+    sd_bus_message_unref(m);
+    if (r < 0) {
+        last_error_ = "Failed to start " + unit + ": " +
+                      std::string(error.message ? error.message : strerror(-r));
+        sd_bus_error_free(&error);
+        sd_bus_message_unref(reply);
+        return false;
+    }
+    sd_bus_error_free(&error);
+    sd_bus_message_unref(reply);
+    return true;
+}
+
+std::optional<double> SystemdDBusVMProvider::get_slot_io_pressure(const std::string& slot_name) {
+    if (!is_valid_slot(slot_name)) {
+        last_error_ = "Invalid slot name: " + slot_name;
+        return std::nullopt;
+    }
+
+    auto cgroup = get_unit_property(get_unit_name(slot_name), "ControlGroup",
+                                    "org.freedesktop.systemd1.Service");
+    if (!cgroup) {
+        return std::nullopt;
+    }
+    if (cgroup->empty()) {
+        return 0.0;  // Not running, so not stalled
+    }
+
+    std::string path = cgroup_root_ + *cgroup + "/io.pressure";
+    std::ifstream pressure(path);
+    if (!pressure) {
+        last_error_ = "Cannot read " + path + " (kernel without PSI?)";
+        return std::nullopt;
+    }
+    // some avg10=1.23 avg60=0.50 avg300=0.10 total=123456
+    std::string line;
+    while (std::getline(pressure, line)) {
+        std::istringstream fields(line);
+        std::string kind;
+        std::string avg10;
+        if (fields >> kind >> avg10 && kind == "some" && avg10.rfind("avg10=", 0) == 0) {
+            return std::strtod(avg10.c_str() + 6, nullptr);
+        }
+    }
+    last_error_ = "Unexpected format in " + path;
+    return std::nullopt;
+}
+
 std::string SystemdDBusVMProvider::get_last_error() const {
     return last_error_;
 }
@@ -1,52 +1,131 @@
 #include "providers/zfs_state_provider.hpp"
+#include "catalog/shared_catalog.hpp"
+#include "image/ext4_image.hpp"
+#include "utils/blake3.hpp"
 #include "utils/json.hpp"
+#include "utils/send_stream.hpp"
+#include "utils/slot_link.hpp"
 #include <algorithm>
+#include <cctype>
 #include <cerrno>
+#include <cmath>
 #include <chrono>
+#include <csignal>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <filesystem>
 #include <fstream>
+#include <set>
 #include <thread>
 #include <grp.h>
 #include <pwd.h>
 #include <sstream>
+#include <fcntl.h>
+#include <sys/file.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <sys/nvpair.h>
+#include <libzfs_core.h>
 
 namespace fs = std::filesystem;
 
 namespace vmstate {
 
-// Helper struct for collecting datasets during iteration
-struct DatasetCollector {
-    std::vector<StateInfo>* states;
+// Walk state for visiting datasets during iteration
+struct DatasetWalk {
+    const StateVisitor* visitor;
     std::string base_path;
-    libzfs_handle_t* zfs_handle;
+    size_t visited = 0;
 };
 
-// Helper struct for collecting snapshots during iteration
-struct SnapshotCollector {
-    std::vector<SnapshotInfo>* snapshots;
+// Walk state for visiting snapshots during iteration
+struct SnapshotWalk {
+    const SnapshotVisitor* visitor;
     std::string base_path;
+    size_t limit = 0;           // 0 = unlimited
+    size_t visited = 0;
 };
 
+// Walk state for a reconcile pass: state names and clone-for snapshots
+struct ReconcileWalk {
+    struct CloneSnapshot {
+        std::string full_name;
+        std::string dest;           // State the snapshot was taken for
+        uint64_t clones;
+        uint64_t holds;
+        uint64_t creation;
+    };
+    std::string base_path;
+    std::set<std::string> states;
+    size_t snapshots = 0;
+    std::vector<CloneSnapshot> clone_snapshots;
+};
+
+// Serializes changes to slot assignments and slot links between processes
+// (assign and reconcile repairs); readers never take this lock
+class AssignmentLock {
+public:
+    explicit AssignmentLock(const std::string& assignments_file) {
+        fd_ = open((assignments_file + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd_ >= 0) {
+            flock(fd_, LOCK_EX);
+        }
+    }
+    ~AssignmentLock() {
+        if (fd_ >= 0) {
+            flock(fd_, LOCK_UN);
+            close(fd_);
+        }
+    }
+
+    AssignmentLock(const AssignmentLock&) = delete;
+    AssignmentLock& operator=(const AssignmentLock&) = delete;
+
+private:
+    int fd_ = -1;
+};
+
+// Whether an nbd device is connected by a live process (a lazy restore
+// serving it); the kernel drops the pid once its server goes away
+static bool nbd_served(const std::string& device) {
+    std::ifstream pid_file("/sys/block/" + device.substr(device.rfind('/') + 1) + "/pid");
+    pid_t pid = 0;
+    return pid_file >> pid && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+// Longest snapshot range considered as one reclaim candidate. Each range
+// costs one snaprange-space ioctl, so this bounds the planning work per
+// snapshot.
+constexpr size_t RECLAIM_MAX_RANGE = 32;
+
 ZFSStateProvider::ZFSStateProvider(
     const std::string& pool,
     const std::string& base_dataset,
     const std::string& states_dir,
     const std::string& assignments_file,
-    const std::vector<std::string>& slots)
+    const std::vector<std::string>& slots,
+    const std::string& cache_dir,
+    const std::string& catalog_path)
     : pool_(pool),
       base_dataset_(base_dataset),
       states_dir_(states_dir),
       assignments_file_(assignments_file),
-      slots_(slots) {
+      slots_(slots),
+      cache_dir_(cache_dir),
+      catalog_path_(catalog_path),
+      inventory_path_(cache_dir + "/inventory"),
+      latency_history_(cache_dir + "/latency.json") {
     init_libzfs();
 }
 
 ZFSStateProvider::~ZFSStateProvider() {
+    // Leave an up-to-date inventory behind so the next cold listing
+    // doesn't have to walk what this process changed
+    if (inventory_dirty_ && zfs_handle_) {
+        refresh_listing();
+    }
     if (zfs_handle_) {
         libzfs_fini(zfs_handle_);
         zfs_handle_ = nullptr;
@@ -72,6 +151,104 @@ std::string ZFSStateProvider::get_mount_path(
     return states_dir_ + "/" + state_name;
 }
 
+uint64_t ZFSStateProvider::get_pool_txg() const {
+    // The txg history kstat is a cheap read; its last row is the open txg
+    std::ifstream kstat("/proc/spl/kstat/zfs/" + pool_ + "/txgs");
+    std::string line;
+    std::string last;
+    bool in_rows = false;   // Skip the kstat header line before the "txg" column row
+    while (std::getline(kstat, line)) {
+        if (line.rfind("txg", 0) == 0) {
+            in_rows = true;
+        } else if (in_rows && !line.empty() &&
+                   std::isdigit(static_cast<unsigned char>(line[0]))) {
+            last = line;
+        }
+    }
+    if (!last.empty()) {
+        return std::strtoull(last.c_str(), nullptr, 10);
+    }
+
+    // Fall back to the txg in the pool config (txg history may be disabled)
+    uint64_t txg = 0;
+    zpool_handle_t* zph = zfs_handle_ ? zpool_open(zfs_handle_, pool_.c_str()) : nullptr;
+    if (zph) {
+        boolean_t missing = B_FALSE;
+        zpool_refresh_stats(zph, &missing);
+        nvlist_t* config = zpool_get_config(zph, nullptr);
+        if (config) {
+            nvlist_lookup_uint64(config, ZPOOL_CONFIG_POOL_TXG, &txg);
+        }
+        zpool_close(zph);
+    }
+    return txg;
+}
+
+uint64_t ZFSStateProvider::get_assignment_store_version() const {
+    struct stat st;
+    if (stat(assignments_file_.c_str(), &st) != 0) {
+        return 0;
+    }
+    return (static_cast<uint64_t>(st.st_ino) << 32) ^
+           static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000ULL ^
+           static_cast<uint64_t>(st.st_mtim.tv_nsec) ^
+           static_cast<uint64_t>(st.st_size);
+}
+
+uint64_t ZFSStateProvider::get_generation() {
+    // Mix the two sources; only equality matters to callers
+    uint64_t txg = get_pool_txg();
+    uint64_t assignments = get_assignment_store_version();
+    return txg * 0x9E3779B97F4A7C15ULL ^ assignments;
+}
+
+void ZFSStateProvider::record_latency(
+    const std::string& operation,
+    std::chrono::steady_clock::time_point started) {
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - started;
+    latency_history_.record(operation, elapsed.count());
+}
+
+void ZFSStateProvider::apply_history(OperationEstimate& estimate) const {
+    auto stats = latency_history_.get(estimate.operation);
+    estimate.history_samples = stats ? stats->samples : 0;
+    if (stats) {
+        estimate.expected_ms = stats->mean_ms;
+    }
+}
+
+bool ZFSStateProvider::report_progress(utils::ProgressMeter& meter, const std::string& phase,
+                                       uint64_t done, uint64_t total) const {
+    const auto& progress = meter.update(phase, done, total);
+    return !progress_ || progress_(progress);
+}
+
+std::optional<uint64_t> ZFSStateProvider::get_pool_freeing() const {
+    zpool_handle_t* zph = zfs_handle_ ? zpool_open(zfs_handle_, pool_.c_str()) : nullptr;
+    if (!zph) {
+        return std::nullopt;
+    }
+    boolean_t missing = B_FALSE;
+    zpool_refresh_stats(zph, &missing);
+    uint64_t freeing = zpool_get_prop_int(zph, ZPOOL_PROP_FREEING, nullptr);
+    zpool_close(zph);
+    return freeing;
+}
+
+void ZFSStateProvider::note_mutation() const {
+    listing_cache_ = ListingCache{};
+    inventory_dirty_ = true;
+    // Readers fall back to a live walk until the catalog is republished
+    invalidate_shared_catalog(catalog_path_);
+}
+
+std::string ZFSStateProvider::get_snapshot_image_path(
+    const std::string& state_name,
+    const std::string& snapshot_name) const {
+    return get_mount_path(state_name) + "/.zfs/snapshot/" + snapshot_name + "/data.img";
+}
+
 zfs_handle_t* ZFSStateProvider::open_dataset(const std::string& name, int type) const {
     if (!zfs_handle_) {
         return nullptr;
@@ -79,12 +256,18 @@ zfs_handle_t* ZFSStateProvider::open_dataset(const std::string& name, int type)
     return zfs_open(zfs_handle_, name.c_str(), type);
 }
 
-std::map<std::string, std::string> ZFSStateProvider::load_assignments() const {
-    auto result = utils::read_json_file(assignments_file_);
-    if (result) {
-        return *result;
+const std::map<std::string, std::string>& ZFSStateProvider::load_assignments() const {
+    uint64_t version = get_assignment_store_version();
+    if (version != 0 && version == assignments_version_) {
+        return assignments_cache_;
     }
-    return {};
+
+    auto result = utils::read_json_file(assignments_file_);
+    assignments_version_ = version;
+    assignments_cache_ = result ? std::move(*result) : std::map<std::string, std::string>{};
+
+    state_slots_ = index_state_slots(slots_, assignments_cache_);
+    return assignments_cache_;
 }
 
 bool ZFSStateProvider::save_assignments(
@@ -122,10 +305,14 @@ bool ZFSStateProvider::set_state_permissions(
     return true;
 }
 
+std::string ZFSStateProvider::get_slot_dir(const std::string& slot_name) const {
+    return "/var/lib/microvms/" + slot_name;
+}
+
 bool ZFSStateProvider::create_state_symlink(
     const std::string& slot_name,
     const std::string& state_name) const {
-    std::string slot_dir = "/var/lib/microvms/" + slot_name;
+    std::string slot_dir = get_slot_dir(slot_name);
     std::string slot_data = slot_dir + "/data.img";
     std::string state_data = get_mount_path(state_name) + "/data.img";
 
@@ -137,31 +324,7 @@ bool ZFSStateProvider::create_state_symlink(
         return false;
     }
 
-    // Remove existing symlink or backup regular file
-    // Use symlink_status to detect symlinks without following them
-    std::error_code ec;
-    auto status = fs::symlink_status(slot_data, ec);
-    if (!ec && fs::exists(status)) {
-        if (fs::is_symlink(status)) {
-            fs::remove(slot_data, ec);
-            if (ec) {
-                last_error_ = "Failed to remove existing symlink: " + ec.message();
-                return false;
-            }
-        } else if (fs::is_regular_file(status)) {
-            fs::rename(slot_data, slot_data + ".backup", ec);
-            if (ec) {
-                last_error_ = "Failed to backup existing file: " + ec.message();
-                return false;
-            }
-        }
-    }
-
-    // Create symlink
-    try {
-        fs::create_symlink(state_data, slot_data);
-    } catch (const std::exception& e) {
-        last_error_ = "Failed to create symlink: " + std::string(e.what());
+    if (!utils::install_slot_link(slot_data, state_data, last_error_)) {
         return false;
     }
 
@@ -178,6 +341,8 @@ bool ZFSStateProvider::create_state_symlink(
 }
 
 bool ZFSStateProvider::create_state(const std::string& name) {
+    auto started = std::chrono::steady_clock::now();
+
     if (!zfs_handle_) {
         last_error_ = "libzfs not initialized";
         return false;
@@ -216,6 +381,7 @@ bool ZFSStateProvider::create_state(const std::string& name) {
                       std::string(libzfs_error_description(zfs_handle_));
         return false;
     }
+    note_mutation();
 
     // Explicitly mount the dataset (auto-mount may not work in all environments)
     zfs_handle_t* zhp = open_dataset(dataset, ZFS_TYPE_FILESYSTEM);
@@ -247,10 +413,13 @@ bool ZFSStateProvider::create_state(const std::string& name) {
         return false;
     }
 
+    record_latency("create_state", started);
     return true;
 }
 
 bool ZFSStateProvider::delete_state(const std::string& name, bool force) {
+    auto started = std::chrono::steady_clock::now();
+
     if (!zfs_handle_) {
         last_error_ = "libzfs not initialized";
         return false;
@@ -271,6 +440,7 @@ bool ZFSStateProvider::delete_state(const std::string& name, bool force) {
     }
 
     std::string dataset = get_dataset_path(name);
+    utils::ProgressMeter meter("delete_state", name);
 
     // Open the dataset
     zfs_handle_t* zhp = open_dataset(dataset, ZFS_TYPE_FILESYSTEM);
@@ -279,6 +449,7 @@ bool ZFSStateProvider::delete_state(const std::string& name, bool force) {
                       std::string(libzfs_error_description(zfs_handle_));
         return false;
     }
+    uint64_t used = zfs_prop_get_int(zhp, ZFS_PROP_USEDDS);
 
     // Get the origin property (if this is a clone)
     char origin[ZFS_MAX_DATASET_NAME_LEN];
@@ -290,6 +461,7 @@ bool ZFSStateProvider::delete_state(const std::string& name, bool force) {
 
     // Unmount if mounted (required before destroy)
     if (zfs_is_mounted(zhp, nullptr)) {
+        report_progress(meter, "unmount");
         int unmount_ret = zfs_unmount(zhp, nullptr, 0);
         if (unmount_ret != 0) {
             // Try force unmount
@@ -298,6 +470,7 @@ bool ZFSStateProvider::delete_state(const std::string& name, bool force) {
     }
 
     // Destroy the dataset
+    report_progress(meter, "destroy", 0, used);
     int ret = zfs_destroy(zhp, B_FALSE);
     zfs_close(zhp);
 
@@ -308,6 +481,7 @@ bool ZFSStateProvider::delete_state(const std::string& name, bool force) {
                       (desc ? desc : "unknown error");
         return false;
     }
+    note_mutation();
 
     // If this was a clone, try to clean up the origin snapshot
     if (!origin_snap.empty()) {
@@ -319,11 +493,17 @@ bool ZFSStateProvider::delete_state(const std::string& name, bool force) {
         }
     }
 
+    // The space comes back in the background; wait_for_freeing follows it
+    report_progress(meter, "destroy", used, used);
+    record_latency("delete_state", started);
     return true;
 }
 
 bool ZFSStateProvider::clone_state(const std::string& source,
-                                    const std::string& dest) {
+                                    const std::string& dest,
+                                    const std::vector<FileInjection>& files) {
+    auto started = std::chrono::steady_clock::now();
+
     if (!zfs_handle_) {
         last_error_ = "libzfs not initialized";
         return false;
@@ -346,6 +526,7 @@ bool ZFSStateProvider::clone_state(const std::string& source,
     // Create a snapshot for cloning
     std::string snap_name = "clone-for-" + dest;
     std::string full_snap = src_dataset + "@" + snap_name;
+    utils::ProgressMeter meter("clone_state", dest);
 
     // Open source dataset
     zfs_handle_t* src_zhp = open_dataset(src_dataset, ZFS_TYPE_FILESYSTEM);
@@ -355,6 +536,7 @@ bool ZFSStateProvider::clone_state(const std::string& source,
     }
 
     // Create snapshot
+    report_progress(meter, "snapshot");
     nvlist_t* snap_props = nullptr;
     nvlist_alloc(&snap_props, NV_UNIQUE_NAME, 0);
 
@@ -382,6 +564,7 @@ bool ZFSStateProvider::clone_state(const std::string& source,
                       dst_mount.c_str());
 
     // Clone from snapshot
+    report_progress(meter, "clone");
     ret = zfs_clone(snap_zhp, dst_dataset.c_str(), clone_props);
     nvlist_free(clone_props);
     zfs_close(snap_zhp);
@@ -391,6 +574,7 @@ bool ZFSStateProvider::clone_state(const std::string& source,
                       std::string(libzfs_error_description(zfs_handle_));
         return false;
     }
+    note_mutation();
 
     // Note: We intentionally do NOT promote the clone here.
     // Promoting would make the source depend on the clone's snapshot,
@@ -405,6 +589,7 @@ bool ZFSStateProvider::clone_state(const std::string& source,
     }
 
     // Explicitly mount the dataset (auto-mount may not work in all environments)
+    report_progress(meter, "mount");
     if (!zfs_is_mounted(clone_zhp, nullptr)) {
         ret = zfs_mount(clone_zhp, nullptr, 0);
         if (ret != 0) {
@@ -427,6 +612,19 @@ bool ZFSStateProvider::clone_state(const std::string& source,
         return false;
     }
 
+    // Provision the clone before anything can boot it; a half-provisioned
+    // clone is removed rather than left behind
+    if (!files.empty()) {
+        report_progress(meter, "inject");
+    }
+    if (!files.empty() && !inject_files(dest, files)) {
+        std::string inject_error = last_error_;
+        delete_state(dest, true);
+        last_error_ = inject_error;
+        return false;
+    }
+
+    record_latency("clone_state", started);
     return true;
 }
 
@@ -450,6 +648,14 @@ std::optional<StateInfo> ZFSStateProvider::get_state_info(
         return std::nullopt;
     }
 
+    if (listing_cache_.has_states && listing_cache_.generation == get_generation()) {
+        auto it = listing_cache_.state_index.find(name);
+        if (it == listing_cache_.state_index.end()) {
+            return std::nullopt;
+        }
+        return listing_cache_.states[it->second];
+    }
+
     std::string dataset = get_dataset_path(name);
     zfs_handle_t* zhp = open_dataset(dataset, ZFS_TYPE_FILESYSTEM);
     if (!zhp) {
@@ -470,15 +676,16 @@ std::optional<StateInfo> ZFSStateProvider::get_state_info(
 }
 
 int ZFSStateProvider::dataset_iter_callback(zfs_handle_t* zhp, void* data) {
-    auto* collector = static_cast<DatasetCollector*>(data);
+    auto* walk = static_cast<DatasetWalk*>(data);
 
     const char* name = zfs_get_name(zhp);
     std::string name_str(name);
+    bool keep_going = true;
 
     // Skip the base dataset itself
-    if (name_str != collector->base_path) {
+    if (name_str != walk->base_path) {
         // Extract state name from dataset path
-        std::string state_name = name_str.substr(collector->base_path.size() + 1);
+        std::string state_name = name_str.substr(walk->base_path.size() + 1);
 
         // Skip nested datasets
         if (state_name.find('/') == std::string::npos) {
@@ -487,6 +694,8 @@ int ZFSStateProvider::dataset_iter_callback(zfs_handle_t* zhp, void* data) {
             info.dataset = name_str;
             info.used_bytes = zfs_prop_get_int(zhp, ZFS_PROP_USED);
             info.available_bytes = zfs_prop_get_int(zhp, ZFS_PROP_AVAILABLE);
+            info.guid = zfs_prop_get_int(zhp, ZFS_PROP_GUID);
+            info.snapshots_changed = zfs_prop_get_int(zhp, ZFS_PROP_SNAPSHOTS_CHANGED);
 
             char mountpoint[ZFS_MAXPROPLEN];
             if (zfs_prop_get(zhp, ZFS_PROP_MOUNTPOINT, mountpoint,
@@ -494,40 +703,135 @@ int ZFSStateProvider::dataset_iter_callback(zfs_handle_t* zhp, void* data) {
                 info.path = mountpoint;
             }
 
-            collector->states->push_back(info);
+            walk->visited++;
+            keep_going = (*walk->visitor)(info);
         }
     }
 
     zfs_close(zhp);
-    return 0;
+    // A non-zero return stops zfs_iter_filesystems
+    return keep_going ? 0 : 1;
 }
 
-std::vector<StateInfo> ZFSStateProvider::list_states() {
-    std::vector<StateInfo> result;
-
+size_t ZFSStateProvider::for_each_state(const StateVisitor& fn) {
     if (!zfs_handle_) {
-        return result;
+        return 0;
     }
 
     std::string base = pool_ + "/" + base_dataset_;
     zfs_handle_t* base_zhp = open_dataset(base, ZFS_TYPE_FILESYSTEM);
     if (!base_zhp) {
-        return result;
+        return 0;
     }
 
-    DatasetCollector collector;
-    collector.states = &result;
-    collector.base_path = base;
-    collector.zfs_handle = zfs_handle_;
+    DatasetWalk walk;
+    walk.visitor = &fn;
+    walk.base_path = base;
 
-    zfs_iter_filesystems(base_zhp, dataset_iter_callback, &collector);
+    zfs_iter_filesystems(base_zhp, dataset_iter_callback, &walk);
     zfs_close(base_zhp);
 
-    return result;
+    return walk.visited;
+}
+
+std::vector<StateInfo> ZFSStateProvider::list_states() {
+    refresh_listing();
+    return listing_cache_.states;
+}
+
+bool ZFSStateProvider::read_inventory(CatalogData& data) const {
+    SharedCatalogReader reader(inventory_path_);
+    return reader.read([&data](const CatalogView& view) {
+        data = CatalogData{};
+        data.generation = view.generation();
+        for (size_t i = 0; i < view.state_count(); i++) {
+            data.states.push_back(view.to_state_info(view.state(i)));
+        }
+        for (size_t i = 0; i < view.snapshot_count(); i++) {
+            data.snapshots.push_back(view.to_snapshot_info(view.snapshot(i)));
+        }
+    });
+}
+
+void ZFSStateProvider::refresh_listing() {
+    if (!zfs_handle_) {
+        return;
+    }
+
+    // Capture the generation before walking, so a change during the walk
+    // makes the cached copy look stale rather than current
+    uint64_t generation = get_generation();
+    if (listing_cache_.has_states && listing_cache_.has_snapshots &&
+        listing_cache_.generation == generation) {
+        return;
+    }
+
+    CatalogData inventory;
+    bool have_inventory = read_inventory(inventory);
+    if (have_inventory && inventory.generation == generation) {
+        listing_cache_ = ListingCache{};
+        listing_cache_.generation = generation;
+        listing_cache_.states = std::move(inventory.states);
+        listing_cache_.snapshots = std::move(inventory.snapshots);
+        listing_cache_.has_states = true;
+        listing_cache_.has_snapshots = true;
+        listing_cache_.build_index();
+        return;
+    }
+
+    // snapshots_changed has one-second resolution, so a change time that
+    // isn't strictly before the walk may hide a later change in the same
+    // second. Such states are not trusted: the inventory stores them with a
+    // zero stamp, which never matches, so the next refresh re-reads them.
+    uint64_t walk_started = static_cast<uint64_t>(std::time(nullptr));
+
+    std::vector<StateInfo> states;
+    for_each_state([&states](const StateInfo& info) {
+        states.push_back(info);
+        return true;
+    });
+
+    // Straight to libzfs for changed states: the generation was checked
+    // above, and the cache being rebuilt can't answer anyway
+    std::vector<bool> trusted;
+    ListingCache fresh;
+    static_cast<StateListing&>(fresh) = merge_listing(
+        std::move(states), inventory.states, inventory.snapshots, walk_started,
+        [this](const std::string& state, std::vector<SnapshotInfo>& snapshots) {
+            walk_snapshots(state, 0, [&snapshots](const SnapshotInfo& info) {
+                snapshots.push_back(info);
+                return true;
+            });
+        },
+        trusted);
+    fresh.generation = generation;
+    fresh.has_states = true;
+    fresh.has_snapshots = true;
+
+    CatalogData data;
+    data.generation = generation;
+    data.states = fresh.states;
+    data.snapshots = fresh.snapshots;
+    for (size_t s = 0; s < data.states.size(); s++) {
+        if (!trusted[s]) {
+            data.states[s].snapshots_changed = 0;
+        }
+    }
+    data.assignments = list_assignments();
+
+    // Best-effort, like the fingerprint cache: a failed write only costs
+    // another walk next time
+    std::string error;
+    if (publish_shared_catalog(inventory_path_, data, error)) {
+        inventory_dirty_ = false;
+    }
+    listing_cache_ = std::move(fresh);
 }
 
 bool ZFSStateProvider::create_snapshot(const std::string& state_name,
                                          const std::string& snapshot_name) {
+    auto started = std::chrono::steady_clock::now();
+
     if (!zfs_handle_) {
         last_error_ = "libzfs not initialized";
         return false;
@@ -552,11 +856,15 @@ bool ZFSStateProvider::create_snapshot(const std::string& state_name,
         return false;
     }
 
+    note_mutation();
+    record_latency("create_snapshot", started);
     return true;
 }
 
 bool ZFSStateProvider::delete_snapshot(const std::string& state_name,
                                          const std::string& snapshot_name) {
+    auto started = std::chrono::steady_clock::now();
+
     if (!zfs_handle_) {
         last_error_ = "libzfs not initialized";
         return false;
@@ -578,11 +886,15 @@ bool ZFSStateProvider::delete_snapshot(const std::string& state_name,
         return false;
     }
 
+    note_mutation();
+    record_latency("delete_snapshot", started);
     return true;
 }
 
 bool ZFSStateProvider::restore_snapshot(const std::string& snapshot_name,
                                           const std::string& new_state_name) {
+    auto started = std::chrono::steady_clock::now();
+
     if (!zfs_handle_) {
         last_error_ = "libzfs not initialized";
         return false;
@@ -602,6 +914,7 @@ bool ZFSStateProvider::restore_snapshot(const std::string& snapshot_name,
 
     std::string dst_dataset = get_dataset_path(new_state_name);
     std::string dst_mount = get_mount_path(new_state_name);
+    utils::ProgressMeter meter("restore_snapshot", new_state_name);
 
     // Open the snapshot
     zfs_handle_t* snap_zhp = open_dataset(snap->full_name, ZFS_TYPE_SNAPSHOT);
@@ -617,6 +930,7 @@ bool ZFSStateProvider::restore_snapshot(const std::string& snapshot_name,
                       dst_mount.c_str());
 
     // Clone from snapshot
+    report_progress(meter, "clone");
     int ret = zfs_clone(snap_zhp, dst_dataset.c_str(), props);
     nvlist_free(props);
     zfs_close(snap_zhp);
@@ -626,6 +940,7 @@ bool ZFSStateProvider::restore_snapshot(const std::string& snapshot_name,
                       std::string(libzfs_error_description(zfs_handle_));
         return false;
     }
+    note_mutation();
 
     // Note: We intentionally do NOT promote the clone here.
     // Promoting would make the original state depend on the restored state's snapshot,
@@ -640,6 +955,7 @@ bool ZFSStateProvider::restore_snapshot(const std::string& snapshot_name,
     }
 
     // Explicitly mount the dataset (auto-mount may not work in all environments)
+    report_progress(meter, "mount");
     if (!zfs_is_mounted(clone_zhp, nullptr)) {
         ret = zfs_mount(clone_zhp, nullptr, 0);
         if (ret != 0) {
@@ -662,14 +978,16 @@ bool ZFSStateProvider::restore_snapshot(const std::string& snapshot_name,
         return false;
     }
 
+    record_latency("restore_snapshot", started);
     return true;
 }
 
 int ZFSStateProvider::snapshot_iter_callback(zfs_handle_t* zhp, void* data) {
-    auto* collector = static_cast<SnapshotCollector*>(data);
+    auto* walk = static_cast<SnapshotWalk*>(data);
 
     const char* full_name = zfs_get_name(zhp);
     std::string full_name_str(full_name);
+    bool keep_going = true;
 
     // Find @ separator
     size_t at_pos = full_name_str.find('@');
@@ -679,8 +997,8 @@ int ZFSStateProvider::snapshot_iter_callback(zfs_handle_t* zhp, void* data) {
 
         // Extract state name
         std::string state_name;
-        if (dataset.size() > collector->base_path.size() + 1) {
-            state_name = dataset.substr(collector->base_path.size() + 1);
+        if (dataset.size() > walk->base_path.size() + 1) {
+            state_name = dataset.substr(walk->base_path.size() + 1);
         }
 
         SnapshotInfo info;
@@ -688,6 +1006,7 @@ int ZFSStateProvider::snapshot_iter_callback(zfs_handle_t* zhp, void* data) {
         info.state_name = state_name;
         info.full_name = full_name_str;
         info.size_bytes = zfs_prop_get_int(zhp, ZFS_PROP_REFERENCED);
+        info.creation_unix = zfs_prop_get_int(zhp, ZFS_PROP_CREATION);
 
         // Get creation time
         char creation[64];
@@ -696,70 +1015,123 @@ int ZFSStateProvider::snapshot_iter_callback(zfs_handle_t* zhp, void* data) {
             info.creation_time = creation;
         }
 
-        collector->snapshots->push_back(info);
+        walk->visited++;
+        keep_going = (*walk->visitor)(info) &&
+                     (walk->limit == 0 || walk->visited < walk->limit);
     }
 
     zfs_close(zhp);
-    return 0;
+    // A non-zero return stops zfs_iter_snapshots (and is passed back to us)
+    return keep_going ? 0 : 1;
 }
 
-std::vector<SnapshotInfo> ZFSStateProvider::list_snapshots(
-    const std::string& state_name) {
-    std::vector<SnapshotInfo> result;
-
+size_t ZFSStateProvider::for_each_snapshot(const std::string& state_name,
+                                           size_t limit,
+                                           const SnapshotVisitor& fn) {
     if (!zfs_handle_) {
-        return result;
+        return 0;
     }
 
+    // A current listing (e.g. loaded from the inventory) answers without a walk
+    if (listing_cache_.has_snapshots && listing_cache_.generation == get_generation()) {
+        size_t visited = 0;
+        auto visit = [&](const SnapshotInfo& snap) {
+            visited++;
+            return fn(snap) && (limit == 0 || visited < limit);
+        };
+        if (state_name.empty()) {
+            for (const auto& snap : listing_cache_.snapshots) {
+                if (!visit(snap)) break;
+            }
+        } else if (auto it = listing_cache_.snapshots_by_state.find(state_name);
+                   it != listing_cache_.snapshots_by_state.end()) {
+            for (size_t i : it->second) {
+                if (!visit(listing_cache_.snapshots[i])) break;
+            }
+        }
+        return visited;
+    }
+
+    return walk_snapshots(state_name, limit, fn);
+}
+
+size_t ZFSStateProvider::walk_snapshots(const std::string& state_name,
+                                        size_t limit,
+                                        const SnapshotVisitor& fn) {
     std::string base = pool_ + "/" + base_dataset_;
     std::string target = state_name.empty() ? base : get_dataset_path(state_name);
 
     zfs_handle_t* zhp = open_dataset(target, ZFS_TYPE_FILESYSTEM);
     if (!zhp) {
-        return result;
+        return 0;
     }
 
-    SnapshotCollector collector;
-    collector.snapshots = &result;
-    collector.base_path = base;
+    SnapshotWalk walk;
+    walk.visitor = &fn;
+    walk.base_path = base;
+    walk.limit = limit;
 
     // If listing for a specific state, just iterate its snapshots
     // Otherwise, iterate all filesystems and their snapshots
     // Note: zfs_iter_snapshots takes (handle, simple, callback, data, min_txg, max_txg)
     // Use 0, 0 to iterate all snapshots without txg filtering
-    if (!state_name.empty()) {
-        zfs_iter_snapshots(zhp, B_FALSE, snapshot_iter_callback, &collector, 0, 0);
-    } else {
-        // Need to iterate all child filesystems and their snapshots
-        zfs_iter_snapshots(zhp, B_FALSE, snapshot_iter_callback, &collector, 0, 0);
+    int stopped = zfs_iter_snapshots(zhp, B_FALSE, snapshot_iter_callback, &walk, 0, 0);
 
-        // Also iterate child filesystems
+    if (state_name.empty() && stopped == 0) {
+        // Also iterate child filesystems, propagating an early stop upwards
         auto iter_children = [](zfs_handle_t* child_zhp, void* data) -> int {
-            auto* coll = static_cast<SnapshotCollector*>(data);
-            zfs_iter_snapshots(child_zhp, B_FALSE, snapshot_iter_callback, data, 0, 0);
+            int ret = zfs_iter_snapshots(child_zhp, B_FALSE, snapshot_iter_callback,
+                                         data, 0, 0);
             zfs_close(child_zhp);
-            return 0;
+            return ret;
         };
-        zfs_iter_filesystems(zhp, iter_children, &collector);
+        zfs_iter_filesystems(zhp, iter_children, &walk);
     }
 
     zfs_close(zhp);
+    return walk.visited;
+}
+
+std::vector<SnapshotInfo> ZFSStateProvider::list_snapshots(
+    const std::string& state_name) {
+    if (state_name.empty()) {
+        refresh_listing();
+        return listing_cache_.snapshots;
+    }
+
+    // One state: from the cache when it is current, otherwise a walk of
+    // that state alone rather than a refresh of the whole pool
+    std::vector<SnapshotInfo> result;
+    for_each_snapshot(state_name, 0, [&result](const SnapshotInfo& info) {
+        result.push_back(info);
+        return true;
+    });
     return result;
 }
 
 std::optional<SnapshotInfo> ZFSStateProvider::find_snapshot(
     const std::string& snapshot_name) {
-    auto snapshots = list_snapshots();
-    for (const auto& snap : snapshots) {
-        if (snap.name == snapshot_name) {
-            return snap;
+    if (listing_cache_.has_snapshots && listing_cache_.generation == get_generation()) {
+        auto it = listing_cache_.snapshot_index.find(snapshot_name);
+        if (it == listing_cache_.snapshot_index.end()) {
+            return std::nullopt;
         }
+        return listing_cache_.snapshots[it->second];
     }
-    return std::nullopt;
+
+    std::optional<SnapshotInfo> found;
+    for_each_snapshot("", 0, [&](const SnapshotInfo& snap) {
+        if (snap.name == snapshot_name) {
+            found = snap;
+            return false;
+        }
+        return true;
+    });
+    return found;
 }
 
 std::string ZFSStateProvider::get_slot_state(const std::string& slot_name) {
-    auto assignments = load_assignments();
+    const auto& assignments = load_assignments();
     auto it = assignments.find(slot_name);
     if (it != assignments.end()) {
         return it->second;
@@ -777,6 +1149,17 @@ bool ZFSStateProvider::assign_state(const std::string& slot_name,
         return false;
     }
 
+    // Held until the link is in place, so reconcile never sees the
+    // assignment without its state or link
+    AssignmentLock lock(assignments_file_);
+
+    auto user = is_state_in_use(state_name);
+    if (user && *user != slot_name) {
+        last_error_ = "State '" + state_name + "' is in use on " + *user +
+                      "; move that slot to another state first";
+        return false;
+    }
+
     // Create state if it doesn't exist
     if (!state_exists(state_name)) {
         if (!create_state(state_name)) {
@@ -791,6 +1174,7 @@ bool ZFSStateProvider::assign_state(const std::string& slot_name,
         last_error_ = "Failed to save assignments";
         return false;
     }
+    note_mutation();
 
     // Create symlink
     if (!create_state_symlink(slot_name, state_name)) {
@@ -800,9 +1184,39 @@ bool ZFSStateProvider::assign_state(const std::string& slot_name,
     return true;
 }
 
+bool ZFSStateProvider::swap_states(const std::string& slot_a, const std::string& slot_b) {
+    for (const auto& slot : {slot_a, slot_b}) {
+        if (std::find(slots_.begin(), slots_.end(), slot) == slots_.end()) {
+            last_error_ = "Invalid slot name: " + slot;
+            return false;
+        }
+    }
+    if (slot_a == slot_b) {
+        last_error_ = "Can't swap " + slot_a + " with itself";
+        return false;
+    }
+
+    AssignmentLock lock(assignments_file_);
+
+    // One save, so the states are never on both slots or on neither
+    auto assignments = load_assignments();
+    std::string state_a = get_slot_state(slot_a);
+    std::string state_b = get_slot_state(slot_b);
+    assignments[slot_a] = state_b;
+    assignments[slot_b] = state_a;
+    if (!save_assignments(assignments)) {
+        last_error_ = "Failed to save assignments";
+        return false;
+    }
+    note_mutation();
+
+    return create_state_symlink(slot_a, state_b) && create_state_symlink(slot_b, state_a);
+}
+
 std::vector<SlotAssignment> ZFSStateProvider::list_assignments() {
     std::vector<SlotAssignment> result;
-    auto assignments = load_assignments();
+    const auto& assignments = load_assignments();
+    result.reserve(slots_.size());
 
     for (const auto& slot : slots_) {
         SlotAssignment sa;
@@ -817,13 +1231,1194 @@ std::vector<SlotAssignment> ZFSStateProvider::list_assignments() {
 
 std::optional<std::string> ZFSStateProvider::is_state_in_use(
     const std::string& state_name) {
-    auto assignments = list_assignments();
-    for (const auto& a : assignments) {
-        if (a.state_name == state_name) {
-            return a.slot_name;
+    load_assignments();
+    auto it = state_slots_.find(state_name);
+    if (it == state_slots_.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+std::optional<ImageLocation> ZFSStateProvider::locate_image(
+    const std::string& name) {
+    if (!zfs_handle_) {
+        last_error_ = "libzfs not initialized";
+        return std::nullopt;
+    }
+
+    // Resolve the name to either a live state or a snapshot
+    ImageLocation location;
+    size_t at_pos = name.find('@');
+    if (at_pos != std::string::npos) {
+        location.state_name = name.substr(0, at_pos);
+        location.snapshot_name = name.substr(at_pos + 1);
+    } else if (state_exists(name)) {
+        location.state_name = name;
+    } else {
+        auto snap = find_snapshot(name);
+        if (!snap) {
+            last_error_ = "No state or snapshot named '" + name + "'";
+            return std::nullopt;
+        }
+        location.state_name = snap->state_name;
+        location.snapshot_name = snap->name;
+    }
+
+    location.image_path = location.snapshot_name.empty()
+        ? get_mount_path(location.state_name) + "/data.img"
+        : get_snapshot_image_path(location.state_name, location.snapshot_name);
+    return location;
+}
+
+std::optional<ChangedRanges> ZFSStateProvider::changed_ranges(const std::string& from,
+                                                            const std::string& to) {
+    auto from_loc = locate_image(from);
+    auto to_loc = locate_image(to);
+    if (!from_loc || !to_loc) {
+        return std::nullopt;
+    }
+    if (from_loc->snapshot_name.empty() || to_loc->snapshot_name.empty()) {
+        last_error_ = "Changed ranges are found between two snapshots";
+        return std::nullopt;
+    }
+    if (from_loc->state_name != to_loc->state_name) {
+        last_error_ = "'" + from + "' and '" + to + "' are snapshots of different states";
+        return std::nullopt;
+    }
+
+    struct stat from_st;
+    struct stat to_st;
+    if (stat(from_loc->image_path.c_str(), &from_st) != 0 ||
+        stat(to_loc->image_path.c_str(), &to_st) != 0) {
+        last_error_ = std::string("Failed to stat snapshot image: ") + std::strerror(errno);
+        return std::nullopt;
+    }
+
+    ChangedRanges ranges;
+    std::string dataset = get_dataset_path(from_loc->state_name);
+    std::string from_full = dataset + "@" + from_loc->snapshot_name;
+    std::string to_full = dataset + "@" + to_loc->snapshot_name;
+    ranges.from = from_loc->state_name + "@" + from_loc->snapshot_name;
+    ranges.to = to_loc->state_name + "@" + to_loc->snapshot_name;
+    ranges.image_size = static_cast<uint64_t>(to_st.st_size);
+
+    // A ZFS file's inode number is its object number in the stream. A
+    // different one means data.img was replaced (e.g. a slot image swap),
+    // and the new file shares nothing with the old
+    if (from_st.st_ino != to_st.st_ino) {
+        ranges.replaced = true;
+        ranges.extents.push_back(ChangedExtent{0, ranges.image_size, false});
+        return ranges;
+    }
+    const uint64_t object = static_cast<uint64_t>(to_st.st_ino);
+
+    // Compressed and embedded blocks as stored, so the stream is as small
+    // as it can be; only the record headers are looked at
+    auto flags = static_cast<lzc_send_flags>(LZC_SEND_FLAG_EMBED_DATA |
+                                             LZC_SEND_FLAG_LARGE_BLOCK |
+                                             LZC_SEND_FLAG_COMPRESS);
+    uint64_t estimate = 0;
+    lzc_send_space(to_full.c_str(), from_full.c_str(), flags, &estimate);
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        last_error_ = std::string("Failed to create pipe: ") + std::strerror(errno);
+        return std::nullopt;
+    }
+    int send_rc = 0;
+    std::thread sender([&] {
+        send_rc = lzc_send(to_full.c_str(), from_full.c_str(), fds[1], flags);
+        close(fds[1]);
+    });
+
+    utils::ProgressMeter meter("changed_ranges", ranges.to);
+    std::vector<std::pair<uint64_t, uint64_t>> written;
+    std::vector<std::pair<uint64_t, uint64_t>> freed;
+    std::string error;
+    bool parsed = utils::scan_send_stream(fds[0], [&](const utils::SendRange& range) {
+        if (range.object != object || range.offset >= ranges.image_size) {
+            return;
+        }
+        uint64_t end = range.length > ranges.image_size - range.offset
+            ? ranges.image_size
+            : range.offset + range.length;
+        (range.freed ? freed : written).emplace_back(range.offset, end);
+    }, error, [&](uint64_t consumed) {
+        report_progress(meter, "scan", consumed, std::max(estimate, consumed));
+    });
+    sender.join();
+    close(fds[0]);
+
+    if (send_rc != 0) {
+        last_error_ = send_rc == EXDEV
+            ? "'" + ranges.from + "' is not an earlier snapshot than '" + ranges.to + "'"
+            : "Incremental send failed: " + std::string(std::strerror(send_rc));
+        return std::nullopt;
+    }
+    if (!parsed) {
+        last_error_ = error;
+        return std::nullopt;
+    }
+
+    // Records come in object order but a FREE can cover blocks that are
+    // written again later in the stream; written wins
+    auto coalesce = [](std::vector<std::pair<uint64_t, uint64_t>>& list) {
+        std::sort(list.begin(), list.end());
+        std::vector<std::pair<uint64_t, uint64_t>> merged;
+        for (const auto& r : list) {
+            if (!merged.empty() && r.first <= merged.back().second) {
+                merged.back().second = std::max(merged.back().second, r.second);
+            } else {
+                merged.push_back(r);
+            }
+        }
+        list.swap(merged);
+    };
+    coalesce(written);
+    coalesce(freed);
+
+    size_t w = 0;
+    for (auto [start, end] : freed) {
+        while (w < written.size() && written[w].second <= start) {
+            w++;
+        }
+        for (size_t i = w; i < written.size() && written[i].first < end; i++) {
+            if (written[i].first > start) {
+                ranges.extents.push_back(ChangedExtent{start, written[i].first - start, true});
+            }
+            start = std::max(start, written[i].second);
+        }
+        if (start < end) {
+            ranges.extents.push_back(ChangedExtent{start, end - start, true});
+        }
+    }
+    for (const auto& [start, end] : written) {
+        ranges.extents.push_back(ChangedExtent{start, end - start, false});
+    }
+    std::sort(ranges.extents.begin(), ranges.extents.end(),
+              [](const auto& a, const auto& b) { return a.offset < b.offset; });
+
+    ranges.stream_bytes = meter.get().bytes_done;
+    return ranges;
+}
+
+bool ZFSStateProvider::inject_files(const std::string& state_name,
+                                    const std::vector<FileInjection>& files) {
+    auto started = std::chrono::steady_clock::now();
+
+    if (!state_exists(state_name)) {
+        last_error_ = "State '" + state_name + "' doesn't exist";
+        return false;
+    }
+
+    // Check the whole batch before the image is opened for writing, so a
+    // bad entry anywhere leaves the image untouched
+    std::vector<uint32_t> modes;
+    uint64_t total_bytes = 0;
+    for (const auto& file : files) {
+        struct stat st;
+        if (::stat(file.source_path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            last_error_ = "Not a regular file: " + file.source_path;
+            return false;
+        }
+        const std::string& dest = file.dest_path;
+        if (dest.empty() || dest[0] != '/' || dest.back() == '/') {
+            last_error_ = "Destination must be an absolute file path: " + dest;
+            return false;
+        }
+        modes.push_back(file.mode ? *file.mode : (st.st_mode & 07777));
+        total_bytes += static_cast<uint64_t>(st.st_size);
+    }
+
+    std::string image_path = get_mount_path(state_name) + "/data.img";
+    Ext4Image image(image_path);
+    if (!image.open(true)) {
+        last_error_ = image.get_last_error();
+        return false;
+    }
+    // Writing around an unreplayed journal would corrupt the filesystem
+    if (image.needs_recovery()) {
+        last_error_ = "Filesystem in " + image_path + " needs journal recovery; "
+                      "boot the state once or run e2fsck first";
+        return false;
+    }
+    // Conservative: blocks of files being replaced are not counted as free
+    auto free = image.free_bytes();
+    if (free && total_bytes > *free) {
+        last_error_ = "Files need " + std::to_string(total_bytes) + " bytes but " +
+                      image_path + " has " + std::to_string(*free) + " free";
+        return false;
+    }
+
+    for (size_t i = 0; i < files.size(); i++) {
+        const auto& file = files[i];
+        if (!image.write_file(file.dest_path, file.source_path, modes[i], file.uid, file.gid)) {
+            last_error_ = image.get_last_error();
+            return false;
+        }
+    }
+
+    if (!image.close()) {
+        last_error_ = image.get_last_error();
+        return false;
+    }
+
+    record_latency("inject_files", started);
+    return true;
+}
+
+std::optional<FingerprintInfo> ZFSStateProvider::fingerprint(
+    const std::string& name) {
+    auto location = locate_image(name);
+    if (!location) {
+        return std::nullopt;
+    }
+    const std::string& state_name = location->state_name;
+    const std::string& snapshot_name = location->snapshot_name;
+
+    FingerprintInfo info;
+    info.name = name;
+    info.cached = false;
+    info.size_bytes = 0;
+
+    // Live states change under us, so only snapshots are cached (by GUID,
+    // which survives renames and is never reused for different contents)
+    std::string guid;
+    info.image_path = location->image_path;
+    if (!snapshot_name.empty()) {
+        std::string full_snap = get_dataset_path(state_name) + "@" + snapshot_name;
+        zfs_handle_t* zhp = open_dataset(full_snap, ZFS_TYPE_SNAPSHOT);
+        if (!zhp) {
+            last_error_ = "Snapshot '" + full_snap + "' not found";
+            return std::nullopt;
+        }
+        guid = std::to_string(zfs_prop_get_int(zhp, ZFS_PROP_GUID));
+        zfs_close(zhp);
+    }
+
+    std::string cache_file = cache_dir_ + "/fingerprints.json";
+    std::map<std::string, std::string> cache;
+    if (!guid.empty()) {
+        auto loaded = utils::read_json_file(cache_file);
+        if (loaded) {
+            cache = *loaded;
+        }
+        // Entries are stored as "<hash> <size>"
+        auto it = cache.find(guid);
+        if (it != cache.end()) {
+            std::istringstream entry(it->second);
+            if (entry >> info.hash >> info.size_bytes) {
+                info.cached = true;
+                return info;
+            }
+        }
+    }
+
+    std::error_code ec;
+    auto size = fs::file_size(info.image_path, ec);
+    if (ec) {
+        last_error_ = "Cannot read image " + info.image_path + ": " + ec.message();
+        return std::nullopt;
+    }
+    info.size_bytes = size;
+
+    std::string hash_error;
+    utils::ProgressMeter meter("fingerprint", name);
+    auto digest = utils::blake3_file(info.image_path, 0, hash_error,
+                                     [&](uint64_t done, uint64_t total) {
+        report_progress(meter, "hash", done, total);
+    });
+    if (!digest) {
+        last_error_ = hash_error;
+        return std::nullopt;
+    }
+    info.hash = utils::to_hex(*digest);
+
+    if (!guid.empty()) {
+        // Caching is best-effort; a failed write only costs a rehash later
+        fs::create_directories(cache_dir_, ec);
+        cache[guid] = info.hash + " " + std::to_string(info.size_bytes);
+        utils::write_json_file(cache_file, cache);
+    }
+
+    return info;
+}
+
+bool ZFSStateProvider::load_reclaim_chains(const std::string& state_name,
+                                           std::vector<ReclaimChain>& chains) {
+    std::vector<std::string> states;
+    if (!state_name.empty()) {
+        states.push_back(state_name);
+    } else {
+        for_each_state([&](const StateInfo& s) {
+            states.push_back(s.name);
+            return true;
+        });
+    }
+
+    for (const auto& name : states) {
+        zfs_handle_t* zhp = open_dataset(get_dataset_path(name), ZFS_TYPE_FILESYSTEM);
+        if (!zhp) {
+            last_error_ = "State '" + name + "' doesn't exist";
+            return false;
+        }
+        ReclaimChain chain;
+        chain.state_name = name;
+        // Sorted by createtxg, which is the order snaprange space is defined on
+        zfs_iter_snapshots_sorted(zhp, reclaim_iter_callback, &chain, 0, 0);
+        zfs_close(zhp);
+        if (!chain.snapshots.empty()) {
+            chains.push_back(std::move(chain));
+        }
+    }
+    return true;
+}
+
+int ZFSStateProvider::reclaim_iter_callback(zfs_handle_t* zhp, void* data) {
+    auto* chain = static_cast<ReclaimChain*>(data);
+
+    std::string full_name = zfs_get_name(zhp);
+    ReclaimChain::Snapshot snap;
+    snap.full_name = full_name;
+    snap.name = full_name.substr(full_name.find('@') + 1);
+    snap.used_bytes = zfs_prop_get_int(zhp, ZFS_PROP_USED);
+    // Clone origins and held snapshots can't be destroyed
+    snap.pinned = zfs_prop_get_int(zhp, ZFS_PROP_NUMCLONES) > 0 ||
+                  zfs_prop_get_int(zhp, ZFS_PROP_USERREFS) > 0;
+    chain->snapshots.push_back(std::move(snap));
+
+    zfs_close(zhp);
+    return 0;
+}
+
+std::optional<ReclaimPlan> ZFSStateProvider::plan_reclaim(uint64_t target_bytes,
+                                                          const std::string& state_name) {
+    if (!zfs_handle_) {
+        last_error_ = "libzfs not initialized";
+        return std::nullopt;
+    }
+
+    std::vector<ReclaimChain> chains;
+    if (!load_reclaim_chains(state_name, chains)) {
+        return std::nullopt;
+    }
+
+    ReclaimPlan plan{};
+    plan.target_bytes = target_bytes;
+
+    // Every contiguous range of unpinned snapshots, up to RECLAIM_MAX_RANGE
+    // long. Destroying a range frees the blocks born after the snapshot
+    // before it and freed before the one after it, which can be far more
+    // than the sum of the snapshots' own USED.
+    struct Candidate {
+        size_t chain;
+        size_t first;
+        size_t last;        // Inclusive
+        uint64_t bytes;
+    };
+    std::vector<Candidate> candidates;
+
+    for (size_t c = 0; c < chains.size(); c++) {
+        const auto& snaps = chains[c].snapshots;
+        for (size_t first = 0; first < snaps.size(); first++) {
+            if (snaps[first].pinned) {
+                plan.pinned.push_back(snaps[first].full_name);
+                continue;
+            }
+            for (size_t last = first;
+                 last < snaps.size() && !snaps[last].pinned &&
+                 last - first < RECLAIM_MAX_RANGE;
+                 last++) {
+                uint64_t bytes = snaps[first].used_bytes;
+                // lzc calls return the error rather than setting errno
+                int err = last == first ? 0 : lzc_snaprange_space(
+                                                  snaps[first].full_name.c_str(),
+                                                  snaps[last].full_name.c_str(), &bytes);
+                if (err != 0) {
+                    last_error_ = "Failed to compute space for " + snaps[first].full_name +
+                                  "%" + snaps[last].name + ": " + std::strerror(err);
+                    return std::nullopt;
+                }
+                if (bytes > 0) {
+                    candidates.push_back({c, first, last, bytes});
+                }
+            }
+        }
+    }
+
+    // Chosen ranges must be separated by a kept snapshot, otherwise they
+    // would really be one larger range and their space wouldn't add up
+    std::vector<std::vector<bool>> blocked(chains.size());
+    for (size_t c = 0; c < chains.size(); c++) {
+        blocked[c].assign(chains[c].snapshots.size(), false);
+    }
+    auto usable = [&](const Candidate& cand) {
+        size_t lo = cand.first > 0 ? cand.first - 1 : 0;
+        size_t hi = std::min(cand.last + 1, blocked[cand.chain].size() - 1);
+        for (size_t i = lo; i <= hi; i++) {
+            if (blocked[cand.chain][i]) return false;
+        }
+        return true;
+    };
+
+    std::vector<const Candidate*> chosen;
+    while (plan.freed_bytes < target_bytes) {
+        uint64_t remaining = target_bytes - plan.freed_bytes;
+        const Candidate* finisher = nullptr;
+        const Candidate* best = nullptr;
+        for (const auto& cand : candidates) {
+            if (!usable(cand)) continue;
+            size_t count = cand.last - cand.first + 1;
+            if (cand.bytes >= remaining) {
+                // Fewest snapshots that finish the job, then most space
+                size_t best_count = finisher ? finisher->last - finisher->first + 1 : 0;
+                if (!finisher || count < best_count ||
+                    (count == best_count && cand.bytes > finisher->bytes)) {
+                    finisher = &cand;
+                }
+            }
+            // Otherwise the most space per deleted snapshot
+            if (!best ||
+                cand.bytes * (best->last - best->first + 1) >
+                    best->bytes * count) {
+                best = &cand;
+            }
+        }
+
+        const Candidate* pick = finisher ? finisher : best;
+        if (!pick) break;
+        chosen.push_back(pick);
+        plan.freed_bytes += pick->bytes;
+        for (size_t i = pick->first; i <= pick->last; i++) {
+            blocked[pick->chain][i] = true;
+        }
+    }
+    plan.reaches_target = plan.freed_bytes >= target_bytes;
+
+    std::sort(chosen.begin(), chosen.end(), [](const Candidate* a, const Candidate* b) {
+        return a->chain != b->chain ? a->chain < b->chain : a->first < b->first;
+    });
+    for (const auto* cand : chosen) {
+        ReclaimDeletion deletion;
+        deletion.state_name = chains[cand->chain].state_name;
+        deletion.freed_bytes = cand->bytes;
+        for (size_t i = cand->first; i <= cand->last; i++) {
+            deletion.snapshots.push_back(chains[cand->chain].snapshots[i].name);
+        }
+        plan.deletions.push_back(std::move(deletion));
+    }
+
+    return plan;
+}
+
+bool ZFSStateProvider::execute_reclaim(const ReclaimPlan& plan) {
+    auto started = std::chrono::steady_clock::now();
+
+    if (!zfs_handle_) {
+        last_error_ = "libzfs not initialized";
+        return false;
+    }
+    if (plan.deletions.empty()) {
+        return true;
+    }
+
+    nvlist_t* snaps = nullptr;
+    if (nvlist_alloc(&snaps, NV_UNIQUE_NAME, 0) != 0) {
+        last_error_ = "Failed to allocate nvlist";
+        return false;
+    }
+    for (const auto& deletion : plan.deletions) {
+        for (const auto& name : deletion.snapshots) {
+            nvlist_add_boolean(snaps, (get_dataset_path(deletion.state_name) + "@" + name).c_str());
+        }
+    }
+
+    // One ioctl destroys the whole set atomically
+    int ret = zfs_destroy_snaps_nvl(zfs_handle_, snaps, B_FALSE);
+    nvlist_free(snaps);
+
+    if (ret != 0) {
+        last_error_ = "Failed to destroy snapshots: " +
+                      std::string(libzfs_error_description(zfs_handle_));
+        return false;
+    }
+
+    note_mutation();
+    record_latency("reclaim", started);
+    return true;
+}
+
+int ZFSStateProvider::reconcile_iter_callback(zfs_handle_t* zhp, void* data) {
+    auto* walk = static_cast<ReconcileWalk*>(data);
+
+    std::string name = zfs_get_name(zhp);
+    if (name.find('@') != std::string::npos) {
+        walk->snapshots++;
+        std::string snap_name = name.substr(name.find('@') + 1);
+        if (snap_name.rfind("clone-for-", 0) == 0) {
+            ReconcileWalk::CloneSnapshot snap;
+            snap.full_name = name;
+            snap.dest = snap_name.substr(std::strlen("clone-for-"));
+            snap.clones = zfs_prop_get_int(zhp, ZFS_PROP_NUMCLONES);
+            snap.holds = zfs_prop_get_int(zhp, ZFS_PROP_USERREFS);
+            snap.creation = zfs_prop_get_int(zhp, ZFS_PROP_CREATION);
+            walk->clone_snapshots.push_back(std::move(snap));
+        }
+    } else {
+        // A state: record it and walk its snapshots (nested datasets skipped)
+        std::string state_name = name.substr(walk->base_path.size() + 1);
+        if (state_name.find('/') == std::string::npos) {
+            walk->states.insert(state_name);
+            zfs_iter_snapshots(zhp, B_FALSE, reconcile_iter_callback, data, 0, 0);
+        }
+    }
+
+    zfs_close(zhp);
+    return 0;
+}
+
+std::optional<ReconcileReport> ZFSStateProvider::reconcile(bool repair,
+                                                           uint64_t min_age_seconds) {
+    auto started = std::chrono::steady_clock::now();
+
+    if (!zfs_handle_) {
+        last_error_ = "libzfs not initialized";
+        return std::nullopt;
+    }
+
+    // A repairing pass holds the assignment lock from the scan to the last
+    // repair: an assign that ran in between could otherwise have its new
+    // state, assignment or link undone. Only temp files and orphan
+    // snapshots rely on --min-age.
+    std::optional<AssignmentLock> lock;
+    if (repair) {
+        lock.emplace(assignments_file_);
+    }
+
+    ReconcileWalk walk;
+    walk.base_path = pool_ + "/" + base_dataset_;
+    zfs_handle_t* base_zhp = open_dataset(walk.base_path, ZFS_TYPE_FILESYSTEM);
+    if (!base_zhp) {
+        last_error_ = "Failed to open " + walk.base_path + ": " +
+                      std::string(libzfs_error_description(zfs_handle_));
+        return std::nullopt;
+    }
+
+    uint64_t now = static_cast<uint64_t>(std::time(nullptr));
+    auto old_enough = [&](uint64_t unix_time) {
+        return unix_time <= now && now - unix_time >= min_age_seconds;
+    };
+
+    // What each slot directory holds
+    struct SlotScan {
+        std::string slot;
+        bool is_link = false;
+        std::string link_target;
+        bool has_image = false;         // data.img exists (link or file)
+        bool has_backup = false;
+        bool has_staged_image = false;  // Regular data.img.tmp (older assigns)
+    };
+    struct TempFile {
+        std::string path;
+        uint64_t mtime;
+    };
+    std::vector<SlotScan> slot_scans(slots_.size());
+    std::vector<TempFile> temp_files;
+
+    // The filesystem side is independent of the pool, so it is scanned on
+    // its own thread while libzfs walks the datasets
+    std::thread fs_scan([&] {
+        // Regular files from write-then-rename; in slot directories only
+        // links staged for a swap, since a file there may be a slot image
+        auto add_temp = [&](const std::string& path, bool links_only = false) {
+            struct stat st;
+            if (lstat(path.c_str(), &st) == 0 &&
+                (S_ISLNK(st.st_mode) || (S_ISREG(st.st_mode) && !links_only))) {
+                temp_files.push_back({path, static_cast<uint64_t>(st.st_mtim.tv_sec)});
+            }
+        };
+        auto add_temps_in = [&](const std::string& dir, bool links_only = false) {
+            std::error_code ec;
+            for (const auto& entry : fs::directory_iterator(dir, ec)) {
+                std::string name = entry.path().filename().string();
+                if (name.size() > 4 && name.ends_with(".tmp")) {
+                    add_temp(entry.path().string(), links_only);
+                }
+            }
+        };
+
+        for (size_t i = 0; i < slots_.size(); i++) {
+            SlotScan& scan = slot_scans[i];
+            scan.slot = slots_[i];
+            std::string slot_data = get_slot_dir(scan.slot) + "/data.img";
+
+            struct stat st;
+            if (lstat(slot_data.c_str(), &st) == 0) {
+                scan.has_image = true;
+                if (S_ISLNK(st.st_mode)) {
+                    std::error_code ec;
+                    scan.is_link = true;
+                    scan.link_target = fs::read_symlink(slot_data, ec).string();
+                }
+            }
+            scan.has_backup = lstat((slot_data + ".backup").c_str(), &st) == 0;
+            scan.has_staged_image = lstat((slot_data + ".tmp").c_str(), &st) == 0 &&
+                                    S_ISREG(st.st_mode);
+            add_temps_in(get_slot_dir(scan.slot), true);
+        }
+
+        // Files written with write-then-rename by this provider
+        add_temp(assignments_file_ + ".tmp");
+        add_temp(catalog_path_ + ".tmp");
+        add_temps_in(cache_dir_);
+    });
+
+    zfs_iter_filesystems(base_zhp, reconcile_iter_callback, &walk);
+    zfs_close(base_zhp);
+    fs_scan.join();
+
+    ReconcileReport report;
+    report.states_scanned = walk.states.size();
+    report.snapshots_scanned = walk.snapshots;
+    report.slots_scanned = slots_.size();
+
+    // States whose lazy restore died before hydrating: data.img still
+    // links to an nbd device nobody serves and the fetched blocks are in
+    // data.img.partial. The image is unusable without its server, so the
+    // state is deleted as the restore would have done. They count as gone
+    // for the assignment and link checks below.
+    std::vector<size_t> orphan_restores;
+    for (auto it = walk.states.begin(); it != walk.states.end();) {
+        std::string image = get_mount_path(*it) + "/data.img";
+        std::string target;
+        struct stat st;
+        if (lstat((image + ".partial").c_str(), &st) == 0 &&
+            lstat(image.c_str(), &st) == 0 && S_ISLNK(st.st_mode)) {
+            std::error_code ec;
+            target = fs::read_symlink(image, ec).string();
+        }
+        if (!target.starts_with("/dev/nbd") || nbd_served(target)) {
+            ++it;
+            continue;
+        }
+        orphan_restores.push_back(report.items.size());
+        report.items.push_back({"orphan-lazy-restore", *it,
+                                "data.img -> " + target + " (not served), data.img.partial "
+                                "present", "delete state", false, ""});
+        it = walk.states.erase(it);
+    }
+
+    // Clone snapshots whose clone was never created (or was deleted without
+    // its origin snapshot); destroyed together in one batch
+    std::vector<size_t> orphan_items;
+    for (const auto& snap : walk.clone_snapshots) {
+        if (snap.clones > 0 || snap.holds > 0 || walk.states.count(snap.dest) ||
+            !old_enough(snap.creation)) {
+            continue;
+        }
+        orphan_items.push_back(report.items.size());
+        report.items.push_back({"orphan-snapshot", snap.full_name,
+                                "no clone and state '" + snap.dest + "' doesn't exist",
+                                "destroy snapshot", false, ""});
+    }
+
+    // Assignments to unknown slots or to states that no longer exist
+    auto assignments = load_assignments();
+    bool assignments_changed = false;
+    std::set<std::string> known_slots(slots_.begin(), slots_.end());
+    for (auto it = assignments.begin(); it != assignments.end();) {
+        bool known_slot = known_slots.count(it->first) != 0;
+        if (known_slot && walk.states.count(it->second)) {
+            ++it;
+            continue;
+        }
+        ReconcileItem item{"stale-assignment", it->first, "", "remove assignment", false, ""};
+        item.detail = known_slot ? "assigned state '" + it->second + "' doesn't exist"
+                                 : "unknown slot (assigned '" + it->second + "')";
+        if (known_slot) {
+            item.action += " (slot falls back to '" + it->first + "')";
+        }
+        report.items.push_back(std::move(item));
+        it = assignments.erase(it);
+        assignments_changed = true;
+    }
+
+    // Slot images: each slot's data.img should link to its assigned state
+    std::vector<std::pair<size_t, std::string>> relinks;     // Item, state
+    std::vector<size_t> unlinks;
+    std::vector<size_t> backup_restores;
+    for (const auto& scan : slot_scans) {
+        auto assigned = assignments.find(scan.slot);
+        std::string expected_state = assigned != assignments.end() ? assigned->second : scan.slot;
+        bool expected_exists = walk.states.count(expected_state) > 0;
+        std::string expected_target = get_mount_path(expected_state) + "/data.img";
+
+        if (scan.is_link && scan.link_target != expected_target) {
+            // A state's image may not exist until first boot, so a link is
+            // only dangling when the state directory itself is gone
+            std::error_code ec;
+            bool dangling = !fs::exists(fs::path(scan.link_target).parent_path(), ec);
+            if (expected_exists) {
+                relinks.emplace_back(report.items.size(), expected_state);
+                report.items.push_back({dangling ? "dangling-symlink" : "mismatched-symlink",
+                                        scan.slot, "data.img -> " + scan.link_target,
+                                        "link to state '" + expected_state + "'", false, ""});
+            } else if (dangling) {
+                unlinks.push_back(report.items.size());
+                report.items.push_back({"dangling-symlink", scan.slot,
+                                        "data.img -> " + scan.link_target,
+                                        "remove link", false, ""});
+            }
+        }
+
+        if (scan.has_backup) {
+            if (!scan.has_image) {
+                // Interrupted between moving the image aside and linking
+                if (expected_exists) {
+                    relinks.emplace_back(report.items.size(), expected_state);
+                    report.items.push_back({"image-backup", scan.slot,
+                                            "data.img missing, data.img.backup present",
+                                            "link to state '" + expected_state + "'",
+                                            false, ""});
+                } else {
+                    backup_restores.push_back(report.items.size());
+                    report.items.push_back({"image-backup", scan.slot,
+                                            "data.img missing, data.img.backup present",
+                                            "restore data.img from backup", false, ""});
+                }
+            } else {
+                // The only copy of the slot's pre-state image; never removed
+                report.items.push_back({"image-backup", scan.slot,
+                                        "data.img.backup left by an earlier assign",
+                                        "keep (remove by hand once unneeded)", false, ""});
+            }
+        }
+
+        if (scan.has_staged_image) {
+            // Assigns that swapped a regular image out through data.img.tmp
+            // could stop with the slot's only image there
+            report.items.push_back({"image-backup", scan.slot,
+                                    "data.img.tmp is a regular file, possibly the slot's image",
+                                    "keep (move aside by hand)", false, ""});
+        }
+    }
+
+    std::vector<size_t> temp_items;
+    for (const auto& temp : temp_files) {
+        if (!old_enough(temp.mtime)) {
+            continue;
+        }
+        temp_items.push_back(report.items.size());
+        report.items.push_back({"stale-temp-file", temp.path,
+                                "left by an interrupted write-then-rename or link swap",
+                                "remove file", false, ""});
+    }
+
+    if (!repair) {
+        return report;
+    }
+
+    for (size_t index : orphan_restores) {
+        auto& item = report.items[index];
+        item.repaired = delete_state(item.target, true);
+        if (!item.repaired) item.error = last_error_;
+    }
+    if (assignments_changed) {
+        bool saved = save_assignments(assignments);
+        for (auto& item : report.items) {
+            if (item.kind == "stale-assignment") {
+                item.repaired = saved;
+                if (!saved) item.error = "Failed to save assignments";
+            }
+        }
+        if (saved) {
+            note_mutation();
+        }
+    }
+
+    for (const auto& [index, state] : relinks) {
+        auto& item = report.items[index];
+        item.repaired = create_state_symlink(item.target, state);
+        if (!item.repaired) item.error = last_error_;
+    }
+    for (size_t index : unlinks) {
+        auto& item = report.items[index];
+        std::error_code ec;
+        fs::remove(get_slot_dir(item.target) + "/data.img", ec);
+        item.repaired = !ec;
+        if (ec) item.error = ec.message();
+    }
+    for (size_t index : backup_restores) {
+        auto& item = report.items[index];
+        std::string slot_data = get_slot_dir(item.target) + "/data.img";
+        std::error_code ec;
+        fs::rename(slot_data + ".backup", slot_data, ec);
+        item.repaired = !ec;
+        if (ec) item.error = ec.message();
+    }
+    for (size_t index : temp_items) {
+        auto& item = report.items[index];
+        if (unlink(item.target.c_str()) == 0 || errno == ENOENT) {
+            item.repaired = true;
+        } else {
+            item.error = std::strerror(errno);
+        }
+    }
+
+    if (!orphan_items.empty()) {
+        nvlist_t* snaps = nullptr;
+        if (nvlist_alloc(&snaps, NV_UNIQUE_NAME, 0) == 0) {
+            for (size_t index : orphan_items) {
+                nvlist_add_boolean(snaps, report.items[index].target.c_str());
+            }
+            // One ioctl for the whole set, as in execute_reclaim
+            int ret = zfs_destroy_snaps_nvl(zfs_handle_, snaps, B_FALSE);
+            nvlist_free(snaps);
+            std::string destroy_error = ret == 0 ? "" : libzfs_error_description(zfs_handle_);
+            for (size_t index : orphan_items) {
+                report.items[index].repaired = ret == 0;
+                report.items[index].error = destroy_error;
+            }
+            if (ret == 0) {
+                note_mutation();
+            }
+        } else {
+            for (size_t index : orphan_items) {
+                report.items[index].error = "Failed to allocate nvlist";
+            }
+        }
+    }
+
+    record_latency("reconcile", started);
+    return report;
+}
+
+void ZFSStateProvider::set_progress_callback(ProgressCallback fn) {
+    progress_ = std::move(fn);
+}
+
+bool ZFSStateProvider::wait_for_freeing(std::chrono::milliseconds timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    utils::ProgressMeter meter("wait_for_freeing", pool_);
+    uint64_t total = 0;
+
+    while (true) {
+        auto freeing = get_pool_freeing();
+        if (!freeing) {
+            last_error_ = "Failed to open pool '" + pool_ + "'";
+            return false;
+        }
+        // Other destroys can add to the backlog while we wait
+        total = std::max(total, *freeing);
+        if (!report_progress(meter, "freeing", total - *freeing, total)) {
+            return *freeing == 0;
+        }
+        if (*freeing == 0) {
+            return true;
+        }
+        if (std::chrono::steady_clock::now() >= deadline) {
+            last_error_ = "Timed out with " + std::to_string(*freeing) +
+                          " bytes still being freed";
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    }
+}
+
+zpool_handle_t* ZFSStateProvider::open_pool_stats(nvlist_t** vdev_tree) {
+    zpool_handle_t* zph = zfs_handle_ ? zpool_open(zfs_handle_, pool_.c_str()) : nullptr;
+    if (!zph) {
+        last_error_ = "Failed to open pool '" + pool_ + "'";
+        return nullptr;
+    }
+    boolean_t missing = B_FALSE;
+    zpool_refresh_stats(zph, &missing);
+    nvlist_t* config = zpool_get_config(zph, nullptr);
+    if (!config || nvlist_lookup_nvlist(config, ZPOOL_CONFIG_VDEV_TREE, vdev_tree) != 0) {
+        last_error_ = "Pool '" + pool_ + "' has no vdev tree";
+        zpool_close(zph);
+        return nullptr;
+    }
+    return zph;
+}
+
+void ZFSStateProvider::collect_trim_status(nvlist_t* vdev, PoolScanStatus& status,
+                                           size_t& leaves, size_t& active,
+                                           size_t& complete) {
+    nvlist_t** children = nullptr;
+    unsigned count = 0;
+    if (nvlist_lookup_nvlist_array(vdev, ZPOOL_CONFIG_CHILDREN, &children, &count) == 0) {
+        for (unsigned i = 0; i < count; i++) {
+            collect_trim_status(children[i], status, leaves, active, complete);
+        }
+        return;
+    }
+
+    uint64_t* raw = nullptr;
+    unsigned words = 0;
+    if (nvlist_lookup_uint64_array(vdev, ZPOOL_CONFIG_VDEV_STATS, &raw, &words) != 0) {
+        return;
+    }
+    const auto* vs = reinterpret_cast<const vdev_stat_t*>(raw);
+    leaves++;
+    if (vs->vs_trim_notsup) {
+        return;
+    }
+    status.supported = true;
+    status.bytes_done += vs->vs_trim_bytes_done;
+    status.bytes_total += vs->vs_trim_bytes_est;
+    switch (vs->vs_trim_state) {
+    case VDEV_TRIM_ACTIVE:
+        active++;
+        status.running = true;
+        status.started_unix = std::max(status.started_unix, vs->vs_trim_action_time);
+        break;
+    case VDEV_TRIM_SUSPENDED:
+        status.running = true;
+        break;
+    case VDEV_TRIM_COMPLETE:
+        complete++;
+        status.finished_unix = std::max(status.finished_unix, vs->vs_trim_action_time);
+        break;
+    default:
+        break;
+    }
+}
+
+std::optional<PoolScanStatus> ZFSStateProvider::get_pool_scan(PoolScanKind kind) {
+    nvlist_t* vdev_tree = nullptr;
+    zpool_handle_t* zph = open_pool_stats(&vdev_tree);
+    if (!zph) {
+        return std::nullopt;
+    }
+
+    PoolScanStatus status;
+    status.kind = kind;
+    if (kind == PoolScanKind::Scrub) {
+        uint64_t* raw = nullptr;
+        unsigned words = 0;
+        // No scan stats until the pool has been scanned once
+        if (nvlist_lookup_uint64_array(vdev_tree, ZPOOL_CONFIG_SCAN_STATS, &raw, &words) == 0) {
+            const auto* ps = reinterpret_cast<const pool_scan_stat_t*>(raw);
+            if (ps->pss_func == POOL_SCAN_SCRUB) {
+                status.running = ps->pss_state == DSS_SCANNING;
+                status.paused = status.running && ps->pss_pass_scrub_pause != 0;
+                status.bytes_done = ps->pss_issued;
+                status.bytes_total = ps->pss_to_examine;
+                status.started_unix = ps->pss_start_time;
+                if (ps->pss_state == DSS_FINISHED) {
+                    status.finished_unix = ps->pss_end_time;
+                }
+            }
+        }
+    } else {
+        status.supported = false;
+        size_t leaves = 0;
+        size_t active = 0;
+        size_t complete = 0;
+        collect_trim_status(vdev_tree, status, leaves, active, complete);
+        status.paused = status.running && active == 0;
+        // A pass is only complete once every device has finished it
+        if (status.running || complete == 0) {
+            status.finished_unix = 0;
+        }
+    }
+    zpool_close(zph);
+    return status;
+}
+
+bool ZFSStateProvider::start_pool_scan(PoolScanKind kind) {
+    nvlist_t* vdev_tree = nullptr;
+    zpool_handle_t* zph = open_pool_stats(&vdev_tree);
+    if (!zph) {
+        return false;
+    }
+
+    int rc;
+    if (kind == PoolScanKind::Scrub) {
+        // Also resumes a paused scrub
+        rc = zpool_scan(zph, POOL_SCAN_SCRUB, POOL_SCRUB_NORMAL);
+    } else {
+        // Also resumes suspended devices; fullpool skips those without TRIM
+        nvlist_t* leaves = nullptr;
+        nvlist_alloc(&leaves, NV_UNIQUE_NAME, 0);
+        zpool_collect_leaves(zph, vdev_tree, leaves);
+        trimflags_t flags{};
+        flags.fullpool = B_TRUE;
+        rc = zpool_trim(zph, POOL_TRIM_START, leaves, &flags);
+        nvlist_free(leaves);
+    }
+    if (rc != 0) {
+        last_error_ = std::string(kind == PoolScanKind::Scrub ? "Scrub" : "TRIM") +
+                      " of '" + pool_ + "' failed: " +
+                      libzfs_error_description(zfs_handle_);
+    }
+    zpool_close(zph);
+    return rc == 0;
+}
+
+bool ZFSStateProvider::pause_pool_scan(PoolScanKind kind) {
+    nvlist_t* vdev_tree = nullptr;
+    zpool_handle_t* zph = open_pool_stats(&vdev_tree);
+    if (!zph) {
+        return false;
+    }
+
+    int rc;
+    if (kind == PoolScanKind::Scrub) {
+        rc = zpool_scan(zph, POOL_SCAN_SCRUB, POOL_SCRUB_PAUSE);
+    } else {
+        nvlist_t* leaves = nullptr;
+        nvlist_alloc(&leaves, NV_UNIQUE_NAME, 0);
+        zpool_collect_leaves(zph, vdev_tree, leaves);
+        trimflags_t flags{};
+        flags.fullpool = B_TRUE;
+        rc = zpool_trim(zph, POOL_TRIM_SUSPEND, leaves, &flags);
+        nvlist_free(leaves);
+    }
+    if (rc != 0) {
+        last_error_ = std::string("Pausing ") +
+                      (kind == PoolScanKind::Scrub ? "scrub" : "TRIM") + " of '" + pool_ +
+                      "' failed: " + libzfs_error_description(zfs_handle_);
+    }
+    zpool_close(zph);
+    return rc == 0;
+}
+
+std::optional<PoolLatency> ZFSStateProvider::get_pool_latency() {
+    nvlist_t* vdev_tree = nullptr;
+    zpool_handle_t* zph = open_pool_stats(&vdev_tree);
+    if (!zph) {
+        return std::nullopt;
+    }
+
+    // The root vdev's histograms cover the whole pool; bucket i counts
+    // I/Os that took [2^i, 2^(i+1)) ns. Only the sync and async read and
+    // write classes (guest and application I/O) are counted: the totals
+    // include scrub and TRIM I/O, so a scrub would pause on its own load.
+    nvlist_t* ex = nullptr;
+    if (nvlist_lookup_nvlist(vdev_tree, ZPOOL_CONFIG_VDEV_STATS_EX, &ex) != 0) {
+        last_error_ = "Pool '" + pool_ + "' doesn't report latency histograms";
+        zpool_close(zph);
+        return std::nullopt;
+    }
+    PoolLatency latency;
+    for (const char* key : {ZPOOL_CONFIG_VDEV_SYNC_R_LAT_HISTO,
+                            ZPOOL_CONFIG_VDEV_SYNC_W_LAT_HISTO,
+                            ZPOOL_CONFIG_VDEV_ASYNC_R_LAT_HISTO,
+                            ZPOOL_CONFIG_VDEV_ASYNC_W_LAT_HISTO}) {
+        uint64_t* buckets = nullptr;
+        unsigned count = 0;
+        if (nvlist_lookup_uint64_array(ex, key, &buckets, &count) != 0) {
+            continue;
+        }
+        for (unsigned i = 0; i < count; i++) {
+            latency.ops += buckets[i];
+            // Count each I/O at its bucket's midpoint
+            latency.total_ms += static_cast<double>(buckets[i]) * 1.5 *
+                                std::ldexp(1.0, static_cast<int>(i)) / 1e6;
+        }
+    }
+    zpool_close(zph);
+    return latency;
+}
+
+std::optional<OperationEstimate> ZFSStateProvider::estimate_clone(
+    const std::string& source) {
+    zfs_handle_t* zhp = open_dataset(get_dataset_path(source), ZFS_TYPE_FILESYSTEM);
+    if (!zhp) {
+        last_error_ = "Source state '" + source + "' doesn't exist";
+        return std::nullopt;
+    }
+
+    OperationEstimate estimate{};
+    estimate.operation = "clone_state";
+    // The clone shares every block with its origin snapshot
+    estimate.immediate_bytes = 0;
+    // The clone-for-<dest> snapshot holds whatever isn't already held by an
+    // older snapshot, once the source overwrites it
+    estimate.pinned_bytes = zfs_prop_get_int(zhp, ZFS_PROP_WRITTEN);
+    estimate.freed_bytes = 0;
+    estimate.notes.push_back("Pinned space grows as '" + source +
+                             "' and the clone diverge from each other");
+    zfs_close(zhp);
+
+    apply_history(estimate);
+    return estimate;
+}
+
+std::optional<OperationEstimate> ZFSStateProvider::estimate_restore(
+    const std::string& snapshot_name) {
+    auto snap = find_snapshot(snapshot_name);
+    if (!snap) {
+        last_error_ = "Snapshot '" + snapshot_name + "' not found";
+        return std::nullopt;
+    }
+
+    zfs_handle_t* zhp = open_dataset(snap->full_name, ZFS_TYPE_SNAPSHOT);
+    if (!zhp) {
+        last_error_ = "Failed to open snapshot " + snap->full_name;
+        return std::nullopt;
+    }
+
+    OperationEstimate estimate{};
+    estimate.operation = "restore_snapshot";
+    estimate.immediate_bytes = 0;
+    // A snapshot with a clone can't be destroyed, so its unique space stays
+    estimate.pinned_bytes = zfs_prop_get_int(zhp, ZFS_PROP_USED);
+    estimate.freed_bytes = 0;
+    estimate.notes.push_back(snap->full_name + " can't be deleted while the restored state exists");
+    zfs_close(zhp);
+
+    apply_history(estimate);
+    return estimate;
+}
+
+std::optional<OperationEstimate> ZFSStateProvider::estimate_delete(
+    const std::string& name) {
+    zfs_handle_t* zhp = open_dataset(get_dataset_path(name), ZFS_TYPE_FILESYSTEM);
+    if (!zhp) {
+        last_error_ = "State '" + name + "' doesn't exist";
+        return std::nullopt;
+    }
+
+    OperationEstimate estimate{};
+    estimate.operation = "delete_state";
+    estimate.immediate_bytes = 0;
+    estimate.pinned_bytes = 0;
+    estimate.freed_bytes = zfs_prop_get_int(zhp, ZFS_PROP_USEDDS);
+
+    if (zfs_prop_get_int(zhp, ZFS_PROP_USEDSNAP) > 0) {
+        estimate.notes.push_back("'" + name + "' has snapshots; delete them first or the "
+                                 "destroy will fail");
+    }
+
+    // delete_state also removes the origin snapshot if nothing else uses it
+    char origin[ZFS_MAX_DATASET_NAME_LEN];
+    if (zfs_prop_get(zhp, ZFS_PROP_ORIGIN, origin, sizeof(origin),
+                     nullptr, nullptr, 0, B_FALSE) == 0 && origin[0] != '\0') {
+        zfs_handle_t* snap_zhp = open_dataset(origin, ZFS_TYPE_SNAPSHOT);
+        if (snap_zhp) {
+            if (zfs_prop_get_int(snap_zhp, ZFS_PROP_NUMCLONES) <= 1) {
+                estimate.freed_bytes += zfs_prop_get_int(snap_zhp, ZFS_PROP_USED);
+                estimate.notes.push_back(std::string("Origin snapshot ") + origin +
+                                         " is destroyed too");
+            } else {
+                estimate.notes.push_back(std::string("Origin snapshot ") + origin +
+                                         " is kept (other clones use it)");
+            }
+            zfs_close(snap_zhp);
         }
     }
-    return std::nullopt;
+
+    if (auto slot = is_state_in_use(name)) {
+        estimate.notes.push_back("'" + name + "' is assigned to " + *slot +
+                                 "; delete will refuse");
+    }
+    zfs_close(zhp);
+
+    apply_history(estimate);
+    return estimate;
 }
 
 std::string ZFSStateProvider::get_last_error() const {
@@ -834,4 +2429,8 @@ std::string ZFSStateProvider::get_states_dir() const {
     return states_dir_;
 }
 
+std::string ZFSStateProvider::get_catalog_path() const {
+    return catalog_path_;
+}
+
 } // namespace vmstate
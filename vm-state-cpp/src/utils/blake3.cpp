@@ -0,0 +1,295 @@
+#include "utils/blake3.hpp"
+#include "utils/io_engine.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+
+namespace vmstate {
+namespace utils {
+
+namespace {
+
+constexpr size_t BLOCK_LEN = 64;
+constexpr size_t CHUNK_LEN = 1024;
+
+// Each worker hashes one slab at a time. Slabs are a power-of-two number of
+// chunks, so every slab boundary is also a subtree boundary in the BLAKE3 tree.
+constexpr size_t SLAB_LEN = 4 * 1024 * 1024;
+
+constexpr uint32_t CHUNK_START = 1 << 0;
+constexpr uint32_t CHUNK_END = 1 << 1;
+constexpr uint32_t PARENT = 1 << 2;
+constexpr uint32_t ROOT = 1 << 3;
+
+constexpr uint32_t IV[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+constexpr uint8_t MSG_PERMUTATION[16] = {
+    2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8,
+};
+
+using CV = std::array<uint32_t, 8>;
+
+inline uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+inline void g(uint32_t* s, int a, int b, int c, int d, uint32_t mx, uint32_t my) {
+    s[a] = s[a] + s[b] + mx;
+    s[d] = rotr(s[d] ^ s[a], 16);
+    s[c] = s[c] + s[d];
+    s[b] = rotr(s[b] ^ s[c], 12);
+    s[a] = s[a] + s[b] + my;
+    s[d] = rotr(s[d] ^ s[a], 8);
+    s[c] = s[c] + s[d];
+    s[b] = rotr(s[b] ^ s[c], 7);
+}
+
+CV compress(const CV& cv, const uint32_t block[16], uint64_t counter,
+            uint32_t block_len, uint32_t flags) {
+    uint32_t s[16] = {
+        cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+        IV[0], IV[1], IV[2], IV[3],
+        static_cast<uint32_t>(counter), static_cast<uint32_t>(counter >> 32),
+        block_len, flags,
+    };
+    uint32_t m[16];
+    std::memcpy(m, block, sizeof(m));
+
+    for (int round = 0; round < 7; round++) {
+        g(s, 0, 4, 8, 12, m[0], m[1]);
+        g(s, 1, 5, 9, 13, m[2], m[3]);
+        g(s, 2, 6, 10, 14, m[4], m[5]);
+        g(s, 3, 7, 11, 15, m[6], m[7]);
+        g(s, 0, 5, 10, 15, m[8], m[9]);
+        g(s, 1, 6, 11, 12, m[10], m[11]);
+        g(s, 2, 7, 8, 13, m[12], m[13]);
+        g(s, 3, 4, 9, 14, m[14], m[15]);
+
+        uint32_t permuted[16];
+        for (int i = 0; i < 16; i++) {
+            permuted[i] = m[MSG_PERMUTATION[i]];
+        }
+        std::memcpy(m, permuted, sizeof(m));
+    }
+
+    CV out;
+    for (int i = 0; i < 8; i++) {
+        out[i] = s[i] ^ s[i + 8];
+    }
+    return out;
+}
+
+void load_block(const uint8_t* data, size_t len, uint32_t block[16]) {
+    uint8_t bytes[BLOCK_LEN] = {};
+    std::memcpy(bytes, data, len);
+    for (int i = 0; i < 16; i++) {
+        block[i] = static_cast<uint32_t>(bytes[i * 4]) |
+                   (static_cast<uint32_t>(bytes[i * 4 + 1]) << 8) |
+                   (static_cast<uint32_t>(bytes[i * 4 + 2]) << 16) |
+                   (static_cast<uint32_t>(bytes[i * 4 + 3]) << 24);
+    }
+}
+
+CV chunk_cv(const uint8_t* data, size_t len, uint64_t chunk_counter, bool root) {
+    CV cv;
+    std::copy(std::begin(IV), std::end(IV), cv.begin());
+
+    // An empty input is still one (empty) block
+    size_t blocks = len == 0 ? 1 : (len + BLOCK_LEN - 1) / BLOCK_LEN;
+    for (size_t i = 0; i < blocks; i++) {
+        size_t offset = i * BLOCK_LEN;
+        size_t block_len = std::min(BLOCK_LEN, len - offset);
+        bool last = i + 1 == blocks;
+
+        uint32_t flags = 0;
+        if (i == 0) flags |= CHUNK_START;
+        if (last) flags |= CHUNK_END;
+        if (last && root) flags |= ROOT;
+
+        uint32_t block[16];
+        load_block(data + offset, block_len, block);
+        cv = compress(cv, block, chunk_counter, static_cast<uint32_t>(block_len), flags);
+    }
+    return cv;
+}
+
+CV parent_cv(const CV& left, const CV& right, bool root) {
+    uint32_t block[16];
+    std::copy(left.begin(), left.end(), block);
+    std::copy(right.begin(), right.end(), block + 8);
+    CV key;
+    std::copy(std::begin(IV), std::end(IV), key.begin());
+    return compress(key, block, 0, BLOCK_LEN, PARENT | (root ? ROOT : 0));
+}
+
+// Largest power of two strictly less than n (n > 1)
+uint64_t left_split(uint64_t n) {
+    uint64_t p = 1;
+    while (p * 2 < n) {
+        p *= 2;
+    }
+    return p;
+}
+
+// Hash a left-complete subtree of whole chunks starting at chunk_counter
+CV subtree_cv(const uint8_t* data, size_t len, uint64_t chunk_counter, bool root) {
+    if (len <= CHUNK_LEN) {
+        return chunk_cv(data, len, chunk_counter, root);
+    }
+    uint64_t chunks = (len + CHUNK_LEN - 1) / CHUNK_LEN;
+    size_t left_len = left_split(chunks) * CHUNK_LEN;
+    CV left = subtree_cv(data, left_len, chunk_counter, false);
+    CV right = subtree_cv(data + left_len, len - left_len,
+                          chunk_counter + left_len / CHUNK_LEN, false);
+    return parent_cv(left, right, root);
+}
+
+// Combine per-slab chaining values into the root using the same tree shape
+CV merge_cvs(const std::vector<CV>& cvs, size_t lo, size_t hi, bool root) {
+    if (hi - lo == 1) {
+        return cvs[lo];
+    }
+    size_t mid = lo + left_split(hi - lo);
+    return parent_cv(merge_cvs(cvs, lo, mid, false),
+                     merge_cvs(cvs, mid, hi, false), root);
+}
+
+Blake3Digest to_digest(const CV& cv) {
+    Blake3Digest out;
+    for (int i = 0; i < 8; i++) {
+        out[i * 4] = static_cast<uint8_t>(cv[i]);
+        out[i * 4 + 1] = static_cast<uint8_t>(cv[i] >> 8);
+        out[i * 4 + 2] = static_cast<uint8_t>(cv[i] >> 16);
+        out[i * 4 + 3] = static_cast<uint8_t>(cv[i] >> 24);
+    }
+    return out;
+}
+
+}  // anonymous namespace
+
+Blake3Digest blake3(const void* data, size_t len) {
+    return to_digest(subtree_cv(static_cast<const uint8_t*>(data), len, 0, true));
+}
+
+std::optional<Blake3Digest> blake3_file(
+    const std::string& path,
+    unsigned threads,
+    std::string& error,
+    const std::function<void(uint64_t, uint64_t)>& progress) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        error = "Failed to stat " + path + ": " + std::strerror(errno);
+        return std::nullopt;
+    }
+    uint64_t size = static_cast<uint64_t>(st.st_size);
+    if (size == 0) {
+        return blake3(nullptr, 0);
+    }
+    size_t slabs = (size + SLAB_LEN - 1) / SLAB_LEN;
+
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = static_cast<unsigned>(std::min<size_t>(threads, slabs));
+
+    // One thread drives the reads; hashing fans out to workers. Two slabs
+    // per worker keep the queue full while every worker is busy.
+    IoEngineOptions options;
+    options.block_size = SLAB_LEN;
+    options.queue_depth = std::max(8u, threads * 2);
+    options.progress = progress;
+    IoEngine engine(options);
+
+    // Holes hash like zeros; they're read from here instead of the disk
+    static const std::vector<uint8_t> zeros(SLAB_LEN, 0);
+
+    std::vector<CV> cvs(slabs);
+    auto hash_block = [&](const IoBlock& block) {
+        const uint8_t* data = block.data ? block.data : zeros.data();
+        size_t slab = static_cast<size_t>(block.offset / SLAB_LEN);
+        // A single slab is the whole tree, so it must carry the root flag
+        cvs[slab] = subtree_cv(data, block.length, slab * (SLAB_LEN / CHUNK_LEN), slabs == 1);
+        engine.release(block);
+    };
+
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<IoBlock> queue;
+    bool done = false;
+
+    auto worker = [&]() {
+        while (true) {
+            IoBlock block;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [&] { return done || !queue.empty(); });
+                if (queue.empty()) {
+                    return;
+                }
+                block = queue.front();
+                queue.pop_front();
+            }
+            hash_block(block);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++) {
+        pool.emplace_back(worker);
+    }
+
+    bool ok = engine.read_file(path, [&](const IoBlock& block) {
+        if (pool.empty()) {
+            hash_block(block);
+            return true;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(block);
+        }
+        ready.notify_one();
+        return true;
+    });
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+    }
+    ready.notify_all();
+    for (auto& t : pool) {
+        t.join();
+    }
+
+    if (!ok) {
+        error = "Failed to read " + path + ": " + engine.get_last_error();
+        return std::nullopt;
+    }
+
+    if (slabs == 1) {
+        return to_digest(cvs[0]);
+    }
+    return to_digest(merge_cvs(cvs, 0, slabs, true));
+}
+
+std::string to_hex(const Blake3Digest& digest) {
+    static const char* hex = "0123456789abcdef";
+    std::string out;
+    out.reserve(digest.size() * 2);
+    for (uint8_t b : digest) {
+        out += hex[b >> 4];
+        out += hex[b & 0xf];
+    }
+    return out;
+}
+
+} // namespace utils
+} // namespace vmstate
@@ -0,0 +1,548 @@
+#include "utils/io_engine.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace vmstate {
+namespace utils {
+
+namespace {
+
+// O_DIRECT needs buffers, offsets and lengths aligned to the logical block
+// size; 4 KiB covers every device we run on
+constexpr size_t IO_ALIGN = 4096;
+
+constexpr unsigned NO_BUFFER = ~0u;
+
+size_t round_up(size_t n, size_t align) {
+    return (n + align - 1) / align * align;
+}
+
+bool all_zero(const uint8_t* data, size_t len) {
+    // Compare the buffer against itself shifted by 16 bytes after checking
+    // the first 16; memcmp is vectorized, a byte loop is not
+    if (len < 16) {
+        return std::all_of(data, data + len, [](uint8_t b) { return b == 0; });
+    }
+    static const uint8_t zeros[16] = {};
+    return std::memcmp(data, zeros, 16) == 0 && std::memcmp(data, data + 16, len - 16) == 0;
+}
+
+}  // anonymous namespace
+
+// Raw io_uring rings (mapped from the kernel, no liburing)
+struct IoEngine::Ring {
+    int fd = -1;
+    bool fixed_buffers = false;
+
+    void* sq_ptr = MAP_FAILED;
+    size_t sq_len = 0;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_mask = nullptr;
+    unsigned* sq_array = nullptr;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqes_len = 0;
+
+    void* cq_ptr = MAP_FAILED;
+    size_t cq_len = 0;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned* cq_mask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+
+    unsigned to_submit = 0;
+
+    ~Ring() {
+        if (sqes) munmap(sqes, sqes_len);
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_len);
+        if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_len);
+        if (fd >= 0) close(fd);
+    }
+
+    bool setup(unsigned entries) {
+        io_uring_params p{};
+        fd = static_cast<int>(syscall(SYS_io_uring_setup, entries, &p));
+        if (fd < 0) {
+            return false;
+        }
+
+        sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_len = cq_len = std::max(sq_len, cq_len);
+        }
+
+        sq_ptr = mmap(nullptr, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) {
+            return false;
+        }
+        cq_ptr = single_mmap ? sq_ptr
+                             : mmap(nullptr, cq_len, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            return false;
+        }
+        sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+        void* sqes_ptr = mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes_ptr == MAP_FAILED) {
+            return false;
+        }
+        sqes = static_cast<io_uring_sqe*>(sqes_ptr);
+
+        auto* sq = static_cast<uint8_t*>(sq_ptr);
+        sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+
+        auto* cq = static_cast<uint8_t*>(cq_ptr);
+        cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+        return true;
+    }
+};
+
+IoEngine::IoEngine(const IoEngineOptions& options)
+    : options_(options) {
+    options_.queue_depth = std::clamp(options_.queue_depth, 1u, 256u);
+    options_.block_size = round_up(std::max<size_t>(options_.block_size, IO_ALIGN), IO_ALIGN);
+
+    for (unsigned i = 0; i < options_.queue_depth; i++) {
+        void* buf = std::aligned_alloc(IO_ALIGN, options_.block_size);
+        if (!buf) {
+            last_error_ = "Failed to allocate I/O buffers";
+            break;
+        }
+        buffers_.push_back(static_cast<uint8_t*>(buf));
+        free_.push_back(i);
+    }
+    ops_.resize(buffers_.size());
+
+    ring_ = new Ring();
+    if (buffers_.empty() || !ring_->setup(options_.queue_depth)) {
+        // No io_uring (old kernel, seccomp, io_uring_disabled): use pread
+        delete ring_;
+        ring_ = nullptr;
+        return;
+    }
+
+    // Registered buffers spare the kernel a page pin per I/O; if the
+    // memlock limit refuses them, plain reads on the same buffers still work
+    std::vector<iovec> iovs;
+    for (auto* buf : buffers_) {
+        iovs.push_back({buf, options_.block_size});
+    }
+    ring_->fixed_buffers = syscall(SYS_io_uring_register, ring_->fd, IORING_REGISTER_BUFFERS,
+                                   iovs.data(), static_cast<unsigned>(iovs.size())) == 0;
+}
+
+IoEngine::~IoEngine() {
+    delete ring_;
+    for (auto* buf : buffers_) {
+        std::free(buf);
+    }
+}
+
+bool IoEngine::uses_uring() const {
+    return ring_ != nullptr;
+}
+
+std::string IoEngine::get_last_error() const {
+    return last_error_;
+}
+
+int IoEngine::open_input(const std::string& path, bool& direct) {
+    direct = false;
+    if (options_.direct) {
+        int fd = open(path.c_str(), O_RDONLY | O_DIRECT | O_CLOEXEC);
+        if (fd >= 0) {
+            direct = true;
+            return fd;
+        }
+        // EINVAL: the filesystem doesn't do O_DIRECT; anything else is real
+        if (errno != EINVAL) {
+            return -1;
+        }
+    }
+    return open(path.c_str(), O_RDONLY | O_CLOEXEC);
+}
+
+std::vector<std::pair<uint64_t, uint64_t>> IoEngine::data_extents(int fd, uint64_t size) const {
+    std::vector<std::pair<uint64_t, uint64_t>> extents;
+    uint64_t pos = 0;
+    while (pos < size) {
+        off_t data = lseek(fd, static_cast<off_t>(pos), SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) {
+                break;  // Only a hole remains
+            }
+            return {{0, size}};  // No SEEK_DATA here: treat it all as data
+        }
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0) {
+            return {{0, size}};
+        }
+        extents.emplace_back(static_cast<uint64_t>(data), static_cast<uint64_t>(hole));
+        pos = static_cast<uint64_t>(hole);
+    }
+    return extents;
+}
+
+std::vector<std::pair<uint64_t, uint64_t>> IoEngine::intersect(
+    const std::vector<std::pair<uint64_t, uint64_t>>& extents,
+    std::vector<std::pair<uint64_t, uint64_t>> ranges) {
+    std::sort(ranges.begin(), ranges.end());
+    std::vector<std::pair<uint64_t, uint64_t>> result;
+    size_t r = 0;
+    for (const auto& [start, end] : extents) {
+        while (r < ranges.size() && ranges[r].second <= start) {
+            r++;
+        }
+        for (size_t i = r; i < ranges.size() && ranges[i].first < end; i++) {
+            uint64_t from = std::max(start, ranges[i].first);
+            uint64_t to = std::min(end, ranges[i].second);
+            if (from >= to) {
+                continue;
+            }
+            if (!result.empty() && from <= result.back().second) {
+                result.back().second = std::max(result.back().second, to);
+            } else {
+                result.emplace_back(from, to);
+            }
+        }
+    }
+    return result;
+}
+
+bool IoEngine::take_buffer(unsigned& index) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_.empty()) {
+        return false;
+    }
+    index = free_.back();
+    free_.pop_back();
+    return true;
+}
+
+void IoEngine::wait_for_buffer() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    released_.wait(lock, [this] { return !free_.empty(); });
+}
+
+void IoEngine::release(const IoBlock& block) {
+    if (!block.data || block.buffer == NO_BUFFER) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_.push_back(block.buffer);
+    }
+    released_.notify_all();
+}
+
+bool IoEngine::submit(unsigned buffer, int fd, bool write) {
+    Op& op = ops_[buffer];
+    uint8_t* addr = buffers_[buffer] + op.done;
+    size_t len = op.length - op.done;
+    uint64_t offset = op.offset + op.done;
+
+    if (!ring_) {
+        // Fallback: do the I/O now and complete it on the next reap
+        ssize_t n = write ? pwrite(fd, addr, len, static_cast<off_t>(offset))
+                          : pread(fd, addr, len, static_cast<off_t>(offset));
+        sync_done_.emplace_back(buffer, n < 0 ? -errno : static_cast<int>(n));
+        return true;
+    }
+
+    unsigned tail = *ring_->sq_tail;
+    unsigned index = tail & *ring_->sq_mask;
+    io_uring_sqe* sqe = &ring_->sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    if (ring_->fixed_buffers) {
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = static_cast<uint16_t>(buffer);
+    } else {
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(addr);
+    sqe->len = static_cast<uint32_t>(len);
+    sqe->off = offset;
+    sqe->user_data = buffer;
+    ring_->sq_array[index] = index;
+    __atomic_store_n(ring_->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring_->to_submit++;
+    return true;
+}
+
+bool IoEngine::reap(int in_fd, int out_fd, const BlockVisitor& fn, bool& stop,
+                    unsigned& inflight, uint64_t& written, bool direct_out) {
+    std::vector<std::pair<unsigned, int>> completions;
+    if (ring_) {
+        int r = static_cast<int>(syscall(SYS_io_uring_enter, ring_->fd, ring_->to_submit, 1,
+                                         IORING_ENTER_GETEVENTS, nullptr, 0));
+        if (r < 0 && errno != EINTR) {
+            last_error_ = std::string("io_uring_enter failed: ") + std::strerror(errno);
+            return false;
+        }
+        if (r > 0) {
+            ring_->to_submit -= std::min<unsigned>(ring_->to_submit, static_cast<unsigned>(r));
+        }
+        unsigned head = *ring_->cq_head;
+        unsigned tail = __atomic_load_n(ring_->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            const io_uring_cqe& cqe = ring_->cqes[head & *ring_->cq_mask];
+            completions.emplace_back(static_cast<unsigned>(cqe.user_data), cqe.res);
+            head++;
+        }
+        __atomic_store_n(ring_->cq_head, head, __ATOMIC_RELEASE);
+    } else {
+        completions.swap(sync_done_);
+    }
+
+    auto give_back = [this](unsigned buffer) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_.push_back(buffer);
+    };
+
+    for (const auto& [buffer, res] : completions) {
+        Op& op = ops_[buffer];
+        if (res < 0) {
+            if (!stop) {
+                last_error_ = std::string(op.writing ? "Write" : "Read") + " failed at offset " +
+                              std::to_string(op.offset + op.done) + ": " + std::strerror(-res);
+            }
+            stop = true;
+            inflight--;
+            give_back(buffer);
+            continue;
+        }
+
+        op.done += static_cast<size_t>(res);
+        uint64_t valid = std::min<uint64_t>(op.length, file_size_ - op.offset);
+        bool short_io = op.done < (op.writing ? op.length : valid);
+        if (short_io && res > 0 && !stop) {
+            // Resume a short transfer where it stopped
+            if (!submit(buffer, op.writing ? out_fd : in_fd, op.writing)) {
+                return false;
+            }
+            continue;
+        }
+        inflight--;
+
+        if (op.writing || stop) {
+            give_back(buffer);
+            continue;
+        }
+        if (op.done < valid) {
+            last_error_ = "File shrank while reading at offset " +
+                          std::to_string(op.offset + op.done);
+            stop = true;
+            give_back(buffer);
+            continue;
+        }
+        scanned_ += valid;
+
+        if (out_fd < 0) {
+            IoBlock block{op.offset, static_cast<size_t>(valid), buffers_[buffer], buffer};
+            if (!fn(block)) {
+                stop = true;
+            }
+            continue;
+        }
+
+        // copy_file: zero blocks stay holes in the destination
+        if (all_zero(buffers_[buffer], static_cast<size_t>(valid))) {
+            give_back(buffer);
+            continue;
+        }
+        op.writing = true;
+        op.done = 0;
+        op.length = static_cast<size_t>(valid);
+        if (direct_out && op.length % IO_ALIGN != 0) {
+            // The tail block goes out padded; the file is truncated afterwards
+            size_t padded = round_up(op.length, IO_ALIGN);
+            std::memset(buffers_[buffer] + op.length, 0, padded - op.length);
+            op.length = padded;
+        }
+        written += valid;
+        if (!submit(buffer, out_fd, true)) {
+            return false;
+        }
+        inflight++;
+    }
+
+    if (!completions.empty()) {
+        released_.notify_all();
+    }
+    if (options_.progress) {
+        options_.progress(scanned_, file_size_);
+    }
+    return true;
+}
+
+bool IoEngine::run(const std::string& path, int out_fd, const BlockVisitor& fn,
+                   uint64_t* bytes_written) {
+    if (buffers_.empty()) {
+        return false;
+    }
+
+    bool direct = false;
+    int fd = open_input(path, direct);
+    if (fd < 0) {
+        last_error_ = "Failed to open " + path + ": " + std::strerror(errno);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        last_error_ = "Failed to stat " + path + ": " + std::strerror(errno);
+        close(fd);
+        return false;
+    }
+    file_size_ = static_cast<uint64_t>(st.st_size);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    bool direct_out = false;
+    if (out_fd >= 0) {
+        direct_out = (fcntl(out_fd, F_GETFL) & O_DIRECT) != 0;
+        if (ftruncate(out_fd, static_cast<off_t>(file_size_)) != 0) {
+            last_error_ = std::string("Failed to size destination: ") + std::strerror(errno);
+            close(fd);
+            return false;
+        }
+    }
+
+    std::vector<std::pair<uint64_t, uint64_t>> extents;
+    if (options_.skip_holes) {
+        extents = data_extents(fd, file_size_);
+    } else {
+        extents.emplace_back(0, file_size_);
+    }
+    if (!options_.ranges.empty()) {
+        extents = intersect(extents, options_.ranges);
+    }
+
+    const uint64_t block_size = options_.block_size;
+    const uint64_t blocks = (file_size_ + block_size - 1) / block_size;
+    uint64_t next = 0;
+    size_t extent = 0;
+    unsigned inflight = 0;
+    uint64_t written = 0;
+    bool stop = false;
+    bool failed = false;
+    scanned_ = 0;
+    last_error_.clear();
+
+    while (!stop && (next < blocks || inflight > 0)) {
+        while (!stop && next < blocks) {
+            uint64_t offset = next * block_size;
+            uint64_t end = std::min(offset + block_size, file_size_);
+            while (extent < extents.size() && extents[extent].second <= offset) {
+                extent++;
+            }
+            if (extent == extents.size() || extents[extent].first >= end) {
+                // Entirely a hole: nothing to read (or, when copying, write)
+                next++;
+                scanned_ += end - offset;
+                if (out_fd < 0 && !fn(IoBlock{offset, static_cast<size_t>(end - offset),
+                                              nullptr, NO_BUFFER})) {
+                    stop = true;
+                }
+                continue;
+            }
+
+            unsigned buffer;
+            if (!take_buffer(buffer)) {
+                break;
+            }
+            ops_[buffer] = Op{offset, round_up(static_cast<size_t>(end - offset), IO_ALIGN),
+                              0, false};
+            if (!submit(buffer, fd, false)) {
+                failed = true;
+                stop = true;
+                break;
+            }
+            inflight++;
+            next++;
+        }
+
+        if (inflight > 0) {
+            if (!reap(fd, out_fd, fn, stop, inflight, written, direct_out)) {
+                failed = true;
+                break;
+            }
+        } else if (!stop && next < blocks) {
+            wait_for_buffer();
+        }
+    }
+
+    // Let outstanding I/O land before its buffers can be reused
+    bool stopped = stop;
+    while (!failed && inflight > 0) {
+        stop = true;
+        if (!reap(fd, out_fd, fn, stop, inflight, written, direct_out)) {
+            failed = true;
+        }
+    }
+    if (!failed) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        released_.wait(lock, [this] { return free_.size() == buffers_.size(); });
+    }
+    close(fd);
+
+    if (bytes_written) {
+        *bytes_written = written;
+    }
+    return !failed && !stopped && last_error_.empty();
+}
+
+bool IoEngine::read_file(const std::string& path, const BlockVisitor& fn) {
+    if (!run(path, -1, fn, nullptr)) {
+        if (last_error_.empty()) {
+            last_error_ = "Stopped before the end of " + path;
+        }
+        return false;
+    }
+    return true;
+}
+
+bool IoEngine::copy_file(const std::string& src, const std::string& dst,
+                         uint64_t* bytes_written) {
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    int out_fd = options_.direct ? open(dst.c_str(), flags | O_DIRECT, 0644) : -1;
+    if (out_fd < 0) {
+        out_fd = open(dst.c_str(), flags, 0644);
+    }
+    if (out_fd < 0) {
+        last_error_ = "Failed to create " + dst + ": " + std::strerror(errno);
+        return false;
+    }
+
+    bool ok = run(src, out_fd, nullptr, bytes_written);
+    // Padded tail writes may have run past the end
+    if (ok && ftruncate(out_fd, static_cast<off_t>(file_size_)) != 0) {
+        last_error_ = "Failed to size " + dst + ": " + std::strerror(errno);
+        ok = false;
+    }
+    if (ok && fdatasync(out_fd) != 0) {
+        last_error_ = "Failed to sync " + dst + ": " + std::strerror(errno);
+        ok = false;
+    }
+    close(out_fd);
+    return ok;
+}
+
+} // namespace utils
+} // namespace vmstate
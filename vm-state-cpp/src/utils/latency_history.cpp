@@ -0,0 +1,79 @@
+#include "utils/latency_history.hpp"
+#include "utils/json.hpp"
+#include <algorithm>
+#include <filesystem>
+#include <sstream>
+
+namespace fs = std::filesystem;
+
+namespace vmstate {
+namespace utils {
+
+namespace {
+
+// Plain mean until this many samples, then an exponentially weighted mean
+// so the estimate follows the pool as it fills or its load changes
+constexpr uint64_t WARM_SAMPLES = 20;
+constexpr double EWMA_WEIGHT = 0.1;
+
+// Entries are stored as "<samples> <mean_ms> <max_ms>"
+std::optional<LatencyStats> parse_entry(const std::string& entry) {
+    std::istringstream ss(entry);
+    LatencyStats stats;
+    if (ss >> stats.samples >> stats.mean_ms >> stats.max_ms && stats.samples > 0) {
+        return stats;
+    }
+    return std::nullopt;
+}
+
+}  // anonymous namespace
+
+LatencyHistory::LatencyHistory(const std::string& path)
+    : path_(path) {}
+
+std::optional<LatencyStats> LatencyHistory::get(const std::string& operation) const {
+    auto data = read_json_file(path_);
+    if (!data) {
+        return std::nullopt;
+    }
+    auto it = data->find(operation);
+    if (it == data->end()) {
+        return std::nullopt;
+    }
+    return parse_entry(it->second);
+}
+
+void LatencyHistory::record(const std::string& operation, double ms) {
+    std::map<std::string, std::string> data;
+    auto loaded = read_json_file(path_);
+    if (loaded) {
+        data = *loaded;
+    }
+
+    LatencyStats stats{0, 0.0, 0.0};
+    auto it = data.find(operation);
+    if (it != data.end()) {
+        if (auto parsed = parse_entry(it->second)) {
+            stats = *parsed;
+        }
+    }
+
+    stats.samples++;
+    if (stats.samples <= WARM_SAMPLES) {
+        stats.mean_ms += (ms - stats.mean_ms) / static_cast<double>(stats.samples);
+    } else {
+        stats.mean_ms += (ms - stats.mean_ms) * EWMA_WEIGHT;
+    }
+    stats.max_ms = std::max(stats.max_ms, ms);
+
+    std::ostringstream entry;
+    entry << stats.samples << " " << stats.mean_ms << " " << stats.max_ms;
+    data[operation] = entry.str();
+
+    std::error_code ec;
+    fs::create_directories(fs::path(path_).parent_path(), ec);
+    write_json_file(path_, data);
+}
+
+} // namespace utils
+} // namespace vmstate
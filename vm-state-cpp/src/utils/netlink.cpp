@@ -0,0 +1,452 @@
+#include "utils/netlink.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <linux/gen_stats.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/netlink.h>
+#include <linux/pkt_cls.h>
+#include <linux/pkt_sched.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace vmstate {
+namespace utils {
+
+namespace {
+
+// Large enough for a full dump batch; the kernel fills up to this per recv
+constexpr size_t RECV_BUFFER = 64 * 1024;
+
+// Packet scheduler clock: 64ns per tick (PSCHED_SHIFT 6), as reported by
+// /proc/net/psched on every kernel this runs on
+constexpr double PSCHED_TICKS_PER_SEC = 1e9 / 64;
+
+// Token bucket sizing: at least 32K or 10ms at the configured rate, with
+// up to 50ms of queue behind the shaper
+constexpr uint64_t MIN_BURST_BYTES = 32 * 1024;
+constexpr double BURST_SEC = 0.01;
+constexpr double QUEUE_SEC = 0.05;
+
+// Police packets up to GSO size; taps hand over unsegmented skbs
+constexpr uint32_t POLICE_MTU = 65535;
+
+constexpr uint32_t TBF_HANDLE = 0x00010000;      // 1:
+constexpr uint32_t FQ_HANDLE = 0x00020000;       // 2:
+constexpr uint32_t INGRESS_HANDLE = 0xFFFF0000;  // ffff:
+
+// Close the socket on every return path
+class NetlinkSocket {
+public:
+    NetlinkSocket() : fd_(socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) {}
+    ~NetlinkSocket() {
+        if (fd_ >= 0) close(fd_);
+    }
+    int fd() const { return fd_; }
+    uint32_t next_seq() { return ++seq_; }
+
+private:
+    int fd_;
+    uint32_t seq_ = 0;
+};
+
+// An rtnetlink request built up attribute by attribute
+class NetlinkMessage {
+public:
+    NetlinkMessage(uint16_t type, uint16_t flags) : buf_(NLMSG_HDRLEN, 0) {
+        hdr()->nlmsg_len = NLMSG_HDRLEN;
+        hdr()->nlmsg_type = type;
+        hdr()->nlmsg_flags = flags;
+    }
+
+    // Family header (ifinfomsg, tcmsg, ...), directly after the nlmsghdr
+    template <typename T>
+    void put_header(const T& header) {
+        append(&header, sizeof(header));
+    }
+
+    void put_attr(uint16_t type, const void* data, size_t len) {
+        struct rtattr rta{};
+        rta.rta_type = type;
+        rta.rta_len = static_cast<unsigned short>(RTA_LENGTH(len));
+        append(&rta, sizeof(rta));
+        append(data, len);
+    }
+
+    template <typename T>
+    void put_value(uint16_t type, const T& value) {
+        put_attr(type, &value, sizeof(value));
+    }
+
+    void put_string(uint16_t type, const std::string& value) {
+        put_attr(type, value.c_str(), value.size() + 1);
+    }
+
+    // Open a nested attribute; close it with end_nest once its children are added
+    size_t begin_nest(uint16_t type) {
+        size_t offset = buf_.size();
+        put_attr(type, nullptr, 0);
+        return offset;
+    }
+
+    void end_nest(size_t offset) {
+        auto* rta = reinterpret_cast<struct rtattr*>(buf_.data() + offset);
+        rta->rta_len = static_cast<unsigned short>(buf_.size() - offset);
+    }
+
+    struct nlmsghdr* hdr() { return reinterpret_cast<struct nlmsghdr*>(buf_.data()); }
+
+private:
+    void append(const void* data, size_t len) {
+        size_t offset = buf_.size();
+        buf_.resize(offset + NLMSG_ALIGN(len), 0);
+        if (len > 0) {
+            std::memcpy(buf_.data() + offset, data, len);
+        }
+        hdr()->nlmsg_len = static_cast<uint32_t>(buf_.size());
+    }
+
+    std::vector<char> buf_;
+};
+
+/**
+ * Send a request and read replies until the dump ends or the kernel acks
+ *
+ * Data replies are handed to on_reply. Returns 0 on success or the errno
+ * reported by the kernel (error is set either way on failure).
+ */
+int exchange(NetlinkSocket& sock, NetlinkMessage& msg, const std::string& what,
+             const std::function<void(const struct nlmsghdr*)>& on_reply,
+             std::string& error) {
+    uint32_t seq = sock.next_seq();
+    msg.hdr()->nlmsg_seq = seq;
+
+    struct sockaddr_nl kernel{};
+    kernel.nl_family = AF_NETLINK;
+    if (sendto(sock.fd(), msg.hdr(), msg.hdr()->nlmsg_len, 0,
+               reinterpret_cast<struct sockaddr*>(&kernel), sizeof(kernel)) < 0) {
+        error = "Failed to send " + what + ": " + std::strerror(errno);
+        return errno;
+    }
+
+    std::vector<char> buf(RECV_BUFFER);
+    for (;;) {
+        ssize_t n = recv(sock.fd(), buf.data(), buf.size(), 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            error = "Failed to read netlink reply: " + std::string(std::strerror(errno));
+            return errno;
+        }
+
+        int remaining = static_cast<int>(n);
+        for (auto* nh = reinterpret_cast<struct nlmsghdr*>(buf.data());
+             NLMSG_OK(nh, remaining); nh = NLMSG_NEXT(nh, remaining)) {
+            if (nh->nlmsg_seq != seq) {
+                continue;
+            }
+            if (nh->nlmsg_type == NLMSG_DONE) {
+                return 0;
+            }
+            if (nh->nlmsg_type == NLMSG_ERROR) {
+                // An error of 0 is the ack for a non-dump request
+                const auto* err = static_cast<const struct nlmsgerr*>(NLMSG_DATA(nh));
+                if (err->error == 0) {
+                    return 0;
+                }
+                error = what + " failed: " + std::strerror(-err->error);
+                return -err->error;
+            }
+            on_reply(nh);
+        }
+    }
+}
+
+void parse_link(const struct nlmsghdr* nh, std::vector<LinkStats>& out) {
+    if (nh->nlmsg_type != RTM_NEWLINK) {
+        return;
+    }
+    const auto* ifi = static_cast<const struct ifinfomsg*>(NLMSG_DATA(nh));
+    int len = static_cast<int>(nh->nlmsg_len) - static_cast<int>(NLMSG_LENGTH(sizeof(*ifi)));
+    if (len < 0) {
+        return;
+    }
+
+    LinkStats stats{};
+    stats.ifindex = static_cast<uint32_t>(ifi->ifi_index);
+    bool have_stats64 = false;
+
+    for (auto* rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        const void* data = RTA_DATA(rta);
+        size_t payload = RTA_PAYLOAD(rta);
+
+        if (rta->rta_type == IFLA_IFNAME) {
+            const char* name = static_cast<const char*>(data);
+            stats.ifname.assign(name, strnlen(name, payload));
+        } else if (rta->rta_type == IFLA_STATS64 && payload >= sizeof(struct rtnl_link_stats64)) {
+            struct rtnl_link_stats64 s;
+            std::memcpy(&s, data, sizeof(s));
+            stats.rx_bytes = s.rx_bytes;
+            stats.tx_bytes = s.tx_bytes;
+            stats.rx_packets = s.rx_packets;
+            stats.tx_packets = s.tx_packets;
+            stats.rx_dropped = s.rx_dropped;
+            stats.tx_dropped = s.tx_dropped;
+            stats.rx_errors = s.rx_errors;
+            stats.tx_errors = s.tx_errors;
+            have_stats64 = true;
+        } else if (rta->rta_type == IFLA_STATS && !have_stats64 &&
+                   payload >= sizeof(struct rtnl_link_stats)) {
+            // 32-bit counters wrap quickly; only used if stats64 is absent
+            struct rtnl_link_stats s;
+            std::memcpy(&s, data, sizeof(s));
+            stats.rx_bytes = s.rx_bytes;
+            stats.tx_bytes = s.tx_bytes;
+            stats.rx_packets = s.rx_packets;
+            stats.tx_packets = s.tx_packets;
+            stats.rx_dropped = s.rx_dropped;
+            stats.tx_dropped = s.tx_dropped;
+            stats.rx_errors = s.rx_errors;
+            stats.tx_errors = s.tx_errors;
+        }
+    }
+
+    if (!stats.ifname.empty()) {
+        out.push_back(std::move(stats));
+    }
+}
+
+// Sum drops of root and ingress qdiscs per interface; child qdiscs are
+// skipped since their drops are already counted by the parent
+void parse_qdisc(const struct nlmsghdr* nh, std::map<uint32_t, uint64_t>& drops) {
+    if (nh->nlmsg_type != RTM_NEWQDISC) {
+        return;
+    }
+    const auto* tcm = static_cast<const struct tcmsg*>(NLMSG_DATA(nh));
+    int len = static_cast<int>(nh->nlmsg_len) - static_cast<int>(NLMSG_LENGTH(sizeof(*tcm)));
+    if (len < 0 || (tcm->tcm_parent != TC_H_ROOT && tcm->tcm_parent != TC_H_INGRESS)) {
+        return;
+    }
+
+    uint32_t ifindex = static_cast<uint32_t>(tcm->tcm_ifindex);
+    bool have_stats2 = false;
+    for (auto* rta = TCA_RTA(tcm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == TCA_STATS2) {
+            int nested = static_cast<int>(RTA_PAYLOAD(rta));
+            for (auto* sub = static_cast<struct rtattr*>(RTA_DATA(rta)); RTA_OK(sub, nested);
+                 sub = RTA_NEXT(sub, nested)) {
+                if (sub->rta_type == TCA_STATS_QUEUE &&
+                    RTA_PAYLOAD(sub) >= sizeof(struct gnet_stats_queue)) {
+                    struct gnet_stats_queue q;
+                    std::memcpy(&q, RTA_DATA(sub), sizeof(q));
+                    drops[ifindex] += q.drops;
+                    have_stats2 = true;
+                }
+            }
+        } else if (rta->rta_type == TCA_STATS && !have_stats2 &&
+                   RTA_PAYLOAD(rta) >= sizeof(struct tc_stats)) {
+            struct tc_stats s;
+            std::memcpy(&s, RTA_DATA(rta), sizeof(s));
+            drops[ifindex] += s.drops;
+        }
+    }
+}
+
+// Time to send `size` bytes at `rate` bytes/sec, in scheduler ticks
+uint32_t xmit_ticks(uint64_t rate, uint64_t size) {
+    double ticks = static_cast<double>(size) / static_cast<double>(rate) * PSCHED_TICKS_PER_SEC;
+    return static_cast<uint32_t>(std::min(ticks, static_cast<double>(UINT32_MAX)));
+}
+
+uint32_t clamp_u32(uint64_t value) {
+    return static_cast<uint32_t>(std::min<uint64_t>(value, UINT32_MAX));
+}
+
+void set_ratespec(struct tc_ratespec& spec, uint64_t rate) {
+    spec.rate = clamp_u32(rate);  // Rates past 4GB/s go in the RATE64 attribute
+    spec.linklayer = TC_LINKLAYER_ETHERNET;
+    spec.cell_align = -1;
+}
+
+uint64_t burst_bytes(uint64_t rate) {
+    return std::max(static_cast<uint64_t>(static_cast<double>(rate) * BURST_SEC), MIN_BURST_BYTES);
+}
+
+struct tcmsg make_tcmsg(uint32_t ifindex, uint32_t parent, uint32_t handle) {
+    struct tcmsg tcm{};
+    tcm.tcm_family = AF_UNSPEC;
+    tcm.tcm_ifindex = static_cast<int>(ifindex);
+    tcm.tcm_parent = parent;
+    tcm.tcm_handle = handle;
+    return tcm;
+}
+
+// Remove the qdisc attached at parent; a missing qdisc is not an error
+bool delete_qdisc(NetlinkSocket& sock, uint32_t ifindex, uint32_t parent, std::string& error) {
+    NetlinkMessage msg(RTM_DELQDISC, NLM_F_REQUEST | NLM_F_ACK);
+    msg.put_header(make_tcmsg(ifindex, parent, 0));
+    int err = exchange(sock, msg, "RTM_DELQDISC", [](const struct nlmsghdr*) {}, error);
+    if (err == ENOENT || err == EINVAL) {
+        error.clear();
+        return true;
+    }
+    return err == 0;
+}
+
+// tbf at the root shapes transmit; fq below it keeps flows fair
+bool shape_transmit(NetlinkSocket& sock, uint32_t ifindex, uint64_t rate, std::string& error) {
+    uint64_t burst = burst_bytes(rate);
+
+    struct tc_tbf_qopt qopt{};
+    set_ratespec(qopt.rate, rate);
+    qopt.limit = clamp_u32(static_cast<uint64_t>(static_cast<double>(rate) * QUEUE_SEC) + burst);
+    qopt.buffer = xmit_ticks(rate, burst);
+
+    NetlinkMessage tbf(RTM_NEWQDISC, NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE | NLM_F_REPLACE);
+    tbf.put_header(make_tcmsg(ifindex, TC_H_ROOT, TBF_HANDLE));
+    tbf.put_string(TCA_KIND, "tbf");
+    size_t options = tbf.begin_nest(TCA_OPTIONS);
+    tbf.put_value(TCA_TBF_PARMS, qopt);
+    tbf.put_value(TCA_TBF_BURST, clamp_u32(burst));
+    if (rate > UINT32_MAX) {
+        tbf.put_value(TCA_TBF_RATE64, rate);
+    }
+    tbf.end_nest(options);
+    if (exchange(sock, tbf, "RTM_NEWQDISC (tbf)", [](const struct nlmsghdr*) {}, error) != 0) {
+        return false;
+    }
+
+    // Without sch_fq the default bfifo child still enforces the rate
+    NetlinkMessage fq(RTM_NEWQDISC, NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE | NLM_F_REPLACE);
+    fq.put_header(make_tcmsg(ifindex, TBF_HANDLE | 1, FQ_HANDLE));
+    fq.put_string(TCA_KIND, "fq");
+    std::string ignored;
+    exchange(sock, fq, "RTM_NEWQDISC (fq)", [](const struct nlmsghdr*) {}, ignored);
+    return true;
+}
+
+// Receive can't be queued, so a matchall filter polices it on ingress
+bool police_receive(NetlinkSocket& sock, uint32_t ifindex, uint64_t rate, std::string& error) {
+    NetlinkMessage ingress(RTM_NEWQDISC, NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE | NLM_F_REPLACE);
+    ingress.put_header(make_tcmsg(ifindex, TC_H_INGRESS, INGRESS_HANDLE));
+    ingress.put_string(TCA_KIND, "ingress");
+    if (exchange(sock, ingress, "RTM_NEWQDISC (ingress)", [](const struct nlmsghdr*) {}, error) != 0) {
+        return false;
+    }
+
+    struct tc_police police{};
+    police.action = TC_ACT_SHOT;
+    police.mtu = POLICE_MTU;
+    set_ratespec(police.rate, rate);
+    police.burst = xmit_ticks(rate, burst_bytes(rate));
+
+    // The kernel still requires a rate table; same layout tc computes
+    uint8_t cell_log = 0;
+    while ((POLICE_MTU >> cell_log) > 255) {
+        cell_log++;
+    }
+    police.rate.cell_log = cell_log;
+    uint32_t rtab[256];
+    for (uint32_t i = 0; i < 256; i++) {
+        rtab[i] = xmit_ticks(rate, static_cast<uint64_t>(i + 1) << cell_log);
+    }
+
+    struct tcmsg tcm = make_tcmsg(ifindex, INGRESS_HANDLE, 0);
+    tcm.tcm_info = TC_H_MAKE(1U << 16, htons(ETH_P_ALL));  // prio 1, all protocols
+
+    NetlinkMessage filter(RTM_NEWTFILTER, NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE | NLM_F_EXCL);
+    filter.put_header(tcm);
+    filter.put_string(TCA_KIND, "matchall");
+    size_t options = filter.begin_nest(TCA_OPTIONS);
+    size_t actions = filter.begin_nest(TCA_MATCHALL_ACT);
+    size_t first = filter.begin_nest(1);
+    filter.put_string(TCA_ACT_KIND, "police");
+    size_t act_options = filter.begin_nest(TCA_ACT_OPTIONS | NLA_F_NESTED);  // As tc sends it
+    filter.put_value(TCA_POLICE_TBF, police);
+    filter.put_attr(TCA_POLICE_RATE, rtab, sizeof(rtab));
+    if (rate > UINT32_MAX) {
+        filter.put_value(TCA_POLICE_RATE64, rate);
+    }
+    filter.end_nest(act_options);
+    filter.end_nest(first);
+    filter.end_nest(actions);
+    filter.end_nest(options);
+    return exchange(sock, filter, "RTM_NEWTFILTER (police)", [](const struct nlmsghdr*) {}, error) == 0;
+}
+
+}  // anonymous namespace
+
+std::optional<std::vector<LinkStats>> dump_link_stats(std::string& error) {
+    NetlinkSocket sock;
+    if (sock.fd() < 0) {
+        error = std::string("Failed to open netlink socket: ") + std::strerror(errno);
+        return std::nullopt;
+    }
+
+    std::vector<LinkStats> result;
+    NetlinkMessage links(RTM_GETLINK, NLM_F_REQUEST | NLM_F_DUMP);
+    struct ifinfomsg ifi{};
+    ifi.ifi_family = AF_UNSPEC;
+    links.put_header(ifi);
+    if (exchange(sock, links, "RTM_GETLINK",
+                 [&](const struct nlmsghdr* nh) { parse_link(nh, result); }, error) != 0) {
+        return std::nullopt;
+    }
+
+    std::map<uint32_t, uint64_t> drops;
+    NetlinkMessage qdiscs(RTM_GETQDISC, NLM_F_REQUEST | NLM_F_DUMP);
+    qdiscs.put_header(make_tcmsg(0, 0, 0));
+    if (exchange(sock, qdiscs, "RTM_GETQDISC",
+                 [&](const struct nlmsghdr* nh) { parse_qdisc(nh, drops); }, error) != 0) {
+        return std::nullopt;
+    }
+    for (auto& link : result) {
+        auto it = drops.find(link.ifindex);
+        if (it != drops.end()) {
+            link.qdisc_dropped = it->second;
+        }
+    }
+    return result;
+}
+
+bool set_link_rate_limits(const std::string& ifname,
+                          uint64_t tx_bits_per_sec,
+                          uint64_t rx_bits_per_sec,
+                          std::string& error) {
+    uint32_t ifindex = if_nametoindex(ifname.c_str());
+    if (ifindex == 0) {
+        error = "Interface not found: " + ifname;
+        return false;
+    }
+
+    NetlinkSocket sock;
+    if (sock.fd() < 0) {
+        error = std::string("Failed to open netlink socket: ") + std::strerror(errno);
+        return false;
+    }
+
+    if (tx_bits_per_sec > 0) {
+        if (!shape_transmit(sock, ifindex, std::max<uint64_t>(tx_bits_per_sec / 8, 1), error)) {
+            return false;
+        }
+    } else if (!delete_qdisc(sock, ifindex, TC_H_ROOT, error)) {
+        return false;
+    }
+
+    // Rebuilding the ingress qdisc drops any previous police filter with it
+    if (!delete_qdisc(sock, ifindex, TC_H_INGRESS, error)) {
+        return false;
+    }
+    if (rx_bits_per_sec > 0) {
+        return police_receive(sock, ifindex, std::max<uint64_t>(rx_bits_per_sec / 8, 1), error);
+    }
+    return true;
+}
+
+} // namespace utils
+} // namespace vmstate
@@ -0,0 +1,49 @@
+#include "utils/output.hpp"
+#include <cerrno>
+#include <unistd.h>
+
+namespace vmstate {
+namespace utils {
+
+Output::Output(int fd, size_t capacity)
+    : fd_(fd), capacity_(capacity), tty_(isatty(fd) != 0) {
+    buffer_.reserve(capacity_);
+}
+
+Output::~Output() {
+    flush();
+}
+
+bool Output::flush() {
+    return write_out(buffer_.size());
+}
+
+void Output::after_append() {
+    if (buffer_.size() >= capacity_) {
+        flush();
+    } else if (tty_) {
+        size_t newline = buffer_.rfind('\n');
+        if (newline != std::string::npos) {
+            write_out(newline + 1);
+        }
+    }
+}
+
+bool Output::write_out(size_t len) {
+    size_t done = 0;
+    while (done < len && !failed_) {
+        ssize_t n = ::write(fd_, buffer_.data() + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            // Reader went away; drop further output rather than retrying
+            failed_ = true;
+            break;
+        }
+        done += static_cast<size_t>(n);
+    }
+    buffer_.erase(0, len);
+    return !failed_;
+}
+
+} // namespace utils
+} // namespace vmstate
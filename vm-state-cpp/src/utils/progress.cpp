@@ -0,0 +1,116 @@
+#include "utils/progress.hpp"
+#include "utils/json.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <dirent.h>
+#include <map>
+
+namespace vmstate {
+namespace utils {
+
+namespace {
+
+constexpr std::chrono::milliseconds RATE_SAMPLE_INTERVAL{500};
+
+// Weight of the newest sample in the smoothed rate
+constexpr double RATE_SMOOTHING = 0.3;
+
+bool process_alive(int pid) {
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+}  // anonymous namespace
+
+ProgressMeter::ProgressMeter(const std::string& operation, const std::string& target)
+    : started_(std::chrono::steady_clock::now()), last_sample_(started_) {
+    progress_.operation = operation;
+    progress_.target = target;
+}
+
+const OperationProgress& ProgressMeter::update(const std::string& phase,
+                                               uint64_t done, uint64_t total) {
+    auto now = std::chrono::steady_clock::now();
+    if (phase != progress_.phase || done < last_bytes_) {
+        progress_.phase = phase;
+        progress_.bytes_per_second = 0;
+        last_sample_ = now;
+        last_bytes_ = done;
+    } else if (now - last_sample_ >= RATE_SAMPLE_INTERVAL) {
+        std::chrono::duration<double> interval = now - last_sample_;
+        double rate = static_cast<double>(done - last_bytes_) / interval.count();
+        progress_.bytes_per_second = progress_.bytes_per_second == 0
+            ? rate
+            : RATE_SMOOTHING * rate + (1 - RATE_SMOOTHING) * progress_.bytes_per_second;
+        last_sample_ = now;
+        last_bytes_ = done;
+    }
+    progress_.bytes_done = done;
+    progress_.bytes_total = total;
+    progress_.elapsed_seconds = std::chrono::duration<double>(now - started_).count();
+    return progress_;
+}
+
+const OperationProgress& ProgressMeter::get() const {
+    return progress_;
+}
+
+bool write_job_file(const std::string& path, const OperationProgress& progress) {
+    return write_json_file(path, {
+        {"operation", progress.operation},
+        {"target", progress.target},
+        {"phase", progress.phase},
+        {"bytes_done", std::to_string(progress.bytes_done)},
+        {"bytes_total", std::to_string(progress.bytes_total)},
+        {"bytes_per_second", std::to_string(static_cast<uint64_t>(progress.bytes_per_second))},
+        {"elapsed_seconds", std::to_string(progress.elapsed_seconds)},
+        {"pid", std::to_string(progress.pid)},
+    });
+}
+
+std::vector<OperationProgress> read_job_files(const std::string& dir) {
+    std::vector<OperationProgress> jobs;
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        return jobs;
+    }
+    while (struct dirent* entry = readdir(d)) {
+        std::string name = entry->d_name;
+        if (name.size() < 6 || name.compare(name.size() - 5, 5, ".json") != 0) {
+            continue;
+        }
+        auto data = read_json_file(dir + "/" + name);
+        if (!data) {
+            continue;
+        }
+        auto field = [&](const char* key) {
+            auto it = data->find(key);
+            return it == data->end() ? std::string() : it->second;
+        };
+
+        OperationProgress job;
+        job.pid = std::atoi(field("pid").c_str());
+        // A crashed process leaves its file behind; it isn't a job anymore
+        if (!process_alive(job.pid)) {
+            continue;
+        }
+        job.operation = field("operation");
+        job.target = field("target");
+        job.phase = field("phase");
+        job.bytes_done = std::strtoull(field("bytes_done").c_str(), nullptr, 10);
+        job.bytes_total = std::strtoull(field("bytes_total").c_str(), nullptr, 10);
+        job.bytes_per_second = std::strtod(field("bytes_per_second").c_str(), nullptr);
+        job.elapsed_seconds = std::strtod(field("elapsed_seconds").c_str(), nullptr);
+        jobs.push_back(job);
+    }
+    closedir(d);
+
+    std::sort(jobs.begin(), jobs.end(), [](const auto& a, const auto& b) {
+        return a.pid < b.pid;
+    });
+    return jobs;
+}
+
+} // namespace utils
+} // namespace vmstate
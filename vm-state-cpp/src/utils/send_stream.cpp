@@ -0,0 +1,201 @@
+#include "utils/send_stream.hpp"
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <vector>
+
+namespace vmstate {
+namespace utils {
+
+namespace {
+
+// dmu_replay_record_t: type and payload length, then a 304-byte union
+constexpr size_t RECORD_SIZE = 312;
+constexpr size_t BODY = 8;
+
+constexpr uint64_t BACKUP_MAGIC = 0x2F5bacbacULL;
+
+enum RecordType : uint32_t {
+    DRR_BEGIN, DRR_OBJECT, DRR_FREEOBJECTS, DRR_WRITE, DRR_FREE, DRR_END,
+    DRR_WRITE_BYREF, DRR_SPILL, DRR_WRITE_EMBEDDED, DRR_OBJECT_RANGE, DRR_REDACT,
+    DRR_NUMTYPES
+};
+
+// zio_compress: spill records of non-raw streams carry 0 (inherit) here
+constexpr uint8_t ZIO_COMPRESS_OFF = 2;
+
+// struct drr_spill offsets within the union
+constexpr size_t SPILL_LENGTH = 8;
+constexpr size_t SPILL_COMPRESSION = 25;    // After drr_flags
+constexpr size_t SPILL_COMPRESSED_SIZE = 32;
+
+constexpr uint64_t PROGRESS_INTERVAL = 16 * 1024 * 1024;
+
+template <typename T>
+T get(const uint8_t* p, size_t offset) {
+    T value;
+    std::memcpy(&value, p + offset, sizeof(value));
+    return value;
+}
+
+uint64_t round_up8(uint64_t n) {
+    return (n + 7) & ~uint64_t{7};
+}
+
+// Buffered reads that can also skip (read and drop) payloads
+class StreamReader {
+public:
+    explicit StreamReader(int fd) : fd_(fd), buffer_(1024 * 1024) {}
+
+    // Fill dst (or drop n bytes if dst is null); false at EOF or on error
+    bool read(uint8_t* dst, uint64_t n, std::string& error) {
+        while (n > 0) {
+            if (pos_ == len_ && !fill(error)) {
+                return false;
+            }
+            size_t take = static_cast<size_t>(std::min<uint64_t>(n, len_ - pos_));
+            if (dst) {
+                std::memcpy(dst, buffer_.data() + pos_, take);
+                dst += take;
+            }
+            pos_ += take;
+            n -= take;
+        }
+        return true;
+    }
+
+    // Read to EOF so a writer on the other end can finish
+    void drain() {
+        std::string ignored;
+        while (fill(ignored)) {
+            pos_ = len_;
+        }
+    }
+
+    uint64_t consumed() const {
+        return total_ - (len_ - pos_);
+    }
+
+private:
+    bool fill(std::string& error) {
+        ssize_t n;
+        do {
+            n = ::read(fd_, buffer_.data(), buffer_.size());
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            error = std::string("Failed to read send stream: ") + std::strerror(errno);
+            return false;
+        }
+        if (n == 0) {
+            error = "Send stream ended before its END record";
+            return false;
+        }
+        pos_ = 0;
+        len_ = static_cast<size_t>(n);
+        total_ += static_cast<uint64_t>(n);
+        return true;
+    }
+
+    int fd_;
+    std::vector<uint8_t> buffer_;
+    size_t pos_ = 0;
+    size_t len_ = 0;
+    uint64_t total_ = 0;
+};
+
+}  // anonymous namespace
+
+bool scan_send_stream(int fd, const std::function<void(const SendRange&)>& fn,
+                      std::string& error, const std::function<void(uint64_t)>& progress) {
+    StreamReader reader(fd);
+    uint8_t record[RECORD_SIZE];
+    uint64_t reported = 0;
+    bool ok = false;
+
+    for (bool first = true;; first = false) {
+        if (!reader.read(record, RECORD_SIZE, error)) {
+            break;
+        }
+        const uint8_t* body = record + BODY;
+        auto type = get<uint32_t>(record, 0);
+        uint64_t payload = 0;
+
+        if (first && (type != DRR_BEGIN || get<uint64_t>(body, 0) != BACKUP_MAGIC)) {
+            error = "Not a send stream (or from a host of the other byte order)";
+            break;
+        }
+        switch (type) {
+        case DRR_BEGIN:
+            payload = get<uint32_t>(record, 4);    // drr_payloadlen: an nvlist
+            break;
+        case DRR_OBJECT: {
+            auto raw_bonuslen = get<uint32_t>(body, 28);
+            payload = raw_bonuslen != 0 ? raw_bonuslen : round_up8(get<uint32_t>(body, 20));
+            break;
+        }
+        case DRR_WRITE: {
+            auto logical = get<uint64_t>(body, 24);
+            fn(SendRange{get<uint64_t>(body, 0), get<uint64_t>(body, 16), logical,
+                         false});
+            payload = get<uint8_t>(body, 42) != 0 ? get<uint64_t>(body, 88) : logical;
+            break;
+        }
+        case DRR_FREE:
+            fn(SendRange{get<uint64_t>(body, 0), get<uint64_t>(body, 8),
+                         get<uint64_t>(body, 16), true});
+            break;
+        case DRR_WRITE_BYREF:
+            fn(SendRange{get<uint64_t>(body, 0), get<uint64_t>(body, 8),
+                         get<uint64_t>(body, 16), false});
+            break;
+        case DRR_WRITE_EMBEDDED:
+            fn(SendRange{get<uint64_t>(body, 0), get<uint64_t>(body, 8),
+                         get<uint64_t>(body, 16), false});
+            payload = round_up8(get<uint32_t>(body, 44));
+            break;
+        case DRR_SPILL: {
+            // DRR_SPILL_PAYLOAD_SIZE: the compressed size only for a
+            // compressed (raw) record; drr_flags (e.g. UNMODIFIED on
+            // incrementals) doesn't change the payload
+            auto compressed = get<uint64_t>(body, SPILL_COMPRESSED_SIZE);
+            auto compression = get<uint8_t>(body, SPILL_COMPRESSION);
+            payload = compression != ZIO_COMPRESS_OFF && compressed != 0
+                          ? compressed
+                          : get<uint64_t>(body, SPILL_LENGTH);
+            break;
+        }
+        case DRR_FREEOBJECTS:
+        case DRR_OBJECT_RANGE:
+        case DRR_REDACT:
+        case DRR_END:
+            break;
+        default:
+            error = "Unknown send stream record type " + std::to_string(type) +
+                    " at byte " + std::to_string(reader.consumed() - RECORD_SIZE);
+            break;
+        }
+        if (type >= DRR_NUMTYPES) {
+            break;
+        }
+        if (type == DRR_END) {
+            if (progress) {
+                progress(reader.consumed());
+            }
+            ok = true;
+            break;
+        }
+        if (payload > 0 && !reader.read(nullptr, payload, error)) {
+            break;
+        }
+        if (progress && reader.consumed() - reported >= PROGRESS_INTERVAL) {
+            reported = reader.consumed();
+            progress(reported);
+        }
+    }
+
+    reader.drain();
+    return ok;
+}
+
+} // namespace utils
+} // namespace vmstate
@@ -0,0 +1,62 @@
+#include "utils/slot_link.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace vmstate {
+namespace utils {
+
+bool install_slot_link(const std::string& path, const std::string& target,
+                       std::string& error) {
+    std::string staged = path + ".tmp";
+    std::string backup = path + ".backup";
+
+    // A stage left by an interrupted assign is a link; anything else there
+    // isn't ours to delete
+    struct stat st;
+    if (lstat(staged.c_str(), &st) == 0) {
+        if (!S_ISLNK(st.st_mode)) {
+            error = staged + " exists and is not a link; move it aside first";
+            return false;
+        }
+        unlink(staged.c_str());
+    }
+    if (symlink(target.c_str(), staged.c_str()) != 0) {
+        error = "Failed to create symlink: " + std::string(std::strerror(errno));
+        return false;
+    }
+
+    if (lstat(path.c_str(), &st) == 0 && !S_ISLNK(st.st_mode)) {
+        if (!S_ISREG(st.st_mode)) {
+            error = path + " exists and is neither a link nor a file";
+            unlink(staged.c_str());
+            return false;
+        }
+        if (lstat(backup.c_str(), &st) == 0) {
+            error = path + " is a file and " + backup + " already exists; "
+                    "move one of them aside first";
+            unlink(staged.c_str());
+            return false;
+        }
+        // The slot goes without data.img until the rename below; reconcile
+        // links a slot whose image is only in the backup
+        if (rename(path.c_str(), backup.c_str()) != 0) {
+            error = "Failed to backup existing file: " + std::string(std::strerror(errno));
+            unlink(staged.c_str());
+            return false;
+        }
+    }
+
+    // Replacing a link (or nothing) with rename(2) is atomic
+    if (rename(staged.c_str(), path.c_str()) != 0) {
+        error = "Failed to install symlink: " + std::string(std::strerror(errno));
+        unlink(staged.c_str());
+        return false;
+    }
+    return true;
+}
+
+} // namespace utils
+} // namespace vmstate
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdio>
+
+// Checks shared by the test programs: CHECK reports a failed condition and
+// carries on, so one run lists every failure; main() ends with
+// return check_result().
+
+namespace vmstate {
+namespace testing {
+
+inline int failures = 0;
+
+/**
+ * Report the outcome of all checks
+ * @return Exit code for main(): 0 if every check passed
+ */
+inline int check_result() {
+    if (failures > 0) {
+        std::fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    std::printf("all checks passed\n");
+    return 0;
+}
+
+} // namespace testing
+} // namespace vmstate
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            std::fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__,     \
+                         __LINE__, #cond);                                   \
+            vmstate::testing::failures++;                                    \
+        }                                                                    \
+    } while (0)
@@ -0,0 +1,646 @@
+#include "fake_systemd.hpp"
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fnmatch.h>
+#include <fstream>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace vmstate {
+namespace testing {
+
+namespace {
+
+constexpr const char* MANAGER_PATH = "/org/freedesktop/systemd1";
+constexpr const char* MANAGER_INTERFACE = "org.freedesktop.systemd1.Manager";
+constexpr const char* UNIT_PREFIX = "/org/freedesktop/systemd1/unit";
+constexpr const char* UNIT_INTERFACE = "org.freedesktop.systemd1.Unit";
+constexpr const char* SERVICE_INTERFACE = "org.freedesktop.systemd1.Service";
+
+// Upper bound on how long the loop sleeps, so stop() is noticed promptly
+constexpr uint64_t MAX_WAIT_USEC = 50000;
+
+// How long start() waits for dbus-daemon to create its socket
+constexpr auto DAEMON_TIMEOUT = std::chrono::seconds(5);
+
+// Accept any connection, name and message: the bus is private to the test
+constexpr const char* BUS_CONFIG = R"(<!DOCTYPE busconfig PUBLIC "-//freedesktop//DTD D-Bus Bus Configuration 1.0//EN"
+ "http://www.freedesktop.org/standards/dbus/1.0/busconfig.dtd">
+<busconfig>
+  <type>fake-system</type>
+  <listen>unix:path=@SOCKET@</listen>
+  <auth>EXTERNAL</auth>
+  <policy context="default">
+    <allow user="*"/>
+    <allow own="*"/>
+    <allow send_type="method_call"/>
+    <allow send_type="signal"/>
+    <allow send_requested_reply="true" send_type="method_return"/>
+    <allow send_requested_reply="true" send_type="error"/>
+    <allow receive_type="method_call"/>
+    <allow receive_type="method_return"/>
+    <allow receive_type="error"/>
+    <allow receive_type="signal"/>
+  </policy>
+</busconfig>
+)";
+
+}  // anonymous namespace
+
+const sd_bus_vtable FakeSystemd::manager_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_METHOD("StartUnit", "ss", "o", FakeSystemd::method_job, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("StopUnit", "ss", "o", FakeSystemd::method_job, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("RestartUnit", "ss", "o", FakeSystemd::method_job, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("GetUnit", "s", "o", FakeSystemd::method_get_unit, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("LoadUnit", "s", "o", FakeSystemd::method_load_unit, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("Subscribe", "", "", FakeSystemd::method_subscribe, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("ListUnitsByPatterns", "asas", "a(ssssssouso)",
+                  FakeSystemd::method_list_units_by_patterns, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("StartTransientUnit", "ssa(sv)a(sa(sv))", "o",
+                  FakeSystemd::method_start_transient_unit, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_SIGNAL("JobRemoved", "uoss", 0),
+    SD_BUS_VTABLE_END
+};
+
+const sd_bus_vtable FakeSystemd::unit_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_PROPERTY("ActiveState", "s", FakeSystemd::property_active_state, 0, 0),
+    SD_BUS_VTABLE_END
+};
+
+const sd_bus_vtable FakeSystemd::service_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_PROPERTY("ControlGroup", "s", FakeSystemd::property_control_group, 0, 0),
+    SD_BUS_VTABLE_END
+};
+
+FakeSystemd::FakeSystemd() = default;
+
+FakeSystemd::~FakeSystemd() {
+    stop();
+}
+
+bool FakeSystemd::start() {
+    char dir_template[] = "/tmp/fake-systemd-XXXXXX";
+    if (!mkdtemp(dir_template)) {
+        last_error_ = std::string("Failed to create bus directory: ") + strerror(errno);
+        return false;
+    }
+    dir_ = dir_template;
+
+    std::string socket_path = dir_ + "/bus";
+    std::string config_path = dir_ + "/bus.conf";
+    {
+        std::string config = BUS_CONFIG;
+        config.replace(config.find("@SOCKET@"), 8, socket_path);
+        std::ofstream out(config_path);
+        out << config;
+        if (!out.flush()) {
+            last_error_ = "Failed to write " + config_path;
+            return false;
+        }
+    }
+
+    std::string config_arg = "--config-file=" + config_path;
+    daemon_pid_ = fork();
+    if (daemon_pid_ < 0) {
+        last_error_ = std::string("Fork failed: ") + strerror(errno);
+        return false;
+    }
+    if (daemon_pid_ == 0) {
+        execlp("dbus-daemon", "dbus-daemon", config_arg.c_str(), "--nofork", "--nopidfile",
+               static_cast<char*>(nullptr));
+        _exit(127);
+    }
+
+    // The socket appears once the daemon is ready to accept connections
+    auto deadline = std::chrono::steady_clock::now() + DAEMON_TIMEOUT;
+    struct stat st;
+    while (stat(socket_path.c_str(), &st) != 0) {
+        int status;
+        if (waitpid(daemon_pid_, &status, WNOHANG) == daemon_pid_) {
+            daemon_pid_ = -1;
+            last_error_ = "dbus-daemon exited during startup (is it installed?)";
+            return false;
+        }
+        if (std::chrono::steady_clock::now() > deadline) {
+            last_error_ = "Timed out waiting for dbus-daemon";
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    address_ = "unix:path=" + socket_path;
+
+    int r = sd_bus_new(&bus_);
+    if (r >= 0) r = sd_bus_set_address(bus_, address_.c_str());
+    if (r >= 0) r = sd_bus_set_bus_client(bus_, 1);
+    if (r >= 0) r = sd_bus_start(bus_);
+    if (r >= 0) {
+        r = sd_bus_add_object_vtable(bus_, nullptr, MANAGER_PATH, MANAGER_INTERFACE,
+                                     manager_vtable, this);
+    }
+    if (r >= 0) {
+        r = sd_bus_add_fallback_vtable(bus_, nullptr, UNIT_PREFIX, UNIT_INTERFACE,
+                                       unit_vtable, nullptr, this);
+    }
+    if (r >= 0) {
+        r = sd_bus_add_fallback_vtable(bus_, nullptr, UNIT_PREFIX, SERVICE_INTERFACE,
+                                       service_vtable, nullptr, this);
+    }
+    if (r >= 0) r = sd_bus_request_name(bus_, "org.freedesktop.systemd1", 0);
+    if (r < 0) {
+        last_error_ = std::string("Failed to set up fake systemd service: ") + strerror(-r);
+        return false;
+    }
+
+    const char* previous = getenv("DBUS_SYSTEM_BUS_ADDRESS");
+    if (previous) {
+        saved_address_ = previous;
+    }
+    setenv("DBUS_SYSTEM_BUS_ADDRESS", address_.c_str(), 1);
+
+    running_ = true;
+    thread_ = std::thread(&FakeSystemd::serve, this);
+    return true;
+}
+
+void FakeSystemd::stop() {
+    if (running_) {
+        running_ = false;
+        thread_.join();
+        if (saved_address_) {
+            setenv("DBUS_SYSTEM_BUS_ADDRESS", saved_address_->c_str(), 1);
+        } else {
+            unsetenv("DBUS_SYSTEM_BUS_ADDRESS");
+        }
+    }
+    if (bus_) {
+        sd_bus_flush_close_unref(bus_);
+        bus_ = nullptr;
+    }
+    if (daemon_pid_ > 0) {
+        kill(daemon_pid_, SIGTERM);
+        waitpid(daemon_pid_, nullptr, 0);
+        daemon_pid_ = -1;
+    }
+    if (!dir_.empty()) {
+        unlink((dir_ + "/bus").c_str());
+        unlink((dir_ + "/bus.conf").c_str());
+        rmdir(dir_.c_str());
+        dir_.clear();
+    }
+}
+
+std::string FakeSystemd::address() const {
+    return address_;
+}
+
+void FakeSystemd::add_unit(const std::string& unit, const std::string& active_state) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    units_[unit] = active_state;
+}
+
+std::string FakeSystemd::active_state(const std::string& unit) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = units_.find(unit);
+    return it != units_.end() ? it->second : "";
+}
+
+void FakeSystemd::set_reply_delay(const std::string& method, std::chrono::milliseconds delay) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    reply_delays_[method] = delay;
+}
+
+void FakeSystemd::set_job_delay(std::chrono::milliseconds delay) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    job_delay_ = delay;
+}
+
+void FakeSystemd::fail_next(const std::string& method, const std::string& error_name, int count) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    failures_[method] = {error_name, count};
+}
+
+void FakeSystemd::set_job_result(const std::string& unit, const std::string& result) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    job_results_[unit] = result;
+}
+
+void FakeSystemd::set_control_group(const std::string& unit, const std::string& cgroup) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    control_groups_[unit] = cgroup;
+}
+
+std::map<std::string, std::string> FakeSystemd::transient_properties(
+    const std::string& unit) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = transient_units_.find(unit);
+    return it != transient_units_.end() ? it->second : std::map<std::string, std::string>{};
+}
+
+unsigned FakeSystemd::call_count(const std::string& method) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = calls_.find(method);
+    return it != calls_.end() ? it->second : 0;
+}
+
+std::string FakeSystemd::get_last_error() const {
+    return last_error_;
+}
+
+int FakeSystemd::begin_call(const std::string& method, sd_bus_error* error) {
+    std::chrono::milliseconds delay{0};
+    std::string failure;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        calls_[method]++;
+        auto d = reply_delays_.find(method);
+        if (d != reply_delays_.end()) {
+            delay = d->second;
+        }
+        auto f = failures_.find(method);
+        if (f != failures_.end() && f->second.second > 0) {
+            failure = f->second.first;
+            f->second.second--;
+        }
+    }
+
+    // Like systemd, the manager is single-threaded: a slow reply stalls
+    // every other caller too
+    if (delay.count() > 0) {
+        std::this_thread::sleep_for(delay);
+    }
+    if (!failure.empty()) {
+        return sd_bus_error_setf(error, failure.c_str(), "Injected failure for %s", method.c_str());
+    }
+    return 0;
+}
+
+std::string FakeSystemd::unit_path(const std::string& unit) const {
+    char* path = nullptr;
+    if (sd_bus_path_encode(UNIT_PREFIX, unit.c_str(), &path) < 0) {
+        return UNIT_PREFIX;
+    }
+    std::string result(path);
+    free(path);
+    return result;
+}
+
+int FakeSystemd::method_job(sd_bus_message* m, void* userdata, sd_bus_error* error) {
+    auto* self = static_cast<FakeSystemd*>(userdata);
+    std::string method = sd_bus_message_get_member(m);
+
+    const char* unit = nullptr;
+    const char* mode = nullptr;
+    int r = sd_bus_message_read(m, "ss", &unit, &mode);
+    if (r < 0) {
+        return r;
+    }
+    r = self->begin_call(method, error);
+    if (r < 0) {
+        return r;
+    }
+
+    Job job;
+    std::string job_path;
+    {
+        std::lock_guard<std::mutex> lock(self->mutex_);
+        auto it = self->units_.find(unit);
+        if (it == self->units_.end()) {
+            return sd_bus_error_setf(error, "org.freedesktop.systemd1.NoSuchUnit",
+                                     "Unit %s not found.", unit);
+        }
+
+        job.id = self->next_job_id_++;
+        job.unit = unit;
+        job.result = "done";
+        if (method == "StopUnit") {
+            it->second = "deactivating";
+            job.final_state = "inactive";
+        } else {
+            auto result = self->job_results_.find(unit);
+            if (result != self->job_results_.end()) {
+                job.result = result->second;
+            }
+            it->second = "activating";
+            job.final_state = job.result == "done" ? "active" : "failed";
+        }
+        job.due = std::chrono::steady_clock::now() + self->job_delay_;
+        self->jobs_.push_back(job);
+    }
+
+    job_path = std::string(MANAGER_PATH) + "/job/" + std::to_string(job.id);
+    return sd_bus_reply_method_return(m, "o", job_path.c_str());
+}
+
+int FakeSystemd::method_get_unit(sd_bus_message* m, void* userdata, sd_bus_error* error) {
+    auto* self = static_cast<FakeSystemd*>(userdata);
+    const char* unit = nullptr;
+    int r = sd_bus_message_read(m, "s", &unit);
+    if (r < 0) {
+        return r;
+    }
+    r = self->begin_call("GetUnit", error);
+    if (r < 0) {
+        return r;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(self->mutex_);
+        if (self->units_.find(unit) == self->units_.end()) {
+            return sd_bus_error_setf(error, "org.freedesktop.systemd1.NoSuchUnit",
+                                     "Unit %s not loaded.", unit);
+        }
+    }
+    return sd_bus_reply_method_return(m, "o", self->unit_path(unit).c_str());
+}
+
+int FakeSystemd::method_load_unit(sd_bus_message* m, void* userdata, sd_bus_error* error) {
+    auto* self = static_cast<FakeSystemd*>(userdata);
+    const char* unit = nullptr;
+    int r = sd_bus_message_read(m, "s", &unit);
+    if (r < 0) {
+        return r;
+    }
+    r = self->begin_call("LoadUnit", error);
+    if (r < 0) {
+        return r;
+    }
+
+    // systemd loads any name; unknown units simply stay inactive
+    {
+        std::lock_guard<std::mutex> lock(self->mutex_);
+        self->units_.emplace(unit, "inactive");
+    }
+    return sd_bus_reply_method_return(m, "o", self->unit_path(unit).c_str());
+}
+
+int FakeSystemd::method_list_units_by_patterns(sd_bus_message* m, void* userdata,
+                                               sd_bus_error* error) {
+    auto* self = static_cast<FakeSystemd*>(userdata);
+    char** states = nullptr;
+    char** patterns = nullptr;
+    int r = sd_bus_message_read_strv(m, &states);
+    if (r >= 0) {
+        r = sd_bus_message_read_strv(m, &patterns);
+    }
+    auto matches = [&](const std::string& unit, const std::string& state) {
+        bool state_ok = !states || !states[0];
+        for (char** s = states; s && *s && !state_ok; s++) {
+            state_ok = state == *s;
+        }
+        bool pattern_ok = !patterns || !patterns[0];
+        for (char** p = patterns; p && *p && !pattern_ok; p++) {
+            pattern_ok = fnmatch(*p, unit.c_str(), 0) == 0;
+        }
+        return state_ok && pattern_ok;
+    };
+
+    sd_bus_message* reply = nullptr;
+    if (r >= 0) r = self->begin_call("ListUnitsByPatterns", error);
+    if (r >= 0) r = sd_bus_message_new_method_return(m, &reply);
+    if (r >= 0) r = sd_bus_message_open_container(reply, 'a', "(ssssssouso)");
+    if (r >= 0) {
+        std::lock_guard<std::mutex> lock(self->mutex_);
+        for (const auto& [unit, state] : self->units_) {
+            if (!matches(unit, state)) {
+                continue;
+            }
+            std::string path = self->unit_path(unit);
+            r = sd_bus_message_append(reply, "(ssssssouso)", unit.c_str(), "", "loaded",
+                                      state.c_str(), "", "", path.c_str(), 0u, "", "/");
+            if (r < 0) {
+                break;
+            }
+        }
+    }
+    if (r >= 0) r = sd_bus_message_close_container(reply);
+    if (r >= 0) r = sd_bus_send(nullptr, reply, nullptr);
+    sd_bus_message_unref(reply);
+    for (char** list : {states, patterns}) {
+        for (char** s = list; s && *s; s++) {
+            free(*s);
+        }
+        free(list);
+    }
+    return r;
+}
+
+int FakeSystemd::method_subscribe(sd_bus_message* m, void* userdata, sd_bus_error* error) {
+    auto* self = static_cast<FakeSystemd*>(userdata);
+    int r = self->begin_call("Subscribe", error);
+    if (r < 0) {
+        return r;
+    }
+    return sd_bus_reply_method_return(m, "");
+}
+
+int FakeSystemd::method_start_transient_unit(sd_bus_message* m, void* userdata,
+                                             sd_bus_error* error) {
+    auto* self = static_cast<FakeSystemd*>(userdata);
+    const char* unit = nullptr;
+    const char* mode = nullptr;
+    int r = sd_bus_message_read(m, "ss", &unit, &mode);
+    if (r < 0) {
+        return r;
+    }
+
+    // Render each property's value; only the types the provider sends
+    // (s, t, u, au, a(st) and an ExecStart a(sasb)) are understood,
+    // anything else is skipped
+    std::map<std::string, std::string> properties;
+    r = sd_bus_message_enter_container(m, 'a', "(sv)");
+    while (r >= 0 && (r = sd_bus_message_enter_container(m, 'r', "sv")) > 0) {
+        const char* name = nullptr;
+        const char* contents = nullptr;
+        char type = 0;
+        r = sd_bus_message_read(m, "s", &name);
+        if (r >= 0) r = sd_bus_message_peek_type(m, &type, &contents);
+        if (r < 0) break;
+
+        std::string value;
+        std::string signature = contents ? contents : "";
+        if (signature == "s") {
+            const char* text = nullptr;
+            r = sd_bus_message_read(m, "v", "s", &text);
+            value = text ? text : "";
+        } else if (signature == "t") {
+            uint64_t number = 0;
+            r = sd_bus_message_read(m, "v", "t", &number);
+            value = std::to_string(number);
+        } else if (signature == "u") {
+            uint32_t number = 0;
+            r = sd_bus_message_read(m, "v", "u", &number);
+            value = std::to_string(number);
+        } else if (signature == "au" || signature == "a(st)") {
+            r = sd_bus_message_enter_container(m, 'v', signature.c_str());
+            if (r >= 0) r = sd_bus_message_enter_container(m, 'a', signature.c_str() + 1);
+            while (r >= 0) {
+                std::string item;
+                if (signature == "au") {
+                    uint32_t number = 0;
+                    r = sd_bus_message_read(m, "u", &number);
+                    item = std::to_string(number);
+                } else {
+                    const char* device = nullptr;
+                    uint64_t bytes = 0;
+                    r = sd_bus_message_read(m, "(st)", &device, &bytes);
+                    if (r > 0) item = std::string(device) + " " + std::to_string(bytes);
+                }
+                if (r <= 0) break;
+                value += (value.empty() ? "" : ",") + item;
+            }
+            if (r >= 0) r = sd_bus_message_exit_container(m);
+            if (r >= 0) r = sd_bus_message_exit_container(m);
+        } else if (signature == "a(sasb)") {
+            // Rendered as the command line, words separated by spaces
+            r = sd_bus_message_enter_container(m, 'v', "a(sasb)");
+            if (r >= 0) r = sd_bus_message_enter_container(m, 'a', "(sasb)");
+            while (r >= 0 && (r = sd_bus_message_enter_container(m, 'r', "sasb")) > 0) {
+                const char* path = nullptr;
+                int ignore = 0;
+                std::string command;
+                r = sd_bus_message_read(m, "s", &path);
+                if (r >= 0) r = sd_bus_message_enter_container(m, 'a', "s");
+                const char* word = nullptr;
+                while (r >= 0 && (r = sd_bus_message_read(m, "s", &word)) > 0) {
+                    command += (command.empty() ? "" : " ") + std::string(word);
+                }
+                if (r >= 0) r = sd_bus_message_exit_container(m);
+                if (r >= 0) r = sd_bus_message_read(m, "b", &ignore);
+                if (r >= 0) r = sd_bus_message_exit_container(m);
+                value += (value.empty() ? "" : ";") + command;
+            }
+            if (r >= 0) r = sd_bus_message_exit_container(m);
+            if (r >= 0) r = sd_bus_message_exit_container(m);
+        } else {
+            r = sd_bus_message_skip(m, "v");
+        }
+        if (r >= 0) r = sd_bus_message_exit_container(m);
+        properties[name] = value;
+    }
+    if (r >= 0) r = sd_bus_message_exit_container(m);
+    if (r < 0) {
+        return r;
+    }
+
+    r = self->begin_call("StartTransientUnit", error);
+    if (r < 0) {
+        return r;
+    }
+    uint32_t id;
+    {
+        std::lock_guard<std::mutex> lock(self->mutex_);
+        // Scopes start at once, and services are never run: there is
+        // nothing to exec
+        self->units_[unit] = "active";
+        self->transient_units_[unit] = properties;
+        id = self->next_job_id_++;
+    }
+    std::string job_path = std::string(MANAGER_PATH) + "/job/" + std::to_string(id);
+    return sd_bus_reply_method_return(m, "o", job_path.c_str());
+}
+
+int FakeSystemd::property_active_state(sd_bus* /*bus*/, const char* path,
+                                       const char* /*interface*/, const char* /*property*/,
+                                       sd_bus_message* reply, void* userdata,
+                                       sd_bus_error* error) {
+    auto* self = static_cast<FakeSystemd*>(userdata);
+    int r = self->begin_call("ActiveState", error);
+    if (r < 0) {
+        return r;
+    }
+
+    char* unit = nullptr;
+    if (sd_bus_path_decode(path, UNIT_PREFIX, &unit) <= 0) {
+        return sd_bus_error_setf(error, "org.freedesktop.DBus.Error.UnknownObject",
+                                 "Unknown object %s.", path);
+    }
+    std::string state = self->active_state(unit);
+    free(unit);
+    return sd_bus_message_append(reply, "s", state.empty() ? "inactive" : state.c_str());
+}
+
+int FakeSystemd::property_control_group(sd_bus* /*bus*/, const char* path,
+                                        const char* /*interface*/, const char* /*property*/,
+                                        sd_bus_message* reply, void* userdata,
+                                        sd_bus_error* error) {
+    auto* self = static_cast<FakeSystemd*>(userdata);
+    int r = self->begin_call("ControlGroup", error);
+    if (r < 0) {
+        return r;
+    }
+
+    char* unit = nullptr;
+    if (sd_bus_path_decode(path, UNIT_PREFIX, &unit) <= 0) {
+        return sd_bus_error_setf(error, "org.freedesktop.DBus.Error.UnknownObject",
+                                 "Unknown object %s.", path);
+    }
+    std::string cgroup;
+    {
+        std::lock_guard<std::mutex> lock(self->mutex_);
+        auto it = self->control_groups_.find(unit);
+        if (it != self->control_groups_.end()) {
+            cgroup = it->second;
+        }
+    }
+    free(unit);
+    return sd_bus_message_append(reply, "s", cgroup.c_str());
+}
+
+void FakeSystemd::complete_due_jobs() {
+    std::vector<Job> done;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto now = std::chrono::steady_clock::now();
+        for (auto it = jobs_.begin(); it != jobs_.end();) {
+            if (it->due <= now) {
+                units_[it->unit] = it->final_state;
+                done.push_back(*it);
+                it = jobs_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    for (const auto& job : done) {
+        std::string job_path = std::string(MANAGER_PATH) + "/job/" + std::to_string(job.id);
+        sd_bus_emit_signal(bus_, MANAGER_PATH, MANAGER_INTERFACE, "JobRemoved", "uoss",
+                           job.id, job_path.c_str(), job.unit.c_str(), job.result.c_str());
+    }
+}
+
+void FakeSystemd::serve() {
+    while (running_) {
+        complete_due_jobs();
+
+        int r = sd_bus_process(bus_, nullptr);
+        if (r < 0) {
+            break;
+        }
+        if (r > 0) {
+            continue;  // More may be queued
+        }
+
+        // Sleep until there is traffic or the next job is due
+        uint64_t wait_usec = MAX_WAIT_USEC;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto now = std::chrono::steady_clock::now();
+            for (const auto& job : jobs_) {
+                auto until = std::chrono::duration_cast<std::chrono::microseconds>(job.due - now);
+                wait_usec = std::min<uint64_t>(wait_usec, until.count() > 0 ? until.count() : 0);
+            }
+        }
+        sd_bus_wait(bus_, wait_usec);
+    }
+    sd_bus_flush(bus_);
+}
+
+} // namespace testing
+} // namespace vmstate
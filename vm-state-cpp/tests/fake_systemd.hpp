@@ -0,0 +1,184 @@
+#pragma once
+
+#include <systemd/sd-bus.h>
+#include <sys/types.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace vmstate {
+namespace testing {
+
+/**
+ * FakeSystemd - Private D-Bus daemon with a stand-in systemd manager
+ *
+ * Starts a dbus-daemon on a socket in a temporary directory and serves the
+ * subset of org.freedesktop.systemd1 that SystemdDBusVMProvider uses:
+ * Manager.StartUnit/StopUnit/RestartUnit/GetUnit/LoadUnit/Subscribe/
+ * StartTransientUnit/ListUnitsByPatterns, the Manager.JobRemoved signal,
+ * the Unit ActiveState property and the Service ControlGroup property.
+ * DBUS_SYSTEM_BUS_ADDRESS points at the private bus while the fixture is
+ * running, so providers created in between talk to it instead of systemd.
+ *
+ * Jobs behave like systemd's: a start leaves the unit "activating" until
+ * the job delay has passed, then it becomes "active" and JobRemoved is
+ * emitted. Per-method reply delays and injected failures make slow or
+ * failing managers reproducible. Methods are named as on the bus, with
+ * "ActiveState" standing for property reads.
+ *
+ * The service runs on its own thread; configuration calls are safe while
+ * it is serving.
+ */
+class FakeSystemd {
+public:
+    FakeSystemd();
+    ~FakeSystemd();
+
+    FakeSystemd(const FakeSystemd&) = delete;
+    FakeSystemd& operator=(const FakeSystemd&) = delete;
+
+    /**
+     * Launch the bus and start serving
+     * @return true once the service owns org.freedesktop.systemd1
+     */
+    bool start();
+
+    /**
+     * Stop serving, shut the bus down and restore DBUS_SYSTEM_BUS_ADDRESS
+     */
+    void stop();
+
+    /**
+     * Bus address (unix:path=...)
+     */
+    std::string address() const;
+
+    /**
+     * Define a unit; GetUnit fails with NoSuchUnit for undefined units
+     * @param unit Unit name (e.g., "microvm@slot1.service")
+     * @param active_state Initial ActiveState
+     */
+    void add_unit(const std::string& unit, const std::string& active_state = "inactive");
+
+    /**
+     * Current ActiveState of a unit ("" if undefined)
+     */
+    std::string active_state(const std::string& unit) const;
+
+    /**
+     * Delay every reply to a method
+     */
+    void set_reply_delay(const std::string& method, std::chrono::milliseconds delay);
+
+    /**
+     * Time jobs take to finish (0 finishes them on the next loop iteration)
+     */
+    void set_job_delay(std::chrono::milliseconds delay);
+
+    /**
+     * Fail the next calls to a method with a D-Bus error
+     * @param method Method name
+     * @param error_name D-Bus error name (e.g., "org.freedesktop.systemd1.NoSuchUnit")
+     * @param count Number of calls to fail
+     */
+    void fail_next(const std::string& method, const std::string& error_name, int count = 1);
+
+    /**
+     * Finish a unit's start jobs with this result instead of "done"
+     *
+     * Any result other than "done" leaves the unit "failed".
+     */
+    void set_job_result(const std::string& unit, const std::string& result);
+
+    /**
+     * Set the ControlGroup a unit reports ("" while it isn't running)
+     */
+    void set_control_group(const std::string& unit, const std::string& cgroup);
+
+    /**
+     * Properties a transient unit was started with, rendered as text
+     * (strings as is, numbers in decimal, arrays comma-separated)
+     */
+    std::map<std::string, std::string> transient_properties(const std::string& unit) const;
+
+    /**
+     * Number of calls received for a method
+     */
+    unsigned call_count(const std::string& method) const;
+
+    /**
+     * Get the last error message
+     */
+    std::string get_last_error() const;
+
+private:
+    struct Job {
+        uint32_t id;
+        std::string unit;
+        std::string result;
+        std::string final_state;
+        std::chrono::steady_clock::time_point due;
+    };
+
+    static int method_job(sd_bus_message* m, void* userdata, sd_bus_error* error);
+    static int method_get_unit(sd_bus_message* m, void* userdata, sd_bus_error* error);
+    static int method_load_unit(sd_bus_message* m, void* userdata, sd_bus_error* error);
+    static int method_subscribe(sd_bus_message* m, void* userdata, sd_bus_error* error);
+    static int method_list_units_by_patterns(sd_bus_message* m, void* userdata,
+                                             sd_bus_error* error);
+    static int method_start_transient_unit(sd_bus_message* m, void* userdata,
+                                           sd_bus_error* error);
+    static int property_active_state(sd_bus* bus, const char* path, const char* interface,
+                                     const char* property, sd_bus_message* reply,
+                                     void* userdata, sd_bus_error* error);
+    static int property_control_group(sd_bus* bus, const char* path, const char* interface,
+                                      const char* property, sd_bus_message* reply,
+                                      void* userdata, sd_bus_error* error);
+
+    static const sd_bus_vtable manager_vtable[];
+    static const sd_bus_vtable unit_vtable[];
+    static const sd_bus_vtable service_vtable[];
+
+    // Count the call, apply its delay and any injected failure; returns a
+    // negative errno (with error set) if the call should fail
+    int begin_call(const std::string& method, sd_bus_error* error);
+
+    // Object path of a unit
+    std::string unit_path(const std::string& unit) const;
+
+    // Service thread: dispatch calls and finish due jobs
+    void serve();
+
+    // Apply finished jobs and emit JobRemoved for them
+    void complete_due_jobs();
+
+    mutable std::mutex mutex_;
+    std::map<std::string, std::string> units_;
+    std::map<std::string, std::chrono::milliseconds> reply_delays_;
+    std::map<std::string, std::pair<std::string, int>> failures_;
+    std::map<std::string, std::string> job_results_;
+    std::map<std::string, unsigned> calls_;
+    std::map<std::string, std::string> control_groups_;
+    std::map<std::string, std::map<std::string, std::string>> transient_units_;
+    std::chrono::milliseconds job_delay_{0};
+    std::vector<Job> jobs_;
+    uint32_t next_job_id_ = 1;
+
+    std::string dir_;
+    std::string address_;
+    std::optional<std::string> saved_address_;
+    std::string last_error_;
+    pid_t daemon_pid_ = -1;
+    sd_bus* bus_ = nullptr;
+    std::thread thread_;
+    std::atomic<bool> running_{false};
+};
+
+} // namespace testing
+} // namespace vmstate
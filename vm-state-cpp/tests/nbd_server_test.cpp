@@ -0,0 +1,378 @@
+// NbdServer against a minimal in-test NBD client on a Unix socket
+//
+// Serves a sparse temporary file and checks negotiation, structured reads
+// with hole chunks, block status, refused writes and a second concurrent
+// connection using the old-style EXPORT_NAME handshake; then serves a
+// HydratingSource writably over a socket pair, as for the kernel driver.
+
+#include "check.hpp"
+#include "nbd/hydrating_source.hpp"
+#include "nbd/nbd_server.hpp"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+using vmstate::nbd::FileSource;
+using vmstate::nbd::HydratingSource;
+using vmstate::nbd::NbdServer;
+using vmstate::nbd::NbdServerOptions;
+
+namespace {
+
+constexpr uint64_t IMAGE_SIZE = 4 * 1024 * 1024;
+constexpr uint64_t SECOND_DATA = 1024 * 1024;   // Data at [0, 4K) and [1M, 1M+4K)
+
+// Just enough of a client to drive the server
+class Client {
+public:
+    explicit Client(const std::string& socket_path) {
+        fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        std::strcpy(addr.sun_path, socket_path.c_str());
+        if (connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    // A socket already past negotiation
+    explicit Client(int fd) : fd_(fd) {}
+
+    ~Client() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    bool connected() const { return fd_ >= 0; }
+
+    void put(const std::string& data) {
+        ssize_t n = send(fd_, data.data(), data.size(), MSG_NOSIGNAL);
+        (void)n;
+    }
+
+    std::string get(size_t len) {
+        std::string data(len, '\0');
+        size_t done = 0;
+        while (done < len) {
+            ssize_t n = recv(fd_, data.data() + done, len - done, 0);
+            if (n <= 0) {
+                return {};
+            }
+            done += static_cast<size_t>(n);
+        }
+        return data;
+    }
+
+    static void put_be(std::string& out, uint64_t v, int bytes) {
+        for (int i = bytes - 1; i >= 0; i--) {
+            out.push_back(static_cast<char>(v >> (8 * i)));
+        }
+    }
+
+    static uint64_t be(const std::string& in, size_t pos, int bytes) {
+        uint64_t v = 0;
+        for (int i = 0; i < bytes; i++) {
+            v = v << 8 | static_cast<uint8_t>(in[pos + static_cast<size_t>(i)]);
+        }
+        return v;
+    }
+
+    // Send an option request
+    void option(uint32_t option, const std::string& data) {
+        std::string out;
+        put_be(out, 0x49484156454F5054ULL, 8);
+        put_be(out, option, 4);
+        put_be(out, data.size(), 4);
+        put(out + data);
+    }
+
+    // Next option reply: its type, with data filled in
+    uint32_t reply(std::string& data) {
+        std::string header = get(20);
+        if (header.size() != 20 || be(header, 0, 8) != 0x3e889045565a9ULL) {
+            return 0;
+        }
+        data = get(be(header, 16, 4));
+        return static_cast<uint32_t>(be(header, 12, 4));
+    }
+
+    void request(uint16_t type, uint16_t flags, uint64_t cookie, uint64_t offset,
+                 uint32_t length) {
+        std::string out;
+        put_be(out, 0x25609513, 4);
+        put_be(out, flags, 2);
+        put_be(out, type, 2);
+        put_be(out, cookie, 8);
+        put_be(out, offset, 8);
+        put_be(out, length, 4);
+        put(out);
+    }
+
+    // One structured chunk: type, flags and payload
+    bool chunk(uint16_t& type, uint16_t& flags, std::string& payload) {
+        std::string header = get(20);
+        if (header.size() != 20 || be(header, 0, 4) != 0x668e33ef) {
+            return false;
+        }
+        flags = static_cast<uint16_t>(be(header, 4, 2));
+        type = static_cast<uint16_t>(be(header, 6, 2));
+        payload = get(be(header, 16, 4));
+        return true;
+    }
+
+private:
+    int fd_ = -1;
+};
+
+std::string make_image(const std::string& dir, std::string& contents) {
+    std::string path = dir + "/data.img";
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    contents.assign(IMAGE_SIZE, '\0');
+    for (uint64_t off : {uint64_t{0}, SECOND_DATA}) {
+        for (size_t i = 0; i < 4096; i++) {
+            contents[off + i] = static_cast<char>('a' + (off + i) % 26);
+        }
+        ssize_t n = pwrite(fd, contents.data() + off, 4096, static_cast<off_t>(off));
+        (void)n;
+    }
+    int r = ftruncate(fd, static_cast<off_t>(IMAGE_SIZE));
+    (void)r;
+    close(fd);
+    return path;
+}
+
+void test_structured(const std::string& socket_path, const std::string& contents) {
+    Client client(socket_path);
+    CHECK(client.connected());
+
+    std::string hello = client.get(18);
+    CHECK(Client::be(hello, 0, 8) == 0x4e42444d41474943ULL);
+    std::string flags;
+    Client::put_be(flags, 3, 4);     // Fixed newstyle, no zeroes
+    client.put(flags);
+
+    std::string data;
+    client.option(8, "");        // STRUCTURED_REPLY
+    CHECK(client.reply(data) == 1);
+
+    std::string query;
+    Client::put_be(query, 0, 4);     // Default export
+    Client::put_be(query, 1, 4);
+    Client::put_be(query, 15, 4);
+    query += "base:allocation";
+    client.option(10, query);    // SET_META_CONTEXT
+    CHECK(client.reply(data) == 4);
+    uint32_t context = static_cast<uint32_t>(Client::be(data, 0, 4));
+    CHECK(data.substr(4) == "base:allocation");
+    CHECK(client.reply(data) == 1);
+
+    std::string go;
+    Client::put_be(go, 4, 4);
+    go += "snap";
+    Client::put_be(go, 0, 2);
+    client.option(7, go);        // GO
+    CHECK(client.reply(data) == 3);
+    CHECK(Client::be(data, 2, 8) == IMAGE_SIZE);
+    CHECK((Client::be(data, 10, 2) & 2) != 0);  // Read-only
+    CHECK(client.reply(data) == 1);
+
+    // A read spanning data and a hole comes back as one chunk of each
+    client.request(0, 0, 1, 0, 8192);
+    uint16_t type = 0;
+    uint16_t chunk_flags = 0;
+    CHECK(client.chunk(type, chunk_flags, data));
+    CHECK(type == 1 && (chunk_flags & 1) == 0);
+    CHECK(Client::be(data, 0, 8) == 0);
+    CHECK(data.substr(8) == contents.substr(0, 4096));
+    CHECK(client.chunk(type, chunk_flags, data));
+    CHECK(type == 2 && (chunk_flags & 1) == 1);
+    CHECK(Client::be(data, 0, 8) == 4096 && Client::be(data, 8, 4) == 4096);
+
+    // Block status maps the whole image
+    client.request(7, 0, 2, 0, IMAGE_SIZE);
+    CHECK(client.chunk(type, chunk_flags, data));
+    CHECK(type == 5 && (chunk_flags & 1) == 1);
+    CHECK(Client::be(data, 0, 4) == context);
+    CHECK(data.size() == 4 + 4 * 8);
+    if (data.size() == 4 + 4 * 8) {
+        CHECK(Client::be(data, 4, 4) == 4096 && Client::be(data, 8, 4) == 0);
+        CHECK(Client::be(data, 12, 4) == SECOND_DATA - 4096 && Client::be(data, 16, 4) == 3);
+        CHECK(Client::be(data, 20, 4) == 4096 && Client::be(data, 24, 4) == 0);
+        CHECK(Client::be(data, 28, 4) == IMAGE_SIZE - SECOND_DATA - 4096);
+    }
+
+    // Writes are refused (after their payload is read past)
+    client.request(1, 0, 3, 0, 512);
+    client.put(std::string(512, 'x'));
+    CHECK(client.chunk(type, chunk_flags, data));
+    CHECK(type == 0x8001 && Client::be(data, 0, 4) == 1);     // EPERM
+
+    // Out-of-bounds reads are refused and the connection keeps working
+    client.request(0, 0, 4, IMAGE_SIZE - 4096, 8192);
+    CHECK(client.chunk(type, chunk_flags, data));
+    CHECK(type == 0x8001 && Client::be(data, 0, 4) == 22);    // EINVAL
+    client.request(0, 4, 5, SECOND_DATA, 4096);                 // DF: one chunk
+    CHECK(client.chunk(type, chunk_flags, data));
+    CHECK(type == 1 && data.substr(8) == contents.substr(SECOND_DATA, 4096));
+
+    client.request(2, 0, 6, 0, 0);     // DISC
+}
+
+void test_export_name(const std::string& socket_path, const std::string& contents) {
+    Client client(socket_path);
+    CHECK(client.connected());
+    client.get(18);
+    std::string flags;
+    Client::put_be(flags, 1, 4);     // Fixed newstyle, with the 124 zero bytes
+    client.put(flags);
+
+    client.option(1, "snap");    // EXPORT_NAME
+    std::string reply = client.get(8 + 2 + 124);
+    CHECK(Client::be(reply, 0, 8) == IMAGE_SIZE);
+
+    // Simple replies: header then the bytes, holes included
+    client.request(0, 0, 9, SECOND_DATA - 100, 200);
+    std::string header = client.get(16);
+    CHECK(Client::be(header, 0, 4) == 0x67446698 && Client::be(header, 4, 4) == 0);
+    CHECK(Client::be(header, 8, 8) == 9);
+    CHECK(client.get(200) == contents.substr(SECOND_DATA - 100, 200));
+
+    client.request(2, 0, 10, 0, 0);
+}
+
+void test_unknown_export(const std::string& socket_path) {
+    Client client(socket_path);
+    client.get(18);
+    std::string flags;
+    Client::put_be(flags, 3, 4);
+    client.put(flags);
+
+    std::string info;
+    Client::put_be(info, 5, 4);
+    info += "other";
+    Client::put_be(info, 0, 2);
+    client.option(6, info);      // INFO
+    std::string data;
+    CHECK(client.reply(data) == 0x80000006);
+}
+
+void test_hydrating(const std::string& dir, const std::string& image,
+                    std::string contents) {
+    FileSource origin;
+    CHECK(origin.open(image));
+    HydratingSource source(origin, 64 * 1024);
+    std::string local = dir + "/local.img";
+    CHECK(source.create(local));
+    CHECK(!source.create(local));      // Never over an existing file
+    CHECK(source.size() == IMAGE_SIZE);
+
+    NbdServerOptions options;
+    options.writable = true;
+    NbdServer server(source, options);
+    CHECK((server.export_flags() & 2) == 0);      // Not read-only
+
+    int fds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == 0);
+    std::thread serving([&] { server.serve_connected(fds[1]); });
+    Client client(fds[0]);
+
+    // A write into a chunk not fetched yet lands on the origin's data
+    client.request(1, 1, 1, SECOND_DATA + 100, 512);   // FUA
+    client.put(std::string(512, 'x'));
+    std::string header = client.get(16);
+    CHECK(Client::be(header, 0, 4) == 0x67446698 && Client::be(header, 4, 4) == 0);
+    contents.replace(SECOND_DATA + 100, 512, 512, 'x');
+    CHECK(source.demand_fetches() == 1);
+
+    client.request(0, 0, 2, SECOND_DATA, 4096);
+    header = client.get(16);
+    CHECK(Client::be(header, 4, 4) == 0);
+    CHECK(client.get(4096) == contents.substr(SECOND_DATA, 4096));
+    CHECK(source.demand_fetches() == 1);   // Same chunk
+
+    client.request(3, 0, 3, 0, 0);         // FLUSH
+    header = client.get(16);
+    CHECK(Client::be(header, 4, 4) == 0);
+    client.request(2, 0, 4, 0, 0);         // DISC
+    serving.join();
+    close(fds[1]);
+
+    // Allocation is the origin's until fetched
+    auto extents = source.extents(0, IMAGE_SIZE);
+    CHECK(!extents.empty() && !extents.front().hole && extents.front().length == 4096);
+
+    std::atomic<bool> stop{false};
+    uint64_t last_done = 0;
+    CHECK(source.fill(stop, [&](uint64_t done, uint64_t total) {
+        CHECK(done > last_done && total == IMAGE_SIZE);
+        last_done = done;
+    }));
+    CHECK(source.hydrated());
+    CHECK(last_done == IMAGE_SIZE);
+
+    // A full copy, with the holes left as holes
+    std::string copy(IMAGE_SIZE, '\0');
+    CHECK(source.read(0, IMAGE_SIZE, reinterpret_cast<uint8_t*>(copy.data())) == 0);
+    CHECK(copy == contents);
+    struct stat st;
+    CHECK(stat(local.c_str(), &st) == 0 && st.st_blocks * 512 < 1024 * 1024);
+    source.close();
+    unlink(local.c_str());
+}
+
+}  // anonymous namespace
+
+int main() {
+    char dir_template[] = "/tmp/nbd-test-XXXXXX";
+    if (!mkdtemp(dir_template)) {
+        std::perror("mkdtemp");
+        return 1;
+    }
+    std::string dir = dir_template;
+    std::string contents;
+    std::string image = make_image(dir, contents);
+
+    FileSource source;
+    CHECK(source.open(image));
+    NbdServerOptions options;
+    options.socket_path = dir + "/nbd.sock";
+    options.export_name = "snap";
+    {
+        NbdServer server(source, options);
+        CHECK(server.listen());
+
+        std::atomic<bool> stop{false};
+        std::thread serving([&] { server.serve(stop); });
+
+        // Keep one connection open while the others run
+        Client idle(options.socket_path);
+        test_structured(options.socket_path, contents);
+        test_export_name(options.socket_path, contents);
+        test_unknown_export(options.socket_path);
+        CHECK(idle.connected());
+
+        // Stopping shuts down connections that are still open
+        stop = true;
+        serving.join();
+        CHECK(server.connections_accepted() == 4);
+    }
+    // The server removes its socket when it goes away
+    CHECK(access(options.socket_path.c_str(), F_OK) != 0);
+
+    test_hydrating(dir, image, contents);
+
+    unlink(image.c_str());
+    rmdir(dir.c_str());
+
+    return vmstate::testing::check_result();
+}
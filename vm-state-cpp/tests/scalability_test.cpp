@@ -0,0 +1,616 @@
+// Scalability of CLI commands and provider methods with many slots and states
+//
+// Grows a file-backed pool (FilePoolStateProvider) and a SyntheticVMProvider
+// geometrically, up to 1,024 slots and 100,000 states with a snapshot each,
+// and times the listing commands, the per-entity lookups and the shared
+// catalog at every size. Lookups are charged as if made once per entity,
+// so a lookup that scans shows up as quadratic. The chart shows cost per
+// entity: flat bars mean linear scaling.
+//
+// Fails when a log-log slope exceeds MAX_SLOPE (ignoring sizes measured
+// under the noise floor) or when the provider calls a command makes grow
+// with the pool. CLI commands check for root and are skipped without it.
+//
+// The provider timings cover the test doubles, i.e. what the CLI asks of a
+// provider. The ZFS provider's listing code is timed directly (its
+// inventory merge, name indexes and state -> slot index, which need no
+// pool); its libzfs walks are not. The systemd provider's listing is
+// checked at 1,024 slots in systemd_dbus_vm_provider_test.
+//
+// ctest runs it with --quick; the full sweep is for running by hand.
+//
+// Usage: scalability_test [--quick] [--csv]
+//   --quick  stop at 256 slots / 10,000 states
+//   --csv    print samples as CSV instead of the chart
+
+#include "check.hpp"
+#include "synthetic_providers.hpp"
+#include "catalog/shared_catalog.hpp"
+#include "catalog/snapshot_catalog.hpp"
+#include "cli/cli.hpp"
+#include "providers/state_listing.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <limits>
+#include <map>
+#include <optional>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+using vmstate::CLI;
+using vmstate::testing::FilePoolStateProvider;
+using vmstate::testing::SyntheticVMProvider;
+using vmstate::testing::failures;
+
+namespace {
+
+struct Level {
+    size_t slots;
+    size_t states;      // Each with one snapshot
+};
+
+constexpr Level LEVELS[] = {{16, 100}, {64, 1000}, {256, 10000}, {1024, 100000}};
+
+// Allowed growth exponent of cost against entity count (1.0 = linear).
+// Sorts, tree and binary-search lookups and cache misses at 100k entries
+// put sound operations at up to about 1.2; a scan per entity comes out
+// near 2.
+constexpr double MAX_SLOPE = 1.35;
+
+// Measurements shorter than this are mostly timer and scheduler noise
+constexpr double NOISE_FLOOR = 0.002;
+
+// Lookups timed per size; their cost is scaled up to one per entity
+constexpr size_t LOOKUPS = 1000;
+
+constexpr size_t NO_CALLS = std::numeric_limits<size_t>::max();
+
+struct Sample {
+    size_t slots;
+    size_t states;
+    double n;           // Entities the operation scales with
+    double measured;    // Seconds actually timed
+    double cost;        // Seconds for the whole pool
+    size_t calls;       // Provider calls per run (NO_CALLS if not counted)
+};
+
+struct Series {
+    std::string label;
+    std::string unit;   // What n counts
+    std::vector<Sample> samples;
+};
+
+std::vector<Series> results;
+
+void record(const std::string& label, const std::string& unit, const Sample& sample) {
+    auto it = std::find_if(results.begin(), results.end(),
+                           [&](const Series& s) { return s.label == label; });
+    if (it == results.end()) {
+        results.push_back({label, unit, {}});
+        it = results.end() - 1;
+    }
+    it->samples.push_back(sample);
+}
+
+template <typename Fn>
+double elapsed(Fn&& fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+    return seconds.count();
+}
+
+struct Timing {
+    double per_run;     // Seconds
+    double measured;    // Seconds timed to get there
+};
+
+// Time fn, repeated until a measurement clears the noise floor. The
+// fastest of three measurements is the one least disturbed by everything
+// else on the box, which also leaves out a first run that warmed caches.
+template <typename Fn>
+Timing time_runs(Fn&& fn) {
+    size_t reps = 1;
+    auto batch = [&] {
+        for (size_t r = 0; r < reps; r++) {
+            fn();
+        }
+    };
+    double best = elapsed(batch);
+    for (int runs = 1; runs < 3; runs++) {
+        if (best < 2 * NOISE_FLOOR) {
+            // Too short to trust: start over with enough repetitions
+            reps *= best > 0 ? std::clamp<size_t>(
+                                   static_cast<size_t>(std::ceil(2 * NOISE_FLOOR / best)), 2, 1000)
+                             : 1000;
+            best = elapsed(batch);
+            runs = 0;
+            continue;
+        }
+        best = std::min(best, elapsed(batch));
+    }
+    return {best / static_cast<double>(reps), best};
+}
+
+// Sends stdout and stderr to /dev/null while alive
+class Quiet {
+public:
+    Quiet() {
+        std::fflush(stdout);
+        std::fflush(stderr);
+        out_ = dup(STDOUT_FILENO);
+        err_ = dup(STDERR_FILENO);
+        int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        close(null);
+    }
+    ~Quiet() {
+        dup2(out_, STDOUT_FILENO);
+        dup2(err_, STDERR_FILENO);
+        close(out_);
+        close(err_);
+    }
+
+private:
+    int out_;
+    int err_;
+};
+
+int run_cli(CLI& cli, std::vector<std::string> args) {
+    args.insert(args.begin(), "vm-state");
+    std::vector<char*> argv;
+    for (auto& arg : args) {
+        argv.push_back(arg.data());
+    }
+    argv.push_back(nullptr);
+    Quiet quiet;
+    return cli.run(static_cast<int>(args.size()), argv.data());
+}
+
+std::string state_name(size_t i) {
+    return "state" + std::to_string(i);
+}
+
+std::string snapshot_name(size_t i) {
+    return "snap" + std::to_string(i);
+}
+
+std::vector<std::string> slot_names(size_t count) {
+    std::vector<std::string> slots;
+    for (size_t i = 1; i <= count; i++) {
+        slots.push_back("slot" + std::to_string(i));
+    }
+    return slots;
+}
+
+// Grow the pool to a level: new states with a snapshot each, and the new
+// slots assigned to states of their own
+bool populate(const std::string& root, const Level& level, size_t from_states,
+              size_t from_slots) {
+    FilePoolStateProvider pool(root, slot_names(level.slots));
+    for (size_t i = from_states; i < level.states; i++) {
+        if (!pool.create_state(state_name(i)) ||
+            !pool.create_snapshot(state_name(i), snapshot_name(i))) {
+            std::fprintf(stderr, "populate: %s\n", pool.get_last_error().c_str());
+            return false;
+        }
+    }
+    for (size_t i = from_slots; i < level.slots; i++) {
+        if (!pool.assign_state("slot" + std::to_string(i + 1), state_name(i))) {
+            std::fprintf(stderr, "populate: %s\n", pool.get_last_error().c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+// Lookup names spread over the whole pool
+std::vector<size_t> spread(size_t count) {
+    std::vector<size_t> picks;
+    for (size_t i = 0; i < LOOKUPS; i++) {
+        picks.push_back(i * count / LOOKUPS);
+    }
+    return picks;
+}
+
+void measure_cli(const std::string& root, const Level& level) {
+    auto* vm = new SyntheticVMProvider(level.slots);
+    auto* pool = new FilePoolStateProvider(root, slot_names(level.slots));
+    CLI cli{std::unique_ptr<vmstate::VMProvider>(vm),
+            std::unique_ptr<vmstate::StateProvider>(pool)};
+    const double entities = static_cast<double>(level.slots + 2 * level.states);
+
+    auto command = [&](const std::string& label, const std::vector<std::string>& args) {
+        vm->reset_calls();
+        pool->reset_calls();
+        int rc = run_cli(cli, args);
+        CHECK(rc == 0);
+        if (rc != 0) {
+            std::fprintf(stderr, "'%s' failed at %zu states\n", label.c_str(), level.states);
+        }
+        size_t calls = vm->total_calls() + pool->total_calls();
+        auto t = time_runs([&] { run_cli(cli, args); });
+        record(label, "entities",
+               {level.slots, level.states, entities, t.measured, t.per_run, calls});
+    };
+
+    // One state's snapshots, asked for every state in turn
+    auto per_state = [&](const std::string& label) {
+        auto picks = spread(level.states);
+        int failed = 0;
+        auto t = time_runs([&] {
+            for (size_t i : picks) {
+                failed += run_cli(cli, {"snapshots", state_name(i)}) != 0;
+            }
+        });
+        CHECK(failed == 0);
+        double cost = t.per_run / static_cast<double>(picks.size()) *
+                      static_cast<double>(level.states);
+        record(label, "states", {level.slots, level.states,
+                                 static_cast<double>(level.states), t.measured, cost, NO_CALLS});
+    };
+
+    // Walks first: the pool changed since any earlier publish
+    command("list (walk)", {"list"});
+    CHECK(vm->call_count("is_running") == 0);
+    command("snapshots (walk)", {"snapshots"});
+    command("snapshots --match (walk)", {"snapshots", "--match", "snap1*"});
+    per_state("snapshots <state> (walk)");
+    command("reconcile --dry-run", {"reconcile", "--dry-run", "--foreground"});
+
+    command("catalog publish", {"catalog", "publish"});
+    command("list (catalog)", {"list"});
+    command("snapshots (catalog)", {"snapshots"});
+    command("snapshots --match (catalog)", {"snapshots", "--match", "snap1*"});
+    per_state("snapshots <state> (catalog)");
+    command("catalog dump", {"catalog", "dump"});
+}
+
+// Time one call of fn over the whole pool
+template <typename Fn>
+void whole(const Level& level, const std::string& label, const std::string& unit, double n,
+           Fn&& fn) {
+    auto t = time_runs(fn);
+    record(label, unit, {level.slots, level.states, n, t.measured, t.per_run, NO_CALLS});
+}
+
+// Steady-state lookups: caches and indexes are built by the first run
+template <typename Fn>
+void lookup(const Level& level, const std::string& label, const std::string& unit, double n,
+            Fn&& fn) {
+    auto picks = spread(static_cast<size_t>(n));
+    auto t = time_runs([&] {
+        for (size_t i : picks) {
+            fn(i);
+        }
+    });
+    double cost = t.per_run / static_cast<double>(picks.size()) * n;
+    record(label, unit, {level.slots, level.states, n, t.measured, cost, NO_CALLS});
+}
+
+void measure_providers(const std::string& root, const Level& level) {
+    SyntheticVMProvider vm(level.slots);
+    FilePoolStateProvider pool(root, slot_names(level.slots));
+    const double slots = static_cast<double>(level.slots);
+    const double states = static_cast<double>(level.states);
+
+    whole(level, "get_all_statuses", "slots", slots,
+          [&] { CHECK(vm.get_all_statuses()); });
+    lookup(level, "is_running", "slots", slots, [&](size_t i) {
+        vm.is_running("slot" + std::to_string(i + 1));
+    });
+
+    whole(level, "list_assignments", "slots", slots, [&] {
+        CHECK(pool.list_assignments().size() == level.slots);
+    });
+    lookup(level, "get_slot_state", "slots", slots, [&](size_t i) {
+        CHECK(pool.get_slot_state("slot" + std::to_string(i + 1)) == state_name(i));
+    });
+    lookup(level, "is_state_in_use", "states", states, [&](size_t i) {
+        CHECK(pool.is_state_in_use(state_name(i)).has_value() == (i < level.slots));
+    });
+
+    whole(level, "list_states", "states", states, [&] {
+        CHECK(pool.list_states().size() == level.states);
+    });
+    lookup(level, "state_exists", "states", states, [&](size_t i) {
+        CHECK(pool.state_exists(state_name(i)));
+    });
+    lookup(level, "get_state_info", "states", states, [&](size_t i) {
+        CHECK(pool.get_state_info(state_name(i)));
+    });
+
+    std::vector<vmstate::SnapshotInfo> snapshots;
+    whole(level, "list_snapshots", "snapshots", states, [&] { snapshots = pool.list_snapshots(); });
+    CHECK(snapshots.size() == level.states);
+    lookup(level, "find_snapshot", "snapshots", states, [&](size_t i) {
+        auto snap = pool.find_snapshot(snapshot_name(i));
+        CHECK(snap && snap->state_name == state_name(i));
+    });
+
+    // Shared components the commands are built on
+    whole(level, "SnapshotCatalog build", "snapshots", states, [&] {
+        vmstate::SnapshotCatalog catalog(snapshots);
+    });
+    vmstate::SnapshotCatalog catalog(snapshots);
+    lookup(level, "SnapshotCatalog query <state>", "snapshots", states, [&](size_t i) {
+        vmstate::SnapshotQuery query;
+        query.state_name = state_name(i);
+        CHECK(catalog.query(query).size() == 1);
+    });
+
+    vmstate::CatalogData data;
+    data.generation = pool.get_generation();
+    data.states = pool.list_states();
+    data.snapshots = snapshots;
+    data.assignments = pool.list_assignments();
+    std::string path = root + "/provider-catalog";
+    std::string error;
+    whole(level, "publish_shared_catalog", "entities", slots + 2 * states, [&] {
+        CHECK(vmstate::publish_shared_catalog(path, data, error));
+    });
+    vmstate::SharedCatalogReader reader(path);
+    whole(level, "SharedCatalogReader read", "entities", slots + 2 * states, [&] {
+        // Touch every record, as a consumer walking the listing would
+        size_t seen = 0;
+        CHECK(reader.read([&](const vmstate::CatalogView& view) {
+            seen = 0;
+            for (size_t i = 0; i < view.state_count(); i++) {
+                seen += !view.str(view.state(i).name).empty();
+            }
+            for (size_t i = 0; i < view.snapshot_count(); i++) {
+                seen += !view.str(view.snapshot(i).full_name).empty();
+            }
+            for (size_t i = 0; i < view.assignment_count(); i++) {
+                seen += !view.str(view.assignment(i).slot_name).empty();
+            }
+        }));
+        CHECK(seen == level.slots + 2 * level.states);
+    });
+    lookup(level, "CatalogView snapshot_range", "snapshots", states, [&](size_t i) {
+        reader.read([&](const vmstate::CatalogView& view) {
+            auto [first, last] = view.snapshot_range(state_name(i));
+            CHECK(last - first == 1);
+        });
+    });
+}
+
+// ZFSStateProvider's listing code, which it shares with no double: the
+// inventory merge a refresh does, the name indexes that answer lookups,
+// and the state -> slot index behind is_state_in_use
+void measure_listing(const Level& level) {
+    const double slots = static_cast<double>(level.slots);
+    const double states = static_cast<double>(level.states);
+
+    std::vector<vmstate::StateInfo> walked;
+    std::vector<vmstate::SnapshotInfo> stored;
+    for (size_t i = 0; i < level.states; i++) {
+        vmstate::StateInfo state;
+        state.name = state_name(i);
+        state.guid = i + 1;
+        state.snapshots_changed = 1000;
+        walked.push_back(state);
+        vmstate::SnapshotInfo snap;
+        snap.name = snapshot_name(i);
+        snap.state_name = state.name;
+        snap.full_name = state.name + "@" + snap.name;
+        stored.push_back(snap);
+    }
+    // One state's snapshots changed since the inventory was written
+    auto inventory = walked;
+    inventory[level.states / 2].snapshots_changed = 999;
+
+    size_t reads = 0;
+    auto read_snapshots = [&](const std::string& state,
+                              std::vector<vmstate::SnapshotInfo>& snapshots) {
+        reads++;
+        vmstate::SnapshotInfo snap;
+        snap.name = "new-" + state;
+        snap.state_name = state;
+        snapshots.push_back(snap);
+    };
+    vmstate::StateListing listing;
+    std::vector<bool> trusted;
+    auto t = time_runs([&] {
+        auto snapshots = stored;    // Moved from by the merge
+        reads = 0;
+        listing = vmstate::merge_listing(walked, inventory, snapshots, 2000, read_snapshots,
+                                         trusted);
+    });
+    record("merge_listing (1 changed)", "entities",
+           {level.slots, level.states, 2 * states, t.measured, t.per_run, reads});
+    CHECK(reads == 1);
+    CHECK(listing.snapshots.size() == level.states);
+    CHECK(std::count(trusted.begin(), trusted.end(), true) ==
+          static_cast<std::ptrdiff_t>(level.states));
+
+    whole(level, "StateListing build_index", "entities", 2 * states,
+          [&] { listing.build_index(); });
+    lookup(level, "StateListing state_index", "states", states, [&](size_t i) {
+        CHECK(listing.state_index.count(state_name(i)) == 1);
+    });
+    lookup(level, "StateListing snapshots_by_state", "states", states, [&](size_t i) {
+        auto it = listing.snapshots_by_state.find(state_name(i));
+        CHECK(it != listing.snapshots_by_state.end() && it->second.size() == 1);
+    });
+
+    auto slots_in_order = slot_names(level.slots);
+    std::map<std::string, std::string> assignments;
+    for (size_t i = 0; i < level.slots; i++) {
+        assignments[slots_in_order[i]] = state_name(i);
+    }
+    std::unordered_map<std::string, std::string> state_slots;
+    whole(level, "index_state_slots", "slots", slots, [&] {
+        state_slots = vmstate::index_state_slots(slots_in_order, assignments);
+    });
+    lookup(level, "state_slots lookup", "states", states, [&](size_t i) {
+        CHECK(state_slots.count(state_name(i)) == (i < level.slots ? 1u : 0u));
+    });
+}
+
+// Least-squares slope of log(cost) against log(n), over samples above the
+// noise floor; nullopt when fewer than two qualify
+std::optional<double> slope(const Series& series) {
+    std::vector<std::pair<double, double>> points;
+    for (const auto& s : series.samples) {
+        if (s.measured >= NOISE_FLOOR && s.cost > 0) {
+            points.emplace_back(std::log(s.n), std::log(s.cost));
+        }
+    }
+    if (points.size() < 2) {
+        return std::nullopt;
+    }
+    double mx = 0, my = 0;
+    for (const auto& [x, y] : points) {
+        mx += x;
+        my += y;
+    }
+    mx /= static_cast<double>(points.size());
+    my /= static_cast<double>(points.size());
+    double sxy = 0, sxx = 0;
+    for (const auto& [x, y] : points) {
+        sxy += (x - mx) * (y - my);
+        sxx += (x - mx) * (x - mx);
+    }
+    if (sxx <= 0) {
+        return std::nullopt;
+    }
+    return sxy / sxx;
+}
+
+// Calls per run should not depend on the pool's size
+bool calls_flat(const Series& series) {
+    const auto& first = series.samples.front();
+    return std::all_of(series.samples.begin(), series.samples.end(), [&](const Sample& s) {
+        return s.calls == NO_CALLS || s.calls <= first.calls;
+    });
+}
+
+void print_chart() {
+    std::printf("Cost per entity at each size (flat bars = linear)\n\n");
+    for (const auto& series : results) {
+        auto s = slope(series);
+        bool flat = calls_flat(series);
+        bool ok = (!s || *s <= MAX_SLOPE) && flat;
+        char shown[16] = "-";
+        if (s) {
+            std::snprintf(shown, sizeof(shown), "%.2f", *s);
+        }
+        std::printf("%-32s slope %5s%s  %s\n", series.label.c_str(), shown,
+                    flat ? "" : "  calls grow", ok ? "ok" : "SUPER-LINEAR");
+
+        double widest = 0;
+        for (const auto& sample : series.samples) {
+            widest = std::max(widest, sample.cost / sample.n);
+        }
+        for (const auto& sample : series.samples) {
+            double per = sample.cost / sample.n;
+            int bar = widest > 0 ? static_cast<int>(std::lround(per / widest * 40)) : 0;
+            std::printf("  %8.0f %-9s %10.2f ms %9.3f us/each  %-40s",
+                        sample.n, series.unit.c_str(), sample.cost * 1e3, per * 1e6,
+                        std::string(static_cast<size_t>(std::max(bar, 1)), '#').c_str());
+            if (sample.calls != NO_CALLS) {
+                std::printf("  %zu calls", sample.calls);
+            }
+            std::printf("\n");
+        }
+        std::printf("\n");
+    }
+}
+
+void print_csv() {
+    std::printf("operation,slots,states,n,unit,measured_s,cost_s,calls\n");
+    for (const auto& series : results) {
+        for (const auto& s : series.samples) {
+            std::printf("\"%s\",%zu,%zu,%.0f,%s,%.6f,%.6f,", series.label.c_str(), s.slots,
+                        s.states, s.n, series.unit.c_str(), s.measured, s.cost);
+            if (s.calls != NO_CALLS) {
+                std::printf("%zu", s.calls);
+            }
+            std::printf("\n");
+        }
+    }
+}
+
+}  // anonymous namespace
+
+int main(int argc, char* argv[]) {
+    bool quick = false;
+    bool csv = false;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--quick") == 0) {
+            quick = true;
+        } else if (std::strcmp(argv[i], "--csv") == 0) {
+            csv = true;
+        } else {
+            std::fprintf(stderr, "Usage: %s [--quick] [--csv]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    const char* tmp = std::getenv("TMPDIR");
+    std::string root = std::string(tmp ? tmp : "/tmp") + "/vm-state-scale.XXXXXX";
+    if (!mkdtemp(root.data())) {
+        std::perror("mkdtemp");
+        return 1;
+    }
+
+    bool root_user = geteuid() == 0;
+    if (!root_user) {
+        std::fprintf(stderr, "not root: skipping CLI commands, timing providers only\n");
+    }
+
+    size_t levels = std::size(LEVELS) - (quick ? 1 : 0);
+    size_t states = 0;
+    size_t slots = 0;
+    for (size_t i = 0; i < levels; i++) {
+        const Level& level = LEVELS[i];
+        std::fprintf(stderr, "%zu slots, %zu states, %zu snapshots...\n",
+                     level.slots, level.states, level.states);
+        if (!populate(root, level, states, slots)) {
+            failures++;
+            break;
+        }
+        states = level.states;
+        slots = level.slots;
+
+        if (root_user) {
+            measure_cli(root, level);
+        }
+        measure_providers(root, level);
+        measure_listing(level);
+    }
+
+    std::error_code ec;
+    std::filesystem::remove_all(root, ec);
+
+    if (csv) {
+        print_csv();
+    } else {
+        print_chart();
+    }
+
+    for (const auto& series : results) {
+        auto s = slope(series);
+        if (s && *s > MAX_SLOPE) {
+            std::fprintf(stderr, "%s: cost grows as n^%.2f\n", series.label.c_str(), *s);
+            failures++;
+        }
+        if (!calls_flat(series)) {
+            std::fprintf(stderr, "%s: provider calls grow with the pool\n",
+                         series.label.c_str());
+            failures++;
+        }
+    }
+
+    return vmstate::testing::check_result();
+}
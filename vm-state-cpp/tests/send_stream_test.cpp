@@ -0,0 +1,162 @@
+// scan_send_stream over hand-built streams
+//
+// Each stream is a BEGIN record, the records under test and an END record,
+// laid out as dmu_replay_record_t on this host's byte order.
+
+#include "check.hpp"
+#include "utils/send_stream.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using vmstate::utils::scan_send_stream;
+using vmstate::utils::SendRange;
+
+namespace {
+
+constexpr size_t RECORD_SIZE = 312;
+constexpr size_t BODY = 8;
+
+constexpr uint32_t DRR_BEGIN = 0;
+constexpr uint32_t DRR_WRITE = 3;
+constexpr uint32_t DRR_FREE = 4;
+constexpr uint32_t DRR_END = 5;
+constexpr uint32_t DRR_SPILL = 7;
+
+constexpr uint8_t DRR_SPILL_UNMODIFIED = 1;
+constexpr uint8_t ZIO_COMPRESS_OFF = 2;
+constexpr uint8_t ZIO_COMPRESS_LZ4 = 15;
+
+class Stream {
+public:
+    Stream() {
+        auto& begin = record(DRR_BEGIN);
+        put<uint64_t>(begin, BODY, 0x2F5bacbacULL);
+    }
+
+    std::vector<uint8_t>& record(uint32_t type) {
+        records_.emplace_back(RECORD_SIZE, 0);
+        put<uint32_t>(records_.back(), 0, type);
+        return records_.back();
+    }
+
+    // Block contents following the last record
+    void payload(size_t size, uint8_t fill) {
+        records_.emplace_back(size, fill);
+    }
+
+    template <typename T>
+    static void put(std::vector<uint8_t>& bytes, size_t offset, T value) {
+        std::memcpy(bytes.data() + offset, &value, sizeof(value));
+    }
+
+    // Scan the stream from a file; false if it wasn't accepted
+    bool scan(std::vector<SendRange>& ranges, std::string& error) {
+        record(DRR_END);
+        char path[] = "/tmp/send-stream-test-XXXXXX";
+        int fd = mkstemp(path);
+        if (fd < 0) {
+            error = "mkstemp failed";
+            return false;
+        }
+        unlink(path);
+        for (const auto& bytes : records_) {
+            if (write(fd, bytes.data(), bytes.size()) != static_cast<ssize_t>(bytes.size())) {
+                error = "write failed";
+                close(fd);
+                return false;
+            }
+        }
+        lseek(fd, 0, SEEK_SET);
+        bool ok = scan_send_stream(
+            fd, [&](const SendRange& range) { ranges.push_back(range); }, error);
+        close(fd);
+        return ok;
+    }
+
+private:
+    std::vector<std::vector<uint8_t>> records_;
+};
+
+void add_write(Stream& stream, uint64_t object, uint64_t offset, uint64_t length) {
+    auto& write = stream.record(DRR_WRITE);
+    Stream::put<uint64_t>(write, BODY + 0, object);
+    Stream::put<uint64_t>(write, BODY + 16, offset);
+    Stream::put<uint64_t>(write, BODY + 24, length);
+    stream.payload(length, 0xab);
+}
+
+void add_spill(Stream& stream, uint8_t flags, uint8_t compression, uint64_t length,
+               uint64_t compressed_size) {
+    auto& spill = stream.record(DRR_SPILL);
+    Stream::put<uint64_t>(spill, BODY + 0, 1);
+    Stream::put<uint64_t>(spill, BODY + 8, length);
+    Stream::put<uint8_t>(spill, BODY + 24, flags);
+    Stream::put<uint8_t>(spill, BODY + 25, compression);
+    Stream::put<uint64_t>(spill, BODY + 32, compressed_size);
+    // 0xff bytes would read as an unknown record type if not skipped
+    bool compressed = compression != ZIO_COMPRESS_OFF && compressed_size != 0;
+    stream.payload(compressed ? compressed_size : length, 0xff);
+}
+
+// Incremental sends mark spill blocks the destination already has as
+// UNMODIFIED; the payload is still the whole block
+void test_unmodified_spill() {
+    Stream stream;
+    add_spill(stream, DRR_SPILL_UNMODIFIED, 0, 512, 0);
+    add_write(stream, 2, 4096, 4096);
+    auto& free = stream.record(DRR_FREE);
+    Stream::put<uint64_t>(free, BODY + 0, 2);
+    Stream::put<uint64_t>(free, BODY + 8, 8192);
+    Stream::put<uint64_t>(free, BODY + 16, UINT64_MAX);
+
+    std::vector<SendRange> ranges;
+    std::string error;
+    CHECK(stream.scan(ranges, error));
+    CHECK(error.empty());
+    CHECK(ranges.size() == 2);
+    if (ranges.size() == 2) {
+        CHECK(ranges[0].object == 2 && ranges[0].offset == 4096 &&
+              ranges[0].length == 4096 && !ranges[0].freed);
+        CHECK(ranges[1].offset == 8192 && ranges[1].length == UINT64_MAX && ranges[1].freed);
+    }
+}
+
+// Raw streams send a compressed spill block at its compressed size
+void test_compressed_spill() {
+    Stream stream;
+    add_spill(stream, 0, ZIO_COMPRESS_LZ4, 512, 64);
+    add_write(stream, 2, 0, 512);
+
+    std::vector<SendRange> ranges;
+    std::string error;
+    CHECK(stream.scan(ranges, error));
+    CHECK(ranges.size() == 1);
+}
+
+// A spill block with compression off (and no compressed size) is sent at
+// drr_length, however its flags are set
+void test_uncompressed_spill() {
+    Stream stream;
+    add_spill(stream, DRR_SPILL_UNMODIFIED, ZIO_COMPRESS_OFF, 512, 0);
+    add_write(stream, 2, 0, 512);
+
+    std::vector<SendRange> ranges;
+    std::string error;
+    CHECK(stream.scan(ranges, error));
+    CHECK(error.empty());
+    CHECK(ranges.size() == 1);
+}
+
+}  // namespace
+
+int main() {
+    test_unmodified_spill();
+    test_compressed_spill();
+    test_uncompressed_spill();
+    return vmstate::testing::check_result();
+}
@@ -0,0 +1,131 @@
+// install_slot_link in a temporary slot directory
+//
+// Links a slot that holds a regular image, then replays the states an
+// interrupted switch can leave behind and checks that the image survives
+// each of them and the next switch completes.
+
+#include "check.hpp"
+#include "utils/slot_link.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using vmstate::utils::install_slot_link;
+
+namespace fs = std::filesystem;
+
+namespace {
+
+void write_file(const std::string& path, const std::string& contents) {
+    std::ofstream(path) << contents;
+}
+
+std::string read_file(const std::string& path) {
+    std::ifstream in(path);
+    std::stringstream contents;
+    contents << in.rdbuf();
+    return contents.str();
+}
+
+bool is_link(const std::string& path) {
+    struct stat st;
+    return lstat(path.c_str(), &st) == 0 && S_ISLNK(st.st_mode);
+}
+
+bool exists(const std::string& path) {
+    struct stat st;
+    return lstat(path.c_str(), &st) == 0;
+}
+
+std::string link_target(const std::string& path) {
+    std::error_code ec;
+    return fs::read_symlink(path, ec).string();
+}
+
+// A slot with a regular image is linked; the image moves to the backup
+void test_regular_image(const std::string& dir) {
+    std::string data = dir + "/data.img";
+    write_file(data, "slot image");
+
+    std::string error;
+    CHECK(install_slot_link(data, "/states/a/data.img", error));
+    CHECK(is_link(data));
+    CHECK(link_target(data) == "/states/a/data.img");
+    CHECK(read_file(data + ".backup") == "slot image");
+    CHECK(!exists(data + ".tmp"));
+
+    // Switching between states replaces only the link
+    CHECK(install_slot_link(data, "/states/b/data.img", error));
+    CHECK(link_target(data) == "/states/b/data.img");
+    CHECK(read_file(data + ".backup") == "slot image");
+    CHECK(!exists(data + ".tmp"));
+}
+
+// Stopped after staging the link and moving the image aside: data.img is
+// missing, the stage is a link, the image is in the backup
+void test_interrupted_after_backup(const std::string& dir) {
+    std::string data = dir + "/data.img";
+    write_file(data + ".backup", "slot image");
+    CHECK(symlink("/states/a/data.img", (data + ".tmp").c_str()) == 0);
+
+    std::string error;
+    CHECK(install_slot_link(data, "/states/a/data.img", error));
+    CHECK(link_target(data) == "/states/a/data.img");
+    CHECK(read_file(data + ".backup") == "slot image");
+    CHECK(!exists(data + ".tmp"));
+}
+
+// An older assign that exchanged a regular image with the staged link and
+// stopped there: the image sits at data.img.tmp and must not be deleted
+void test_interrupted_exchange(const std::string& dir) {
+    std::string data = dir + "/data.img";
+    CHECK(symlink("/states/a/data.img", data.c_str()) == 0);
+    write_file(data + ".tmp", "slot image");
+
+    std::string error;
+    CHECK(!install_slot_link(data, "/states/b/data.img", error));
+    CHECK(!error.empty());
+    CHECK(read_file(data + ".tmp") == "slot image");
+    CHECK(link_target(data) == "/states/a/data.img");
+}
+
+// A second regular image never overwrites an existing backup
+void test_backup_kept(const std::string& dir) {
+    std::string data = dir + "/data.img";
+    write_file(data, "new image");
+    write_file(data + ".backup", "old image");
+
+    std::string error;
+    CHECK(!install_slot_link(data, "/states/a/data.img", error));
+    CHECK(read_file(data) == "new image");
+    CHECK(read_file(data + ".backup") == "old image");
+    CHECK(!exists(data + ".tmp"));
+}
+
+} // namespace
+
+int main() {
+    char dir_template[] = "/tmp/slot-link-test-XXXXXX";
+    if (!mkdtemp(dir_template)) {
+        std::perror("mkdtemp");
+        return 1;
+    }
+    std::string root = dir_template;
+
+    int n = 0;
+    for (auto test : {test_regular_image, test_interrupted_after_backup,
+                      test_interrupted_exchange, test_backup_kept}) {
+        std::string dir = root + "/slot" + std::to_string(++n);
+        fs::create_directory(dir);
+        test(dir);
+    }
+
+    std::error_code ec;
+    fs::remove_all(root, ec);
+    return vmstate::testing::check_result();
+}
@@ -0,0 +1,731 @@
+#include "synthetic_providers.hpp"
+#include "utils/json.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace vmstate {
+namespace testing {
+
+namespace {
+
+// Entries of a directory, without "." and ".."; empty if it can't be read
+std::vector<std::string> read_dir(const std::string& path) {
+    std::vector<std::string> names;
+    DIR* dir = opendir(path.c_str());
+    if (!dir) {
+        return names;
+    }
+    while (dirent* entry = readdir(dir)) {
+        if (std::strcmp(entry->d_name, ".") != 0 && std::strcmp(entry->d_name, "..") != 0) {
+            names.emplace_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+    return names;
+}
+
+// Names become path components: no separators, no hidden entries
+bool valid_name(const std::string& name) {
+    return !name.empty() && name[0] != '.' && name.find('/') == std::string::npos &&
+           name.find('@') == std::string::npos;
+}
+
+std::string format_unix(time_t t) {
+    char buf[64];
+    struct tm tm;
+    localtime_r(&t, &tm);
+    std::strftime(buf, sizeof(buf), "%a %b %e %H:%M %Y", &tm);
+    return buf;
+}
+
+} // namespace
+
+// ========== SyntheticVMProvider ==========
+
+SyntheticVMProvider::SyntheticVMProvider(size_t slot_count) {
+    slots_.reserve(slot_count);
+    for (size_t i = 1; i <= slot_count; i++) {
+        slots_.push_back("slot" + std::to_string(i));
+        statuses_[slots_.back()] = VMStatus::Stopped;
+    }
+}
+
+bool SyntheticVMProvider::begin_call(const std::string& method, const std::string& slot_name) {
+    calls_[method]++;
+    if (!slot_name.empty() && !statuses_.count(slot_name)) {
+        last_error_ = "Invalid slot name: " + slot_name;
+        return false;
+    }
+    return true;
+}
+
+bool SyntheticVMProvider::start(const std::string& slot_name) {
+    if (!begin_call("start", slot_name)) return false;
+    statuses_[slot_name] = VMStatus::Running;
+    return true;
+}
+
+bool SyntheticVMProvider::stop(const std::string& slot_name) {
+    if (!begin_call("stop", slot_name)) return false;
+    statuses_[slot_name] = VMStatus::Stopped;
+    return true;
+}
+
+bool SyntheticVMProvider::start_and_wait(const std::string& slot_name,
+                                         std::chrono::milliseconds) {
+    if (!begin_call("start_and_wait", slot_name)) return false;
+    statuses_[slot_name] = VMStatus::Running;
+    return true;
+}
+
+bool SyntheticVMProvider::stop_and_wait(const std::string& slot_name,
+                                        std::chrono::milliseconds) {
+    if (!begin_call("stop_and_wait", slot_name)) return false;
+    statuses_[slot_name] = VMStatus::Stopped;
+    return true;
+}
+
+bool SyntheticVMProvider::restart(const std::string& slot_name) {
+    if (!begin_call("restart", slot_name)) return false;
+    statuses_[slot_name] = VMStatus::Running;
+    return true;
+}
+
+bool SyntheticVMProvider::is_running(const std::string& slot_name) {
+    return begin_call("is_running", slot_name) &&
+           statuses_[slot_name] == VMStatus::Running;
+}
+
+VMStatus SyntheticVMProvider::get_status(const std::string& slot_name) {
+    if (!begin_call("get_status", slot_name)) return VMStatus::Unknown;
+    return statuses_[slot_name];
+}
+
+std::optional<std::map<std::string, VMStatus>> SyntheticVMProvider::get_all_statuses() {
+    begin_call("get_all_statuses");
+    return statuses_;
+}
+
+std::optional<VMInfo> SyntheticVMProvider::get_info(const std::string& slot_name) {
+    if (!begin_call("get_info", slot_name)) return std::nullopt;
+    VMInfo info;
+    info.slot_name = slot_name;
+    info.status = statuses_[slot_name];
+    return info;
+}
+
+std::vector<std::string> SyntheticVMProvider::list_slots() {
+    begin_call("list_slots");
+    return slots_;
+}
+
+bool SyntheticVMProvider::is_valid_slot(const std::string& slot_name) {
+    begin_call("is_valid_slot");
+    return statuses_.count(slot_name) != 0;
+}
+
+std::optional<std::vector<SlotNetStats>> SyntheticVMProvider::get_network_stats() {
+    begin_call("get_network_stats");
+    last_error_ = "Network stats are not simulated";
+    return std::nullopt;
+}
+
+bool SyntheticVMProvider::set_net_limit(const std::string& slot_name, const NetLimit&) {
+    begin_call("set_net_limit", slot_name);
+    last_error_ = "Network limits are not simulated";
+    return false;
+}
+
+std::optional<NetLimit> SyntheticVMProvider::get_net_limit(const std::string& slot_name) {
+    begin_call("get_net_limit", slot_name);
+    last_error_ = "Network limits are not simulated";
+    return std::nullopt;
+}
+
+bool SyntheticVMProvider::apply_net_limit(const std::string& slot_name) {
+    begin_call("apply_net_limit", slot_name);
+    last_error_ = "Network limits are not simulated";
+    return false;
+}
+
+bool SyntheticVMProvider::enter_background(const BackgroundLimits&) {
+    begin_call("enter_background");
+    return true;
+}
+
+bool SyntheticVMProvider::start_transient_service(const std::string&, const std::string&,
+                                                  const std::vector<std::string>&) {
+    begin_call("start_transient_service");
+    last_error_ = "Transient services are not simulated";
+    return false;
+}
+
+std::optional<double> SyntheticVMProvider::get_slot_io_pressure(const std::string& slot_name) {
+    begin_call("get_slot_io_pressure", slot_name);
+    last_error_ = "Pressure is not simulated";
+    return std::nullopt;
+}
+
+std::string SyntheticVMProvider::get_last_error() const {
+    return last_error_;
+}
+
+size_t SyntheticVMProvider::call_count(const std::string& method) const {
+    auto it = calls_.find(method);
+    return it != calls_.end() ? it->second : 0;
+}
+
+size_t SyntheticVMProvider::total_calls() const {
+    size_t total = 0;
+    for (const auto& [method, n] : calls_) {
+        total += n;
+    }
+    return total;
+}
+
+void SyntheticVMProvider::reset_calls() {
+    calls_.clear();
+}
+
+// ========== FilePoolStateProvider ==========
+
+FilePoolStateProvider::FilePoolStateProvider(const std::string& root,
+                                             std::vector<std::string> slots)
+    : root_(root),
+      states_dir_(root + "/states"),
+      slots_(std::move(slots)),
+      slot_set_(slots_.begin(), slots_.end()) {
+    mkdir(states_dir_.c_str(), 0755);
+    std::ifstream in(root_ + "/generation");
+    in >> generation_;
+}
+
+FilePoolStateProvider::~FilePoolStateProvider() {
+    std::ofstream(root_ + "/generation") << generation_ << "\n";
+}
+
+void FilePoolStateProvider::count(const std::string& method) {
+    calls_[method]++;
+}
+
+bool FilePoolStateProvider::unsupported(const std::string& method) {
+    count(method);
+    last_error_ = method + " is not supported by the file pool";
+    return false;
+}
+
+void FilePoolStateProvider::note_mutation() {
+    generation_++;
+    snapshot_index_.reset();
+}
+
+std::optional<StateInfo> FilePoolStateProvider::read_state(const std::string& name) const {
+    std::string path = states_dir_ + "/" + name;
+    struct stat image;
+    if (!valid_name(name) || stat((path + "/data.img").c_str(), &image) != 0) {
+        return std::nullopt;
+    }
+    StateInfo info;
+    info.name = name;
+    info.path = path;
+    info.dataset = "filepool/" + name;
+    info.used_bytes = static_cast<uint64_t>(image.st_blocks) * 512;
+    info.available_bytes = IMAGE_SIZE;
+    info.guid = image.st_ino;
+    info.snapshots_changed = static_cast<uint64_t>(image.st_ctime);
+    return info;
+}
+
+std::vector<std::string> FilePoolStateProvider::state_names() const {
+    auto names = read_dir(states_dir_);
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+size_t FilePoolStateProvider::visit_snapshots(const std::string& state_name, size_t limit,
+                                              size_t visited,
+                                              const SnapshotVisitor& fn) const {
+    std::string dir = states_dir_ + "/" + state_name + "/.snapshots";
+    auto names = read_dir(dir);
+    std::sort(names.begin(), names.end());
+    for (const auto& name : names) {
+        struct stat marker;
+        if (stat((dir + "/" + name).c_str(), &marker) != 0) {
+            continue;   // Deleted since the listing
+        }
+        SnapshotInfo info;
+        info.name = name;
+        info.state_name = state_name;
+        info.full_name = state_name + "@" + name;
+        info.creation_unix = static_cast<uint64_t>(marker.st_mtime);
+        info.creation_time = format_unix(marker.st_mtime);
+        info.size_bytes = static_cast<uint64_t>(marker.st_size);
+        visited++;
+        if (!fn(info) || (limit != 0 && visited >= limit)) {
+            break;
+        }
+    }
+    return visited;
+}
+
+bool FilePoolStateProvider::create_state(const std::string& name) {
+    count("create_state");
+    if (!valid_name(name)) {
+        last_error_ = "Invalid state name: " + name;
+        return false;
+    }
+    std::string path = states_dir_ + "/" + name;
+    if (mkdir(path.c_str(), 0755) != 0 || mkdir((path + "/.snapshots").c_str(), 0755) != 0) {
+        last_error_ = "Failed to create state '" + name + "': " + std::strerror(errno);
+        return false;
+    }
+    int fd = ::open((path + "/data.img").c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    bool sized = fd >= 0 && ftruncate(fd, static_cast<off_t>(IMAGE_SIZE)) == 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!sized) {
+        last_error_ = "Failed to create image for '" + name + "': " + std::strerror(errno);
+        return false;
+    }
+    note_mutation();
+    return true;
+}
+
+bool FilePoolStateProvider::delete_state(const std::string& name, bool force) {
+    count("delete_state");
+    if (!read_state(name)) {
+        last_error_ = "State '" + name + "' not found";
+        return false;
+    }
+    if (!force) {
+        if (auto slot = is_state_in_use(name)) {
+            last_error_ = "State '" + name + "' is assigned to " + *slot;
+            return false;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::remove_all(states_dir_ + "/" + name, ec);
+    if (ec) {
+        last_error_ = "Failed to delete state '" + name + "': " + ec.message();
+        return false;
+    }
+    note_mutation();
+    return true;
+}
+
+bool FilePoolStateProvider::clone_state(const std::string&, const std::string&,
+                                        const std::vector<FileInjection>&) {
+    return unsupported("clone_state");
+}
+
+bool FilePoolStateProvider::state_exists(const std::string& name) {
+    count("state_exists");
+    return read_state(name).has_value();
+}
+
+std::optional<StateInfo> FilePoolStateProvider::get_state_info(const std::string& name) {
+    count("get_state_info");
+    return read_state(name);
+}
+
+std::vector<StateInfo> FilePoolStateProvider::list_states() {
+    count("list_states");
+    std::vector<StateInfo> states;
+    for (const auto& name : state_names()) {
+        if (auto info = read_state(name)) {
+            states.push_back(std::move(*info));
+        }
+    }
+    return states;
+}
+
+size_t FilePoolStateProvider::for_each_state(const StateVisitor& fn) {
+    count("for_each_state");
+    size_t visited = 0;
+    for (const auto& name : state_names()) {
+        auto info = read_state(name);
+        if (!info) {
+            continue;
+        }
+        visited++;
+        if (!fn(*info)) {
+            break;
+        }
+    }
+    return visited;
+}
+
+bool FilePoolStateProvider::create_snapshot(const std::string& state_name,
+                                            const std::string& snapshot_name) {
+    count("create_snapshot");
+    auto state = read_state(state_name);
+    if (!state || !valid_name(snapshot_name)) {
+        last_error_ = !state ? "State '" + state_name + "' not found"
+                             : "Invalid snapshot name: " + snapshot_name;
+        return false;
+    }
+    std::string marker = states_dir_ + "/" + state_name + "/.snapshots/" + snapshot_name;
+    int fd = ::open(marker.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        last_error_ = "Failed to create snapshot '" + state_name + "@" + snapshot_name +
+                      "': " + std::strerror(errno);
+        return false;
+    }
+    // The marker's size records what the image referenced at the time
+    bool sized = ftruncate(fd, static_cast<off_t>(state->used_bytes)) == 0;
+    close(fd);
+    if (!sized) {
+        last_error_ = "Failed to record snapshot size: " + std::string(std::strerror(errno));
+        return false;
+    }
+    note_mutation();
+    return true;
+}
+
+bool FilePoolStateProvider::delete_snapshot(const std::string& state_name,
+                                            const std::string& snapshot_name) {
+    count("delete_snapshot");
+    std::string marker = states_dir_ + "/" + state_name + "/.snapshots/" + snapshot_name;
+    if (!valid_name(state_name) || !valid_name(snapshot_name) || unlink(marker.c_str()) != 0) {
+        last_error_ = "Snapshot '" + state_name + "@" + snapshot_name + "' not found";
+        return false;
+    }
+    note_mutation();
+    return true;
+}
+
+bool FilePoolStateProvider::restore_snapshot(const std::string&, const std::string&) {
+    return unsupported("restore_snapshot");
+}
+
+std::vector<SnapshotInfo> FilePoolStateProvider::list_snapshots(const std::string& state_name) {
+    count("list_snapshots");
+    std::vector<SnapshotInfo> result;
+    auto collect = [&result](const SnapshotInfo& snap) {
+        result.push_back(snap);
+        return true;
+    };
+    if (!state_name.empty()) {
+        visit_snapshots(state_name, 0, 0, collect);
+        return result;
+    }
+    for (const auto& name : state_names()) {
+        visit_snapshots(name, 0, 0, collect);
+    }
+    return result;
+}
+
+size_t FilePoolStateProvider::for_each_snapshot(const std::string& state_name, size_t limit,
+                                                const SnapshotVisitor& fn) {
+    count("for_each_snapshot");
+    if (!state_name.empty()) {
+        return visit_snapshots(state_name, limit, 0, fn);
+    }
+
+    // Stop walking states once the visitor or the limit says so
+    size_t visited = 0;
+    bool stopped = false;
+    auto visitor = [&](const SnapshotInfo& snap) {
+        stopped = !fn(snap);
+        return !stopped;
+    };
+    for (const auto& name : state_names()) {
+        visited = visit_snapshots(name, limit, visited, visitor);
+        if (stopped || (limit != 0 && visited >= limit)) {
+            break;
+        }
+    }
+    return visited;
+}
+
+const std::unordered_map<std::string, std::string>& FilePoolStateProvider::snapshot_index() {
+    if (!snapshot_index_) {
+        snapshot_index_.emplace();
+        for (const auto& name : state_names()) {
+            for (auto& snapshot : read_dir(states_dir_ + "/" + name + "/.snapshots")) {
+                snapshot_index_->try_emplace(std::move(snapshot), name);
+            }
+        }
+    }
+    return *snapshot_index_;
+}
+
+std::optional<SnapshotInfo> FilePoolStateProvider::find_snapshot(
+    const std::string& snapshot_name) {
+    count("find_snapshot");
+    const auto& index = snapshot_index();
+    auto it = index.find(snapshot_name);
+    if (it == index.end()) {
+        return std::nullopt;
+    }
+
+    std::string marker = states_dir_ + "/" + it->second + "/.snapshots/" + snapshot_name;
+    struct stat st;
+    if (stat(marker.c_str(), &st) != 0) {
+        return std::nullopt;
+    }
+    SnapshotInfo info;
+    info.name = snapshot_name;
+    info.state_name = it->second;
+    info.full_name = it->second + "@" + snapshot_name;
+    info.creation_unix = static_cast<uint64_t>(st.st_mtime);
+    info.creation_time = format_unix(st.st_mtime);
+    info.size_bytes = static_cast<uint64_t>(st.st_size);
+    return info;
+}
+
+const std::map<std::string, std::string>& FilePoolStateProvider::load_assignments() {
+    if (!assignments_) {
+        auto stored = utils::read_json_file(root_ + "/assignments.json");
+        assignments_ = stored ? std::move(*stored) : std::map<std::string, std::string>{};
+        state_slots_.clear();
+        for (const auto& slot : slots_) {
+            auto it = assignments_->find(slot);
+            state_slots_.try_emplace(it != assignments_->end() ? it->second : slot, slot);
+        }
+    }
+    return *assignments_;
+}
+
+std::string FilePoolStateProvider::get_slot_state(const std::string& slot_name) {
+    count("get_slot_state");
+    const auto& assignments = load_assignments();
+    auto it = assignments.find(slot_name);
+    return it != assignments.end() ? it->second : slot_name;
+}
+
+bool FilePoolStateProvider::assign_state(const std::string& slot_name,
+                                         const std::string& state_name) {
+    count("assign_state");
+    if (!slot_set_.count(slot_name)) {
+        last_error_ = "Invalid slot name: " + slot_name;
+        return false;
+    }
+    load_assignments();
+    auto user = state_slots_.find(state_name);
+    if (user != state_slots_.end() && user->second != slot_name) {
+        last_error_ = "State '" + state_name + "' is in use on " + user->second;
+        return false;
+    }
+    if (!read_state(state_name) && !create_state(state_name)) {
+        return false;
+    }
+    auto assignments = load_assignments();
+    assignments[slot_name] = state_name;
+    if (!utils::write_json_file(root_ + "/assignments.json", assignments)) {
+        last_error_ = "Failed to save assignments";
+        return false;
+    }
+    assignments_.reset();
+    note_mutation();
+    return true;
+}
+
+bool FilePoolStateProvider::swap_states(const std::string& slot_a, const std::string& slot_b) {
+    count("swap_states");
+    if (!slot_set_.count(slot_a) || !slot_set_.count(slot_b) || slot_a == slot_b) {
+        last_error_ = "Invalid slots: " + slot_a + ", " + slot_b;
+        return false;
+    }
+    auto assignments = load_assignments();
+    auto state_of = [&](const std::string& slot) {
+        auto it = assignments.find(slot);
+        return it != assignments.end() ? it->second : slot;
+    };
+    std::string state_a = state_of(slot_a);
+    std::string state_b = state_of(slot_b);
+    assignments[slot_a] = state_b;
+    assignments[slot_b] = state_a;
+    if (!utils::write_json_file(root_ + "/assignments.json", assignments)) {
+        last_error_ = "Failed to save assignments";
+        return false;
+    }
+    assignments_.reset();
+    note_mutation();
+    return true;
+}
+
+std::vector<SlotAssignment> FilePoolStateProvider::list_assignments() {
+    count("list_assignments");
+    const auto& assignments = load_assignments();
+    std::vector<SlotAssignment> result;
+    result.reserve(slots_.size());
+    for (const auto& slot : slots_) {
+        auto it = assignments.find(slot);
+        result.push_back({slot, it != assignments.end() ? it->second : slot});
+    }
+    return result;
+}
+
+std::optional<std::string> FilePoolStateProvider::is_state_in_use(
+    const std::string& state_name) {
+    count("is_state_in_use");
+    load_assignments();
+    auto it = state_slots_.find(state_name);
+    if (it == state_slots_.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+std::optional<ImageLocation> FilePoolStateProvider::locate_image(const std::string& name) {
+    count("locate_image");
+    if (!read_state(name)) {
+        last_error_ = "No state named '" + name + "' (snapshot images aren't simulated)";
+        return std::nullopt;
+    }
+    return ImageLocation{name, "", states_dir_ + "/" + name + "/data.img"};
+}
+
+std::optional<ChangedRanges> FilePoolStateProvider::changed_ranges(const std::string&,
+                                                                   const std::string&) {
+    unsupported("changed_ranges");
+    return std::nullopt;
+}
+
+bool FilePoolStateProvider::inject_files(const std::string&,
+                                         const std::vector<FileInjection>&) {
+    return unsupported("inject_files");
+}
+
+std::optional<FingerprintInfo> FilePoolStateProvider::fingerprint(const std::string&) {
+    unsupported("fingerprint");
+    return std::nullopt;
+}
+
+std::optional<ReclaimPlan> FilePoolStateProvider::plan_reclaim(uint64_t, const std::string&) {
+    unsupported("plan_reclaim");
+    return std::nullopt;
+}
+
+bool FilePoolStateProvider::execute_reclaim(const ReclaimPlan&) {
+    return unsupported("execute_reclaim");
+}
+
+std::optional<ReconcileReport> FilePoolStateProvider::reconcile(bool repair, uint64_t) {
+    count("reconcile");
+    ReconcileReport report;
+    std::unordered_set<std::string> states;
+    for (auto& name : state_names()) {
+        report.snapshots_scanned += read_dir(states_dir_ + "/" + name + "/.snapshots").size();
+        states.insert(std::move(name));
+    }
+    report.states_scanned = states.size();
+    report.slots_scanned = slots_.size();
+
+    // Only stale assignments can exist here; the rest of the debris is ZFS's
+    auto assignments = load_assignments();
+    bool changed = false;
+    for (auto it = assignments.begin(); it != assignments.end();) {
+        bool known_slot = slot_set_.count(it->first) != 0;
+        if (known_slot && states.count(it->second)) {
+            ++it;
+            continue;
+        }
+        ReconcileItem item{"stale-assignment", it->first, "", "remove assignment", false, ""};
+        item.detail = known_slot ? "assigned state '" + it->second + "' doesn't exist"
+                                 : "unknown slot (assigned '" + it->second + "')";
+        report.items.push_back(std::move(item));
+        it = assignments.erase(it);
+        changed = true;
+    }
+
+    if (repair && changed) {
+        bool saved = utils::write_json_file(root_ + "/assignments.json", assignments);
+        for (auto& item : report.items) {
+            item.repaired = saved;
+            item.error = saved ? "" : "failed to save assignments";
+        }
+        assignments_.reset();
+        note_mutation();
+    }
+    return report;
+}
+
+void FilePoolStateProvider::set_progress_callback(ProgressCallback fn) {
+    progress_callback_ = std::move(fn);
+}
+
+bool FilePoolStateProvider::wait_for_freeing(std::chrono::milliseconds) {
+    count("wait_for_freeing");
+    return true;    // Deletes free their space immediately
+}
+
+std::optional<PoolScanStatus> FilePoolStateProvider::get_pool_scan(PoolScanKind) {
+    unsupported("get_pool_scan");
+    return std::nullopt;
+}
+
+bool FilePoolStateProvider::start_pool_scan(PoolScanKind) {
+    return unsupported("start_pool_scan");
+}
+
+bool FilePoolStateProvider::pause_pool_scan(PoolScanKind) {
+    return unsupported("pause_pool_scan");
+}
+
+std::optional<PoolLatency> FilePoolStateProvider::get_pool_latency() {
+    unsupported("get_pool_latency");
+    return std::nullopt;
+}
+
+std::optional<OperationEstimate> FilePoolStateProvider::estimate_clone(const std::string&) {
+    unsupported("estimate_clone");
+    return std::nullopt;
+}
+
+std::optional<OperationEstimate> FilePoolStateProvider::estimate_restore(const std::string&) {
+    unsupported("estimate_restore");
+    return std::nullopt;
+}
+
+std::optional<OperationEstimate> FilePoolStateProvider::estimate_delete(const std::string&) {
+    unsupported("estimate_delete");
+    return std::nullopt;
+}
+
+std::string FilePoolStateProvider::get_last_error() const {
+    return last_error_;
+}
+
+std::string FilePoolStateProvider::get_states_dir() const {
+    return states_dir_;
+}
+
+std::string FilePoolStateProvider::get_catalog_path() const {
+    return root_ + "/catalog";
+}
+
+uint64_t FilePoolStateProvider::get_generation() {
+    count("get_generation");
+    return generation_;
+}
+
+size_t FilePoolStateProvider::call_count(const std::string& method) const {
+    auto it = calls_.find(method);
+    return it != calls_.end() ? it->second : 0;
+}
+
+size_t FilePoolStateProvider::total_calls() const {
+    size_t total = 0;
+    for (const auto& [method, n] : calls_) {
+        total += n;
+    }
+    return total;
+}
+
+void FilePoolStateProvider::reset_calls() {
+    calls_.clear();
+}
+
+} // namespace testing
+} // namespace vmstate
@@ -0,0 +1,227 @@
+#pragma once
+
+#include "providers/state_provider.hpp"
+#include "providers/vm_provider.hpp"
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace vmstate {
+namespace testing {
+
+/**
+ * SyntheticVMProvider - In-memory VM provider with any number of slots
+ *
+ * Slots are named slot1..slotN and start out stopped; start/stop flip the
+ * status immediately. Every call is counted by method name, so a test can
+ * tell a command that asks once for all slots from one that asks per slot.
+ * Network, limits, pressure and transient services are unsupported
+ * (false / nullopt), and enter_background() succeeds without doing
+ * anything.
+ */
+class SyntheticVMProvider : public VMProvider {
+public:
+    explicit SyntheticVMProvider(size_t slot_count);
+
+    bool start(const std::string& slot_name) override;
+    bool stop(const std::string& slot_name) override;
+    bool start_and_wait(const std::string& slot_name,
+                        std::chrono::milliseconds timeout) override;
+    bool stop_and_wait(const std::string& slot_name,
+                       std::chrono::milliseconds timeout) override;
+    bool restart(const std::string& slot_name) override;
+    bool is_running(const std::string& slot_name) override;
+    VMStatus get_status(const std::string& slot_name) override;
+    std::optional<std::map<std::string, VMStatus>> get_all_statuses() override;
+    std::optional<VMInfo> get_info(const std::string& slot_name) override;
+    std::vector<std::string> list_slots() override;
+    bool is_valid_slot(const std::string& slot_name) override;
+    std::optional<std::vector<SlotNetStats>> get_network_stats() override;
+    bool set_net_limit(const std::string& slot_name, const NetLimit& limit) override;
+    std::optional<NetLimit> get_net_limit(const std::string& slot_name) override;
+    bool apply_net_limit(const std::string& slot_name) override;
+    bool enter_background(const BackgroundLimits& limits) override;
+    bool start_transient_service(const std::string& unit, const std::string& description,
+                                 const std::vector<std::string>& argv) override;
+    std::optional<double> get_slot_io_pressure(const std::string& slot_name) override;
+    std::string get_last_error() const override;
+
+    /**
+     * Number of calls received for a method (e.g., "is_running")
+     */
+    size_t call_count(const std::string& method) const;
+
+    /**
+     * Total calls across all methods
+     */
+    size_t total_calls() const;
+
+    /**
+     * Forget the call counts
+     */
+    void reset_calls();
+
+private:
+    // Count a call; returns false (with last_error_ set) for unknown slots
+    bool begin_call(const std::string& method, const std::string& slot_name = "");
+
+    std::vector<std::string> slots_;
+    std::map<std::string, VMStatus> statuses_;
+    std::map<std::string, size_t> calls_;
+    std::string last_error_;
+};
+
+/**
+ * FilePoolStateProvider - State provider over plain directories
+ *
+ * Stands in for a ZFS pool at sizes a test can't create datasets for:
+ *
+ *   <root>/states/<state>/data.img                sparse image file
+ *   <root>/states/<state>/.snapshots/<snapshot>   marker file per snapshot
+ *   <root>/assignments.json                       slot -> state
+ *   <root>/catalog                                shared catalog segment
+ *
+ * Everything lives on disk, so a new provider over the same root sees
+ * what an earlier one created, and listings cost a directory walk like
+ * a real pool. Like ZFSStateProvider, assignments and snapshot names are
+ * indexed in memory and the indexes are dropped on any mutation. The
+ * generation counts mutations; it is kept in <root>/generation when the
+ * provider goes away, so a catalog published before later changes reads
+ * as stale.
+ *
+ * Clones, restores, images of snapshots, injection, fingerprints, reclaim
+ * and pool maintenance are unsupported (false / nullopt with an error).
+ * Calls are counted like SyntheticVMProvider's.
+ */
+class FilePoolStateProvider : public StateProvider {
+public:
+    /**
+     * @param root Existing directory the pool lives under
+     * @param slots Slot names assignments may use
+     */
+    FilePoolStateProvider(const std::string& root, std::vector<std::string> slots);
+    ~FilePoolStateProvider() override;
+
+    FilePoolStateProvider(const FilePoolStateProvider&) = delete;
+    FilePoolStateProvider& operator=(const FilePoolStateProvider&) = delete;
+
+    bool create_state(const std::string& name) override;
+    bool delete_state(const std::string& name, bool force = false) override;
+    bool clone_state(const std::string& source, const std::string& dest,
+                     const std::vector<FileInjection>& files = {}) override;
+    bool state_exists(const std::string& name) override;
+    std::optional<StateInfo> get_state_info(const std::string& name) override;
+    std::vector<StateInfo> list_states() override;
+    size_t for_each_state(const StateVisitor& fn) override;
+
+    bool create_snapshot(const std::string& state_name,
+                         const std::string& snapshot_name) override;
+    bool delete_snapshot(const std::string& state_name,
+                         const std::string& snapshot_name) override;
+    bool restore_snapshot(const std::string& snapshot_name,
+                          const std::string& new_state_name) override;
+    std::vector<SnapshotInfo> list_snapshots(const std::string& state_name = "") override;
+    size_t for_each_snapshot(const std::string& state_name, size_t limit,
+                             const SnapshotVisitor& fn) override;
+    std::optional<SnapshotInfo> find_snapshot(const std::string& snapshot_name) override;
+
+    std::string get_slot_state(const std::string& slot_name) override;
+    bool assign_state(const std::string& slot_name, const std::string& state_name) override;
+    bool swap_states(const std::string& slot_a, const std::string& slot_b) override;
+    std::vector<SlotAssignment> list_assignments() override;
+    std::optional<std::string> is_state_in_use(const std::string& state_name) override;
+
+    std::optional<ImageLocation> locate_image(const std::string& name) override;
+    std::optional<ChangedRanges> changed_ranges(const std::string& from,
+                                                const std::string& to) override;
+    bool inject_files(const std::string& state_name,
+                      const std::vector<FileInjection>& files) override;
+    std::optional<FingerprintInfo> fingerprint(const std::string& name) override;
+
+    std::optional<ReclaimPlan> plan_reclaim(uint64_t target_bytes,
+                                            const std::string& state_name = "") override;
+    bool execute_reclaim(const ReclaimPlan& plan) override;
+    std::optional<ReconcileReport> reconcile(bool repair, uint64_t min_age_seconds) override;
+
+    void set_progress_callback(ProgressCallback fn) override;
+    bool wait_for_freeing(std::chrono::milliseconds timeout) override;
+    std::optional<PoolScanStatus> get_pool_scan(PoolScanKind kind) override;
+    bool start_pool_scan(PoolScanKind kind) override;
+    bool pause_pool_scan(PoolScanKind kind) override;
+    std::optional<PoolLatency> get_pool_latency() override;
+
+    std::optional<OperationEstimate> estimate_clone(const std::string& source) override;
+    std::optional<OperationEstimate> estimate_restore(const std::string& snapshot_name) override;
+    std::optional<OperationEstimate> estimate_delete(const std::string& name) override;
+
+    std::string get_last_error() const override;
+    std::string get_states_dir() const override;
+    std::string get_catalog_path() const override;
+    uint64_t get_generation() override;
+
+    /**
+     * Number of calls received for a method (e.g., "list_states")
+     */
+    size_t call_count(const std::string& method) const;
+
+    /**
+     * Total calls across all methods
+     */
+    size_t total_calls() const;
+
+    /**
+     * Forget the call counts
+     */
+    void reset_calls();
+
+    /**
+     * Size of the sparse data.img given to new states
+     */
+    static constexpr uint64_t IMAGE_SIZE = 64ULL * 1024 * 1024;
+
+private:
+    void count(const std::string& method);
+
+    // Fail an unsupported method
+    bool unsupported(const std::string& method);
+
+    // Build StateInfo for a state directory; nullopt if it doesn't exist
+    std::optional<StateInfo> read_state(const std::string& name) const;
+
+    // State names, sorted like a dataset listing
+    std::vector<std::string> state_names() const;
+
+    // Visit one state's snapshots in name order
+    size_t visit_snapshots(const std::string& state_name, size_t limit, size_t visited,
+                           const SnapshotVisitor& fn) const;
+
+    // Assignments from assignments.json, with a state -> first slot index
+    const std::map<std::string, std::string>& load_assignments();
+
+    // Snapshot name -> state, built on first use
+    const std::unordered_map<std::string, std::string>& snapshot_index();
+
+    // Drop the indexes and bump the generation
+    void note_mutation();
+
+    std::string root_;
+    std::string states_dir_;
+    std::vector<std::string> slots_;
+    std::unordered_set<std::string> slot_set_;
+    uint64_t generation_ = 1;
+
+    std::optional<std::map<std::string, std::string>> assignments_;
+    std::unordered_map<std::string, std::string> state_slots_;
+    std::optional<std::unordered_map<std::string, std::string>> snapshot_index_;
+
+    std::map<std::string, size_t> calls_;
+    ProgressCallback progress_callback_;
+    std::string last_error_;
+};
+
+} // namespace testing
+} // namespace vmstate
@@ -0,0 +1,276 @@
+// SystemdDBusVMProvider against FakeSystemd on a private bus
+//
+// Exits 77 (skipped) when dbus-daemon is unavailable.
+
+#include "check.hpp"
+#include "fake_systemd.hpp"
+#include "providers/systemd_dbus_vm_provider.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using vmstate::BackgroundLimits;
+using vmstate::SystemdDBusVMProvider;
+using vmstate::VMStatus;
+using vmstate::testing::FakeSystemd;
+
+namespace {
+
+// Poll until a unit reaches a state (jobs finish on the fake's own thread)
+bool wait_for_state(FakeSystemd& fake, const std::string& unit, const std::string& state) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    while (fake.active_state(unit) != state) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return true;
+}
+
+void test_lifecycle(FakeSystemd& fake) {
+    SystemdDBusVMProvider provider;
+    const std::string unit = "microvm@slot1.service";
+
+    CHECK(provider.get_status("slot1") == VMStatus::Stopped);
+
+    CHECK(provider.start("slot1"));
+    CHECK(wait_for_state(fake, unit, "active"));
+    CHECK(provider.get_status("slot1") == VMStatus::Running);
+    CHECK(provider.is_running("slot1"));
+
+    CHECK(provider.restart("slot1"));
+    CHECK(wait_for_state(fake, unit, "active"));
+    CHECK(fake.call_count("RestartUnit") == 1);
+
+    CHECK(provider.stop("slot1"));
+    CHECK(wait_for_state(fake, unit, "inactive"));
+    CHECK(provider.get_status("slot1") == VMStatus::Stopped);
+
+    CHECK(fake.call_count("StartUnit") == 1);
+    CHECK(fake.call_count("StopUnit") == 1);
+}
+
+void test_all_statuses(FakeSystemd& fake) {
+    SystemdDBusVMProvider provider;
+    CHECK(provider.start("slot2"));
+    CHECK(wait_for_state(fake, "microvm@slot2.service", "active"));
+    fake.add_unit("microvm@other.service", "active");   // Not a slot
+
+    unsigned before = fake.call_count("ListUnitsByPatterns");
+    unsigned property_reads = fake.call_count("ActiveState");
+    auto statuses = provider.get_all_statuses();
+    CHECK(statuses.has_value());
+    if (statuses) {
+        CHECK(statuses->size() == 5);
+        CHECK(statuses->at("slot2") == VMStatus::Running);
+        CHECK(statuses->at("slot1") == VMStatus::Stopped);
+        CHECK(statuses->at("slot3") == VMStatus::Stopped);    // Never loaded
+    }
+    CHECK(fake.call_count("ListUnitsByPatterns") == before + 1);
+    CHECK(fake.call_count("ActiveState") == property_reads);
+
+    CHECK(provider.stop("slot2"));
+    CHECK(wait_for_state(fake, "microvm@slot2.service", "inactive"));
+}
+
+// The production listing path at scalability_test's largest slot count:
+// one ListUnitsByPatterns call however many slots there are
+void test_many_statuses(FakeSystemd& fake) {
+    constexpr size_t SLOTS = 1024;
+    std::set<std::string> slots;
+    for (size_t i = 1; i <= SLOTS; i++) {
+        std::string slot = "slot" + std::to_string(i);
+        slots.insert(slot);
+        // Every third slot is running; the last few were never loaded
+        if (i <= SLOTS - 8) {
+            fake.add_unit("bigvm@" + slot + ".service", i % 3 == 0 ? "active" : "inactive");
+        }
+    }
+    SystemdDBusVMProvider provider("bigvm@", slots);
+
+    unsigned before = fake.call_count("ListUnitsByPatterns");
+    unsigned property_reads = fake.call_count("ActiveState");
+    auto statuses = provider.get_all_statuses();
+    CHECK(statuses.has_value());
+    if (statuses) {
+        CHECK(statuses->size() == SLOTS);
+        size_t running = std::count_if(statuses->begin(), statuses->end(), [](const auto& s) {
+            return s.second == VMStatus::Running;
+        });
+        CHECK(running == (SLOTS - 8) / 3);
+        CHECK(statuses->at("slot3") == VMStatus::Running);
+        CHECK(statuses->at("slot1024") == VMStatus::Stopped);
+    }
+    CHECK(fake.call_count("ListUnitsByPatterns") == before + 1);
+    CHECK(fake.call_count("ActiveState") == property_reads);
+}
+
+void test_invalid_slot(FakeSystemd& fake) {
+    SystemdDBusVMProvider provider;
+    unsigned before = fake.call_count("StartUnit");
+
+    CHECK(!provider.start("slot9"));
+    CHECK(provider.get_last_error().find("Invalid slot") != std::string::npos);
+    CHECK(fake.call_count("StartUnit") == before);
+}
+
+void test_unloaded_unit(FakeSystemd& fake) {
+    SystemdDBusVMProvider provider;
+
+    // slot3 was never added: GetUnit fails, LoadUnit succeeds
+    unsigned loads = fake.call_count("LoadUnit");
+    CHECK(provider.get_status("slot3") == VMStatus::Stopped);
+    CHECK(fake.call_count("LoadUnit") == loads + 1);
+}
+
+void test_failures(FakeSystemd& fake) {
+    SystemdDBusVMProvider provider;
+
+    fake.fail_next("StartUnit", "org.freedesktop.systemd1.UnitMasked");
+    CHECK(!provider.start("slot2"));
+    CHECK(provider.get_last_error().find("StartUnit") != std::string::npos);
+    CHECK(fake.active_state("microvm@slot2.service") == "inactive");
+
+    fake.set_job_result("microvm@slot2.service", "failed");
+    CHECK(provider.start("slot2"));
+    CHECK(wait_for_state(fake, "microvm@slot2.service", "failed"));
+    CHECK(provider.get_status("slot2") == VMStatus::Failed);
+
+    fake.fail_next("ActiveState", "org.freedesktop.DBus.Error.AccessDenied");
+    CHECK(provider.get_status("slot2") == VMStatus::Unknown);
+}
+
+void test_delays(FakeSystemd& fake) {
+    SystemdDBusVMProvider provider;
+
+    fake.set_reply_delay("GetUnit", std::chrono::milliseconds(100));
+    auto start = std::chrono::steady_clock::now();
+    provider.get_status("slot1");
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    fake.set_reply_delay("GetUnit", std::chrono::milliseconds(0));
+    CHECK(elapsed >= std::chrono::milliseconds(100));
+
+    // A start returns once the job is queued; the unit activates later
+    fake.set_job_delay(std::chrono::milliseconds(200));
+    CHECK(provider.start("slot4"));
+    CHECK(fake.active_state("microvm@slot4.service") == "activating");
+    CHECK(provider.get_status("slot4") == VMStatus::Running);
+    CHECK(wait_for_state(fake, "microvm@slot4.service", "active"));
+    fake.set_job_delay(std::chrono::milliseconds(0));
+}
+
+void test_wait(FakeSystemd& fake) {
+    SystemdDBusVMProvider provider;
+    const std::string unit = "microvm@slot5.service";
+
+    // The waiting variants return once JobRemoved arrives, not before
+    fake.set_job_delay(std::chrono::milliseconds(150));
+    auto start = std::chrono::steady_clock::now();
+    CHECK(provider.start_and_wait("slot5", std::chrono::seconds(2)));
+    CHECK(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(150));
+    CHECK(fake.active_state(unit) == "active");
+
+    CHECK(provider.stop_and_wait("slot5", std::chrono::seconds(2)));
+    CHECK(fake.active_state(unit) == "inactive");
+
+    CHECK(!provider.stop_and_wait("slot5", std::chrono::milliseconds(50)));
+    CHECK(provider.get_last_error().find("Timed out") != std::string::npos);
+    CHECK(wait_for_state(fake, unit, "inactive"));
+    fake.set_job_delay(std::chrono::milliseconds(0));
+
+    fake.set_job_result(unit, "failed");
+    CHECK(!provider.start_and_wait("slot5", std::chrono::seconds(2)));
+    CHECK(provider.get_last_error().find("failed") != std::string::npos);
+    CHECK(fake.call_count("Subscribe") > 0);
+}
+
+void test_background(FakeSystemd& fake) {
+    SystemdDBusVMProvider provider;
+
+    BackgroundLimits limits;
+    limits.io_device = "/dev/zd0";
+    limits.io_read_max = 100 * 1024 * 1024;
+    CHECK(provider.enter_background(limits));
+
+    auto props = fake.transient_properties("vm-state-" + std::to_string(getpid()) + ".scope");
+    CHECK(props["Slice"] == "vm-state-background.slice");
+    CHECK(props["PIDs"] == std::to_string(getpid()));
+    CHECK(props["IOWeight"] == "10");
+    CHECK(props["CPUWeight"] == "20");
+    CHECK(props["IOReadBandwidthMax"] == "/dev/zd0 104857600");
+    CHECK(props.count("IOWriteBandwidthMax") == 0);
+}
+
+void test_transient_service(FakeSystemd& fake) {
+    SystemdDBusVMProvider provider;
+
+    std::string unit = "vm-state-lazy-restore-blue.service";
+    CHECK(provider.start_transient_service(unit, "Lazy restore of blue",
+                                           {"/bin/vm-state", "lazy-restore", "/img", "blue"}));
+    auto props = fake.transient_properties(unit);
+    CHECK(props["Description"] == "Lazy restore of blue");
+    CHECK(props["CollectMode"] == "inactive-or-failed");
+    CHECK(props["ExecStart"] == "/bin/vm-state lazy-restore /img blue");
+
+    CHECK(!provider.start_transient_service("vm-state-empty.service", "", {}));
+}
+
+void test_io_pressure(FakeSystemd& fake) {
+    char root_template[] = "/tmp/fake-cgroup-XXXXXX";
+    CHECK(mkdtemp(root_template) != nullptr);
+    std::string root = root_template;
+    std::string cgroup = "/system.slice/microvm@slot1.service";
+    mkdir((root + "/system.slice").c_str(), 0755);
+    mkdir((root + cgroup).c_str(), 0755);
+    std::ofstream(root + cgroup + "/io.pressure")
+        << "some avg10=12.50 avg60=3.00 avg300=0.75 total=123456\n"
+        << "full avg10=8.00 avg60=2.00 avg300=0.50 total=98765\n";
+
+    SystemdDBusVMProvider provider("microvm@", {"slot1", "slot2"}, "vm-",
+                                   "/var/lib/microvms", root);
+    fake.set_control_group("microvm@slot1.service", cgroup);
+    auto pressure = provider.get_slot_io_pressure("slot1");
+    CHECK(pressure && *pressure == 12.5);
+
+    // A stopped slot has no cgroup and so no stall
+    fake.set_control_group("microvm@slot2.service", "");
+    pressure = provider.get_slot_io_pressure("slot2");
+    CHECK(pressure && *pressure == 0.0);
+
+    std::system(("rm -rf " + root).c_str());
+}
+
+}  // anonymous namespace
+
+int main() {
+    FakeSystemd fake;
+    if (!fake.start()) {
+        std::fprintf(stderr, "skipping: %s\n", fake.get_last_error().c_str());
+        return 77;
+    }
+    for (const char* slot : {"slot1", "slot2", "slot4", "slot5"}) {
+        fake.add_unit(std::string("microvm@") + slot + ".service");
+    }
+
+    test_lifecycle(fake);
+    test_all_statuses(fake);
+    test_many_statuses(fake);
+    test_invalid_slot(fake);
+    test_unloaded_unit(fake);
+    test_failures(fake);
+    test_delays(fake);
+    test_wait(fake);
+    test_background(fake);
+    test_transient_service(fake);
+    test_io_pressure(fake);
+
+    fake.stop();
+    return vmstate::testing::check_result();
+}